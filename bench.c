@@ -0,0 +1,507 @@
+/*
+ * SFS存储引擎的基准测试（不经过FUSE，直接调用sfs_rw.h中的函数）
+ * 在临时映像上格式化一个文件系统，依次运行各负载，结果以JSON输出到stdout，便于比较不同的构建
+ * 用法: sfsbench [-o 映像] [-k file|mmap|ram] [-s 映像大小] [-b 块大小] [-E] [-C] [-D] [-R]
+ *                [-n 文件数] [-d 目录深度] [-f 读写文件大小] [-z 读写大小列表] [-S 随机种子] [-w 负载列表]
+ * -k：块设备后端（默认file）；ram不使用映像文件，结果只反映引擎本身的开销
+ * 负载（-w，逗号分隔，默认全部）：
+ *   create   在一个目录下创建n个文件
+ *   stat     逐个解析路径并读取inode（getattr）
+ *   lookup   解析深度为d的路径
+ *   readdir  列出含n个文件的目录
+ *   unlink   删除n个文件
+ *   seqwrite/seqread/randwrite/randread  以-z中的每种大小顺序或随机读写大小为-f的文件
+ *   clone    以1 MiB为单位用copy_file_range将大小为-f的文件复制到新文件的开头（clone）和错开3个块处（clone_shift），
+ *            有引用计数表（-D、-R）时共享数据块；复制后读回校验，内容不一致时报错退出
+ * 每个负载输出操作数、总时间、每秒操作数、p50/p99延迟（微秒），读写负载另有吞吐量（MB/s）
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include "sfs_ds.h"    // SFS文件系统相关数据结构
+#include "sfs_dev.h"   // SFS文件系统块设备
+#include "sfs_rw.h"    // SFS文件系统相关读写操作
+#include "sfs_utils.h" // SFS文件系统相关辅助函数
+#include "sfs_orphan.h" // SFS文件系统后台删除
+
+#define BENCH_IMG "/tmp/sfsbench.img" // 默认的临时映像
+#define BENCH_MAX_SIZES 8             // -z最多的读写大小数目
+
+// 基准测试参数
+struct bench_config {
+    long fs_bytes;     // 映像大小
+    long block_size;   // 块大小
+    long features;     // 文件系统特性（同mkfs的-E、-C、-D、-R）
+    long files;        // create/stat/readdir/unlink的文件数
+    long depth;        // lookup的目录深度
+    long file_size;    // 读写负载的文件大小
+    long io_sizes[BENCH_MAX_SIZES]; // 读写负载的每次读写大小
+    int num_io_sizes;
+    unsigned long seed; // 随机读写的种子
+    const char* workloads; // 运行的负载，NULL为全部
+    const char* backend;   // 块设备后端（file、mmap或ram）
+};
+
+// 一个负载的延迟样本
+struct bench_result {
+    uint64_t* samples; // 每次操作的延迟（纳秒）
+    long n, cap;
+    uint64_t start, end; // 整个负载的开始和结束时间
+    long bytes;          // 读写的字节数，非读写负载为0
+};
+
+int bench_first = 1; // 是否是第一个输出的负载（JSON数组分隔符）
+
+// 单调时钟（纳秒）
+uint64_t bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64随机数，保证同一种子的随机读写序列相同
+uint64_t bench_rand(unsigned long* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+void bench_begin(struct bench_result* r) {
+    r->n = 0;
+    r->bytes = 0;
+    r->start = bench_now();
+}
+
+// 记录一次从start开始的操作
+void bench_sample(struct bench_result* r, uint64_t start) {
+    if (r->n == r->cap) {
+        r->cap = r->cap == 0 ? 1024 : r->cap * 2;
+        r->samples = (uint64_t*)realloc(r->samples, r->cap * sizeof(uint64_t));
+    }
+    r->samples[r->n++] = bench_now() - start;
+}
+
+int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// 排序后的样本中位于百分位p的延迟（微秒）
+double bench_percentile(struct bench_result* r, double p) {
+    if (r->n == 0) {
+        return 0;
+    }
+    long i = (long)(r->n * p / 100.0);
+    return r->samples[MIN(i, r->n - 1)] / 1000.0;
+}
+
+// 输出一个负载的结果（JSON对象）
+void bench_report(struct bench_result* r, const char* name, long io_size) {
+    r->end = bench_now();
+    qsort(r->samples, r->n, sizeof(uint64_t), cmp_u64);
+    double seconds = (r->end - r->start) / 1e9;
+    printf("%s\n    {\"name\": \"%s\"", bench_first ? "" : ",", name);
+    if (io_size > 0) {
+        printf(", \"io_size\": %ld", io_size);
+    }
+    printf(", \"ops\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f",
+           r->n, seconds, seconds > 0 ? r->n / seconds : 0, bench_percentile(r, 50), bench_percentile(r, 99));
+    if (r->bytes > 0) {
+        printf(", \"mb_per_sec\": %.1f", seconds > 0 ? r->bytes / seconds / (1 << 20) : 0);
+    }
+    printf("}");
+    bench_first = 0;
+}
+
+// 负载是否被选中（-w）
+int bench_selected(struct bench_config* cfg, const char* name) {
+    if (cfg->workloads == NULL) {
+        return 1;
+    }
+    size_t len = strlen(name);
+    for (const char* p=cfg->workloads; (p = strstr(p, name)) != NULL; p += len) {
+        if ((p == cfg->workloads || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/************************/
+/* 引擎操作（与sfs.c中的回调相同的步骤，不加锁） */
+
+/**
+ * 在path处创建文件或目录（同SFS_mknod、SFS_mkdir）
+ * @return 成功返回0，失败返回-1
+ */
+int bench_create(const char* path, int type) {
+    char parent_path[MAX_PATH_LEN];
+    char file_name[MAX_FILE_NAME + MAX_FILE_EXTENSION + 1];
+    get_parent_path(path, parent_path);
+    get_file_name(path, file_name);
+    struct entry parent_entry;
+    if (find_entry(parent_path, &parent_entry) != 0 || parent_entry.type != DIR_TYPE) {
+        return -1;
+    }
+    int ino;
+    if (get_free_ino(&ino) != 0) {
+        return -1;
+    }
+    struct inode parent_inode, inode;
+    read_inode(parent_entry.inode, &parent_inode);
+    new_inode(&inode, ino, type);
+    inherit_compress(&inode, &parent_inode);
+    write_inode(ino, &inode);
+    set_inode_bitmap_used(ino);
+    struct entry entry;
+    if (type == DIR_TYPE) {
+        new_entry(&entry, file_name, "", DIR_TYPE, ino);
+    } else {
+        char name[MAX_FILE_NAME + MAX_FILE_EXTENSION + 1], ext[MAX_FILE_EXTENSION + 1];
+        fname_ext(file_name, name, ext);
+        new_entry(&entry, name, ext, FILE_TYPE, ino);
+    }
+    if (add_entry(&parent_inode, &entry) != 0) {
+        set_free_inode_bitmap(ino);
+        return -1;
+    }
+    return 0;
+}
+
+// 删除path处的文件（同SFS_unlink）
+int bench_unlink(const char* path) {
+    char parent_path[MAX_PATH_LEN];
+    struct entry entry, parent_entry;
+    if (find_entry(path, &entry) != 0) {
+        return -1;
+    }
+    get_parent_path(path, parent_path);
+    find_entry(parent_path, &parent_entry);
+    struct inode parent_inode;
+    read_inode(parent_entry.inode, &parent_inode);
+    return remove_entry(&parent_inode, &entry);
+}
+
+// 解析path并读取其inode（同SFS_getattr）
+int bench_stat(const char* path, struct inode* inode) {
+    struct entry entry;
+    if (find_entry(path, &entry) != 0) {
+        return -1;
+    }
+    return read_inode(entry.inode, inode);
+}
+
+/* 以上是引擎操作 */
+
+/************************/
+/* 负载 */
+
+// 创建、查看、列出和删除同一目录下的n个文件
+void bench_namespace(struct bench_config* cfg, struct bench_result* r) {
+    char path[MAX_PATH_LEN];
+    struct inode inode;
+    bench_create("/many", DIR_TYPE);
+    if (bench_selected(cfg, "create") || bench_selected(cfg, "stat") ||
+        bench_selected(cfg, "readdir") || bench_selected(cfg, "unlink")) {
+        bench_begin(r);
+        for (long i=0; i<cfg->files; i++) {
+            uint64_t start = bench_now();
+            sprintf(path, "/many/f%ld", i);
+            if (bench_create(path, FILE_TYPE) != 0) {
+                fprintf(stderr, "[bench] Error: failed to create %s\n", path);
+                exit(1);
+            }
+            bench_sample(r, start);
+        }
+        if (bench_selected(cfg, "create")) {
+            bench_report(r, "create", 0);
+        }
+    }
+    if (bench_selected(cfg, "stat")) {
+        bench_begin(r);
+        for (long i=0; i<cfg->files; i++) {
+            uint64_t start = bench_now();
+            sprintf(path, "/many/f%ld", i);
+            bench_stat(path, &inode);
+            bench_sample(r, start);
+        }
+        bench_report(r, "stat", 0);
+    }
+    if (bench_selected(cfg, "readdir")) {
+        // 每次操作列出整个目录（同ls：读取目录的全部目录项并读取各自的inode）
+        bench_begin(r);
+        for (int k=0; k<10; k++) {
+            uint64_t start = bench_now();
+            struct inode dir_inode;
+            struct dir dir;
+            bench_stat("/many", &dir_inode);
+            read_dir(&dir_inode, &dir);
+            for (int i=0; i<dir.num_entries; i++) {
+                read_inode(dir.entries[i]->inode, &inode);
+            }
+            free_dir(&dir);
+            bench_sample(r, start);
+        }
+        bench_report(r, "readdir", 0);
+    }
+    if (bench_selected(cfg, "unlink")) {
+        bench_begin(r);
+        for (long i=0; i<cfg->files; i++) {
+            uint64_t start = bench_now();
+            sprintf(path, "/many/f%ld", i);
+            bench_unlink(path);
+            bench_sample(r, start);
+        }
+        bench_report(r, "unlink", 0);
+    }
+}
+
+// 解析深度为d的路径
+void bench_lookup(struct bench_config* cfg, struct bench_result* r) {
+    char path[MAX_PATH_LEN] = "";
+    for (long i=0; i<cfg->depth; i++) {
+        size_t len = strlen(path);
+        if (len + 8 >= MAX_PATH_LEN) {
+            break; // 路径长度受MAX_PATH_LEN限制
+        }
+        sprintf(path + len, "/d%ld", i);
+        bench_create(path, DIR_TYPE);
+    }
+    strcat(path, "/leaf");
+    bench_create(path, FILE_TYPE);
+    struct inode inode;
+    bench_begin(r);
+    for (long i=0; i<cfg->files; i++) {
+        uint64_t start = bench_now();
+        if (bench_stat(path, &inode) != 0) {
+            fprintf(stderr, "[bench] Error: failed to resolve %s\n", path);
+            exit(1);
+        }
+        bench_sample(r, start);
+    }
+    bench_report(r, "lookup", 0);
+}
+
+// 以io_size为单位顺序或随机读写大小为file_size的文件
+void bench_io(struct bench_config* cfg, struct bench_result* r, long io_size) {
+    char path[MAX_PATH_LEN];
+    sprintf(path, "/io%ld", io_size);
+    bench_create(path, FILE_TYPE);
+    struct entry entry;
+    struct inode inode;
+    find_entry(path, &entry);
+    read_inode(entry.inode, &inode);
+    char* buf = (char*)malloc(io_size);
+    for (long i=0; i<io_size; i++) {
+        buf[i] = (char)(i * 7 + io_size);
+    }
+    long count = cfg->file_size / io_size;
+    unsigned long state = cfg->seed;
+    const char* names[4] = { "seqwrite", "seqread", "randwrite", "randread" };
+    for (int w=0; w<4; w++) {
+        if (!bench_selected(cfg, names[w]) && !(w == 0 && (bench_selected(cfg, "seqread") ||
+                                                            bench_selected(cfg, "randread") ||
+                                                            bench_selected(cfg, "randwrite")))) {
+            continue;
+        }
+        int is_write = w == 0 || w == 2;
+        bench_begin(r);
+        for (long i=0; i<count; i++) {
+            long no = w < 2 ? i : (long)(bench_rand(&state) % count);
+            off_t offset = no * io_size;
+            uint64_t start = bench_now();
+            if (is_write) {
+                // 同SFS_write：写入数据后更新文件大小并写回inode
+                if (write_file(&inode, buf, io_size, offset) != 0) {
+                    fprintf(stderr, "[bench] Error: no space left for %s\n", path);
+                    exit(1);
+                }
+                inode.st_size = MAX(inode.st_size, offset + io_size);
+                write_inode(inode.st_ino, &inode);
+            } else {
+                read_file(&inode, buf, io_size, offset);
+            }
+            bench_sample(r, start);
+            r->bytes += io_size;
+        }
+        if (bench_selected(cfg, names[w])) {
+            bench_report(r, names[w], io_size);
+        }
+    }
+    free(buf);
+    // 大文件删除后成为孤儿，立即回收以免占用之后负载的空间
+    bench_unlink(path);
+    while (reclaim_orphan_step(ORPHAN_STEP_BLOCKS) > 0) {
+    }
+}
+
+// 将文件以1 MiB为单位复制到新文件的offset处并读回校验（同SFS_copy_file_range）
+void bench_clone_to(struct inode* src, const char* data, const char* path, off_t offset, struct bench_result* r) {
+    bench_create(path, FILE_TYPE);
+    struct entry entry;
+    struct inode dst;
+    find_entry(path, &entry);
+    read_inode(entry.inode, &dst);
+    long chunk = 1 << 20;
+    bench_begin(r);
+    for (off_t done=0; done<src->st_size; done+=chunk) {
+        uint64_t start = bench_now();
+        long n = copy_file_range_inode(src, done, &dst, offset + done, chunk);
+        write_inode(dst.st_ino, &dst);
+        if (n < 0) {
+            fprintf(stderr, "[bench] Error: copy_file_range to %s failed: %ld\n", path, n);
+            exit(1);
+        }
+        bench_sample(r, start);
+        r->bytes += n;
+    }
+    bench_report(r, offset == 0 ? "clone" : "clone_shift", chunk);
+    char* buf = (char*)malloc(chunk);
+    for (off_t done=0; done<src->st_size; done+=chunk) {
+        long n = MIN(chunk, src->st_size - done);
+        if (read_file(&dst, buf, n, offset + done) != n || memcmp(buf, data + done, n) != 0) {
+            fprintf(stderr, "[bench] Error: %s differs from the source near offset %ld\n", path, (long)(offset + done));
+            exit(1);
+        }
+    }
+    free(buf);
+    bench_unlink(path);
+}
+
+// 复制文件：dst与src的块（压缩文件为簇）偏移相同时共享数据块，错开时按字节复制
+void bench_clone(struct bench_config* cfg, struct bench_result* r) {
+    bench_create("/clonesrc", FILE_TYPE);
+    struct entry entry;
+    struct inode src;
+    find_entry("/clonesrc", &entry);
+    read_inode(entry.inode, &src);
+    // 每3个32 KiB中有一个为随机数据（压缩时保存为普通块），其余可以压缩
+    char* data = (char*)malloc(cfg->file_size);
+    unsigned long state = cfg->seed;
+    for (long i=0; i<cfg->file_size; i++) {
+        data[i] = (i >> 15) % 3 == 1 ? (char)bench_rand(&state) : (char)('a' + (i / 100) % 7);
+    }
+    if (write_file(&src, data, cfg->file_size, 0) != 0) {
+        fprintf(stderr, "[bench] Error: no space left for /clonesrc\n");
+        exit(1);
+    }
+    src.st_size = cfg->file_size;
+    write_inode(src.st_ino, &src);
+    bench_clone_to(&src, data, "/clone0", 0, r);
+    bench_clone_to(&src, data, "/clone3", 3 * sb->block_size, r);
+    free(data);
+    bench_unlink("/clonesrc");
+    while (reclaim_orphan_step(ORPHAN_STEP_BLOCKS) > 0) {
+    }
+}
+
+/* 以上是负载 */
+
+void usage(const char* prog) {
+    printf("usage: %s [-o image] [-k file|mmap|ram] [-s size] [-b block_size] [-E] [-C] [-D] [-R] [-n files] [-d depth]\n"
+           "       [-f file_size] [-z io_size,...] [-S seed] [-w workload,...]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    struct bench_config cfg = {
+        .fs_bytes = 256L << 20, .block_size = BLOCK_SIZE, .features = 0,
+        .files = 1000, .depth = 16, .file_size = 16L << 20,
+        .io_sizes = { 4096, 65536, 1 << 20 }, .num_io_sizes = 3,
+        .seed = 88172645463325252UL, .workloads = NULL, .backend = "file",
+    };
+    const char* img = BENCH_IMG;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:k:s:b:n:d:f:z:S:w:ECDRh")) != -1) {
+        switch (opt) {
+            case 'o': img = optarg; continue;
+            case 'k': cfg.backend = optarg; continue;
+            case 's': cfg.fs_bytes = parse_size(optarg); break;
+            case 'b': cfg.block_size = parse_size(optarg); break;
+            case 'n': cfg.files = parse_size(optarg); break;
+            case 'd': cfg.depth = parse_size(optarg); break;
+            case 'f': cfg.file_size = parse_size(optarg); break;
+            case 'z': {
+                cfg.num_io_sizes = 0;
+                for (char* tok=strtok(optarg, ","); tok!=NULL && cfg.num_io_sizes<BENCH_MAX_SIZES; tok=strtok(NULL, ",")) {
+                    if ((cfg.io_sizes[cfg.num_io_sizes++] = parse_size(tok)) < 0) {
+                        printf("[bench] Error: invalid io size %s\n", tok);
+                        return 1;
+                    }
+                }
+                continue;
+            }
+            case 'S': cfg.seed = strtoul(optarg, NULL, 10) | 1; continue;
+            case 'w': cfg.workloads = optarg; continue;
+            case 'E': cfg.features |= FEATURE_EXTENTS; continue;
+            case 'C': cfg.features |= FEATURE_COMPRESS; continue;
+            case 'D': cfg.features |= FEATURE_DEDUP; continue;
+            case 'R': cfg.features |= FEATURE_REFLINK; continue;
+            default: usage(argv[0]); return 1;
+        }
+        if (cfg.fs_bytes < 0 || cfg.block_size < 0 || cfg.files < 0 || cfg.depth < 0 || cfg.file_size < 0) {
+            printf("[bench] Error: invalid argument %s\n", optarg);
+            return 1;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // 格式化临时映像（同mkfs.sfs），并初始化根目录（同SFS_init）
+    fs_img = (char*)img;
+    int is_ram = strcmp(cfg.backend, "ram") == 0;
+    if (!is_ram) {
+        int fd = open(fs_img, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, cfg.fs_bytes) != 0) {
+            perror("[bench] Error: failed to create the image");
+            return 1;
+        }
+        close(fd);
+    }
+    bdev = open_block_dev(cfg.backend, fs_img, cfg.fs_bytes);
+    if (bdev == NULL) {
+        perror("[bench] Error: failed to open the block device");
+        return 1;
+    }
+    sb = (struct sb*)malloc(sizeof(struct sb));
+    if (format_fs(cfg.fs_bytes, cfg.block_size, cfg.fs_bytes / INODE_RATIO, cfg.features) != 0) {
+        return 1;
+    }
+    root_entry = (struct entry*)malloc(sizeof(struct entry));
+    new_entry(root_entry, "/", "", DIR_TYPE, 0);
+
+    printf("{\n  \"config\": {\"image_size\": %ld, \"block_size\": %ld, \"features\": %ld, \"files\": %ld, "
+           "\"depth\": %ld, \"file_size\": %ld, \"seed\": %lu, \"backend\": \"%s\"},\n  \"results\": [",
+           cfg.fs_bytes, cfg.block_size, cfg.features, cfg.files, cfg.depth, cfg.file_size, cfg.seed, bdev->ops->name);
+    struct bench_result r = {0};
+    bench_namespace(&cfg, &r);
+    if (bench_selected(&cfg, "lookup")) {
+        bench_lookup(&cfg, &r);
+    }
+    for (int i=0; i<cfg.num_io_sizes; i++) {
+        bench_io(&cfg, &r, cfg.io_sizes[i]);
+    }
+    if (bench_selected(&cfg, "clone")) {
+        bench_clone(&cfg, &r);
+    }
+    printf("\n  ]\n}\n");
+
+    free(r.samples);
+    close_block_dev(bdev);
+    if (!is_ram) {
+        unlink(fs_img);
+    }
+    free(root_entry);
+    free(sb);
+    return 0;
+}
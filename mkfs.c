@@ -0,0 +1,103 @@
+/*
+ * SFS文件系统的格式化工具（mkfs）
+ * 根据映像大小、块大小和inode数目计算各区域的布局，写入超级块、清空位图并创建根目录
+ * 用法: mkfs.sfs [-s 映像大小] [-b 块大小] [-i inode数目] [-E] [-C] [-D] [-R] 映像文件
+ * 映像大小可以带K、M、G后缀，未指定时使用映像文件的现有大小（文件不存在时为8MB）
+ * -E：新建的文件和目录使用extent映射数据块（大文件只需少量extent描述）
+ * -C：新建的文件默认按簇进行LZ4透明压缩（也可以用chattr +c只对某个目录启用）
+ * -D：启用块级去重，内容相同的数据块共享同一个物理块（数据区开头存放数据块引用计数表）
+ * -R：只建立数据块引用计数表，copy_file_range（cp --reflink）共享数据块而不复制，写入时不去重
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "sfs_ds.h"    // SFS文件系统相关数据结构
+#include "sfs_dev.h"   // SFS文件系统块设备
+#include "sfs_rw.h"    // SFS文件系统相关读写操作
+#include "sfs_utils.h" // SFS文件系统相关辅助函数
+
+void usage(const char* prog) {
+    printf("usage: %s [-s size[K|M|G]] [-b block_size] [-i num_inodes] [-E] [-C] [-D] [-R] image\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    long fs_bytes = 0;            // 映像大小（字节）
+    long block_size = BLOCK_SIZE; // 块大小（字节）
+    long num_inodes = 0;          // inode数目
+    long features = 0;            // 文件系统特性
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:i:ECDRh")) != -1) {
+        switch (opt) {
+            case 's': fs_bytes = parse_size(optarg); break;
+            case 'b': block_size = parse_size(optarg); break;
+            case 'i': num_inodes = parse_size(optarg); break;
+            case 'E': features |= FEATURE_EXTENTS; continue;
+            case 'C': features |= FEATURE_COMPRESS; continue;
+            case 'D': features |= FEATURE_DEDUP; continue;
+            case 'R': features |= FEATURE_REFLINK; continue;
+            default: usage(argv[0]); return 1;
+        }
+        if (fs_bytes < 0 || block_size < 0 || num_inodes < 0) {
+            printf("[mkfs] Error: invalid argument %s\n", optarg);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    fs_img = argv[optind];
+
+    // 打开映像文件（不存在则创建）
+    int fd = open(fs_img, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("[mkfs] Error: failed to open the file system image");
+        return 1;
+    }
+    if (fs_bytes == 0) {
+        // 未指定大小，使用映像文件的现有大小
+        fs_bytes = st.st_size == 0 ? FS_SIZE : st.st_size;
+    }
+    // 调整映像文件大小（扩大时为稀疏文件，不占用宿主机空间）
+    int ret = ftruncate(fd, fs_bytes);
+    close(fd);
+    if (ret != 0 || (bdev = open_file_dev(fs_img)) == NULL) {
+        perror("[mkfs] Error: failed to resize the file system image");
+        return 1;
+    }
+    if (num_inodes == 0) {
+        num_inodes = fs_bytes / INODE_RATIO;
+    }
+
+    sb = (struct sb*)malloc(sizeof(struct sb));
+    if (format_fs(fs_bytes, block_size, num_inodes, features) != 0) {
+        close_block_dev(bdev);
+        return 1;
+    }
+    mark_fs_clean(); // 首次挂载时直接读入空闲空间摘要和空闲计数
+    close_block_dev(bdev);
+
+    printf("%s: %ld blocks of %ld bytes, %ld inodes, %ld data blocks\n",
+           fs_img, sb->fs_size, sb->block_size, sb->num_inodes, sb->datasize);
+    printf("\tinode bitmap: block %ld (%ld blocks)\n", sb->first_blk_of_inodebitmap, sb->inodebitmap_size);
+    printf("\tdata bitmap:  block %ld (%ld blocks)\n", sb->first_blk_of_databitmap, sb->databitmap_size);
+    printf("\tinode area:   block %ld (%ld blocks)\n", sb->first_inode, sb->inode_area_size);
+    printf("\tdata area:    block %ld (%ld blocks)\n", sb->first_blk, sb->datasize);
+    printf("\tfree summary: block %ld (%ld blocks)\n", sb->first_blk_of_summary, sb->summary_size);
+    printf("\tblock map:    %s\n", (sb->features & FEATURE_EXTENTS) ? "extents" : "indirect");
+    printf("\tcompression:  %s\n", (sb->features & FEATURE_COMPRESS) ? "lz4" : "off");
+    if (sb->features & FEATURE_DEDUP) {
+        printf("\tdedup:        reference table at block %ld (%ld blocks)\n", sb->first_blk_of_reftable, sb->reftable_size);
+    } else if (sb->features & FEATURE_REFLINK) {
+        printf("\treflink:      reference table at block %ld (%ld blocks)\n", sb->first_blk_of_reftable, sb->reftable_size);
+    }
+    free(sb);
+    return 0;
+}
@@ -8,10 +8,21 @@
 #include <time.h>
 #include <errno.h>
 #include <math.h>
+#include <linux/fs.h> // FS_IOC_GETFLAGS、FS_IOC_SETFLAGS、FS_COMPR_FL
+#undef BLOCK_SIZE     // 与sfs_ds.h中的默认块大小同名
 
 #include "sfs_ds.h"    // SFS文件系统相关数据结构
+#include "sfs_dev.h"   // SFS文件系统块设备
 #include "sfs_rw.h"    // SFS文件系统相关读写操作
 #include "sfs_utils.h" // SFS文件系统相关辅助函数
+#include "sfs_sync.h"  // SFS文件系统相关持久化操作
+#include "sfs_orphan.h" // SFS文件系统后台删除
+#include "sfs_splice.h" // SFS文件系统的缓冲区读写（read_buf、write_buf）
+#include "sfs_cache.h"  // SFS文件系统内核缓存配置与失效通知
+#include "sfs_trace.h"  // SFS文件系统跟踪
+#include "sfs_stats.h"  // SFS文件系统运行统计
+#include "sfs_record.h" // SFS文件系统I/O记录与回放
+#include "sfs_defrag.h" // SFS文件系统碎片分析与整理
 
 // ************************************************************************************
 // 以下为fuse_operations需要实现的SFS回调函数
@@ -19,28 +30,34 @@
 /*
  * 基于inode组织磁盘：
  * | super block | inode bitmap | data bitmap | inode area | data area |
- * inode号或块号大小为: sizeof(short int)=2，一个数据块可存放 512/2=256 个块号
- * 最大文件大小为: (4*512 + 256*512 + 256**2*512 + 256**3*512) Byte = 8224MB
+ * 各区域的位置和大小由mkfs根据映像大小、块大小和inode数目计算，并写入超级块
+ * inode号和块号大小为: sizeof(int)=4，默认4KB的数据块可存放 4096/4=1024 个块号
+ * 最大文件大小为: (4*4K + 1024*4K + 1024**2*4K + 1024**3*4K) Byte ≈ 4TB（受32位块号限制为8TB的数据区）
  * 
  * 初始化文件系统：
- * 1. 打开文件系统的载体文件（sfs.img）
- * 2. 检查文件系统是否已经被初始化（检查sb->fs_size），如果已经初始化，可以跳过初始化步骤
- * 3. 如果文件系统尚未初始化，进行初始化操作，包括超级块的填充以及inode位图和数据块位图的初始化
+ * 1. 按挂载选项打开块设备（默认为载体文件sfs.img，ram后端为内存虚拟磁盘）
+ * 2. 检查文件系统是否已经被格式化（检查超级块魔数），如果已经格式化，从超级块读取几何参数
+ * 3. 如果虚拟磁盘全0（尚未格式化，内存虚拟磁盘总是如此），按设备大小和默认参数进行格式化
+ * 4. 将位图读入内存；上次正常卸载时直接读入空闲计数和空闲空间摘要，否则重新统计（并行扫描数据块位图）
 */
 static void* SFS_init(struct fuse_conn_info* conn, struct fuse_config *cfg) {
-    // 8M大小的虚拟磁盘文件映像路径，该文件作为SFS文件系统的载体
-    fs = fopen(fs_img, "rb+");
-    if (fs == NULL) {
-        // 检查映像文件路径
-        perror("[SFS_init] Error: failed to open the file system image");
-        printf("[SFS_init] Error: the file system image's path: %s\n", fs_img);
+    // 虚拟磁盘文件映像路径，该文件作为SFS文件系统的载体
+    if (sfs_opts.image != NULL) {
+        fs_img = sfs_opts.image;
+    }
+    long ram_size = sfs_opts.ram_size != NULL ? parse_size(sfs_opts.ram_size) : FS_SIZE;
+    bdev = open_block_dev(sfs_opts.backend, fs_img, ram_size);
+    if (bdev == NULL) {
+        // 检查映像文件路径和块设备选项
+        perror("[SFS_init] Error: failed to open the block device");
+        TRACE_STR(ERROR, fs_img, "the file system image's path: %s");
         return NULL;
     }
+    TRACE_STR(INFO, bdev->ops->name, "block device: %s size=%ld", bdev->size);
 
-    // 检查文件系统是否已经初始化，可以通过检查超级块的fs_size来实现
-    sb = malloc(sizeof(struct sb));
-    fseek(fs, 0, SEEK_SET);              // 定位超级块位置
-    fread(sb, sizeof(struct sb), 1, fs); // 读取超级块数据
+    // 检查文件系统是否已经初始化，可以通过检查超级块的魔数来实现
+    sb = calloc(1, sizeof(struct sb));
+    bdev_read(sb, sizeof(struct sb), 0); // 读取超级块数据
 
     // 初始化根目录属性
     root_entry = (struct entry*)malloc(sizeof(struct entry));
@@ -50,60 +67,68 @@ static void* SFS_init(struct fuse_conn_info* conn, struct fuse_config *cfg) {
     root_entry->inode = 0;             // 根目录的inode号为0
     work_entry = root_entry;           // 当前工作目录为根目录
 
-    if (sb->fs_size > 0) {
+    if (sb->magic == SFS_MAGIC) {
         // 文件系统已初始化，无需再次初始化虚拟磁盘文件sfs.img
-        printf("[SFS_init] SFS has been initialized\n");
+        TRACE(INFO, "SFS has been initialized");
+        if (sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE) {
+            TRACE(ERROR, "unsupported block size %ld", sb->block_size);
+            return NULL;
+        }
+        if (load_bitmaps() != 0) { // 位图读入内存
+            TRACE(ERROR, "failed to load the bitmaps");
+            return NULL;
+        }
+        init_dirty_map(); // 分配fsync使用的脏块表
+        load_reftable();  // 数据块引用计数表和指纹索引读入内存
+    } else if (sb->fs_size != 0) {
+        // 超级块非空但魔数不匹配，不是当前格式的SFS虚拟磁盘
+        TRACE(ERROR, "unknown file system format, please format the image with mkfs.sfs");
+        return NULL;
     } else {
         // 进行虚拟磁盘初始化
-        printf("[SFS_init] Start initializing SFS\n");
-        // 文件系统虚拟磁盘尚未初始化，进行初始化操作（格式化）
-        // 首先填充超级块（超级块位于第0块）
-        sb->fs_size                  = FS_SIZE / BLOCK_SIZE;                                // 文件系统大小，以块为单位，共16*1024块
-        sb->first_blk_of_inodebitmap = 1;                                                   // inode位图的第一块块号
-        sb->inodebitmap_size         = NUM_INODE_BITMAP_BLOCK;                              // inode位图大小为1块（512B）
-        sb->first_blk_of_databitmap  = sb->first_blk_of_inodebitmap + sb->inodebitmap_size; // 数据块位图的第一块块号（第2块）
-        sb->databitmap_size          = NUM_DATA_BITMAP_BLOCK;                               // 数据块位图大小为4块（4 * 512 = 2048 Byte）
-        sb->first_inode              = sb->first_blk_of_databitmap + sb->databitmap_size;   // inode区的第一块块号（第6块）
-        sb->inode_area_size          = sb->inodebitmap_size * BLOCK_SIZE * 8;               // inode区大小为512*8块，该文件系统最多有4k个文件
-        sb->first_blk                = sb->first_inode + sb->inode_area_size;               // 数据区的第一块块号（6 + 4096 = 4102）
-        sb->datasize                 = sb->databitmap_size * BLOCK_SIZE * 8;                // 数据区大小为4*512*8块
-
-        // 将超级块数据写到到文件系统载体文件
-        fseek(fs, 0, SEEK_SET);
-        fwrite(sb, sizeof(struct sb), 1, fs);
-
-        // 将根目录的相关信息填写到inode区的第一个inode
-        struct inode* root_inode = (struct inode*)malloc(sizeof(struct inode));
-        root_inode->st_mode  = __S_IFDIR | 0755; // 目录文件
-        root_inode->st_ino   = 0;                // 根目录的inode号为0（第一个）
-        root_inode->st_nlink = 2;                // 链接引用数（根目录为2，其它目录为1）
-        root_inode->st_uid   = 0;                // 拥有者的用户ID，0为超级用户
-        root_inode->st_gid   = 0;                // 拥有者的组ID，0为超级用户组
-        root_inode->st_size  = 0;                // 初始大小为空
-
-        // 初始化根目录inode
-        write_inode(0, root_inode); // 写回磁盘更新
-        set_inode_bitmap_used(0);   // 第一个inode已分配（ino=0）
-
-        // 完成文件系统初始化，关闭文件系统载体文件 
-        free(root_inode);
-        root_inode = NULL;
-    }
-
-    // 检查超级块属性
-    printf("\tsuper block: first inode bitmap=%ld\n", sb->first_blk_of_inodebitmap);
-    printf("\tsuper block: inode bitmap size=%ld\n", sb->inodebitmap_size);
-    printf("\tsuper block: first datablock bitmap=%ld\n", sb->first_blk_of_databitmap);
-    printf("\tsuper block: datablock bitmap size=%ld\n", sb->databitmap_size);
-    printf("\tsuper block: first inode=%ld\n", sb->first_inode);
-    printf("\tsuper block: first datablock=%ld\n", sb->first_blk);
-    printf("\tsuper block: file system size=%ld\n", sb->fs_size);
-    // 检查root_entry
-    char* type = root_entry->type == DIR_TYPE ? "DIR": "FILE";
-    printf("\troot entry: name=%s\n", root_entry->name);
-    printf("\troot entry: type=%s\n", type);
-    printf("\troot entry: inode=%d\n", root_entry->inode);
+        TRACE(INFO, "Start initializing SFS");
+        // 文件系统虚拟磁盘尚未初始化，按块设备大小和默认参数进行格式化
+        long fs_bytes = bdev->size;
+        if (format_fs(fs_bytes, BLOCK_SIZE, fs_bytes / INODE_RATIO, 0) != 0) {
+            return NULL;
+        }
+    }
+
+    // 记录超级块属性
+    TRACE(INFO, "inode bitmap=%ld (%ld blocks) datablock bitmap=%ld (%ld blocks)",
+          sb->first_blk_of_inodebitmap, sb->inodebitmap_size, sb->first_blk_of_databitmap, sb->databitmap_size);
+    TRACE(INFO, "first inode=%ld first datablock=%ld reference table=%ld (%ld blocks)",
+          sb->first_inode, sb->first_blk, sb->first_blk_of_reftable, sb->reftable_size);
+    TRACE(INFO, "file system size=%ld block size=%ld inodes=%ld features=%#lx",
+          sb->fs_size, sb->block_size, sb->num_inodes, sb->features);
+    TRACE_STR(INFO, root_entry->name, "root entry: name=%s type=%ld inode=%ld", root_entry->type, root_entry->inode);
+
+    // 允许libfuse通过splice从FUSE设备读取请求，write_buf的数据可以从管道直接写入映像文件
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_MOVE);
+    // 记录FUSE回调和块设备操作
+    if (sfs_opts.record != NULL) {
+        if (start_recorder(sfs_opts.record) != 0) {
+            perror("[SFS_init] Error: failed to create the record file");
+        } else {
+            bdev = open_record_dev(bdev);
+        }
+    }
+
+    // 按挂载选项配置内核缓存，并启动缓存失效通知线程（回放时没有fuse实例，也没有需要通知的内核缓存）
+    apply_cache_options(conn, cfg);
+    if (sfs_opts.replay == NULL && start_invalidate_worker() != 0) {
+        TRACE(ERROR, "failed to start the cache invalidation thread");
+    }
+
+    // 收到SIGUSR1时将运行统计输出到stderr
+    if (start_stats_dump_worker() != 0) {
+        TRACE(ERROR, "failed to start the statistics dump thread");
+    }
 
+    // 启动后台回收线程（继续回收上次卸载或崩溃时未回收完的孤儿）
+    if (start_orphan_worker() != 0) {
+        TRACE(ERROR, "failed to start the orphan reclaim thread");
+    }
     return NULL;
 }
 
@@ -112,7 +137,16 @@ static int SFS_getattr(const char *path,
                        struct stat *stbuf, 
                        struct fuse_file_info *fi) {
     (void) fi;
-    printf("[SFS_getattr] path=%s\n", path);
+    TRACE_STR(DEBUG, path, "path=%s");
+
+    // 统计信息虚拟文件（只读，大小为0，读取时由direct_io忽略大小）
+    if (strcmp(path, STATS_PATH) == 0) {
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_blksize = sb->block_size;
+        return 0;
+    }
 
     // 过滤文件（包括进行读写文件时一些隐藏文件、临时文件等，防止SFS为它们额外创建数据结构）
     char fname[MAX_PATH_LEN];
@@ -126,7 +160,7 @@ static int SFS_getattr(const char *path,
                         fname[0] == '.' || 
                         fname[strlen(fname)-1] == '~';
         if (condition) {
-            printf("[SFS_getattr] filter the hidden file %s\n", fname);
+            TRACE_STR(DEBUG, fname, "filter the hidden file %s");
             free(t_entry);
             return -1;
         }
@@ -137,7 +171,7 @@ static int SFS_getattr(const char *path,
     struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
     // 根据路径获取目标entry
     if (find_entry(path, entry) == -1) {
-        printf("[SFS_getattr] Error: path %s is not existed\n", path);
+        TRACE_STR(DEBUG, path, "path %s is not existed");
         return -ENOENT; // 没有该目录或文件
     }
     // 根据inode号读取对应索引节点
@@ -147,13 +181,13 @@ static int SFS_getattr(const char *path,
     // 根据inode将属性赋值stbuf(struct stat)，文件系统便可知道文件属性
     memset(stbuf, 0, sizeof(struct stat));
     stbuf->st_mode    = inode->st_mode;  // 权限，也可以显示是目录还是普通文件类型
-    stbuf->st_ino     = inode->st_ino;   // inode号（short int）
+    stbuf->st_ino     = inode->st_ino;   // inode号（int）
 	stbuf->st_nlink   = inode->st_nlink; // 链接数
 	stbuf->st_uid     = inode->st_uid;   // 用户id
 	stbuf->st_gid     = inode->st_gid;   // 用户组id
 	stbuf->st_size    = inode->st_size;  // 文件大小
-    stbuf->st_blksize = BLOCK_SIZE;
-    stbuf->st_blocks  = inode->st_size / BLOCK_SIZE + 1;
+    stbuf->st_blksize = sb->block_size;
+    stbuf->st_blocks  = (long)inode->st_blocks * (sb->block_size / 512); // 实际分配的块数，以512字节为单位（空洞和内联数据不占用数据块）
 
     free(entry);
     free(inode);
@@ -174,12 +208,12 @@ static int SFS_readdir(const char* path, void* buf,
                        enum fuse_readdir_flags flags) {
     (void) fi;
     off_t cur = offset; // 当前需要进行返回的目录项偏移
-    printf("[SFS_readir] path=%s\n", path);
+    TRACE_STR(DEBUG, path, "path=%s");
     struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
     // 根据路径解析获取将要读取的entry
     if (find_entry(path, entry) == -1) {
         // 该目录没有对应entry
-        printf("[SFS_readir] Error: this path %s does not exist\n", path);
+        TRACE_STR(DEBUG, path, "this path %s does not exist");
         return -1;
     }
 
@@ -191,28 +225,32 @@ static int SFS_readdir(const char* path, void* buf,
     read_dir(inode, dir);
 
     if (cur < dir->num_entries) {
-        char fname[MAX_FILE_NAME + 1 + MAX_FILE_EXTENSION];
+        char fname[MAX_FILE_NAME + 2 + MAX_FILE_EXTENSION];
         full_name(dir->entries[cur]->name, dir->entries[cur]->extension, fname);
         // printf("[SFS_readdir] name=%s\n", fname);
         // 将文件名加入到缓冲区，文件系统会自动获取目录项进行显示
         filler(buf, fname, NULL, ++cur, 0); 
     }
 
+    free_dir(dir);
+    free(dir);
+    free(inode);
+    free(entry);
     return 0;
 }
 
 // 创建目录
 static int SFS_mkdir(const char* path, mode_t mode) {
-    printf("[SFS_mkdir] path=%s\n", path);
+    TRACE_STR(DEBUG, path, "path=%s");
     (void) mode;
     struct entry* parent_entry = (struct entry*)malloc(sizeof(struct entry));
-    char* parent_path = (char*)malloc(sizeof(path));
+    char* parent_path = (char*)malloc(MAX_PATH_LEN);
     // 获取path的上一级目录
     get_parent_path(path, parent_path); // 获得上一级路径
     find_entry(parent_path, parent_entry); // 获得上一级entry（需要保证是目录文件类型）
     if (parent_entry->type != DIR_TYPE) {
         // 需要保证上一级是目录文件类型
-        printf("[SFS_mkdir] Error: parent entry is not DIR type\n");
+        TRACE(DEBUG, "parent entry is not DIR type");
         free(parent_entry);
         free(parent_path);
         parent_entry = NULL;
@@ -221,20 +259,24 @@ static int SFS_mkdir(const char* path, mode_t mode) {
     }
 
     // 寻找空闲inode装载新创建的目录
-    short int* ino = (short int*)malloc(sizeof(short int));
+    int* ino = (int*)malloc(sizeof(int));
     get_free_ino(ino);
     if (*ino == -1) {
         // 没有空闲inode
-        printf("[SFS_mkdir] Error: there is no free inode for new entry\n");
+        TRACE(ERROR, "there is no free inode for new entry");
         free(parent_entry);
         free(parent_path);
         free(ino);
         return -1;
     }
 
+    // 读取父目录的inode，新目录继承其压缩设置
+    struct inode* parent_inode = (struct inode*)malloc(sizeof(struct inode));
+    read_inode(parent_entry->inode, parent_inode);
     // 创建新inode指向new_entry
     struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
     new_inode(inode, *ino, DIR_TYPE);
+    inherit_compress(inode, parent_inode);
     // 将该inode写入虚拟磁盘
     write_inode(*ino, inode); 
     set_inode_bitmap_used(*ino);
@@ -244,11 +286,14 @@ static int SFS_mkdir(const char* path, mode_t mode) {
     get_file_name(path, file_name);
     struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
     new_entry(entry, file_name, "", DIR_TYPE, *ino);
-    // 读取父目录的entry，将新创建的子目录加入其中
-    struct inode* parent_inode = (struct inode*)malloc(sizeof(struct inode));
-    read_inode(parent_entry->inode, parent_inode);
+    // 将新创建的子目录加入父目录
     //printf("[SFS_mkdir] add entry name=%s\n", entry->name);
-    add_entry(parent_inode, entry);
+    int ret = 0;
+    if (add_entry(parent_inode, entry) != 0) {
+        // 父目录没有空间存放新目录项，释放已分配的inode
+        set_free_inode_bitmap(*ino);
+        ret = -ENOSPC;
+    }
 
     free(ino);
     free(inode);
@@ -262,35 +307,35 @@ static int SFS_mkdir(const char* path, mode_t mode) {
     parent_path = NULL;
     parent_entry = NULL;
     parent_inode = NULL;
-    return 0;
+    return ret;
 }
 
 // 删除目录
 static int SFS_rmdir(const char* path) {
-    printf("[SFS_rmdir] path=%s\n", path);
+    TRACE_STR(DEBUG, path, "path=%s");
     if (strcmp(path, "/") == 0) {
         // 根目录无法删除
-        printf("[SFS_rmdir] fail to remove the root dir\n");
+        TRACE(DEBUG, "fail to remove the root dir");
         return -1;
     }
     // 路径解析
     struct entry* entry = (struct entry*)malloc(sizeof(struct entry)); // 待删除的entry
     if (find_entry(path, entry) != 0) {
         // 不存在该路径对应的entry
-        printf("[SFS_rmdir] the path %s does not exist\n", path);
+        TRACE_STR(DEBUG, path, "the path %s does not exist");
         return -1;
     }
     // 找到了路径需要删除目录对应的entry
     // 从父目录下将其删除
     struct entry* parent_entry = (struct entry*)malloc(sizeof(struct entry));
-    char* parent_path = (char*)malloc(sizeof(path));
+    char* parent_path = (char*)malloc(MAX_PATH_LEN);
     // 获取path的上一级目录
     get_parent_path(path, parent_path); // 获得上一级路径
     find_entry(parent_path, parent_entry); // 获得上一级entry
     // 遍历parent_inode的数据块进行匹配删除（在remove_entry内）
     struct inode* parent_inode = (struct inode*)malloc(sizeof(struct inode));
     read_inode(parent_entry->inode, parent_inode);
-    remove_entry(parent_inode, entry); // 内部递归操作，将目录的子目录项一同清空
+    remove_entry(parent_inode, entry); // 内部递归释放目录下的全部子目录和文件及其数据块
 
     free(entry);
     free(parent_entry);
@@ -301,26 +346,26 @@ static int SFS_rmdir(const char* path) {
 // 创建文件
 // touch要求不仅仅是创建文件，还要求可以修改文件的访问时间，故实现了utimeus调用
 static int SFS_mknod(const char* path, mode_t mode, dev_t dev) {
-    printf("[SFS_mknod] path=%s\n", path);
+    TRACE_STR(DEBUG, path, "path=%s");
     (void) mode;
     (void) dev;
     // 过滤文件
     char file_name[MAX_FILE_NAME + MAX_FILE_EXTENSION + 1];
     get_file_name(path, file_name);
     if (strcmp(file_name, "") == 0 || file_name[0] == '.') {
-        printf("[SFS_mknod] filter the hidden file %s\n", file_name);
+        TRACE_STR(DEBUG, file_name, "filter the hidden file %s");
         return -1;
     }
 
     // 获取父目录，将新创建文件加入其中
     struct entry* parent_entry = (struct entry*)malloc(sizeof(struct entry));
-    char* parent_path = (char*)malloc(sizeof(path));
+    char* parent_path = (char*)malloc(MAX_PATH_LEN);
     // 获取path的上一级目录
     get_parent_path(path, parent_path); // 获得上一级路径
     find_entry(parent_path, parent_entry); // 获得上一级entry（需要保证是目录文件类型）
     if (parent_entry->type != DIR_TYPE) {
         // 需要保证上一级是目录文件类型
-        printf("[SFS_mknod] Error: parent entry is not DIR type\n");
+        TRACE(DEBUG, "parent entry is not DIR type");
         free(parent_entry);
         free(parent_path);
         parent_entry = NULL;
@@ -329,20 +374,24 @@ static int SFS_mknod(const char* path, mode_t mode, dev_t dev) {
     }
 
     // 寻找空闲inode指向新创建的文件
-    short int* ino = (short int*)malloc(sizeof(short int));
+    int* ino = (int*)malloc(sizeof(int));
     get_free_ino(ino);
     if (*ino == -1) {
         // 没有空闲inode
-        printf("[SFS_mknod] Error: there is no free inode for new entry\n");
+        TRACE(ERROR, "there is no free inode for new entry");
         free(parent_entry);
         free(parent_path);
         free(ino);
         return -1;
     }
 
+    // 读取父目录的inode，新文件继承其压缩设置
+    struct inode* parent_inode = (struct inode*)malloc(sizeof(struct inode));
+    read_inode(parent_entry->inode, parent_inode);
     // 创建新inode指向new_entry
     struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
     new_inode(inode, *ino, FILE_TYPE);
+    inherit_compress(inode, parent_inode);
     // 将该inode写入虚拟磁盘
     write_inode(*ino, inode); 
     set_inode_bitmap_used(*ino);
@@ -352,10 +401,13 @@ static int SFS_mknod(const char* path, mode_t mode, dev_t dev) {
     fname_ext(file_name, entry->name, entry->extension); // 分割文件名和扩展名
     new_entry(entry, entry->name, entry->extension, FILE_TYPE, *ino);
 
-    struct inode* parent_inode = (struct inode*)malloc(sizeof(struct inode));
-    read_inode(parent_entry->inode, parent_inode);
     //printf("[SFS_mknod] add entry name=%s\n", entry->name);
-    add_entry(parent_inode, entry); // 将新创建文件加入到父目录下
+    int ret = 0;
+    if (add_entry(parent_inode, entry) != 0) { // 将新创建文件加入到父目录下
+        // 父目录没有空间存放新目录项，释放已分配的inode
+        set_free_inode_bitmap(*ino);
+        ret = -ENOSPC;
+    }
 
     free(ino);
     free(inode);
@@ -370,35 +422,35 @@ static int SFS_mknod(const char* path, mode_t mode, dev_t dev) {
     parent_entry = NULL;
     parent_inode = NULL;
 
-    return 0;
+    return ret;
 }
 
 // 删除文件
 // 与删除目录实现基本一致
 static int SFS_unlink(const char* path) {
-    printf("[SFS_unlink] path=%s\n", path);
+    TRACE_STR(DEBUG, path, "path=%s");
     if (strcmp(path, "/") == 0) {
         // 根目录无法删除
-        printf("[SFS_unlink] fail to remove the root dir\n");
+        TRACE(DEBUG, "fail to remove the root dir");
         return -1;
     }
     // 路径解析获取需要删除的文件
     struct entry* entry = (struct entry*)malloc(sizeof(struct entry)); // 待删除的entry
     if (find_entry(path, entry) != 0) {
         // 不存在该路径对应的entry
-        printf("[SFS_unlink] the path %s does not exist\n", path);
+        TRACE_STR(DEBUG, path, "the path %s does not exist");
         return -1;
     }
     // 找到了路径对应的entry
     struct entry* parent_entry = (struct entry*)malloc(sizeof(struct entry));
-    char* parent_path = (char*)malloc(sizeof(path));
+    char* parent_path = (char*)malloc(MAX_PATH_LEN);
     // 获取path的上一级目录
     get_parent_path(path, parent_path); // 获得上一级路径
     find_entry(parent_path, parent_entry); // 获得上一级entry
     // 遍历parent_inode的数据块进行匹配删除
     struct inode* parent_inode = (struct inode*)malloc(sizeof(struct inode));
     read_inode(parent_entry->inode, parent_inode);
-    remove_entry(parent_inode, entry); // 父目录删除子文件
+    remove_entry(parent_inode, entry); // 父目录删除子文件，并释放文件的数据块
 
     free(entry);
     free(parent_entry);
@@ -406,83 +458,346 @@ static int SFS_unlink(const char* path) {
     return 0;
 }
 
-// 打开文件
+// 打开文件，打开统计信息虚拟文件时生成统计快照（之后的读取都读这份快照）
 static int SFS_open(const char* path, struct fuse_file_info* fi) {
-	(void)fi;
-	(void)path;
+    if (strcmp(path, STATS_PATH) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        size_t len;
+        fi->fh = (uint64_t)(uintptr_t)stats_format(&len);
+        fi->direct_io = 1; // 内容与文件大小无关，不经过内核页缓存
+    }
 	return 0;
 }
 
 // 关闭文件
 static int SFS_release(const char* path, struct fuse_file_info* fi) {
-    (void)fi;
-	(void)path;
+    if (strcmp(path, STATS_PATH) == 0) {
+        free((char*)(uintptr_t)fi->fh);
+    }
     return 0;
 }
 
+// 读取统计信息虚拟文件中从offset开始的内容（打开时生成的快照）
+static int read_stats_file(struct fuse_file_info* fi, char* buf, size_t size, off_t offset) {
+    const char* text = (const char*)(uintptr_t)fi->fh;
+    long len = strlen(text);
+    if (offset >= len) {
+        return 0;
+    }
+    size = MIN(size, len - offset);
+    memcpy(buf, text + offset, size);
+    return size;
+}
+
 // 读文件
 static int SFS_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-    (void) fi;
-    printf("[SFS_read] path=%s\n", path);
+    TRACE_STR(DEBUG, path, "path=%s");
+    if (strcmp(path, STATS_PATH) == 0) {
+        return read_stats_file(fi, buf, size, offset);
+    }
     // 路径解析获取需要读取的文件entry
     struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
     find_entry(path, entry);
     // 判断是否属于普通文件类型
     if (entry->type != FILE_TYPE) {
-        printf("[SFS_read] the path %s is not a file\n", path);
+        TRACE_STR(DEBUG, path, "the path %s is not a file");
         return -EISDIR; // 无法读取目录
     }
     // 获取读取文件的inode
     struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
     read_inode(entry->inode, inode);
-    if (inode->st_size < offset) {
-        free(entry);
-        free(inode);
-        // 要保证文件大小大于所要读取的偏移量
-        return -ESPIPE;
-    }
     // printf("[SFS_read] inode size=%ld\n", inode->st_size);
 
-    char* data = malloc(inode->st_size);
-    read_file(inode, data, size); // 将inode存储的数据读取到data
-    // 将数据data拷贝到buf缓冲区，即内存
-    memcpy(buf, data + offset, size);
+    // 只读取请求范围内的数据块，直接拷贝到buf缓冲区（空洞读出为0，超出文件末尾读出0字节）
+    long ret = read_file(inode, buf, size, offset);
+    free(entry);
+    free(inode);
+    return ret; // 返回实际读取的字节数，如果读取失败，返回负数表示错误
+}
+
+// 读文件：物理上连续的数据块合并为一段，持有全局锁时读出到内存段返回
+static int SFS_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* fi) {
+    TRACE_STR(DEBUG, path, "path=%s");
+    if (strcmp(path, STATS_PATH) == 0) {
+        struct fuse_bufvec* bufv = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec));
+        *bufv = FUSE_BUFVEC_INIT(size);
+        bufv->buf[0].mem = malloc(size);
+        bufv->buf[0].size = read_stats_file(fi, (char*)bufv->buf[0].mem, size, offset);
+        *bufp = bufv;
+        return 0;
+    }
+    struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
+    if (find_entry(path, entry) != 0) {
+        free(entry);
+        return -ENOENT;
+    }
+    if (entry->type != FILE_TYPE) {
+        free(entry);
+        return -EISDIR;
+    }
+    struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
+    read_inode(entry->inode, inode);
+    int ret = read_file_bufvec(inode, size, offset, bufp);
     free(entry);
     free(inode);
-    return size; // 返回实际读取的字节数，如果读取失败，返回负数表示错误
+    return ret;
 }
 
 // 写文件
 static int SFS_write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
     (void) fi;
-    printf("[SFS_write] path=%s\n", path);
+    TRACE_STR(DEBUG, path, "path=%s");
     // 路径解析
     struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
     find_entry(path, entry);
     if (entry->type != FILE_TYPE) {
-        printf("[SFS_read] the path %s is not a file\n", path);
+        TRACE_STR(DEBUG, path, "the path %s is not a file");
         return -EISDIR; // 无法读取目录
     }
     // 获取待写文件的inode
     struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
     read_inode(entry->inode, inode);
-    if (inode->st_size < offset) {
-        // 要保证文件大小大于所要读取的偏移量
-        free(entry);
-        free(inode);
-        return -ESPIPE;
-    }
-    // 写后文件的大小
-    int new_size = MAX(offset + size, inode->st_size);
-    char* data = malloc(new_size);
-    // 首先将文件内容读取出来，在此基础上写
-    read_file(inode, data, inode->st_size); 
-    memcpy(data + offset, buf, size);  // 将写的数据拷贝到读取的数据中
-    write_file(inode, data, new_size); // 将写后的数据拷贝回索引节点
-    inode->st_size = new_size; // 更新inode文件大小
+    // 写后文件的大小（offset超出文件末尾时，中间部分成为空洞，不分配数据块）
+    off_t new_size = MAX(offset + size, inode->st_size);
+    int ret = size;
+    // 只写入请求范围内的数据块
+    if (write_file(inode, buf, size, offset) != 0) {
+        ret = -ENOSPC; // 没有空闲数据块，已分配的数据块仍记录在inode中
+    } else {
+        inode->st_size = new_size; // 更新inode文件大小
+    }
     // 写回inode到磁盘
     write_inode(inode->st_ino, inode);
-    return size;
+    free(entry);
+    free(inode);
+    return ret;
+}
+
+// 写文件（零拷贝）：写入已分配的独占数据块时，数据从buf（可能是管道）直接写入映像文件
+static int SFS_write_buf(const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* fi) {
+    (void) fi;
+    TRACE_STR(DEBUG, path, "path=%s");
+    struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
+    if (find_entry(path, entry) != 0) {
+        free(entry);
+        return -ENOENT;
+    }
+    if (entry->type != FILE_TYPE) {
+        free(entry);
+        return -EISDIR;
+    }
+    struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
+    read_inode(entry->inode, inode);
+    long ret = write_file_bufvec(inode, buf, offset);
+    if (ret > 0) {
+        inode->st_size = MAX(inode->st_size, offset + ret);
+    }
+    write_inode(inode->st_ino, inode);
+    free(entry);
+    free(inode);
+    return ret;
+}
+
+// 关闭文件描述符时调用（每次close都会调用，一个文件可能被调用多次）
+// 只写回延后的引用计数表，不等待落盘
+static int SFS_flush(const char* path, struct fuse_file_info* fi) {
+    (void) path;
+    (void) fi;
+    return flush_fs();
+}
+
+/**
+ * 同步文件数据和元数据到虚拟磁盘所在的存储设备
+ * @param datasync 非0表示fdatasync
+ */
+static int SFS_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+    (void) fi;
+    TRACE_STR(DEBUG, path, "path=%s datasync=%ld", datasync);
+    // fsync不整体持有fs_lock（设备刷新期间不持有），查找inode时加锁，sync_inode在锁内重新读取inode
+    pthread_mutex_lock(&fs_lock);
+    struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
+    if (find_entry(path, entry) != 0) {
+        pthread_mutex_unlock(&fs_lock);
+        TRACE_STR(DEBUG, path, "the path %s does not exist");
+        free(entry);
+        return -ENOENT;
+    }
+    int ino = entry->inode;
+    pthread_mutex_unlock(&fs_lock);
+    free(entry);
+    return sync_inode(ino, datasync);
+}
+
+// 文件系统的容量和空闲空间（df），直接返回超级块中随分配和释放更新的空闲计数，不扫描位图
+static int SFS_statfs(const char* path, struct statvfs* st) {
+    (void) path;
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = sb->block_size;
+    st->f_frsize = sb->block_size;
+    st->f_blocks = sb->datasize;
+    st->f_bfree = st->f_bavail = __atomic_load_n(&sb->free_blocks, __ATOMIC_RELAXED);
+    st->f_files = sb->num_inodes;
+    st->f_ffree = st->f_favail = __atomic_load_n(&sb->free_inodes, __ATOMIC_RELAXED);
+    st->f_namemax = MAX_FILE_NAME + 1 + MAX_FILE_EXTENSION; // 8.3格式
+    return 0;
+}
+
+// 同步目录（目录项存放在目录inode的数据块中，与文件的同步方式相同）
+static int SFS_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi) {
+    return SFS_fsync(path, datasync, fi);
+}
+
+// 修改文件大小
+static int SFS_truncate(const char* path, off_t size, struct fuse_file_info* fi) {
+    (void) fi;
+    TRACE_STR(DEBUG, path, "path=%s size=%ld", size);
+    if (size < 0) {
+        return -EINVAL;
+    }
+    struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
+    if (find_entry(path, entry) != 0) {
+        free(entry);
+        return -ENOENT;
+    }
+    if (entry->type != FILE_TYPE) {
+        free(entry);
+        return -EISDIR;
+    }
+    struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
+    read_inode(entry->inode, inode);
+    int ret = truncate_file(inode, size) == 0 ? 0 : -ENOSPC;
+    write_inode(inode->st_ino, inode);
+    free(entry);
+    free(inode);
+    return ret;
+}
+
+// 预分配或释放文件空间（支持FALLOC_FL_KEEP_SIZE和FALLOC_FL_PUNCH_HOLE）
+static int SFS_fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi) {
+    (void) fi;
+    TRACE_STR(DEBUG, path, "path=%s mode=%#lx offset=%ld length=%ld", mode, offset, length);
+    struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
+    if (find_entry(path, entry) != 0) {
+        free(entry);
+        return -ENOENT;
+    }
+    if (entry->type != FILE_TYPE) {
+        free(entry);
+        return -ENODEV; // 只支持普通文件
+    }
+    struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
+    read_inode(entry->inode, inode);
+    int ret = fallocate_file(inode, mode, offset, length);
+    write_inode(inode->st_ino, inode);
+    free(entry);
+    free(inode);
+    return ret;
+}
+
+// 查找文件中的数据或空洞（SEEK_DATA、SEEK_HOLE），直接根据块映射回答，不读取数据块
+static off_t SFS_lseek(const char* path, off_t off, int whence, struct fuse_file_info* fi) {
+    (void) fi;
+    TRACE_STR(DEBUG, path, "path=%s off=%ld whence=%ld", off, whence);
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL; // 其它whence由内核自行处理
+    }
+    struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
+    if (find_entry(path, entry) != 0) {
+        free(entry);
+        return -ENOENT;
+    }
+    struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
+    read_inode(entry->inode, inode);
+    off_t ret = seek_data_hole(inode, off, whence);
+    free(entry);
+    free(inode);
+    return ret;
+}
+
+// 复制文件区间（copy_file_range，cp默认使用），可以时直接共享源文件的数据块，否则在文件系统内复制
+static ssize_t SFS_copy_file_range(const char* path_in, struct fuse_file_info* fi_in, off_t offset_in,
+                                   const char* path_out, struct fuse_file_info* fi_out, off_t offset_out,
+                                   size_t size, int flags) {
+    (void) fi_in;
+    (void) fi_out;
+    TRACE_STR(DEBUG, path_in, "from %s offset=%ld size=%ld", offset_in, size);
+    TRACE_STR(DEBUG, path_out, "to %s offset=%ld", offset_out);
+    if (flags != 0) {
+        return -EINVAL;
+    }
+    struct entry* entry_in = (struct entry*)malloc(sizeof(struct entry));
+    struct entry* entry_out = (struct entry*)malloc(sizeof(struct entry));
+    ssize_t ret = 0;
+    if (find_entry(path_in, entry_in) != 0 || find_entry(path_out, entry_out) != 0) {
+        ret = -ENOENT;
+    } else if (entry_in->type != FILE_TYPE || entry_out->type != FILE_TYPE) {
+        ret = -EISDIR;
+    }
+    if (ret != 0) {
+        free(entry_in);
+        free(entry_out);
+        return ret;
+    }
+    struct inode* src = (struct inode*)malloc(sizeof(struct inode));
+    struct inode* dst = src; // 同一个文件内复制时共用一个inode结构体
+    read_inode(entry_in->inode, src);
+    if (entry_out->inode != entry_in->inode) {
+        dst = (struct inode*)malloc(sizeof(struct inode));
+        read_inode(entry_out->inode, dst);
+    }
+    ret = copy_file_range_inode(src, offset_in, dst, offset_out, size);
+    write_inode(dst->st_ino, dst);
+    if (dst != src) {
+        free(dst);
+    }
+    free(src);
+    free(entry_in);
+    free(entry_out);
+    return ret;
+}
+
+// 读取或修改inode标志（lsattr/chattr），目前只支持FS_COMPR_FL（透明压缩）
+// SFS_IOC_FRAGINFO读取文件的碎片信息，SFS_IOC_DEFRAG在线整理文件的碎片（sfsfrag -f）
+static int SFS_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags, void* data) {
+    (void) arg;
+    (void) fi;
+    TRACE_STR(DEBUG, path, "path=%s cmd=%#lx", cmd);
+    if (flags & FUSE_IOCTL_COMPAT) {
+        return -ENOSYS;
+    }
+    if ((unsigned int)cmd != FS_IOC_GETFLAGS && (unsigned int)cmd != FS_IOC_SETFLAGS &&
+        (unsigned int)cmd != SFS_IOC_FRAGINFO && (unsigned int)cmd != SFS_IOC_DEFRAG) {
+        return -ENOTTY;
+    }
+    struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
+    if (find_entry(path, entry) != 0) {
+        free(entry);
+        return -ENOENT;
+    }
+    struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
+    read_inode(entry->inode, inode);
+    int ret = 0;
+    if ((unsigned int)cmd == FS_IOC_GETFLAGS) {
+        *(unsigned int*)data = (inode->flags & INODE_COMPRESS) ? FS_COMPR_FL : 0;
+    } else if ((unsigned int)cmd == SFS_IOC_FRAGINFO) {
+        inode_frag_info(inode, (struct frag_info*)data);
+    } else if ((unsigned int)cmd == SFS_IOC_DEFRAG) {
+        ret = defrag_inode(inode, (struct frag_info*)data);
+        if (ret == 0) {
+            invalidate_path(path); // st_blocks可能改变（索引块数不同）
+        }
+    } else {
+        ret = set_inode_compress(inode, *(unsigned int*)data & FS_COMPR_FL);
+        write_inode(inode->st_ino, inode);
+        if (ret == 0) {
+            invalidate_path(path); // inode由SFS直接修改（不经过setattr），通知内核丢弃缓存的属性
+        }
+    }
+    free(entry);
+    free(inode);
+    return ret;
 }
 
 // 修改时间
@@ -493,23 +808,165 @@ int SFS_utimens(const char* path, const struct timespec tv[2], struct fuse_file_
 }
 
 
+// 卸载文件系统时调用（fuse实例销毁前），停止需要fuse实例的缓存失效通知线程和后台回收线程，
+// 写回延后的修改后将文件系统标记为正常卸载
+static void SFS_destroy(void* private_data) {
+    (void) private_data;
+    stop_invalidate_worker();
+    stop_stats_dump_worker();
+    if (bdev == NULL || data_bitmap == NULL) {
+        return; // 初始化失败，没有可写回的状态
+    }
+    stop_orphan_worker(); // 未回收完的孤儿留在链表中，下次挂载时继续回收
+    write_reftable();     // 写回延后的指纹
+    if (mark_fs_clean() != 0) {
+        TRACE(ERROR, "failed to mark the file system clean");
+    }
+}
+
 // 定义文件系统支持的操作函数，并添加到该结构体中
 // fuse会在执行linux相关操作时执行我们所定义的文件操作函数
+/*
+ * 除fsync外的回调都在全局锁fs_lock下执行，与其它回调和后台回收线程互斥
+ * SFS_LOCKED为回调生成加锁的包装函数name_locked，同时记录等待fs_lock的时间和回调的延迟（含等待时间）
+ * 不加锁的回调由SFS_TIMED生成只记录延迟的包装函数name_timed
+ * rec为启用记录（record=）时写入记录的参数(path, path2, offset, size, arg)，含义见struct record_entry；
+ * 加锁的回调在释放fs_lock前记录，记录的顺序就是回调执行的顺序
+*/
+#define RECORD_ARGS(...) __VA_ARGS__
+
+#define SFS_LOCKED(ret_type, name, timer, params, args, rec) \
+static ret_type name##_locked params {                       \
+    uint64_t start = stats_now();                            \
+    pthread_mutex_lock(&fs_lock);                            \
+    stats_record(STAT_LOCK_WAIT, start);                     \
+    ret_type ret = name args;                                \
+    record_fuse_op(timer, start, ret, RECORD_ARGS rec);      \
+    pthread_mutex_unlock(&fs_lock);                          \
+    stats_record(timer, start);                              \
+    return ret;                                              \
+}
+
+#define SFS_TIMED(ret_type, name, timer, params, args, rec) \
+static ret_type name##_timed params {                       \
+    uint64_t start = stats_now();                           \
+    ret_type ret = name args;                               \
+    record_fuse_op(timer, start, ret, RECORD_ARGS rec);     \
+    stats_record(timer, start);                             \
+    return ret;                                             \
+}
+
+SFS_LOCKED(int, SFS_getattr, STAT_GETATTR, (const char* path, struct stat* st, struct fuse_file_info* fi), (path, st, fi),
+           (path, NULL, 0, 0, 0))
+SFS_LOCKED(int, SFS_readdir, STAT_READDIR, (const char* path, void* buf, fuse_fill_dir_t filler, off_t offset,
+                                            struct fuse_file_info* fi, enum fuse_readdir_flags flags),
+                                           (path, buf, filler, offset, fi, flags),
+           (path, NULL, offset, 0, 0))
+SFS_LOCKED(int, SFS_mkdir, STAT_MKDIR, (const char* path, mode_t mode), (path, mode), (path, NULL, 0, 0, mode))
+SFS_LOCKED(int, SFS_rmdir, STAT_RMDIR, (const char* path), (path), (path, NULL, 0, 0, 0))
+SFS_LOCKED(int, SFS_mknod, STAT_MKNOD, (const char* path, mode_t mode, dev_t dev), (path, mode, dev), (path, NULL, 0, 0, mode))
+SFS_LOCKED(int, SFS_unlink, STAT_UNLINK, (const char* path), (path), (path, NULL, 0, 0, 0))
+SFS_LOCKED(int, SFS_read, STAT_READ, (const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi),
+                                     (path, buf, size, offset, fi),
+           (path, NULL, offset, size, 0))
+SFS_LOCKED(int, SFS_write, STAT_WRITE, (const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi),
+                                       (path, buf, size, offset, fi),
+           (path, NULL, offset, size, 0))
+SFS_LOCKED(int, SFS_read_buf, STAT_READ_BUF, (const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* fi),
+                                             (path, bufp, size, offset, fi),
+           (path, NULL, offset, size, 0))
+SFS_LOCKED(int, SFS_write_buf, STAT_WRITE_BUF, (const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* fi),
+                                               (path, buf, offset, fi),
+           (path, NULL, offset, fuse_buf_size(buf), 0))
+SFS_LOCKED(int, SFS_flush, STAT_FLUSH, (const char* path, struct fuse_file_info* fi), (path, fi), (path, NULL, 0, 0, 0))
+SFS_LOCKED(off_t, SFS_lseek, STAT_LSEEK, (const char* path, off_t off, int whence, struct fuse_file_info* fi),
+                                         (path, off, whence, fi),
+           (path, NULL, off, 0, whence))
+SFS_LOCKED(int, SFS_truncate, STAT_TRUNCATE, (const char* path, off_t size, struct fuse_file_info* fi), (path, size, fi),
+           (path, NULL, 0, size, 0))
+SFS_LOCKED(int, SFS_fallocate, STAT_FALLOCATE, (const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi),
+                                               (path, mode, offset, length, fi),
+           (path, NULL, offset, length, mode))
+SFS_LOCKED(ssize_t, SFS_copy_file_range, STAT_COPY_FILE_RANGE, (const char* path_in, struct fuse_file_info* fi_in, off_t offset_in,
+                                                                const char* path_out, struct fuse_file_info* fi_out, off_t offset_out,
+                                                                size_t size, int flags),
+                                                               (path_in, fi_in, offset_in, path_out, fi_out, offset_out, size, flags),
+           (path_in, path_out, offset_in, size, offset_out))
+SFS_LOCKED(int, SFS_ioctl, STAT_IOCTL, (const char* path, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags, void* data),
+                                       (path, cmd, arg, fi, flags, data),
+           (path, NULL, 0, data != NULL ? *(unsigned int*)data : 0, (unsigned int)cmd))
+SFS_TIMED(int, SFS_fsync, STAT_FSYNC, (const char* path, int datasync, struct fuse_file_info* fi), (path, datasync, fi),
+          (path, NULL, 0, 0, datasync))
+SFS_TIMED(int, SFS_statfs, STAT_STATFS, (const char* path, struct statvfs* st), (path, st),
+          (path, NULL, 0, 0, 0))
+
 static struct fuse_operations SFS_operations = {
-    .init    = SFS_init,    // 初始化文件系统
-    .getattr = SFS_getattr, // 获取文件或目录的属性
-    .readdir = SFS_readdir, // 读取目录
-    .mkdir   = SFS_mkdir,   // 创建目录
-    .rmdir   = SFS_rmdir,   // 删除目录
-    .mknod   = SFS_mknod,   // 创建文件
-    .unlink  = SFS_unlink,  // 删除文件
-    .open    = SFS_open,    // 打开文件
-    .release = SFS_release, // 关闭文件
-    .read    = SFS_read,    // 读文件
-    .write   = SFS_write,   // 写文件
-    .utimens = SFS_utimens, // 修改时间（创建文件要求实现）
+    .init      = SFS_init,             // 初始化文件系统
+    .destroy   = SFS_destroy,          // 卸载文件系统
+    .getattr   = SFS_getattr_locked,   // 获取文件或目录的属性
+    .readdir   = SFS_readdir_locked,   // 读取目录
+    .mkdir     = SFS_mkdir_locked,     // 创建目录
+    .rmdir     = SFS_rmdir_locked,     // 删除目录
+    .mknod     = SFS_mknod_locked,     // 创建文件
+    .unlink    = SFS_unlink_locked,    // 删除文件
+    .open      = SFS_open,             // 打开文件
+    .release   = SFS_release,          // 关闭文件
+    .read      = SFS_read_locked,      // 读文件
+    .write     = SFS_write_locked,     // 写文件
+    .read_buf  = SFS_read_buf_locked,  // 读文件（连续的数据块合并读取）
+    .write_buf = SFS_write_buf_locked, // 写文件（直接写入映像文件，零拷贝）
+    .utimens   = SFS_utimens,          // 修改时间（创建文件要求实现）
+    .flush     = SFS_flush_locked,     // 关闭文件时刷新缓冲区
+    .fsync     = SFS_fsync_timed,      // 同步文件（fsync/fdatasync）
+    .fsyncdir  = SFS_fsyncdir,         // 同步目录
+    .lseek     = SFS_lseek_locked,     // 查找数据和空洞
+    .statfs    = SFS_statfs_timed,     // 文件系统的容量和空闲空间
+    .truncate  = SFS_truncate_locked,  // 修改文件大小
+    .fallocate = SFS_fallocate_locked, // 预分配或释放文件空间
+    .ioctl     = SFS_ioctl_locked,     // 读取或修改inode标志（chattr +c启用压缩）
+    .copy_file_range = SFS_copy_file_range_locked, // 复制文件区间（共享数据块）
 };
 
+/**
+ * 不挂载，在虚拟磁盘上回放记录文件（-o replay=路径），完成后输出各回调的回放次数、
+ * 返回值与记录不同的次数以及运行统计（延迟直方图），用于比较不同实现在同一负载下的表现
+ * 虚拟磁盘应为新格式化的映像（或backend=ram），以便重现记录开始时的状态
+ * @return 成功返回0
+ */
+static int SFS_replay(const char* path, double speed) {
+    struct fuse_config cfg;
+    struct fuse_conn_info conn;
+    memset(&cfg, 0, sizeof(cfg));
+    memset(&conn, 0, sizeof(conn));
+    SFS_operations.init(&conn, &cfg);
+    if (bdev == NULL || sb == NULL || sb->magic != SFS_MAGIC) {
+        return 1;
+    }
+    struct replay_result result;
+    uint64_t start = stats_now();
+    int ret = replay_record(path, &SFS_operations, speed, &result);
+    double elapsed = (stats_now() - start) / 1e9;
+    SFS_operations.destroy(NULL);
+    if (ret != 0) {
+        perror("[SFS_replay] Error: failed to replay the record file");
+        return 1;
+    }
+    long total = 0;
+    printf("%-16s %10s %10s\n", "op", "count", "mismatch");
+    for (int op=0; op<NUM_FUSE_TIMERS; op++) {
+        if (result.count[op] > 0) {
+            printf("%-16s %10ld %10ld\n", stats_timer_names[op], result.count[op], result.mismatch[op]);
+            total += result.count[op];
+        }
+    }
+    printf("replayed %ld operations in %.3f s (%ld block records skipped)\n\n", total, elapsed, result.blocks);
+    size_t len;
+    char* stats = stats_format(&len);
+    fwrite(stats, 1, len, stdout);
+    free(stats);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     // printf("%lu\n", sizeof(struct file));
     // 权限掩码，umask(0)为0取反再创建文件时权限（mode）相与
@@ -517,9 +974,24 @@ int main(int argc, char *argv[]) {
     // 为后面的代码调用函数mkdir给出最大的权限，避免了创建目录或文件的权限不确定性
     umask(0);
     int ret = 0;
-    // fuse库的入口起点，通过SFS_operation包含的回调函数来执行文件系统操作
-    ret = fuse_main(argc, argv, &SFS_operations, NULL);
-    fclose(fs);
+    // 解析内核缓存相关的挂载选项，其余参数交给fuse_main
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &sfs_opts, sfs_opt_specs, NULL) != 0) {
+        return 1;
+    }
+    if (sfs_opts.replay != NULL) {
+        // 回放记录文件，不挂载
+        ret = SFS_replay(sfs_opts.replay, sfs_opts.replay_speed);
+    } else {
+        // fuse库的入口起点，通过SFS_operation包含的回调函数来执行文件系统操作
+        ret = fuse_main(args.argc, args.argv, &SFS_operations, NULL);
+    }
+    fuse_opt_free_args(&args);
+    stop_recorder();
+    if (sfs_opts.trace_file != NULL && trace_dump(sfs_opts.trace_file) != 0) {
+        perror("[main] Error: failed to write the trace file");
+    }
+    close_block_dev(bdev);
     free(sb);
     sb = NULL;
     return ret;
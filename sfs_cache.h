@@ -0,0 +1,203 @@
+/*
+ * SFS文件系统的内核缓存配置与缓存失效通知
+ * 挂载选项控制内核缓存目录项、属性和文件数据的时间，以及是否启用writeback cache；
+ * SFS自身（而不是经由内核的请求）修改文件后，通过fuse_invalidate_path通知内核丢弃相应缓存
+*/
+#ifndef __SFS_CACHE_H__
+#define __SFS_CACHE_H__
+
+#include <fuse3/fuse.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sfs_ds.h"
+#include "sfs_trace.h"
+
+/**
+ * SFS的挂载选项：内核缓存相关（-o entry_timeout=秒,attr_timeout=秒,...）、块设备、跟踪以及记录与回放
+ * SFS是映像文件唯一的修改者，默认让内核保留文件数据缓存，目录项和属性缓存1秒
+ */
+struct sfs_options {
+    double entry_timeout;    // 目录项（文件名到inode）的缓存时间（秒）
+    double attr_timeout;     // 文件属性的缓存时间（秒）
+    double negative_timeout; // 不存在的文件名的缓存时间（秒）
+    int kernel_cache;        // 打开文件时保留内核中的文件数据缓存
+    int auto_cache;          // 打开文件时文件大小或修改时间变化才丢弃数据缓存
+    int writeback_cache;     // 写入先缓存在内核中，由内核合并后再写回SFS
+    char* trace_file;        // 卸载时将跟踪记录转储到该文件（-o trace_file=路径，由sfstrace解析）
+    char* image;             // 映像文件路径（-o image=路径，默认为fs_img）
+    char* backend;           // 块设备后端：file（默认）、mmap或ram（内存虚拟磁盘，卸载后内容丢失）
+    char* ram_size;          // ram后端的虚拟磁盘大小（可带K、M、G后缀，默认为FS_SIZE）
+    char* record;            // 将FUSE回调和块设备操作记录到该文件（-o record=路径）
+    char* replay;            // 不挂载，在虚拟磁盘上回放该记录文件中的FUSE回调（-o replay=路径）
+    double replay_speed;     // 回放的时间缩放：0（默认）为尽快回放，1为按记录的时间间隔，2为两倍速
+};
+
+struct sfs_options sfs_opts = {
+    .entry_timeout = 1.0,
+    .attr_timeout = 1.0,
+    .negative_timeout = 1.0,
+    .kernel_cache = 1,
+    .auto_cache = 0,
+    .writeback_cache = 0,
+    .trace_file = NULL,
+    .image = NULL,
+    .backend = NULL,
+    .ram_size = NULL,
+    .record = NULL,
+    .replay = NULL,
+    .replay_speed = 0,
+};
+
+#define SFS_OPT(templ, field, value) { templ, offsetof(struct sfs_options, field), value }
+
+// 挂载选项表（由fuse_opt_parse解析，其余选项交给libfuse）
+const struct fuse_opt sfs_opt_specs[] = {
+    SFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+    SFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+    SFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+    SFS_OPT("kernel_cache", kernel_cache, 1),
+    SFS_OPT("no_kernel_cache", kernel_cache, 0),
+    SFS_OPT("auto_cache", auto_cache, 1),
+    SFS_OPT("writeback_cache", writeback_cache, 1),
+    SFS_OPT("no_writeback_cache", writeback_cache, 0),
+    SFS_OPT("trace_file=%s", trace_file, 0),
+    SFS_OPT("image=%s", image, 0),
+    SFS_OPT("backend=%s", backend, 0),
+    SFS_OPT("ram_size=%s", ram_size, 0),
+    SFS_OPT("record=%s", record, 0),
+    SFS_OPT("replay=%s", replay, 0),
+    SFS_OPT("replay_speed=%lf", replay_speed, 0),
+    FUSE_OPT_END
+};
+
+/**
+ * 按挂载选项配置内核缓存（SFS_init调用）
+ * auto_cache优先于kernel_cache；writeback cache需要内核支持
+ */
+void apply_cache_options(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+    cfg->entry_timeout = sfs_opts.entry_timeout;
+    cfg->attr_timeout = sfs_opts.attr_timeout;
+    cfg->negative_timeout = sfs_opts.negative_timeout;
+    cfg->auto_cache = sfs_opts.auto_cache;
+    cfg->kernel_cache = sfs_opts.kernel_cache && !sfs_opts.auto_cache;
+    if (sfs_opts.writeback_cache) {
+        if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+            conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        } else {
+            TRACE(INFO, "writeback cache is not supported by the kernel");
+        }
+    }
+    TRACE(INFO, "entry_timeout=%ldms attr_timeout=%ldms negative_timeout=%ldms",
+          (long)(cfg->entry_timeout * 1000), (long)(cfg->attr_timeout * 1000), (long)(cfg->negative_timeout * 1000));
+    TRACE(INFO, "kernel_cache=%ld auto_cache=%ld writeback_cache=%ld",
+          cfg->kernel_cache, cfg->auto_cache, (conn->want & FUSE_CAP_WRITEBACK_CACHE) != 0);
+}
+
+/************************/
+/* 缓存失效通知相关函数 */
+
+/**
+ * 待通知内核失效的路径队列
+ * 通知不能在相关请求的处理过程中发出（内核可能正持有该请求所需的锁），
+ * 因此请求处理中只记录路径，由通知线程在不持有fs_lock时逐个发出
+ */
+struct fuse* inval_fuse = NULL;  // 挂载时记录的fuse实例，通知时使用
+char** inval_paths = NULL;       // 待通知的路径
+int inval_count = 0, inval_cap = 0;
+pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+pthread_t inval_thread;           // 通知线程
+int inval_thread_running = 0;     // 通知线程是否已启动
+int inval_stop = 0;               // 通知线程退出标志
+
+/**
+ * 请求内核丢弃path的属性和数据缓存（SFS自身修改了文件时调用，异步通知）
+ * 同一路径已在队列中时不重复加入
+ */
+void invalidate_path(const char* path) {
+    pthread_mutex_lock(&inval_lock);
+    if (inval_thread_running) {
+        int queued = 0;
+        for (int i=0; i<inval_count && !queued; i++) {
+            queued = strcmp(inval_paths[i], path) == 0;
+        }
+        if (!queued) {
+            if (inval_count == inval_cap) {
+                inval_cap = inval_cap == 0 ? 16 : inval_cap * 2;
+                inval_paths = (char**)realloc(inval_paths, inval_cap * sizeof(char*));
+            }
+            inval_paths[inval_count++] = strdup(path);
+            pthread_cond_signal(&inval_cond);
+        }
+    }
+    pthread_mutex_unlock(&inval_lock);
+}
+
+/**
+ * 通知线程：取出队列中的路径，通知内核丢弃其缓存（不持有inval_lock和fs_lock）
+ * 路径已不存在或内核中没有缓存时fuse_invalidate_path返回错误，忽略即可
+ */
+void* invalidate_worker(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&inval_lock);
+    while (!inval_stop) {
+        if (inval_count == 0) {
+            pthread_cond_wait(&inval_cond, &inval_lock);
+            continue;
+        }
+        char* path = inval_paths[--inval_count];
+        pthread_mutex_unlock(&inval_lock);
+        int ret = fuse_invalidate_path(inval_fuse, path);
+        TRACE_STR(DEBUG, path, "path=%s ret=%ld", ret);
+        free(path);
+        pthread_mutex_lock(&inval_lock);
+    }
+    pthread_mutex_unlock(&inval_lock);
+    return NULL;
+}
+
+/**
+ * 启动通知线程（SFS_init调用，此时可以通过fuse_get_context取得fuse实例）
+ */
+int start_invalidate_worker() {
+    if (inval_thread_running) {
+        return 0;
+    }
+    inval_fuse = fuse_get_context()->fuse;
+    inval_stop = 0;
+    if (pthread_create(&inval_thread, NULL, invalidate_worker, NULL) != 0) {
+        return -1;
+    }
+    inval_thread_running = 1;
+    return 0;
+}
+
+/**
+ * 停止通知线程（卸载时调用），未发出的通知直接丢弃（内核缓存随卸载一并失效）
+ */
+void stop_invalidate_worker() {
+    pthread_mutex_lock(&inval_lock);
+    if (!inval_thread_running) {
+        pthread_mutex_unlock(&inval_lock);
+        return;
+    }
+    inval_stop = 1;
+    pthread_cond_broadcast(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+    pthread_join(inval_thread, NULL);
+    pthread_mutex_lock(&inval_lock);
+    inval_thread_running = 0;
+    for (int i=0; i<inval_count; i++) {
+        free(inval_paths[i]);
+    }
+    inval_count = 0;
+    pthread_mutex_unlock(&inval_lock);
+}
+
+/* 以上是缓存失效通知相关函数 */
+
+#endif
@@ -0,0 +1,443 @@
+/*
+ * SFS文件系统的碎片分析与在线碎片整理
+ * 文件的碎片数为其数据块按逻辑顺序排列时物理上不连续的段数（连续存放的文件为1）；
+ * 空闲空间的碎片由空闲空间索引（sfs_space.h）中连续空闲段的数目和长度分布描述
+ * 碎片整理将文件的数据块复制到尽量少的连续空闲段中，在新的块映射（间接索引树或extent树）建好并落盘后，
+ * 一次写回inode切换到新的映射，再释放原来的数据块和索引块，整理期间文件系统保持挂载
+*/
+#ifndef __SFS_DEFRAG_H__
+#define __SFS_DEFRAG_H__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "sfs_ds.h"
+#include "sfs_dev.h"
+#include "sfs_rw.h"
+#include "sfs_sync.h"
+
+// 一个文件的碎片信息（SFS_IOC_FRAGINFO、SFS_IOC_DEFRAG的结果）
+struct frag_info {
+    long data_blocks; // 数据块数
+    long meta_blocks; // 间接索引块或extent树节点块数
+    long fragments;   // 碎片数（整理前）
+    long defragged;   // 碎片数（整理后，SFS_IOC_FRAGINFO时同fragments）
+};
+
+// 读取文件的碎片信息
+#define SFS_IOC_FRAGINFO _IOR('S', 1, struct frag_info)
+// 整理文件的碎片
+#define SFS_IOC_DEFRAG   _IOR('S', 2, struct frag_info)
+
+#define FREE_HIST_SIZE 32 // 空闲段长度直方图的桶数（按2的幂）
+
+// 空闲空间的碎片信息
+struct free_space_info {
+    long free_blocks;             // 空闲数据块数
+    long free_runs;               // 连续空闲段数
+    long largest_run;             // 最长的连续空闲段
+    long hist[FREE_HIST_SIZE];    // 长度在[2^i, 2^(i+1))之间的空闲段数
+};
+
+#define DEFRAG_COPY_BLOCKS 256 // 整理时每次复制的块数
+
+/************************/
+/* 碎片分析相关函数 */
+
+// walk_inode_blocks的回调：统计数据块、索引块和物理上不连续的段数
+void frag_visitor(int datablock_no, int level, void* arg) {
+    struct frag_info* info = (struct frag_info*)arg;
+    if (level > 0) {
+        info->meta_blocks++;
+        return;
+    }
+    // defragged暂存上一个数据块号
+    if (info->data_blocks == 0 || datablock_no != info->defragged + 1) {
+        info->fragments++;
+    }
+    info->defragged = datablock_no;
+    info->data_blocks++;
+}
+
+/**
+ * 统计文件的碎片信息（不修改文件）
+ * 数据块按逻辑顺序遍历，压缩簇按其占用的数据块计算
+ */
+void inode_frag_info(struct inode* inode, struct frag_info* info) {
+    memset(info, 0, sizeof(struct frag_info));
+    walk_inode_blocks(inode, frag_visitor, info);
+    info->defragged = info->fragments;
+}
+
+// walk_free_extents的回调：按长度统计空闲段
+void free_space_visitor(int start, int len, void* arg) {
+    struct free_space_info* info = (struct free_space_info*)arg;
+    (void) start;
+    int bucket = 0;
+    while (bucket + 1 < FREE_HIST_SIZE && (len >> (bucket + 1)) > 0) {
+        bucket++;
+    }
+    info->hist[bucket]++;
+    info->free_runs++;
+    info->free_blocks += len;
+    info->largest_run = MAX(info->largest_run, len);
+}
+
+/**
+ * 遍历空闲空间索引，统计空闲空间的碎片信息
+ */
+void free_space_info(struct free_space_info* info) {
+    memset(info, 0, sizeof(struct free_space_info));
+    walk_free_extents(free_space_visitor, info);
+}
+
+/* 以上是碎片分析相关函数 */
+
+/************************/
+/* 碎片整理相关函数 */
+
+// 一段逻辑和物理上都连续的块
+struct block_run {
+    long lblk;
+    int pblk;
+    long len;
+};
+
+struct run_list {
+    struct block_run* runs;
+    long n, cap;
+    long blocks; // 全部段的块数
+};
+
+// 追加一段，与上一段在逻辑和物理上都相接时合并
+void run_list_add(struct run_list* list, long lblk, int pblk, long len) {
+    struct block_run* last = list->n > 0 ? &list->runs[list->n - 1] : NULL;
+    list->blocks += len;
+    if (last != NULL && last->lblk + last->len == lblk && last->pblk + last->len == pblk) {
+        last->len += len;
+        return;
+    }
+    if (list->n == list->cap) {
+        list->cap = list->cap == 0 ? 16 : list->cap * 2;
+        list->runs = (struct block_run*)realloc(list->runs, list->cap * sizeof(struct block_run));
+    }
+    list->runs[list->n++] = (struct block_run){ lblk, pblk, len };
+}
+
+/**
+ * 收集（level级）间接索引块下的数据块
+ * @param base 该块覆盖的第一个逻辑块号
+ * @param span 块内每个块号覆盖的逻辑块数
+ */
+void collect_index_runs(int datablock_no, int level, long base, long span, struct run_list* list) {
+    struct data_block* db = new_data_block();
+    read_data_block(datablock_no, db);
+    int* nos = (int*)db->data;
+    for (int k=0; k<NUM_PER_INDEX_BLOCK; k++) {
+        if (nos[k] < 0 || nos[k] >= sb->datasize) {
+            continue;
+        }
+        if (level == 1) {
+            run_list_add(list, base + k, nos[k], 1);
+        } else {
+            collect_index_runs(nos[k], level - 1, base + k * span, span / NUM_PER_INDEX_BLOCK, list);
+        }
+    }
+    free_data_block(db);
+}
+
+/**
+ * 收集extent树节点下的全部extent
+ * @return 遇到压缩簇返回-1（压缩簇整簇存放，不整理）
+ */
+int collect_extent_runs(struct extent_header* header, struct extent* extents, struct run_list* list) {
+    int ret = 0;
+    for (int i=0; i<header->entries && ret==0; i++) {
+        if (header->depth == 0) {
+            if (extents[i].len & EXTENT_COMPRESSED) {
+                return -1;
+            }
+            run_list_add(list, extents[i].lblk, extents[i].pblk, extent_plen(&extents[i]));
+            continue;
+        }
+        struct data_block* db = new_data_block();
+        read_data_block(extents[i].pblk, db);
+        if (((struct extent_header*)db->data)->magic == EXTENT_MAGIC) {
+            ret = collect_extent_runs((struct extent_header*)db->data, BLOCK_EXTENTS(db), list);
+        }
+        free_data_block(db);
+    }
+    return ret;
+}
+
+/**
+ * 按逻辑顺序收集文件的全部数据块
+ * @return 成功返回0，文件含压缩簇时返回-1
+ */
+int collect_inode_runs(struct inode* inode, struct run_list* list) {
+    memset(list, 0, sizeof(struct run_list));
+    if (inode->flags & INODE_INLINE) {
+        return 0;
+    }
+    if (inode->flags & INODE_EXTENTS) {
+        return collect_extent_runs(&inode->ext_root.header, inode->ext_root.extents, list);
+    }
+    for (int i=0; i<=3; i++) {
+        if (inode->addr[i] >= 0) {
+            run_list_add(list, i, inode->addr[i], 1);
+        }
+    }
+    long base = 4, span = 1;
+    for (int level=1; level<=3; level++) {
+        if (inode->addr[3 + level] >= 0) {
+            collect_index_runs(inode->addr[3 + level], level, base, span, list);
+        }
+        base += span * NUM_PER_INDEX_BLOCK;
+        span *= NUM_PER_INDEX_BLOCK;
+    }
+    return 0;
+}
+
+// 按长度从大到小排列空闲段
+int cmp_run_len_desc(const void* a, const void* b) {
+    long la = ((const struct block_run*)a)->len, lb = ((const struct block_run*)b)->len;
+    return la < lb ? 1 : la > lb ? -1 : 0;
+}
+
+// 按起始块号从小到大排列空闲段
+int cmp_run_pblk(const void* a, const void* b) {
+    return ((const struct block_run*)a)->pblk - ((const struct block_run*)b)->pblk;
+}
+
+// walk_free_extents的回调：收集空闲段（空闲段之间隔着已使用的块，不会合并）
+void free_run_visitor(int start, int len, void* arg) {
+    run_list_add((struct run_list*)arg, 0, start, len);
+}
+
+/**
+ * 选出容纳want个块所需的最少的连续空闲段（最长的段优先），结果按物理位置排列
+ * @param target 返回选出的空闲段（lblk不使用）
+ * @return 选出的段数，空闲块不足时返回-1
+ */
+long pick_free_runs(long want, struct run_list* target) {
+    struct run_list free_runs = {0};
+    walk_free_extents(free_run_visitor, &free_runs);
+    if (free_runs.blocks < want) {
+        free(free_runs.runs);
+        return -1;
+    }
+    qsort(free_runs.runs, free_runs.n, sizeof(struct block_run), cmp_run_len_desc);
+    memset(target, 0, sizeof(struct run_list));
+    for (long i=0; i<free_runs.n && target->blocks<want; i++) {
+        long len = MIN(free_runs.runs[i].len, want - target->blocks);
+        run_list_add(target, target->n, free_runs.runs[i].pblk, len);
+    }
+    free(free_runs.runs);
+    qsort(target->runs, target->n, sizeof(struct block_run), cmp_run_pblk);
+    return target->n;
+}
+
+/**
+ * 将源段中的块依次复制到目标段中
+ * @return 成功返回0，读写失败返回-1
+ */
+int copy_runs(struct run_list* src, struct run_list* dst) {
+    char* buf = (char*)malloc(DEFRAG_COPY_BLOCKS * sb->block_size);
+    long si = 0, soff = 0, di = 0, doff = 0; // 当前源段、目标段及段内偏移
+    int ret = 0;
+    while (si < src->n) {
+        long n = MIN(MIN(src->runs[si].len - soff, dst->runs[di].len - doff), DEFRAG_COPY_BLOCKS);
+        int from = src->runs[si].pblk + soff, to = dst->runs[di].pblk + doff;
+        if (bdev_read_blocks(sb->first_blk + from, n, buf) != 0 || bdev_write_blocks(sb->first_blk + to, n, buf) != 0) {
+            ret = -1;
+            break;
+        }
+        for (long i=0; i<n; i++) {
+            mark_block_dirty(sb->first_blk + to + i);
+            if (reftable != NULL && reftable[from + i].fingerprint != 0) {
+                set_fingerprint(to + i, reftable[from + i].fingerprint); // 指纹随数据移动
+                forget_fingerprint(from + i);
+            }
+        }
+        if ((soff += n) == src->runs[si].len) {
+            si++;
+            soff = 0;
+        }
+        if ((doff += n) == dst->runs[di].len) {
+            di++;
+            doff = 0;
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * 按src中的逻辑顺序将文件的块映射到dst中的目标段，在tmp中建立新的块映射（只修改tmp）
+ * @return 成功返回0，没有空闲块存放索引块或extent节点时返回-1
+ */
+int build_block_map(struct inode* tmp, struct run_list* src, struct run_list* dst) {
+    memset(tmp->block_map, 0, sizeof(tmp->block_map));
+    if (tmp->flags & INODE_EXTENTS) {
+        tmp->ext_root.header.magic = EXTENT_MAGIC;
+        tmp->ext_root.header.max = INLINE_EXTENTS;
+    } else {
+        for (int i=0; i<=6; i++) {
+            tmp->addr[i] = -1;
+        }
+    }
+    long di = 0, doff = 0;
+    for (long si=0; si<src->n; si++) {
+        long soff = 0;
+        while (soff < src->runs[si].len) {
+            long n = MIN(src->runs[si].len - soff, dst->runs[di].len - doff);
+            long lblk = src->runs[si].lblk + soff;
+            int pblk = dst->runs[di].pblk + doff;
+            if (tmp->flags & INODE_EXTENTS) {
+                if (extent_insert(tmp, lblk, pblk, n) != 0) {
+                    return -1;
+                }
+            } else {
+                for (long i=0; i<n; i++) {
+                    int no;
+                    if (map_block(tmp, lblk + i, 1, pblk + i, &no) != 0) {
+                        return -1;
+                    }
+                }
+            }
+            soff += n;
+            if ((doff += n) == dst->runs[di].len) {
+                di++;
+                doff = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+// walk_inode_blocks的回调：只释放索引块和extent节点块（数据块另行处理）
+void free_meta_visitor(int datablock_no, int level, void* arg) {
+    if (level > 0) {
+        batch_set_datablocks((struct bitmap_batch*)arg, datablock_no, 1, 0);
+    }
+}
+
+/**
+ * 写回目标段中的数据块、新映射的索引块（或extent节点块）以及位图，等待完成并刷新设备
+ * 保证切换到新映射的inode落盘之前，新映射指向的块都已落盘
+ */
+int defrag_sync_new_map(struct inode* tmp, struct run_list* dst) {
+    struct sync_range range = {0};
+    for (long i=0; i<dst->n; i++) {
+        for (long k=0; k<dst->runs[i].len; k++) {
+            sync_block(&range, sb->first_blk + dst->runs[i].pblk + k);
+        }
+    }
+    walk_inode_blocks(tmp, sync_index_visitor, &range);
+    for (long i=0; i<sb->databitmap_size; i++) {
+        sync_block(&range, sb->first_blk_of_databitmap + i);
+    }
+    int ret = wait_sync_ranges(&range);
+    return finish_sync_ranges(&range, ret != 0 ? ret : flush_device());
+}
+
+/**
+ * 整理文件的碎片：将数据块复制到尽量少的连续空闲段，重建块映射后一次写回inode切换到新映射
+ * 顺序：复制数据并建立新映射 -> 新数据块和新索引块落盘 -> 写回inode并落盘 -> 释放原数据块和索引块，
+ * 任何时刻崩溃，inode指向的都是完整的旧映射或新映射（崩溃时可能泄漏尚未释放的块）
+ * 内联文件、压缩文件、孤儿和含共享数据块（去重、reflink）的文件不整理；
+ * 所需的连续段不少于现有碎片数时不移动任何块
+ * 调用者持有fs_lock；inode被修改并已写回
+ * @param info 返回整理前后的碎片信息
+ * @return 成功（包括无需整理）返回0，含共享数据块返回-EBUSY，压缩文件返回-EOPNOTSUPP，空闲块不足返回-ENOSPC，
+ *         写回失败返回负的错误码（切换映射后写回inode失败时原来的块不释放）
+ */
+int defrag_inode(struct inode* inode, struct frag_info* info) {
+    inode_frag_info(inode, info);
+    if ((inode->flags & (INODE_INLINE | INODE_ORPHAN)) || info->fragments <= 1) {
+        return 0;
+    }
+    if (inode_compressed(inode)) {
+        return -EOPNOTSUPP;
+    }
+    struct run_list src, dst;
+    if (collect_inode_runs(inode, &src) != 0) {
+        free(src.runs);
+        return -EOPNOTSUPP;
+    }
+    for (long i=0; i<src.n; i++) {
+        for (long k=0; k<src.runs[i].len; k++) {
+            if (block_is_shared(src.runs[i].pblk + k)) {
+                free(src.runs);
+                return -EBUSY; // 移动共享的块会使共享它的其它文件各自持有一份
+            }
+        }
+    }
+    long pieces = pick_free_runs(src.blocks, &dst);
+    if (pieces < 0 || pieces >= info->fragments) {
+        TRACE(DEBUG, "ino=%d fragments=%ld free pieces=%ld", inode->st_ino, info->fragments, pieces);
+        free(src.runs);
+        free(dst.runs);
+        return pieces < 0 ? -ENOSPC : 0;
+    }
+    TRACE(INFO, "ino=%d blocks=%ld fragments=%ld -> %ld", inode->st_ino, src.blocks, info->fragments, pieces);
+
+    // 1. 占用目标段，复制数据，在tmp中建立新映射
+    struct bitmap_batch batch;
+    init_bitmap_batch(&batch);
+    for (long i=0; i<dst.n; i++) {
+        batch_set_datablocks(&batch, dst.runs[i].pblk, dst.runs[i].len, 1);
+    }
+    commit_bitmap_batch(&batch);
+    struct inode tmp = *inode;
+    int ret = copy_runs(&src, &dst) != 0 ? -EIO : build_block_map(&tmp, &src, &dst) != 0 ? -ENOSPC : 0;
+
+    // 2. 新数据块、新索引块和位图落盘
+    if (ret == 0) {
+        ret = defrag_sync_new_map(&tmp, &dst);
+    }
+    init_bitmap_batch(&batch);
+    if (ret != 0) {
+        // 放弃新映射：释放新建的索引块和全部目标段，inode仍指向原来的块
+        walk_inode_blocks(&tmp, free_meta_visitor, &batch);
+        for (long i=0; i<dst.n; i++) {
+            batch_set_datablocks(&batch, dst.runs[i].pblk, dst.runs[i].len, 0);
+        }
+        commit_bitmap_batch(&batch);
+        free(src.runs);
+        free(dst.runs);
+        return ret;
+    }
+
+    // 3. 写回inode切换到新映射，落盘后才能释放原来的块
+    struct inode old = *inode;
+    memcpy(inode->block_map, tmp.block_map, sizeof(inode->block_map));
+    struct frag_info after;
+    inode_frag_info(inode, &after);
+    inode->st_blocks = after.data_blocks + after.meta_blocks;
+    write_inode(inode->st_ino, inode);
+    struct sync_range range = {0};
+    sync_block(&range, inode_block_no(inode->st_ino));
+    ret = wait_sync_ranges(&range);
+    ret = finish_sync_ranges(&range, ret != 0 ? ret : flush_device());
+    free(src.runs);
+    free(dst.runs);
+    if (ret != 0) {
+        // 不确定盘上的inode指向新映射还是原映射，原来的块不能释放（泄漏，由sfsck回收）
+        return ret;
+    }
+
+    // 4. 释放原来的数据块和索引块
+    walk_inode_blocks(&old, free_block_visitor, &batch);
+    commit_bitmap_batch(&batch);
+    info->defragged = after.fragments;
+    return 0;
+}
+
+/* 以上是碎片整理相关函数 */
+
+#endif
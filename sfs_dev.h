@@ -0,0 +1,333 @@
+/*
+ * SFS文件系统的块设备抽象
+ * 引擎通过bdev读写虚拟磁盘，不直接依赖载体文件；块设备有三种实现：
+ *   file：宿主机上的映像文件（pread/pwrite）
+ *   mmap：将映像文件映射到内存（memcpy读写，与file共享宿主机的页缓存）
+ *   ram： 纯内存的虚拟磁盘（卸载后内容丢失，用于临时数据、基准测试和测试）
+ * 读写以字节为单位（inode和超级块小于一个块），bdev_read_blocks等按块号访问
+*/
+#ifndef __SFS_DEV_H__
+#define __SFS_DEV_H__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sfs_ds.h"
+#include "sfs_utils.h"
+
+struct block_dev;
+
+// 块设备的操作，失败时返回负的错误码
+struct block_dev_ops {
+    const char* name;
+    // 从offset处读取size字节，返回读取的字节数（超出设备末尾的部分不读取）
+    long (*read)(struct block_dev* dev, void* buf, size_t size, off_t offset);
+    // 向offset处写入size字节，返回写入的字节数
+    long (*write)(struct block_dev* dev, const void* buf, size_t size, off_t offset);
+    // 开始写回区间内已写入的数据（wait非0时等待之前开始的写回完成），不刷新设备缓存
+    int (*writeback)(struct block_dev* dev, off_t offset, off_t len, int wait);
+    // 保证之前写回的数据落盘（刷新设备缓存）
+    int (*flush)(struct block_dev* dev);
+    // 丢弃区间内的数据（之后读出全0），释放其占用的空间
+    int (*discard)(struct block_dev* dev, off_t offset, off_t len);
+    void (*close)(struct block_dev* dev);
+};
+
+struct block_dev {
+    const struct block_dev_ops* ops;
+    off_t size; // 设备大小（字节）
+    int fd;     // 载体文件的描述符，没有载体文件（ram）时为-1；write_buf据此将FUSE设备的数据直接写入载体文件
+    char* map;  // mmap和ram的内存区域，file为NULL
+};
+
+struct block_dev* bdev = NULL; // 虚拟磁盘所在的块设备
+
+/************************/
+/* file块设备相关函数 */
+
+long file_dev_read(struct block_dev* dev, void* buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(dev->fd, (char*)buf + done, size - done, offset + done);
+        if (n < 0 && errno != EINTR) {
+            return -errno;
+        }
+        if (n == 0) {
+            break; // 文件末尾
+        }
+        done += n > 0 ? n : 0;
+    }
+    return done;
+}
+
+long file_dev_write(struct block_dev* dev, const void* buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(dev->fd, (const char*)buf + done, size - done, offset + done);
+        if (n < 0 && errno != EINTR) {
+            return -errno;
+        }
+        done += n > 0 ? n : 0;
+    }
+    return done;
+}
+
+int file_dev_writeback(struct block_dev* dev, off_t offset, off_t len, int wait) {
+    unsigned int flags = wait ? SYNC_FILE_RANGE_WAIT_BEFORE : SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE;
+    return sync_file_range(dev->fd, offset, len, flags) == 0 ? 0 : -errno;
+}
+
+int file_dev_flush(struct block_dev* dev) {
+    return fdatasync(dev->fd) == 0 ? 0 : -errno;
+}
+
+// 在载体文件中打洞，稀疏的映像文件随之缩小
+int file_dev_discard(struct block_dev* dev, off_t offset, off_t len) {
+    return fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0 ? 0 : -errno;
+}
+
+void file_dev_close(struct block_dev* dev) {
+    if (dev->map != NULL) {
+        munmap(dev->map, dev->size);
+    }
+    close(dev->fd);
+    free(dev);
+}
+
+const struct block_dev_ops file_dev_ops = {
+    .name = "file",
+    .read = file_dev_read,
+    .write = file_dev_write,
+    .writeback = file_dev_writeback,
+    .flush = file_dev_flush,
+    .discard = file_dev_discard,
+    .close = file_dev_close,
+};
+
+/**
+ * 打开映像文件作为块设备
+ * @return 块设备，失败返回NULL（errno为错误原因）
+ */
+struct block_dev* open_file_dev(const char* path) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    struct block_dev* dev = (struct block_dev*)calloc(1, sizeof(struct block_dev));
+    dev->ops = &file_dev_ops;
+    dev->size = st.st_size;
+    dev->fd = fd;
+    return dev;
+}
+
+/* 以上是file块设备相关函数 */
+
+/************************/
+/* mmap和ram块设备相关函数 */
+
+// 内存区域的读写：超出设备末尾的部分不读写
+long mem_dev_read(struct block_dev* dev, void* buf, size_t size, off_t offset) {
+    if (offset >= dev->size) {
+        return 0;
+    }
+    size = MIN((off_t)size, dev->size - offset);
+    memcpy(buf, dev->map + offset, size);
+    return size;
+}
+
+long mem_dev_write(struct block_dev* dev, const void* buf, size_t size, off_t offset) {
+    if (offset >= dev->size) {
+        return -ENOSPC;
+    }
+    size = MIN((off_t)size, dev->size - offset);
+    memcpy(dev->map + offset, buf, size);
+    return size;
+}
+
+// mmap写入的是载体文件的页缓存，写回和刷新与file相同；丢弃时打洞后映射中读出全0
+int mmap_dev_discard(struct block_dev* dev, off_t offset, off_t len) {
+    return file_dev_discard(dev, offset, len);
+}
+
+const struct block_dev_ops mmap_dev_ops = {
+    .name = "mmap",
+    .read = mem_dev_read,
+    .write = mem_dev_write,
+    .writeback = file_dev_writeback,
+    .flush = file_dev_flush,
+    .discard = mmap_dev_discard,
+    .close = file_dev_close,
+};
+
+/**
+ * 将映像文件映射到内存作为块设备（映像大小在映射后不能改变）
+ * @return 块设备，失败返回NULL（errno为错误原因）
+ */
+struct block_dev* open_mmap_dev(const char* path) {
+    struct block_dev* dev = open_file_dev(path);
+    if (dev == NULL) {
+        return NULL;
+    }
+    if (dev->size == 0) {
+        file_dev_close(dev);
+        errno = EINVAL;
+        return NULL;
+    }
+    dev->map = (char*)mmap(NULL, dev->size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (dev->map == MAP_FAILED) {
+        int err = errno;
+        dev->map = NULL;
+        file_dev_close(dev);
+        errno = err;
+        return NULL;
+    }
+    dev->ops = &mmap_dev_ops;
+    return dev;
+}
+
+// 内存中的虚拟磁盘只在进程中存在，写回和刷新都不需要做什么
+int ram_dev_writeback(struct block_dev* dev, off_t offset, off_t len, int wait) {
+    (void) dev;
+    (void) offset;
+    (void) len;
+    (void) wait;
+    return 0;
+}
+
+int ram_dev_flush(struct block_dev* dev) {
+    (void) dev;
+    return 0;
+}
+
+// 整页归还给系统（之后读出全0），首尾不足一页的部分清0
+int ram_dev_discard(struct block_dev* dev, off_t offset, off_t len) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t end = MIN(offset + len, dev->size);
+    off_t first = (offset + page - 1) / page * page, last = end / page * page;
+    if (first >= last) {
+        memset(dev->map + offset, 0, end - offset);
+        return 0;
+    }
+    memset(dev->map + offset, 0, first - offset);
+    memset(dev->map + last, 0, end - last);
+    return madvise(dev->map + first, last - first, MADV_DONTNEED) == 0 ? 0 : -errno;
+}
+
+void ram_dev_close(struct block_dev* dev) {
+    munmap(dev->map, dev->size);
+    free(dev);
+}
+
+const struct block_dev_ops ram_dev_ops = {
+    .name = "ram",
+    .read = mem_dev_read,
+    .write = mem_dev_write,
+    .writeback = ram_dev_writeback,
+    .flush = ram_dev_flush,
+    .discard = ram_dev_discard,
+    .close = ram_dev_close,
+};
+
+/**
+ * 创建size字节的内存虚拟磁盘（初始全0，按需分配物理内存）
+ * @return 块设备，失败返回NULL（errno为错误原因）
+ */
+struct block_dev* open_ram_dev(off_t size) {
+    if (size <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    char* map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    struct block_dev* dev = (struct block_dev*)calloc(1, sizeof(struct block_dev));
+    dev->ops = &ram_dev_ops;
+    dev->size = size;
+    dev->fd = -1;
+    dev->map = map;
+    return dev;
+}
+
+/* 以上是mmap和ram块设备相关函数 */
+
+/************************/
+/* 块设备访问相关函数 */
+
+/**
+ * 按名称打开块设备
+ * @param backend  file、mmap或ram
+ * @param path     映像文件路径（file、mmap）
+ * @param ram_size 内存虚拟磁盘的大小（ram）
+ * @return 块设备，失败返回NULL（errno为错误原因）
+ */
+struct block_dev* open_block_dev(const char* backend, const char* path, off_t ram_size) {
+    if (backend == NULL || strcmp(backend, "file") == 0) {
+        return open_file_dev(path);
+    }
+    if (strcmp(backend, "mmap") == 0) {
+        return open_mmap_dev(path);
+    }
+    if (strcmp(backend, "ram") == 0) {
+        return open_ram_dev(ram_size);
+    }
+    errno = EINVAL;
+    return NULL;
+}
+
+void close_block_dev(struct block_dev* dev) {
+    if (dev != NULL) {
+        dev->ops->close(dev);
+    }
+}
+
+// 读写虚拟磁盘中offset处的size字节，返回读写的字节数或负的错误码
+long bdev_read(void* buf, size_t size, off_t offset) {
+    return bdev->ops->read(bdev, buf, size, offset);
+}
+
+long bdev_write(const void* buf, size_t size, off_t offset) {
+    return bdev->ops->write(bdev, buf, size, offset);
+}
+
+// 读写从第blk块开始的n个块（绝对块号），成功返回0，失败返回-1
+int bdev_read_blocks(long blk, long n, void* buf) {
+    long size = n * sb->block_size;
+    return bdev_read(buf, size, blk * sb->block_size) == size ? 0 : -1;
+}
+
+int bdev_write_blocks(long blk, long n, const void* buf) {
+    long size = n * sb->block_size;
+    return bdev_write(buf, size, blk * sb->block_size) == size ? 0 : -1;
+}
+
+// 开始写回（或等待写回完成）从第blk块开始的n个块
+int bdev_writeback_blocks(long blk, long n, int wait) {
+    return bdev->ops->writeback(bdev, blk * sb->block_size, n * sb->block_size, wait);
+}
+
+int bdev_flush() {
+    return bdev->ops->flush(bdev);
+}
+
+int bdev_discard_blocks(long blk, long n) {
+    return bdev->ops->discard(bdev, blk * sb->block_size, n * sb->block_size);
+}
+
+/* 以上是块设备访问相关函数 */
+
+#endif
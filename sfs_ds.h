@@ -4,72 +4,219 @@
 #ifndef __SFS_DS_H__
 #define __SFS_DS_H__
 
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
-#define FS_SIZE 8*1024*1024  // 文件系统载体文件大小为8MB
-#define BLOCK_SIZE 512       // 文件系统使用的块的大小为512字节
+#define FS_SIZE 8*1024*1024  // mkfs未指定大小时，文件系统载体文件默认大小为8MB
+#define BLOCK_SIZE 4096      // mkfs未指定块大小时，文件系统使用的块大小为4096字节（实际块大小记录在超级块中）
+#define MIN_BLOCK_SIZE 512   // 支持的最小块大小
+#define MAX_BLOCK_SIZE 65536 // 支持的最大块大小
+#define IO_ALIGN 4096        // 块缓冲区按页对齐，便于I/O路径使用O_DIRECT和splice
 #define MAX_PATH_LEN 256     // 路径最大字节长度为256字节
 #define MAX_FILE_NAME 8      // 文件名为8个字节
 #define MAX_FILE_EXTENSION 3 // 文件扩展名为3个字节
-#define MAX_NUM_ENTRIES 100  // 目录下存放的最大目录项数量
+#define INODE_RATIO 4096     // mkfs未指定inode数目时，默认每4KB空间分配一个inode
+#define INODE_SIZE 128       // inode表中每个inode槽的大小（2个cache line），一个4KB块存放32个inode
 
-#define NUM_INODE_BITMAP_BLOCK 1 // inode位图大小为1块（512B）
-#define NUM_DATA_BITMAP_BLOCK 4  // 数据块位图大小为4块（4 * 512 = 2048 Byte）
+#define SFS_MAGIC 0x53465331 // 超级块魔数（"SFS1"），用于识别已格式化的虚拟磁盘
+
+// 文件系统特性（超级块features字段，由mkfs指定）
+#define FEATURE_EXTENTS 0x1  // 新建的文件和目录使用extent映射数据块
+#define FEATURE_COMPRESS 0x2 // 新建的文件默认启用透明压缩（INODE_COMPRESS）
+#define FEATURE_DEDUP    0x4 // 写入文件时内容相同的数据块共享同一个物理块（需要数据块引用计数表）
+#define FEATURE_REFLINK  0x8 // 只建立数据块引用计数表，copy_file_range可共享数据块，写入时不去重
+
+// inode标志位（inode的flags字段）
+#define INODE_EXTENTS 0x1    // 该inode使用extent树映射数据块，而不是addr[7]
+#define INODE_INLINE  0x2    // 文件数据直接存放在inode中（块映射区和inline_tail），不占用数据块
+#define INODE_ORPHAN  0x4    // inode已从目录中删除，位于孤儿链表中等待后台回收
+#define INODE_COMPRESS 0x8   // 文件数据按簇LZ4压缩存放（使用extent映射）；目录带此标志时其下新建的文件和目录继承
+
+#define INLINE_DATA_SIZE 80  // inode中最多可内联存放的数据字节数
 
 // SFS全局变量
 // 文件系统载体文件路径，作为该文件系统的根目录
 // 虚拟磁盘一行16byte，一个数据块有32行
 char* fs_img = "/home/ubuntu/code/SFS/sfs.img";
-FILE* fs;              // 文件系统载体文件
 struct sb* sb;         // 超级块作为SFS文件系统的全局变量
 struct entry* root_entry;  // 根目录
 struct entry* work_entry;  // 工作目录
+uint8_t* inode_bitmap;     // 挂载时读入内存的inode位图
+uint8_t* data_bitmap;      // 挂载时读入内存的数据块位图
+// 全局锁：FUSE回调与后台线程互斥访问虚拟磁盘（可重入）
+pthread_mutex_t fs_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 /*
  * 超级块（super block），用于描述整个文件系统
- * 超级块大小为72字节（9个long），其占用1个磁盘块
- * 虚拟磁盘（sfs.img）
- * inode bitmap: 0x200
- * data bitmap:  0x400
- * inode area:   0x
- * data area:    0x200C00
+ * 超级块位于第0块，文件系统的几何参数（大小、块大小、inode数目）均由mkfs写入超级块，
+ * 挂载时从超级块读取，各区域的位置和大小由这些参数计算得到
+ * 默认参数（8MB，4KB块，2048个inode）下的虚拟磁盘（sfs.img）
+ * inode bitmap: 0x1000
+ * data bitmap:  0x2000
+ * inode area:   0x3000
+ * data area:    0x43000
 */
 struct sb {
-    long fs_size;                  // 文件系统的大小，以块为单位（16*1024=16384块）
-    long first_blk;                // 数据区的第一块块号，根目录也放在此（4102）
-    long datasize;                 // 数据区大小，以块为单位（4*512*8） 
-    long first_inode;              // inode区起始块号（6）
-    long inode_area_size;          // inode区大小，以块为单位（512*8）
+    long fs_size;                  // 文件系统的大小，以块为单位（8M/4K=2048块）
+    long first_blk;                // 数据区的第一块块号，根目录也放在此（67）
+    long datasize;                 // 数据区大小，以块为单位（1981）
+    long first_inode;              // inode区起始块号（3）
+    long inode_area_size;          // inode区大小，以块为单位（2048/32=64）
     long first_blk_of_inodebitmap; // inode位图区起始块号（1）
     long inodebitmap_size;         // inode位图区大小，以块为单位（1）
     long first_blk_of_databitmap;  // 数据块位图起始块号（2）
-    long databitmap_size;          // 数据块位图大小，以块为单位（4）
+    long databitmap_size;          // 数据块位图大小，以块为单位（1）
+    long magic;                    // 魔数，SFS_MAGIC
+    long block_size;               // 块大小，以字节为单位（4096）
+    long num_inodes;               // inode总数（2048）
+    long features;                 // 文件系统特性（FEATURE_*）
+    long orphan_head;              // 孤儿链表的第一个inode号（0表示链表为空，根目录不会成为孤儿）
+    long first_blk_of_reftable;    // 数据块引用计数表的起始块号（位于数据区开头，这些块在位图中标记为已使用）
+    long reftable_size;            // 数据块引用计数表大小，以块为单位（0表示没有引用计数表）
+    long first_blk_of_summary;     // 空闲空间摘要的起始块号（位于引用计数表之后，这些块在位图中标记为已使用）
+    long summary_size;             // 空闲空间摘要大小，以块为单位（0表示没有，旧映像总是由位图建立空闲空间索引）
+    long summary_valid;            // 摘要是否与位图一致（正常卸载时保存摘要后置1，挂载后清0）
+    long free_blocks;              // 空闲数据块数（随分配和释放更新，正常卸载时写回）
+    long free_inodes;              // 空闲inode数（同上）
+    long clean;                    // 正常卸载时置1，挂载后清0；挂载时为0表示上次没有正常卸载，空闲计数需要重新统计
+};
+
+/*
+ * 空闲空间摘要：正常卸载时保存的全部连续空闲段，挂载时直接读入建立空闲空间索引，不必扫描位图
+ * 摘要区以free_summary_header开头，其后为count个free_summary_entry（按起始块号排列）；
+ * 空闲段多于摘要区的容量时不保存，下次挂载时由位图建立
+*/
+#define SUMMARY_MAGIC 0x53465346 // 空闲空间摘要魔数（"FSFS"）
+
+struct free_summary_header {
+    long magic;  // SUMMARY_MAGIC
+    long count;  // 空闲段数
+    long blocks; // 空闲数据块数
+};
+
+struct free_summary_entry {
+    int start; // 空闲段的起始数据块号
+    int len;   // 块数
+};
+
+/*
+ * 数据块引用计数表中每个数据块的一项
+ * 数据块位图仍表示块是否已分配；shares为块被额外共享的次数（共有shares+1个逻辑块引用该块），
+ * 释放共享的块时只减少shares，shares为0时才真正释放
+ * fingerprint为块内容的指纹（0表示没有），用于写入时查找内容相同的块，共享前总是比较块的实际内容
+*/
+struct ref_entry {
+    uint32_t fingerprint; // 块内容的指纹
+    uint32_t shares;      // 额外的引用数
+};
+
+/*
+ * extent描述一段连续的数据块：文件内从lblk开始的len个逻辑块，依次存放在从pblk开始的数据块中
+ * extent树是一棵B+树，叶子节点存放extent，索引节点存放(起始逻辑块号, 子节点块号)
+ * 树根存放在inode中（最多INLINE_EXTENTS项），其余节点各占一个数据块
+*/
+#define EXTENT_MAGIC 0x5846 // extent节点魔数（"FX"）
+#define INLINE_EXTENTS 3    // inode中树根可存放的项数
+
+struct extent_header {
+    short int magic;   // EXTENT_MAGIC
+    short int entries; // 节点中的有效项数
+    short int max;     // 节点可容纳的项数
+    short int depth;   // 节点高度，0为叶子节点
+};
+
+struct extent {
+    int lblk; // 起始逻辑块号
+    int pblk; // 叶子节点：起始数据块号；索引节点：子节点的数据块号
+    int len;  // 连续的块数（索引节点中不使用）；带EXTENT_COMPRESSED时为压缩簇占用的数据块数
+};
+
+/*
+ * 压缩簇：INODE_COMPRESS文件按簇（多个连续逻辑块）进行LZ4压缩
+ * 压缩后的簇记录为一个带EXTENT_COMPRESSED的extent：逻辑上覆盖从lblk开始的整个簇，
+ * 物理上占用从pblk开始的len个数据块，第一个数据块以cluster_header开头，其后为压缩数据
+ * 压缩后不能节省至少一个数据块的簇按普通extent原样存放
+*/
+#define EXTENT_COMPRESSED 0x40000000 // extent的len字段中的压缩簇标志
+#define CLUSTER_MAGIC 0x5A43         // 压缩簇魔数（"CZ"）
+
+struct cluster_header {
+    int magic; // CLUSTER_MAGIC
+    int clen;  // 压缩数据的字节数
+};
+
+// inode中的extent树根，44字节
+struct extent_root {
+    struct extent_header header;
+    struct extent extents[INLINE_EXTENTS];
 };
 
 /*
  * SFS文件系统采用inode方式管理文件，具体而言：
  * 空闲块和空闲inode均采用位图的方式管理
- * 文件数据块采用直接和间接索引的方式，支持多级目录
+ * 文件数据块采用直接和间接索引（或extent树）的方式，支持多级目录
+ * inode在inode区中紧密排列，每个inode占用INODE_SIZE字节的槽，槽按cache line对齐
+ * 读写文件时频繁访问的热字段（权限、大小、块映射）集中在第一个cache line
 */
 struct inode {
+    // 热字段（第一个cache line）
     short int st_mode;       // 权限，2字节
-    short int st_ino;        // inode号，2字节
-    char st_nlink;           // 连接数，1字节
+    short int flags;         // inode标志位（INODE_*），2字节
+    int st_ino;              // inode号，4字节
+    off_t st_size;           // 文件大小，8字节
+    // 块映射，48字节
+    union {
+        // addr磁盘地址有7个，其中addr[0]-addr[3]是直接地址
+        // addr[4]、addr[5]、addr[6]分别为一次、二次、三次间接索引
+        int addr[7];                 // 磁盘地址（数据块号），28字节
+        struct extent_root ext_root; // flags含INODE_EXTENTS时为extent树根
+        char block_map[48];
+    };
+    // 冷字段
+    int st_nlink;            // 连接数，4字节
     uid_t st_uid;            // 拥有者的用户ID，4字节
     gid_t st_gid;            // 拥有者的组ID，4字节
-    off_t st_size;           // 文件大小，4字节
+    int st_blocks;           // 已分配的数据块数（包括间接索引块和extent树节点块），4字节
     struct timespec st_atim; // 上次访问时间（time of last access），16字节
-    // addr磁盘地址有7个，其中addr[0]-addr[3]是直接地址
-    // addr[4]、addr[5]、addr[6]分别为一次、二次、三次间接索引
-    short int addr[7];       // 磁盘地址，14字节
+    union {
+        // 内联数据的后半部分（前半部分存放在block_map中）
+        char inline_tail[INODE_SIZE - 96];
+        // 孤儿inode在孤儿链表中的下一个inode号（0表示链表结束），inode已删除，内联数据不再需要
+        int next_orphan;
+    };
 };
+_Static_assert(sizeof(struct inode) == INODE_SIZE, "struct inode must fill an inode slot");
+_Static_assert(INLINE_DATA_SIZE == 48 + INODE_SIZE - 96, "inline data fills block_map and inline_tail");
+
+/**
+ * 初始化inode的块映射（新建inode或内联数据转为块存储时调用）
+ * 文件系统启用FEATURE_EXTENTS或inode启用压缩时使用空的extent树，否则addr全部为-1
+ */
+void init_block_map(struct inode* inode) {
+    memset(inode->block_map, 0, sizeof(inode->block_map));
+    if ((sb->features & FEATURE_EXTENTS) || (inode->flags & INODE_COMPRESS)) {
+        // 使用extent树，树根为空的叶子节点（压缩簇只能记录在extent中）
+        inode->flags |= INODE_EXTENTS;
+        inode->ext_root.header.magic = EXTENT_MAGIC;
+        inode->ext_root.header.entries = 0;
+        inode->ext_root.header.max = INLINE_EXTENTS;
+        inode->ext_root.header.depth = 0;
+        return;
+    }
+    for (int i=0; i<=6; i++) {
+        inode->addr[i] = -1; // -1表示未使用该索引级别
+    }
+}
 
 /*
  * entry为SFS文件系统的目录项
  * 在SFS中，目录也被作为文件，只不过这个文件存放的是一个的目录项
- * 每个目录项的大小为16字节，格式如下：
- * 文件名8字节，扩展名3字节，inode号2字节（实际使用12位），备用3字节
+ * 每个目录项的大小为32字节，格式如下：
+ * 文件名8+1字节，扩展名3+1字节，类型1字节，inode号4字节，其余备用
 */
 #define UNUSED 0
 #define FILE_TYPE 1 // 普通文件
@@ -79,21 +226,21 @@ struct entry {
     char name[MAX_FILE_NAME + 1];           // 文件名，8+1字节
     char extension[MAX_FILE_EXTENSION + 1]; // 文件扩展名，3+1字节
     char type; // 目录项类型（0未使用，1普通文件，2目录文件）
-    short int inode;                        // inode号，2字节
-    // 备用3字节，其中1字节用于判断目录项类型 
-    // char reserved[2];
-    // 备用2字节分别用于为name和ext字段补'\0'
+    int inode;                              // inode号，4字节
+    char reserved[12];                      // 备用12字节，使目录项大小为32字节，一个数据块恰好存放整数个目录项
+    // 名字和扩展名各多出的1字节用于补'\0'
 };
 
-// 多级目录结构
+// 多级目录结构（目录项数组按需扩容）
 struct dir {
-    struct entry* entries[MAX_NUM_ENTRIES];
+    struct entry** entries;
     size_t num_entries; // 目录项数目
+    size_t capacity;    // entries数组容量
 };
 
-// 数据块
+// 数据块（缓冲区大小为超级块中的块大小，使用new_data_block分配）
 struct data_block {
-    char data[BLOCK_SIZE];
+    char* data;
 };
 
 /**
@@ -102,16 +249,61 @@ struct data_block {
 struct inode_iter {
     struct inode* inode;
     size_t read_size; // 已读取数据块大小
-    int index;        // 当前索引下标
-    short int datablock_no; // 当前迭代的数据块号
-    int n;            // 多级索引中数据块内的第n个块号（每次间接重新设置为0）
+    long index;       // 下一个需要读取的逻辑块号（文件内第index个数据块）
+    int datablock_no; // 当前迭代的数据块号（-1表示该逻辑块未分配）
 };
 
 // 以上是SFS相关数据结构
 // ***************************************************************************************
 // 以下是SFS数据结构（inode、entry等）初始化函数
 
-void new_inode(struct inode* inode, short int ino, char type) {
+/**
+ * 根据文件系统几何参数计算超级块中各区域的位置和大小
+ * 布局：| super block | inode bitmap | data bitmap | inode area | data area |
+ * @param fs_bytes   文件系统载体文件大小（字节）
+ * @param block_size 块大小（字节）
+ * @param num_inodes inode总数
+ * @return 参数合法返回0，否则返回-1
+ */
+int init_sb(struct sb* sb, long fs_bytes, long block_size, long num_inodes) {
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        return -1; // 块大小必须是512~64K之间的2的幂
+    }
+    if (num_inodes <= 0 || num_inodes > INT32_MAX) {
+        return -1;
+    }
+    long bits_per_block = block_size * 8; // 一个位图块可以描述的块数
+    memset(sb, 0, sizeof(struct sb));
+    sb->magic                    = SFS_MAGIC;
+    sb->block_size               = block_size;
+    sb->num_inodes               = num_inodes;
+    sb->fs_size                  = fs_bytes / block_size;
+    sb->first_blk_of_inodebitmap = 1;
+    sb->inodebitmap_size         = (num_inodes + bits_per_block - 1) / bits_per_block;
+    sb->first_blk_of_databitmap  = sb->first_blk_of_inodebitmap + sb->inodebitmap_size;
+    // 剩余空间由数据块位图和数据区共享，每个位图块描述bits_per_block个数据块
+    long inodes_per_block = block_size / INODE_SIZE; // 一个块可以存放的inode数目
+    long remain = sb->fs_size - sb->first_blk_of_databitmap - (num_inodes + inodes_per_block - 1) / inodes_per_block;
+    if (remain < 2) {
+        return -1;
+    }
+    sb->databitmap_size          = (remain + bits_per_block) / (bits_per_block + 1);
+    sb->first_inode              = sb->first_blk_of_databitmap + sb->databitmap_size;
+    sb->inode_area_size          = (num_inodes + inodes_per_block - 1) / inodes_per_block;
+    sb->first_blk                = sb->first_inode + sb->inode_area_size;
+    sb->datasize                 = sb->fs_size - sb->first_blk;
+    if (sb->datasize > sb->databitmap_size * bits_per_block) {
+        sb->datasize = sb->databitmap_size * bits_per_block;
+    }
+    if (sb->datasize <= 0 || sb->datasize > INT32_MAX) {
+        // 块号为32位有符号整数（-1表示未使用）
+        return -1;
+    }
+    return 0;
+}
+
+void new_inode(struct inode* inode, int ino, char type) {
+    memset(inode, 0, sizeof(struct inode));
     inode->st_ino = ino;
     if (type == DIR_TYPE) {
         inode->st_mode = __S_IFDIR | 0755; // 目录文件
@@ -124,16 +316,24 @@ void new_inode(struct inode* inode, short int ino, char type) {
     inode->st_gid = 0;   // 用户组id
     inode->st_size = 0;  // 文件大小
     // inode->st_atim = time(NULL); // 上次访问时间（time of last access）
-    for (int i=0; i<=6; i++) {
-        inode->addr[i] = -1; // -1表示未使用该索引级别
+    if (type == FILE_TYPE) {
+        // 普通文件先内联存放在inode中，超过INLINE_DATA_SIZE后再转为块存储
+        inode->flags |= INODE_INLINE;
+        return;
     }
+    init_block_map(inode);
 }
 
-void new_entry(struct entry* entry, char* name, char* ext, char type, short int ino) {
+void new_entry(struct entry* entry, char* name, char* ext, char type, int ino) {
+    memset(entry->reserved, 0, sizeof(entry->reserved));
     entry->type = type;
     entry->inode = ino;
-    strcpy(entry->name, name);
-    strcpy(entry->extension, ext);
+    if (entry->name != name) {
+        strcpy(entry->name, name);
+    }
+    if (entry->extension != ext) {
+        strcpy(entry->extension, ext);
+    }
     if (type == DIR_TYPE) {
         strcpy(entry->extension, "");
     }
@@ -144,7 +344,41 @@ void new_inode_iter(struct inode_iter* iter, struct inode* inode) {
     iter->read_size = 0;
     iter->index = 0;
     iter->datablock_no = -1; // 当前迭代的数据块号
-    iter->n = 0;
+}
+
+/**
+ * 分配一个数据块缓冲区，大小为超级块中的块大小，按页对齐
+ * 使用完毕后需要调用free_data_block释放
+ */
+struct data_block* new_data_block() {
+    struct data_block* data_block = (struct data_block*)malloc(sizeof(struct data_block));
+    if (posix_memalign((void**)&data_block->data, IO_ALIGN, sb->block_size) != 0) {
+        free(data_block);
+        return NULL;
+    }
+    return data_block;
+}
+
+void free_data_block(struct data_block* data_block) {
+    if (data_block != NULL) {
+        free(data_block->data);
+        free(data_block);
+    }
+}
+
+void new_dir(struct dir* dir) {
+    dir->entries = NULL;
+    dir->num_entries = 0;
+    dir->capacity = 0;
+}
+
+// 释放目录结构中的全部目录项
+void free_dir(struct dir* dir) {
+    for (size_t i=0; i<dir->num_entries; i++) {
+        free(dir->entries[i]);
+    }
+    free(dir->entries);
+    new_dir(dir);
 }
 
 // 以上是SFS数据结构（inode、entry等）初始化函数
@@ -0,0 +1,168 @@
+/*
+ * SFS文件系统的后台删除（孤儿链表回收）
+ * 删除目录树和大文件时只将其从父目录摘除并加入孤儿链表，rmdir/unlink立即返回，
+ * 由后台线程按速率限制逐步回收子项和数据块；孤儿链表保存在虚拟磁盘上，挂载后继续回收
+*/
+#ifndef __SFS_ORPHAN_H__
+#define __SFS_ORPHAN_H__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sfs_ds.h"
+#include "sfs_rw.h"
+
+#define ORPHAN_STEP_BLOCKS 1024 // 每一步最多回收的块数（或摘除的目录项数），每步之间释放fs_lock
+#define ORPHAN_RATE 65536       // 每秒最多回收的块数
+
+pthread_t orphan_thread;      // 后台回收线程
+int orphan_thread_running = 0; // 后台回收线程是否已启动
+int orphan_stop = 0;           // 通知后台回收线程退出
+
+/**
+ * 从孤儿目录中摘除最多budget个目录项，子项加入孤儿链表头部（先于该目录回收）
+ * 先写回清除了目录项的目录块，再将子项加入孤儿链表：中途崩溃时子项最多成为无人引用的inode，不会误删
+ * @param dir_inode 孤儿目录的inode
+ * @param budget    最多摘除的目录项数
+ * @return 摘除的目录项数
+ */
+long detach_dir_entries(struct inode* dir_inode, long budget) {
+    struct inode_iter* iter = (struct inode_iter*)malloc(sizeof(struct inode_iter));
+    new_inode_iter(iter, dir_inode);
+    struct data_block* datablock = new_data_block();
+    int* children = (int*)malloc(budget * sizeof(int));
+    long n = 0;
+    while (has_next(iter) && n < budget) {
+        next(iter, datablock);
+        int changed = 0;
+        for (int k=0; k<NUM_ENTRIES_PER_BLOCK && n < budget; k++) {
+            struct entry* e = (struct entry*)(datablock->data + k*sizeof(struct entry));
+            if (e->type == UNUSED) {
+                continue;
+            }
+            children[n++] = e->inode;
+            e->type = UNUSED;
+            changed = 1;
+        }
+        if (changed) {
+            write_data_block(iter->datablock_no, datablock);
+        }
+    }
+    struct inode* child = (struct inode*)malloc(sizeof(struct inode));
+    for (long i=0; i<n; i++) {
+        read_inode(children[i], child);
+        if (inode_is_used(children[i]) && !(child->flags & INODE_ORPHAN)) {
+            orphan_add(child);
+        }
+    }
+    free(child);
+    free(children);
+    free(iter);
+    free_data_block(datablock);
+    return n;
+}
+
+/**
+ * 回收孤儿链表头部inode的一部分
+ * 目录：摘除最多budget个目录项；目录已空时释放目录
+ * 文件：从块映射末尾释放最多budget个已分配的数据块（跳过空洞）；数据块全部释放后释放inode
+ * 调用者持有fs_lock
+ * @param budget 本步最多处理的块数或目录项数
+ * @return 本步完成的工作量（释放的块数与摘除的目录项数），链表为空返回0
+ */
+long reclaim_orphan_step(long budget) {
+    int ino = sb->orphan_head;
+    if (ino == 0) {
+        return 0;
+    }
+    struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
+    read_inode(ino, inode);
+    long work = 0;
+    if (S_ISDIR(inode->st_mode)) {
+        work = detach_dir_entries(inode, budget);
+        if (work > 0) {
+            free(inode);
+            return work; // 子项已加入链表头部，之后再回收该目录
+        }
+    } else if (!(inode->flags & INODE_INLINE) && inode->st_blocks > 0) {
+        // 按已分配的块（而不是逻辑块）计数，稀疏文件中的空洞不占用每步的工作量
+        long start = MAX(0, seek_mapped_back(inode, LONG_MAX, budget));
+        if (inode_compressed(inode)) {
+            start -= start % CLUSTER_BLOCKS; // 按整簇释放，避免解压后重新写入部分簇
+        }
+        long before = inode->st_blocks;
+        punch_blocks(inode, start, LONG_MAX);
+        inode->st_size = MIN(inode->st_size, start * sb->block_size);
+        write_inode(ino, inode);
+        work = before - inode->st_blocks;
+        if (start > 0) {
+            free(inode);
+            return MAX(work, 1);
+        }
+    }
+    // 已没有子项和数据块：先从链表中移除，再释放inode
+    TRACE(INFO, "release ino=%ld", ino);
+    sb->orphan_head = inode->next_orphan;
+    write_sb();
+    struct bitmap_batch batch;
+    init_bitmap_batch(&batch);
+    release_inode(ino, &batch);
+    commit_bitmap_batch(&batch);
+    free(inode);
+    return work + 1;
+}
+
+/**
+ * 后台回收线程：孤儿链表非空时逐步回收，每步之间释放fs_lock并按ORPHAN_RATE休眠
+ */
+void* orphan_worker(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&fs_lock);
+    while (!orphan_stop) {
+        if (sb->orphan_head == 0) {
+            pthread_cond_wait(&orphan_cond, &fs_lock);
+            continue;
+        }
+        long work = reclaim_orphan_step(ORPHAN_STEP_BLOCKS);
+        pthread_mutex_unlock(&fs_lock);
+        usleep(work * 1000000L / ORPHAN_RATE);
+        pthread_mutex_lock(&fs_lock);
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return NULL;
+}
+
+/**
+ * 启动后台回收线程（挂载时调用），上次未回收完的孤儿链表会继续回收
+ */
+int start_orphan_worker() {
+    if (sb->orphan_head != 0) {
+        TRACE(INFO, "resume reclaiming orphans from ino=%ld", sb->orphan_head);
+    }
+    orphan_stop = 0;
+    if (pthread_create(&orphan_thread, NULL, orphan_worker, NULL) != 0) {
+        return -1;
+    }
+    orphan_thread_running = 1;
+    return 0;
+}
+
+/**
+ * 停止后台回收线程（卸载时调用），未回收完的孤儿留在链表中，下次挂载时继续
+ */
+void stop_orphan_worker() {
+    if (!orphan_thread_running) {
+        return;
+    }
+    pthread_mutex_lock(&fs_lock);
+    orphan_stop = 1;
+    pthread_cond_broadcast(&orphan_cond);
+    pthread_mutex_unlock(&fs_lock);
+    pthread_join(orphan_thread, NULL);
+    orphan_thread_running = 0;
+}
+
+#endif
@@ -0,0 +1,414 @@
+/*
+ * SFS文件系统的I/O记录与回放
+ * 挂载时指定record=文件，每个FUSE回调（路径、偏移、大小、参数、返回值）和每次块设备操作（偏移、大小）
+ * 连同开始时间和耗时以二进制记录追加到该文件；指定replay=文件时不挂载，在新的虚拟磁盘上
+ * 按记录的顺序重新调用各回调（可按原时间间隔或加速回放），用于在本地重现实际负载、比较不同的实现
+ * 记录不包含文件内容，回放写入时使用由记录序号生成的伪随机数据（不可压缩，不同的写入内容不同）
+*/
+#ifndef __SFS_RECORD_H__
+#define __SFS_RECORD_H__
+
+#include <fuse3/fuse.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sfs_ds.h"
+#include "sfs_dev.h"
+#include "sfs_stats.h"
+#include "sfs_trace.h"
+
+#define RECORD_MAGIC 0x53465352 // 记录文件魔数（"SFSR"）
+#define RECORD_VERSION 1
+#define RECORD_BUF_SIZE (1 << 20) // 记录文件的stdio缓冲区大小
+
+// 记录的类型
+#define RECORD_FUSE  0 // FUSE回调，op为stats_timer中的回调（小于NUM_FUSE_TIMERS）
+#define RECORD_BLOCK 1 // 块设备操作，op为record_block_op
+
+enum record_block_op {
+    RECORD_BLOCK_READ, RECORD_BLOCK_WRITE, RECORD_BLOCK_WRITEBACK, RECORD_BLOCK_FLUSH, RECORD_BLOCK_DISCARD,
+};
+
+// 记录文件头
+struct record_file_header {
+    uint32_t magic;
+    uint32_t version;
+    int64_t dev_size;   // 记录时块设备的大小
+    int64_t block_size; // 记录时的块大小
+};
+
+/**
+ * 一条记录，FUSE回调的记录之后紧跟path_len + path2_len字节的路径（不含结尾的0）
+ * 各回调的参数：
+ *   offset：读写、lseek、fallocate、readdir的偏移，copy_file_range的源偏移
+ *   size：  读写、truncate、fallocate、copy_file_range的大小，ioctl的标志参数
+ *   arg：   mkdir/mknod的mode，fallocate的mode，lseek的whence，fsync的datasync，ioctl的cmd，copy_file_range的目标偏移
+ */
+struct record_entry {
+    uint64_t time;    // 相对记录开始的时间（纳秒）
+    uint64_t latency; // 耗时（纳秒）
+    int64_t offset;
+    int64_t size;
+    int64_t arg;
+    int32_t ret;      // 返回值（块设备操作为读写的字节数或错误码）
+    uint8_t kind;     // RECORD_FUSE或RECORD_BLOCK
+    uint8_t op;
+    uint16_t path_len;
+    uint16_t path2_len;
+};
+
+// 记录器：多个线程（FUSE回调、fsync、后台回收）的记录经互斥锁追加到同一个文件
+struct recorder {
+    FILE* file;
+    pthread_mutex_t lock;
+    uint64_t start; // 开始记录的时间
+    long count;     // 已记录的条数
+};
+
+struct recorder* recorder = NULL; // 未启用记录时为NULL
+
+/************************/
+/* 记录相关函数 */
+
+/**
+ * 开始记录到path（覆盖已有文件）
+ * @return 成功返回0，失败返回-1
+ */
+int start_recorder(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, RECORD_BUF_SIZE);
+    struct record_file_header header = {
+        .magic = RECORD_MAGIC, .version = RECORD_VERSION,
+        .dev_size = bdev->size, .block_size = sb->block_size,
+    };
+    fwrite(&header, sizeof(header), 1, file);
+    recorder = (struct recorder*)calloc(1, sizeof(struct recorder));
+    recorder->file = file;
+    pthread_mutex_init(&recorder->lock, NULL);
+    recorder->start = stats_now();
+    return 0;
+}
+
+// 结束记录，写出缓冲区中的记录
+void stop_recorder() {
+    if (recorder == NULL) {
+        return;
+    }
+    TRACE(INFO, "%ld records", recorder->count);
+    fclose(recorder->file);
+    pthread_mutex_destroy(&recorder->lock);
+    free(recorder);
+    recorder = NULL;
+}
+
+// 追加一条记录（及其路径）
+void record_append(struct record_entry* entry, const char* path, const char* path2) {
+    pthread_mutex_lock(&recorder->lock);
+    fwrite(entry, sizeof(struct record_entry), 1, recorder->file);
+    if (entry->path_len > 0) {
+        fwrite(path, 1, entry->path_len, recorder->file);
+    }
+    if (entry->path2_len > 0) {
+        fwrite(path2, 1, entry->path2_len, recorder->file);
+    }
+    recorder->count++;
+    pthread_mutex_unlock(&recorder->lock);
+}
+
+/**
+ * 记录一次FUSE回调（由sfs.c中的SFS_LOCKED、SFS_TIMED调用）
+ * @param op    回调对应的stats_timer
+ * @param start 回调开始的时间（stats_now）
+ * @param ret   回调的返回值
+ * @param path2 copy_file_range的目标路径，其余回调为NULL
+ */
+void record_fuse_op(int op, uint64_t start, long ret, const char* path, const char* path2,
+                    long offset, long size, long arg) {
+    if (recorder == NULL) {
+        return;
+    }
+    struct record_entry entry = {
+        .time = start - recorder->start, .latency = stats_now() - start,
+        .offset = offset, .size = size, .arg = arg, .ret = ret,
+        .kind = RECORD_FUSE, .op = op,
+        .path_len = path == NULL ? 0 : strnlen(path, MAX_PATH_LEN),
+        .path2_len = path2 == NULL ? 0 : strnlen(path2, MAX_PATH_LEN),
+    };
+    record_append(&entry, path, path2);
+}
+
+/* 以上是记录相关函数 */
+
+/************************/
+/* 记录块设备相关函数 */
+
+// 记录块设备：将每次操作转发给下层块设备并记录
+struct record_dev {
+    struct block_dev dev; // 必须是第一个成员
+    struct block_dev* lower;
+};
+
+#define RECORD_LOWER(dev) (((struct record_dev*)(dev))->lower)
+
+void record_block_op(int op, uint64_t start, long ret, off_t offset, long size) {
+    if (recorder == NULL) {
+        return;
+    }
+    struct record_entry entry = {
+        .time = start - recorder->start, .latency = stats_now() - start,
+        .offset = offset, .size = size, .ret = ret,
+        .kind = RECORD_BLOCK, .op = op,
+    };
+    record_append(&entry, NULL, NULL);
+}
+
+long record_dev_read(struct block_dev* dev, void* buf, size_t size, off_t offset) {
+    uint64_t start = stats_now();
+    long ret = RECORD_LOWER(dev)->ops->read(RECORD_LOWER(dev), buf, size, offset);
+    record_block_op(RECORD_BLOCK_READ, start, ret, offset, size);
+    return ret;
+}
+
+long record_dev_write(struct block_dev* dev, const void* buf, size_t size, off_t offset) {
+    uint64_t start = stats_now();
+    long ret = RECORD_LOWER(dev)->ops->write(RECORD_LOWER(dev), buf, size, offset);
+    record_block_op(RECORD_BLOCK_WRITE, start, ret, offset, size);
+    return ret;
+}
+
+int record_dev_writeback(struct block_dev* dev, off_t offset, off_t len, int wait) {
+    uint64_t start = stats_now();
+    int ret = RECORD_LOWER(dev)->ops->writeback(RECORD_LOWER(dev), offset, len, wait);
+    record_block_op(RECORD_BLOCK_WRITEBACK, start, ret, offset, len);
+    return ret;
+}
+
+int record_dev_flush(struct block_dev* dev) {
+    uint64_t start = stats_now();
+    int ret = RECORD_LOWER(dev)->ops->flush(RECORD_LOWER(dev));
+    record_block_op(RECORD_BLOCK_FLUSH, start, ret, 0, 0);
+    return ret;
+}
+
+int record_dev_discard(struct block_dev* dev, off_t offset, off_t len) {
+    uint64_t start = stats_now();
+    int ret = RECORD_LOWER(dev)->ops->discard(RECORD_LOWER(dev), offset, len);
+    record_block_op(RECORD_BLOCK_DISCARD, start, ret, offset, len);
+    return ret;
+}
+
+void record_dev_close(struct block_dev* dev) {
+    close_block_dev(RECORD_LOWER(dev));
+    free(dev);
+}
+
+const struct block_dev_ops record_dev_ops = {
+    .name = "record",
+    .read = record_dev_read,
+    .write = record_dev_write,
+    .writeback = record_dev_writeback,
+    .flush = record_dev_flush,
+    .discard = record_dev_discard,
+    .close = record_dev_close,
+};
+
+/**
+ * 在lower之上叠加记录块设备（需要先start_recorder）
+ * fd和内存区域与lower相同，write_buf经fd直接写入的数据不经过块设备，不会被记录
+ * @return 记录块设备，关闭时一并关闭lower
+ */
+struct block_dev* open_record_dev(struct block_dev* lower) {
+    struct record_dev* rdev = (struct record_dev*)calloc(1, sizeof(struct record_dev));
+    rdev->dev.ops = &record_dev_ops;
+    rdev->dev.size = lower->size;
+    rdev->dev.fd = lower->fd;
+    rdev->dev.map = lower->map;
+    rdev->lower = lower;
+    return &rdev->dev;
+}
+
+/* 以上是记录块设备相关函数 */
+
+/************************/
+/* 回放相关函数 */
+
+// 用xorshift生成回放第seq条记录写入的数据
+void replay_fill(char* buf, long size, uint64_t seq) {
+    uint64_t x = (88172645463325252ULL ^ (seq * 0x9e3779b97f4a7c15ULL)) | 1;
+    for (long i=0; i<size; i+=sizeof(uint64_t)) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(buf + i, &x, MIN((long)sizeof(uint64_t), size - i));
+    }
+}
+
+// 回放readdir时丢弃目录项
+int replay_filler(void* buf, const char* name, const struct stat* st, off_t off, enum fuse_fill_dir_flags flags) {
+    (void) buf;
+    (void) name;
+    (void) st;
+    (void) off;
+    (void) flags;
+    return 0;
+}
+
+// 释放read_buf返回的bufvec（同libfuse：内存段由回调malloc）
+void replay_free_bufvec(struct fuse_bufvec* bufv) {
+    for (size_t i=0; i<bufv->count; i++) {
+        if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD)) {
+            free(bufv->buf[i].mem);
+        }
+    }
+    free(bufv);
+}
+
+/**
+ * 回放一条FUSE回调记录
+ * @param buf 读写使用的缓冲区，至少entry->size字节
+ * @return 回调的返回值，不支持的回调返回-ENOSYS
+ */
+long replay_fuse_op(const struct fuse_operations* ops, struct record_entry* entry, const char* path,
+                    const char* path2, char* buf) {
+    struct stat st;
+    switch (entry->op) {
+        case STAT_GETATTR: return ops->getattr(path, &st, NULL);
+        case STAT_READDIR: return ops->readdir(path, NULL, replay_filler, entry->offset, NULL, 0);
+        case STAT_MKDIR: return ops->mkdir(path, entry->arg);
+        case STAT_RMDIR: return ops->rmdir(path);
+        case STAT_MKNOD: return ops->mknod(path, entry->arg, 0);
+        case STAT_UNLINK: return ops->unlink(path);
+        case STAT_READ: return ops->read(path, buf, entry->size, entry->offset, NULL);
+        case STAT_WRITE: return ops->write(path, buf, entry->size, entry->offset, NULL);
+        case STAT_READ_BUF: {
+            struct fuse_bufvec* bufv = NULL;
+            int ret = ops->read_buf(path, &bufv, entry->size, entry->offset, NULL);
+            if (ret == 0) {
+                replay_free_bufvec(bufv);
+            }
+            return ret;
+        }
+        case STAT_WRITE_BUF: {
+            struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(entry->size);
+            bufv.buf[0].mem = buf;
+            return ops->write_buf(path, &bufv, entry->offset, NULL);
+        }
+        case STAT_FLUSH: return ops->flush(path, NULL);
+        case STAT_FSYNC: return ops->fsync(path, entry->arg, NULL);
+        case STAT_LSEEK: return ops->lseek(path, entry->offset, entry->arg, NULL);
+        case STAT_TRUNCATE: return ops->truncate(path, entry->size, NULL);
+        case STAT_FALLOCATE: return ops->fallocate(path, entry->arg, entry->offset, entry->size, NULL);
+        case STAT_COPY_FILE_RANGE:
+            return ops->copy_file_range(path, NULL, entry->offset, path2, NULL, entry->arg, entry->size, 0);
+        case STAT_IOCTL: {
+            // 按cmd中编码的参数大小分配（SFS_IOC_DEFRAG等返回结构体），标志参数放在开头
+            char* data = (char*)calloc(1, MAX(_IOC_SIZE((unsigned int)entry->arg), sizeof(unsigned int)));
+            *(unsigned int*)data = entry->size;
+            int ret = ops->ioctl(path, entry->arg, NULL, NULL, 0, data);
+            free(data);
+            return ret;
+        }
+        case STAT_STATFS: {
+            struct statvfs st;
+            return ops->statfs(path, &st);
+        }
+        default: return -ENOSYS;
+    }
+}
+
+// 回放统计：每种回调的次数和返回值与记录不同的次数
+struct replay_result {
+    long count[NUM_STATS_TIMERS];
+    long mismatch[NUM_STATS_TIMERS];
+    long blocks; // 跳过的块设备记录
+};
+
+/**
+ * 在当前挂载的虚拟磁盘上按顺序回放记录文件中的FUSE回调（块设备记录只用于分析，跳过）
+ * 回调按记录的顺序在调用线程中依次执行；统计信息虚拟文件的访问不回放
+ * @param path  记录文件
+ * @param ops   SFS的回调
+ * @param speed 时间缩放：0为不等待，尽快回放；大于0时按记录的时间间隔除以speed等待（1为原速，2为两倍速）
+ * @param result 回放统计
+ * @return 成功返回0，记录文件无法读取或损坏返回-1
+ */
+int replay_record(const char* path, const struct fuse_operations* ops, double speed, struct replay_result* result) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    struct record_file_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != RECORD_MAGIC || header.version != RECORD_VERSION) {
+        fclose(file);
+        errno = EINVAL;
+        return -1;
+    }
+    if (header.dev_size > bdev->size) {
+        TRACE(INFO, "recorded on a larger device (%ld bytes), the replay may run out of space", header.dev_size);
+    }
+    memset(result, 0, sizeof(struct replay_result));
+    long buf_size = 1 << 20;
+    char* buf = (char*)malloc(buf_size);
+    char path1[MAX_PATH_LEN + 1], path2[MAX_PATH_LEN + 1];
+    uint64_t start = stats_now();
+    struct record_entry entry;
+    int ret = 0;
+    for (uint64_t seq=0; fread(&entry, sizeof(entry), 1, file) == 1; seq++) {
+        if (entry.path_len > MAX_PATH_LEN || entry.path2_len > MAX_PATH_LEN ||
+            fread(path1, 1, entry.path_len, file) != entry.path_len ||
+            fread(path2, 1, entry.path2_len, file) != entry.path2_len) {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+        path1[entry.path_len] = '\0';
+        path2[entry.path2_len] = '\0';
+        if (entry.kind != RECORD_FUSE || entry.op >= NUM_FUSE_TIMERS) {
+            result->blocks++;
+            continue;
+        }
+        if (strcmp(path1, STATS_PATH) == 0) {
+            continue;
+        }
+        if (entry.op == STAT_READ || entry.op == STAT_WRITE || entry.op == STAT_WRITE_BUF) {
+            if (entry.size > buf_size) {
+                buf_size = entry.size;
+                buf = (char*)realloc(buf, buf_size);
+            }
+            if (entry.op != STAT_READ) {
+                replay_fill(buf, entry.size, seq);
+            }
+        }
+        if (speed > 0) {
+            // 等待到记录的时间（按speed缩放）
+            uint64_t target = start + (uint64_t)(entry.time / speed);
+            uint64_t now = stats_now();
+            if (target > now) {
+                struct timespec ts = { (target - now) / 1000000000ULL, (target - now) % 1000000000ULL };
+                nanosleep(&ts, NULL);
+            }
+        }
+        long r = replay_fuse_op(ops, &entry, path1, path2, buf);
+        result->count[entry.op]++;
+        if (r != entry.ret) {
+            result->mismatch[entry.op]++;
+            TRACE_STR(DEBUG, path1, "%s: op=%ld returned %ld, recorded %ld", entry.op, r, entry.ret);
+        }
+    }
+    free(buf);
+    fclose(file);
+    return ret;
+}
+
+/* 以上是回放相关函数 */
+
+#endif
@@ -9,26 +9,208 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <malloc.h>
+#include <lz4.h>
 
 #include "sfs_ds.h"
 #include "sfs_utils.h"
+#include "sfs_dev.h"
+#include "sfs_trace.h"
+#include "sfs_stats.h"
+#include "sfs_space.h"
+
+/**
+ * 脏块表：记录写入后尚未被fsync持久化的磁盘块（以整个虚拟磁盘的绝对块号为下标，每块1位）
+ * 所有写磁盘的函数都会标记对应块，fsync时只持久化目标inode相关的脏块
+ */
+uint8_t* dirty_map = NULL;
+
+// 根据超级块分配脏块表（挂载时调用）
+int init_dirty_map() {
+    free(dirty_map);
+    dirty_map = (uint8_t*)calloc((sb->fs_size + 7) / 8, 1);
+    return dirty_map == NULL ? -1 : 0;
+}
+
+/**
+ * 标记一个磁盘块为脏（多个线程可能同时写入和fsync，因此使用原子操作）
+ * @param blk 虚拟磁盘的绝对块号
+ */
+void mark_block_dirty(long blk) {
+    if (dirty_map == NULL || blk < 0 || blk >= sb->fs_size) {
+        return;
+    }
+    __atomic_fetch_or(&dirty_map[blk >> 3], (uint8_t)(1 << (7 - blk % 8)), __ATOMIC_RELAXED);
+}
+
+/**
+ * 测试并清除一个磁盘块的脏标记
+ * @return 清除前该块为脏则返回1，否则返回0
+ */
+int test_and_clear_block_dirty(long blk) {
+    if (dirty_map == NULL || blk < 0 || blk >= sb->fs_size) {
+        return 0;
+    }
+    uint8_t bit = 1 << (7 - blk % 8);
+    uint8_t old = __atomic_fetch_and(&dirty_map[blk >> 3], (uint8_t)~bit, __ATOMIC_RELAXED);
+    return (old & bit) != 0;
+}
+
+/**
+ * 将超级块写回虚拟磁盘（修改了孤儿链表等超级块字段后调用）
+ */
+void write_sb() {
+    bdev_write(sb, sizeof(struct sb), 0);
+    mark_block_dirty(0);
+}
+
+// 一个间接索引块可存放的块号数目
+#define NUM_PER_INDEX_BLOCK (sb->block_size / sizeof(int))
+
+/**
+ * 建立空闲空间索引（同时得到空闲数据块数）
+ * 上次正常卸载时保存了摘要则一次顺序读入整个摘要区，检查后按序建树；否则（崩溃后）并行扫描数据块位图
+ */
+void load_free_extents() {
+    if (sb->clean && sb->summary_valid && sb->summary_size > 0) {
+        struct free_summary_header* header = (struct free_summary_header*)malloc(sb->summary_size * sb->block_size);
+        struct free_summary_entry* entries = (struct free_summary_entry*)(header + 1);
+        long cap = (sb->summary_size * sb->block_size - sizeof(struct free_summary_header)) / sizeof(struct free_summary_entry);
+        int ok = bdev_read_blocks(sb->first_blk_of_summary, sb->summary_size, header) == 0 &&
+                 header->magic == SUMMARY_MAGIC && header->count >= 0 && header->count <= cap;
+        long end = 0, blocks = 0; // 上一段的末尾，检查各段有序且不相接、不重叠
+        for (long i=0; ok && i<header->count; i++) {
+            ok = (i == 0 ? entries[i].start >= 0 : entries[i].start > end) && entries[i].len > 0 && entries[i].start + (long)entries[i].len <= sb->datasize;
+            end = entries[i].start + (long)entries[i].len;
+            blocks += entries[i].len;
+        }
+        ok = ok && blocks == header->blocks && blocks == sb->free_blocks;
+        if (ok) {
+            reset_free_extents();
+            fext_build(entries, header->count);
+        }
+        free(header);
+        if (ok) {
+            TRACE(INFO, "loaded %ld free extents from the summary", free_extent_count);
+            return;
+        }
+        TRACE(ERROR, "invalid free space summary, rebuilding from the bitmap");
+    }
+    int nthreads = build_free_extents(data_bitmap, sb->datasize);
+    TRACE(INFO, "built %ld free extents from the bitmap with %d threads", free_extent_count, nthreads);
+}
+
+// walk_free_extents的回调：将空闲段追加到摘要
+void summary_visitor(int start, int len, void* arg) {
+    struct free_summary_header* header = (struct free_summary_header*)arg;
+    struct free_summary_entry* entries = (struct free_summary_entry*)(header + 1);
+    entries[header->count++] = (struct free_summary_entry){ start, len };
+}
+
+/**
+ * 保存空闲空间摘要（正常卸载时位图已全部写回后调用），由mark_fs_clean在摘要落盘后写回超级块中的有效标记
+ * @return 成功返回0，没有摘要区、空闲段多于摘要区容量或写入失败返回-1（下次挂载时由位图建立索引）
+ */
+int save_free_extents() {
+    long cap = (sb->summary_size * sb->block_size - (long)sizeof(struct free_summary_header)) / (long)sizeof(struct free_summary_entry);
+    if (sb->summary_size == 0 || free_extent_count > cap) {
+        TRACE(INFO, "%ld free extents, summary capacity %ld", free_extent_count, MAX(cap, 0));
+        return -1;
+    }
+    struct free_summary_header* header = (struct free_summary_header*)calloc(sb->summary_size, sb->block_size);
+    header->magic = SUMMARY_MAGIC;
+    header->blocks = sb->free_blocks;
+    walk_free_extents(summary_visitor, header);
+    int ret = bdev_write_blocks(sb->first_blk_of_summary, sb->summary_size, header) == 0 && bdev_flush() == 0 ? 0 : -1;
+    free(header);
+    sb->summary_valid = ret == 0;
+    return ret;
+}
+
+/**
+ * 统计inode位图中的空闲inode（上次没有正常卸载时，超级块中的计数不可信）
+ */
+void count_free_inodes() {
+    long used = 0;
+    for (long i=0; i<(sb->num_inodes + 7) / 8; i++) {
+        used += __builtin_popcount(inode_bitmap[i]);
+    }
+    sb->free_inodes = sb->num_inodes - used;
+}
+
+/**
+ * 将文件系统标记为正常卸载（卸载或离线工具退出、全部修改写回之后调用）
+ * 先保存空闲空间摘要，再写回带有空闲计数的超级块并置clean，下次挂载时不必重新统计
+ * @return 成功返回0，失败返回负的错误码
+ */
+int mark_fs_clean() {
+    save_free_extents();
+    sb->clean = 1;
+    write_sb();
+    return bdev_flush();
+}
+
+/**
+ * 从虚拟磁盘读取inode位图和数据块位图到内存（挂载时调用），并建立空闲空间索引、得到空闲inode数
+ * 此后位图的查询和分配都在内存中完成，修改位图时只写回被修改的位图块
+ * @return 成功返回0，内存不足或清除clean标记后刷新设备失败返回-1
+ */
+int load_bitmaps() {
+    free(inode_bitmap);
+    free(data_bitmap);
+    inode_bitmap = (uint8_t*)malloc(sb->inodebitmap_size * sb->block_size);
+    data_bitmap = (uint8_t*)malloc(sb->databitmap_size * sb->block_size);
+    if (inode_bitmap == NULL || data_bitmap == NULL) {
+        return -1;
+    }
+    bdev_read_blocks(sb->first_blk_of_inodebitmap, sb->inodebitmap_size, inode_bitmap); // 读取inode位图
+    bdev_read_blocks(sb->first_blk_of_databitmap, sb->databitmap_size, data_bitmap);    // 读取数据块位图
+    if (!sb->clean) {
+        count_free_inodes(); // 上次没有正常卸载，重新统计空闲inode（空闲数据块随空闲空间索引重新统计）
+    }
+    load_free_extents();
+    if (sb->clean) {
+        // 从现在到正常卸载之前，磁盘上的空闲计数和摘要都可能与位图不一致
+        // 必须在第一次分配之前落盘，否则崩溃后下次挂载仍会信任过时的计数和摘要，分配出已使用的块
+        sb->clean = 0;
+        sb->summary_valid = 0;
+        write_sb();
+        if (bdev_flush() != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 将位图中第row个字节所在的位图块写回磁盘
+ * @param bitmap    内存中的位图
+ * @param first_blk 该位图区在虚拟磁盘中的起始块号
+ * @param row       被修改的位图字节下标
+ */
+void write_bitmap_block(uint8_t* bitmap, long first_blk, long row) {
+    long i = row / sb->block_size;
+    bdev_write_blocks(first_blk + i, 1, bitmap + i * sb->block_size);
+    mark_block_dirty(first_blk + i);
+}
 
 /**
  * 利用inode位图判断该inode号是否已使用
  * @param ino 需要判断的inode号
  */
-int inode_is_used(short int ino) {
-    // inode位图
-    uint8_t inode_bitmap[NUM_INODE_BITMAP_BLOCK * BLOCK_SIZE] = {0};
-    fseek(fs, sb->first_blk_of_inodebitmap * BLOCK_SIZE, SEEK_SET);
-    fread(inode_bitmap, sizeof(inode_bitmap), 1, fs); // 读取inode位图
-    short int row = ino >> 3; // 位图的行
-    short int col = ino % 8; // 位图的列（在0~7之间）
+int inode_is_used(int ino) {
+    if (ino < 0 || ino >= sb->num_inodes) {
+        return 0;
+    }
+    int row = ino >> 3; // 位图的行
+    int col = ino % 8;  // 位图的列（在0~7之间）
     uint8_t byte = inode_bitmap[row];
     // 根据bitmap判断该inode号是否已使用
-    // 如: byte = 10100100, col = 4 = 00000100
-    // byte & col = 00000100 != 0 可用于判断inode是否存在
+    // 如: byte = 10100100, col = 5，byte右移(7-5)位后最低位为1，表示该inode已使用
     if (((byte >> (7 - col)) & 1) != 0) {
         // 该inode已使用
         return 1;
@@ -41,60 +223,53 @@ int inode_is_used(short int ino) {
  * 利用数据块位图判断对应数据块是否已使用
  * @param data_block_no 需要判断的数据块号
  */
-int data_block_is_used(short int data_block_no) {
-    // 数据块位图
-    uint8_t data_block_bitmap[4 * BLOCK_SIZE] = {0};
-    fseek(fs, sb->first_blk_of_databitmap * BLOCK_SIZE, SEEK_SET);
-    fread(data_block_bitmap, sizeof(data_block_bitmap), 1, fs); // 读取数据块位图
-    short int row = data_block_no >> 3; // 位图的行
-    short int col = data_block_no % 8; // 位图的列（在0~7之间）
-    uint8_t byte = data_block_bitmap[row];
+int data_block_is_used(int data_block_no) {
+    if (data_block_no < 0 || data_block_no >= sb->datasize) {
+        return 0;
+    }
+    int row = data_block_no >> 3; // 位图的行
+    int col = data_block_no % 8;  // 位图的列（在0~7之间）
+    uint8_t byte = data_bitmap[row];
     // 根据bitmap判断该数据块是否已使用
-    // 如: byte = 10100100, col = 4 = 00000100
-    // byte & col = 00000100 != 0 可用于判断inode是否存在
     if (((byte >> (7 - col)) & 1) != 0) {
-        // 该inode已使用
+        // 该数据块已使用
         return 1;
     }
-    // 该inode未使用
+    // 该数据块未使用
     return 0;
 }
 
 // 设置inode号对应bitmap为1表示已使用该inode
-int set_inode_bitmap_used(short int ino) {
-    // 读取inode位图
-    uint8_t inode_bitmap[NUM_INODE_BITMAP_BLOCK * BLOCK_SIZE] = {0};
-    fseek(fs, sb->first_blk_of_inodebitmap * BLOCK_SIZE, SEEK_SET);
-    fread(inode_bitmap, sizeof(inode_bitmap), 1, fs);
+int set_inode_bitmap_used(int ino) {
     // 定位位图的行和列
-    short int row = ino >> 3; // 位图的行
-    short int col = ino % 8; // 位图的列（在0~7之间）
+    int row = ino >> 3; // 位图的行
+    int col = ino % 8;  // 位图的列（在0~7之间）
     // inode号对应位置设为1（或一个1）
     uint8_t byte = 1 << (7 - col);
+    if (!(inode_bitmap[row] & byte)) {
+        sb->free_inodes--;
+    }
     inode_bitmap[row] |= byte;
     // 写回磁盘
-    fseek(fs, sb->first_blk_of_inodebitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(inode_bitmap, sizeof(inode_bitmap), 1, fs);
-    printf("[set_inode_bitmap_used] ino=%d\n", ino);
+    write_bitmap_block(inode_bitmap, sb->first_blk_of_inodebitmap, row);
+    TRACE(DEBUG, "ino=%ld", ino);
     return 0;
 }
 
 // 设置数据块号对应bitmap为1表示已使用该数据块
-int set_datablock_bitmap_used(short int data_block_no) {
-    // 读取数据块位图
-    uint8_t data_block_bitmap[NUM_DATA_BITMAP_BLOCK * BLOCK_SIZE] = {0};
-    fseek(fs, sb->first_blk_of_databitmap * BLOCK_SIZE, SEEK_SET);
-    fread(data_block_bitmap, sizeof(data_block_bitmap), 1, fs);
+int set_datablock_bitmap_used(int data_block_no) {
     // 定位位图的行和列
-    short int row = data_block_no >> 3; // 位图的行
-    short int col = data_block_no % 8; // 位图的列（在0~7之间）
+    int row = data_block_no >> 3; // 位图的行
+    int col = data_block_no % 8;  // 位图的列（在0~7之间）
     // 数据块号对应位置设为1（或一个1）
     uint8_t byte = 1 << (7 - col);
-    data_block_bitmap[row] |= byte;
+    if (!(data_bitmap[row] & byte)) {
+        free_extent_take(data_block_no, 1); // 同步更新空闲空间索引
+    }
+    data_bitmap[row] |= byte;
     // 写回磁盘
-    fseek(fs, sb->first_blk_of_databitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(data_block_bitmap, sizeof(data_block_bitmap), 1, fs);
-    printf("[set_datablock_bitmap_used] datablock_no=%d\n", data_block_no);
+    write_bitmap_block(data_bitmap, sb->first_blk_of_databitmap, row);
+    TRACE(DEBUG, "datablock_no=%ld", data_block_no);
     return 0;
 }
 
@@ -103,139 +278,503 @@ int set_datablock_bitmap_used(short int data_block_no) {
  * 若没有空闲inode则*ino=-1
  * @param ino 获取了空闲可用的索引节点后，将其inode号赋值给该参数ino
 */
-int get_free_ino(short int* ino) {
-    // 读取bitmap
-    uint8_t inode_bitmap[NUM_INODE_BITMAP_BLOCK * BLOCK_SIZE] = {0};
-    fseek(fs, sb->first_blk_of_inodebitmap * BLOCK_SIZE, SEEK_SET);
-    fread(inode_bitmap, sizeof(inode_bitmap), 1, fs);
-    // inode bitmap占1个block（512B）
-    int num_inodes = NUM_INODE_BITMAP_BLOCK * BLOCK_SIZE * 8;
-    int rows = num_inodes / 8;
-    for (int i=0; i<rows; i++) {
+int get_free_ino(int* ino) {
+    if (sb->free_inodes <= 0) {
+        *ino = -1; // 按计数已没有空闲inode，不必扫描位图
+        return -1;
+    }
+    long rows = (sb->num_inodes + 7) / 8;
+    for (long i=0; i<rows; i++) {
         uint8_t byte = inode_bitmap[i];
         if (byte != 0xFF) {
             // byte不是全1，该行有空闲inode
             for (int j=7; j>=0; j--) {
                 if (((byte >> j) & 1) == 0) {
+                    if (i * 8 + (7 - j) >= sb->num_inodes) {
+                        break; // 超出inode总数
+                    }
                     // 有空闲inode
                     *ino = i * 8 + (7 - j);
-                    printf("[get_free_ino] alloc ino=%d\n", *ino);
+                    TRACE(DEBUG, "alloc ino=%ld", *ino);
+                    stats_count(STAT_ALLOC_SCANS, i + 1);
                     return 0;
                 }
             }
-            
         }
     }
     // 未找到空闲inode
+    stats_count(STAT_ALLOC_SCANS, rows);
     *ino = -1;
     return -1;
 }
 
 /**
- * 获取空闲的数据块号
+ * 获取空闲的数据块号（数据块号最小的空闲块，由空闲空间索引查找）
  * 未找到空闲数据块则*datablock_no=-1
  * @param datablock_no 获取了空闲可用的数据块后，将其数据块号赋值给该参数
  */
-int get_free_datablock_no(short int* datablock_no) {
-    // 读取bitmap
-    uint8_t data_block_bitmap[NUM_DATA_BITMAP_BLOCK * BLOCK_SIZE] = {0};
-    fseek(fs, sb->first_blk_of_databitmap * BLOCK_SIZE, SEEK_SET);
-    fread(data_block_bitmap, sizeof(data_block_bitmap), 1, fs);
-    // 数据块bitmap占4个block（4*512B=2048B）
-    int num_datablocks = NUM_DATA_BITMAP_BLOCK * BLOCK_SIZE * 8;
-    int rows = num_datablocks / 8;
-    for (int i=0; i<rows; i++) {
-        uint8_t byte = data_block_bitmap[i];
-        if (byte != 0xFF) {
-            // byte不是全1，该行有空闲数据块
-            for (int j=7; j>=0; j--) {
-                if (((byte >> j) & 1) == 0) {
-                    // 有空闲数据块
-                    *datablock_no = i * 8 + (7 - j);
-                    printf("[get_free_datablock_no] alloc datablock_no=%d\n", *datablock_no);
-                    return 0;
-                }
-            }
+int get_free_datablock_no(int* datablock_no) {
+    if (sb->free_blocks <= 0 || free_extent_near(0, datablock_no) != 0) {
+        // 未找到空闲数据块
+        *datablock_no = -1;
+        return -1;
+    }
+    TRACE(DEBUG, "alloc datablock_no=%ld", *datablock_no);
+    return 0;
+}
+
+/**
+ * 从数据块号goal开始向后寻找空闲数据块（到达数据区末尾后从头继续）
+ * 用于让文件的数据块尽量连续，goal通常为文件上一个数据块的下一块
+ * @param goal         期望的数据块号
+ * @param datablock_no 获取了空闲可用的数据块后，将其数据块号赋值给该参数
+ */
+int get_free_datablock_near(int goal, int* datablock_no) {
+    if (goal < 0 || goal >= sb->datasize || free_extent_near(goal, datablock_no) != 0) {
+        return get_free_datablock_no(datablock_no);
+    }
+    TRACE(DEBUG, "goal=%ld alloc datablock_no=%ld", goal, *datablock_no);
+    return 0;
+}
+
+/************************/
+/* 数据块引用计数表相关函数 */
+
+struct ref_entry* reftable = NULL; // 内存中的数据块引用计数表（每个数据块一项），没有引用计数表时为NULL
+uint8_t* reftable_dirty = NULL;    // 引用计数表中被修改、尚未写回的块（每块一个标记）
+int* fp_buckets = NULL;            // 指纹索引：指纹散列到桶，桶内的数据块通过fp_next串成链表（-1表示链表结束）
+int* fp_next = NULL;
+long fp_nbuckets = 0;              // 指纹索引的桶数（2的幂）
+
+// 引用计数表一个块可存放的项数
+#define REFS_PER_BLOCK (sb->block_size / sizeof(struct ref_entry))
+
+// 指纹所在的桶
+int* fp_bucket(uint32_t fingerprint) {
+    return &fp_buckets[fingerprint & (fp_nbuckets - 1)];
+}
+
+// 将数据块加入其指纹所在桶的链表
+void fp_link(int datablock_no) {
+    int* head = fp_bucket(reftable[datablock_no].fingerprint);
+    fp_next[datablock_no] = *head;
+    *head = datablock_no;
+}
+
+// 将数据块从其指纹所在桶的链表中移除
+void fp_unlink(int datablock_no) {
+    int* p = fp_bucket(reftable[datablock_no].fingerprint);
+    while (*p >= 0 && *p != datablock_no) {
+        p = &fp_next[*p];
+    }
+    if (*p == datablock_no) {
+        *p = fp_next[datablock_no];
+    }
+}
+
+// 标记引用计数表中数据块对应的项被修改
+void mark_reftable_dirty(int datablock_no) {
+    reftable_dirty[datablock_no / REFS_PER_BLOCK] = 1;
+}
+
+/**
+ * 从虚拟磁盘读取数据块引用计数表，并根据其中的指纹建立指纹索引（挂载时调用）
+ * @return 成功返回0，内存不足返回-1
+ */
+int load_reftable() {
+    free(reftable);
+    free(reftable_dirty);
+    free(fp_buckets);
+    free(fp_next);
+    reftable = NULL;
+    reftable_dirty = NULL;
+    fp_buckets = NULL;
+    fp_next = NULL;
+    if (sb->reftable_size == 0) {
+        return 0;
+    }
+    reftable = (struct ref_entry*)malloc(sb->reftable_size * sb->block_size);
+    reftable_dirty = (uint8_t*)calloc(sb->reftable_size, 1);
+    for (fp_nbuckets = 1; fp_nbuckets < sb->datasize; fp_nbuckets <<= 1);
+    fp_buckets = (int*)malloc(fp_nbuckets * sizeof(int));
+    fp_next = (int*)malloc(sb->datasize * sizeof(int));
+    if (reftable == NULL || reftable_dirty == NULL || fp_buckets == NULL || fp_next == NULL) {
+        return -1;
+    }
+    bdev_read_blocks(sb->first_blk_of_reftable, sb->reftable_size, reftable);
+    memset(fp_buckets, -1, fp_nbuckets * sizeof(int));
+    for (long no=0; no<sb->datasize; no++) {
+        if (reftable[no].fingerprint != 0 && data_block_is_used(no)) {
+            fp_link(no);
         }
     }
-    // 未找到空闲数据块
-    *datablock_no = -1;
-    return -1;
+    return 0;
+}
+
+/**
+ * 将引用计数表中被修改的块写回虚拟磁盘
+ * 引用数的修改在每次操作结束时写回；只修改了指纹时可以延后（指纹只是提示，丢失时只会少共享一些块）
+ */
+void write_reftable() {
+    if (reftable == NULL) {
+        return;
+    }
+    for (long i=0; i<sb->reftable_size; i++) {
+        if (!reftable_dirty[i]) {
+            continue;
+        }
+        bdev_write_blocks(sb->first_blk_of_reftable + i, 1, (char*)reftable + i * sb->block_size);
+        mark_block_dirty(sb->first_blk_of_reftable + i);
+        reftable_dirty[i] = 0;
+    }
+}
+
+// 判断数据块是否被多个逻辑块共享（写入前需要复制）
+int block_is_shared(int datablock_no) {
+    return reftable != NULL && datablock_no >= 0 && reftable[datablock_no].shares > 0;
+}
+
+// 增加数据块的一个引用（由调用者写回引用计数表）
+void share_datablock(int datablock_no) {
+    reftable[datablock_no].shares++;
+    mark_reftable_dirty(datablock_no);
+}
+
+/**
+ * 释放数据块的一个引用：块被共享时只减少引用数并返回1，此时数据块仍在使用，不能在位图中释放
+ * 块不再被共享时返回0，同时清除其指纹（由调用者在位图中释放该块）
+ */
+int release_datablock_ref(int datablock_no) {
+    if (reftable == NULL) {
+        return 0;
+    }
+    struct ref_entry* ref = &reftable[datablock_no];
+    if (ref->shares > 0) {
+        ref->shares--;
+        mark_reftable_dirty(datablock_no);
+        return 1;
+    }
+    if (ref->fingerprint != 0) {
+        fp_unlink(datablock_no);
+        ref->fingerprint = 0;
+        mark_reftable_dirty(datablock_no);
+    }
+    return 0;
+}
+
+// 清除数据块的指纹（块的内容将被原地修改）
+void forget_fingerprint(int datablock_no) {
+    if (reftable != NULL && reftable[datablock_no].fingerprint != 0) {
+        fp_unlink(datablock_no);
+        reftable[datablock_no].fingerprint = 0;
+        mark_reftable_dirty(datablock_no);
+    }
+}
+
+// 记录数据块内容的指纹
+void set_fingerprint(int datablock_no, uint32_t fingerprint) {
+    if (reftable[datablock_no].fingerprint == fingerprint) {
+        return;
+    }
+    forget_fingerprint(datablock_no);
+    reftable[datablock_no].fingerprint = fingerprint;
+    mark_reftable_dirty(datablock_no);
+    fp_link(datablock_no);
 }
 
+/**
+ * 计算块内容的指纹（按8字节乘法散列，非0）
+ */
+uint32_t block_fingerprint(const char* data) {
+    const uint64_t* words = (const uint64_t*)data;
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    for (long i=0; i<sb->block_size / 8; i++) {
+        h = (h ^ words[i]) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    return (uint32_t)(h ^ (h >> 29)) | 1;
+}
+
+/* 以上是数据块引用计数表相关函数 */
+
 /**
  * 设置bitmap中inode号为空闲（释放inode）
  * @param ino 需要设置为空闲的inode号
 */
-int set_free_inode_bitmap(short int ino) {
-    // 读取inode位图
-    uint8_t inode_bitmap[NUM_INODE_BITMAP_BLOCK * BLOCK_SIZE] = {0};
-    fseek(fs, sb->first_blk_of_inodebitmap * BLOCK_SIZE, SEEK_SET);
-    fread(inode_bitmap, sizeof(inode_bitmap), 1, fs);
+int set_free_inode_bitmap(int ino) {
     // bitmap定位
     int row = ino >> 3;
     int col = ino % 8;
     // 将对应号设置为0（与一个0）
-    uint8_t byte = inode_bitmap[row];
     uint8_t mask = 0b11111111 - (1 << (7 - col));
-    inode_bitmap[row] = byte & mask;
+    if (inode_bitmap[row] & ~mask) {
+        sb->free_inodes++;
+    }
+    inode_bitmap[row] &= mask;
     // 写回磁盘
-    fseek(fs, sb->first_blk_of_inodebitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(inode_bitmap, sizeof(inode_bitmap), 1, fs);
-    printf("[set_free_inode_bitmap] ino=%d\n", ino);
+    write_bitmap_block(inode_bitmap, sb->first_blk_of_inodebitmap, row);
+    TRACE(DEBUG, "ino=%ld", ino);
     return 0;
 }
 
 /**
  * 设置bitmap中数据块号为空闲（释放数据块）
+ * 被共享的数据块只释放一个引用
  * @param datablock_no 需要设置为空闲的数据块号
 */
-int set_free_datablock_bitmap(short int datablock_no) {
-    // 读取数据位图
-    uint8_t data_block_bitmap[NUM_DATA_BITMAP_BLOCK * BLOCK_SIZE] = {0};
-    fseek(fs, sb->first_blk_of_databitmap * BLOCK_SIZE, SEEK_SET);
-    fread(data_block_bitmap, sizeof(data_block_bitmap), 1, fs);
+int set_free_datablock_bitmap(int datablock_no) {
+    if (release_datablock_ref(datablock_no)) {
+        write_reftable();
+        return 0;
+    }
     // bitmap定位
     int row = datablock_no >> 3;
     int col = datablock_no % 8;
     // 将对应号设置为0（与一个0）
-    uint8_t byte = data_block_bitmap[row];
     uint8_t mask = 0b11111111 - (1 << (7 - col));
-    data_block_bitmap[row] = byte & mask;
+    if (data_bitmap[row] & ~mask) {
+        free_extent_add(datablock_no, 1); // 同步更新空闲空间索引
+    }
+    data_bitmap[row] &= mask;
     // 写回磁盘
-    fseek(fs, sb->first_blk_of_databitmap * BLOCK_SIZE, SEEK_SET);
-    fwrite(data_block_bitmap, sizeof(data_block_bitmap), 1, fs);
-    printf("[set_free_datablock_bitmap] datablock_no=%d\n", datablock_no);
+    write_bitmap_block(data_bitmap, sb->first_blk_of_databitmap, row);
+    TRACE(DEBUG, "datablock_no=%ld", datablock_no);
+    return 0;
+}
+
+/**
+ * 丢弃块设备上的一段块（映像文件中打洞，内存虚拟磁盘归还内存），之后读取这些块得到全0，且不占用宿主机空间
+ * @param blk 虚拟磁盘的绝对块号
+ * @param len 块数
+ * @return 成功返回0，宿主机文件系统不支持时返回-1
+ */
+int punch_host_range(long blk, long len) {
+    if (len <= 0) {
+        return 0;
+    }
+    if (bdev_discard_blocks(blk, len) != 0) {
+        return -1;
+    }
+    for (long i=0; i<len; i++) {
+        mark_block_dirty(blk + i);
+    }
+    return 0;
+}
+
+/**
+ * 批量修改数据块位图：先只修改内存中的位图，提交时每个被修改的位图块只写回一次
+ * 用于一次释放或分配大量数据块（truncate、fallocate、删除文件等），避免逐块写回位图
+ * 释放的数据块区间在提交时交给宿主机打洞，稀疏的映像文件随之缩小
+ */
+struct bitmap_batch {
+    uint8_t* touched; // 被修改的位图块（每个位图块一个标记）
+    long count;       // 修改的数据块数
+    long* freed;      // 释放的数据块区间（起始块号，块数）
+    int n, cap;       // 释放区间数目与容量
+};
+
+void init_bitmap_batch(struct bitmap_batch* batch) {
+    batch->touched = (uint8_t*)calloc(sb->databitmap_size, 1);
+    batch->count = 0;
+    batch->freed = NULL;
+    batch->n = batch->cap = 0;
+}
+
+// 记录释放的数据块区间，与上一个区间相接时合并
+void batch_add_freed(struct bitmap_batch* batch, long datablock_no, long len) {
+    if (batch->n > 0 && batch->freed[2 * batch->n - 2] + batch->freed[2 * batch->n - 1] == datablock_no) {
+        batch->freed[2 * batch->n - 1] += len;
+        return;
+    }
+    if (batch->n == batch->cap) {
+        batch->cap = batch->cap == 0 ? 16 : batch->cap * 2;
+        batch->freed = (long*)realloc(batch->freed, batch->cap * 2 * sizeof(long));
+    }
+    batch->freed[2 * batch->n] = datablock_no;
+    batch->freed[2 * batch->n + 1] = len;
+    batch->n++;
+}
+
+/**
+ * 在内存位图中将从datablock_no开始的len个数据块标记为已使用或空闲
+ * 释放被共享的数据块时只释放一个引用（仍计入count，表示调用者不再引用该块）
+ * @param used 非0表示标记为已使用，0表示释放
+ */
+void batch_set_datablocks(struct bitmap_batch* batch, int datablock_no, long len, int used) {
+    long run = 0, run_end = 0; // 位图中状态改变的连续块[run_end - run, run_end)，合并后同步到空闲空间索引
+    for (long no=datablock_no; no<datablock_no + len; no++) {
+        if (no < 0 || no >= sb->datasize) {
+            continue;
+        }
+        if (!used && release_datablock_ref(no)) {
+            batch->count++;
+            continue;
+        }
+        uint8_t byte = 1 << (7 - no % 8);
+        if (((data_bitmap[no >> 3] & byte) != 0) != (used != 0)) {
+            if (run > 0 && no != run_end) {
+                (used ? free_extent_take : free_extent_add)(run_end - run, run);
+                run = 0;
+            }
+            run++;
+            run_end = no + 1;
+        }
+        if (used) {
+            data_bitmap[no >> 3] |= byte;
+        } else {
+            data_bitmap[no >> 3] &= ~byte;
+        }
+        batch->touched[(no >> 3) / sb->block_size] = 1;
+        batch->count++;
+        if (!used) {
+            batch_add_freed(batch, no, 1);
+        }
+    }
+    if (run > 0) {
+        (used ? free_extent_take : free_extent_add)(run_end - run, run);
+    }
+}
+
+// 写回被修改的位图块（和引用计数表），在宿主机映像中为释放的数据块打洞，并释放批量修改的状态
+void commit_bitmap_batch(struct bitmap_batch* batch) {
+    for (long i=0; i<sb->databitmap_size; i++) {
+        if (batch->touched[i]) {
+            write_bitmap_block(data_bitmap, sb->first_blk_of_databitmap, i * sb->block_size);
+        }
+    }
+    write_reftable();
+    for (int i=0; i<batch->n; i++) {
+        // 释放后又被重新分配的块（如拆分extent时新分配的节点块）不能打洞
+        long start = batch->freed[2 * i], end = start + batch->freed[2 * i + 1];
+        while (start < end) {
+            while (start < end && data_block_is_used(start)) {
+                start++;
+            }
+            long run = start;
+            while (run < end && !data_block_is_used(run)) {
+                run++;
+            }
+            punch_host_range(sb->first_blk + start, run - start);
+            start = run;
+        }
+    }
+    TRACE(DEBUG, "%ld data blocks", batch->count);
+    free(batch->touched);
+    free(batch->freed);
+    batch->touched = NULL;
+    batch->freed = NULL;
+}
+
+// walk_inode_blocks的回调：将遍历到的块加入批量释放
+void free_block_visitor(int datablock_no, int level, void* arg) {
+    (void) level;
+    batch_set_datablocks((struct bitmap_batch*)arg, datablock_no, 1, 0);
+}
+
+/**
+ * 判断是否还有至少n个空闲数据块
+ */
+int has_free_datablocks(long n) {
+    return sb->free_blocks >= n;
+}
+
+/**
+ * 从goal开始寻找一段连续的空闲数据块（只查找，不标记为已使用）
+ * 返回找到的第一段空闲块，长度不超过want
+ * @param goal         期望的起始数据块号
+ * @param want         期望的块数
+ * @param datablock_no 返回起始数据块号
+ * @param len          返回连续空闲块数
+ */
+int get_free_datablock_run(int goal, long want, int* datablock_no, long* len) {
+    if (get_free_datablock_near(goal, datablock_no) != 0) {
+        return -1;
+    }
+    long n = 1;
+    while (n < want && *datablock_no + n < sb->datasize && !data_block_is_used(*datablock_no + n)) {
+        n++;
+    }
+    *len = n;
     return 0;
 }
 
+/**
+ * 从goal开始寻找至少want个连续的空闲数据块（到达数据区末尾后从头继续，只查找，不标记为已使用）
+ * 用于一次写入整个压缩簇
+ * @param datablock_no 返回起始数据块号
+ * @return 找到返回0，没有足够长的连续空闲块返回-1
+ */
+int get_free_datablock_span(int goal, long want, int* datablock_no) {
+    if (goal < 0 || goal >= sb->datasize) {
+        goal = 0;
+    }
+    if (free_extent_find(goal, want, datablock_no) == 0 || free_extent_find(0, want, datablock_no) == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+// 一个块可以存放的inode数目
+#define INODES_PER_BLOCK (sb->block_size / INODE_SIZE)
+
+// inode号所在的inode表块（虚拟磁盘的绝对块号）
+long inode_block_no(int ino) {
+    return sb->first_inode + ino / INODES_PER_BLOCK;
+}
+
+// inode号对应inode槽在虚拟磁盘中的字节偏移
+long inode_offset(int ino) {
+    return inode_block_no(ino) * sb->block_size + (ino % INODES_PER_BLOCK) * INODE_SIZE;
+}
+
 /**
  * 根据inode号读取inode
  * @param ino   需要读取的inode号
  * @param inode 从磁盘中读取inode后拷贝数据到该参数
  */
-int read_inode(short int ino, struct inode* inode) {
-    printf("[read_inode] ino=%d\n", ino);
-    if (ino < 0) {
+int read_inode(int ino, struct inode* inode) {
+    TRACE(DEBUG, "ino=%ld", ino);
+    if (ino < 0 || ino >= sb->num_inodes) {
         return -1;
     }
-    fseek(fs, (sb->first_inode + ino) * BLOCK_SIZE, SEEK_SET);
-    fread(inode, sizeof(struct inode), 1, fs); // 读取inode数据
+    bdev_read(inode, sizeof(struct inode), inode_offset(ino)); // 读取inode数据
+    stats_count(STAT_INODES_READ, 1);
     // 读取成功
     return 0;
 }
 
+/**
+ * 批量读取inode号连续的多个inode（用于扫描inode表）
+ * inode紧密排列，一次顺序读取即可取得INODES_PER_BLOCK倍数目的inode
+ * @param ino    第一个inode号
+ * @param n      读取的inode数目
+ * @param inodes 存放读取结果的数组，至少n个元素
+ * @return 实际读取的inode数目
+ */
+long read_inodes(int ino, long n, struct inode* inodes) {
+    if (ino < 0 || ino >= sb->num_inodes) {
+        return 0;
+    }
+    n = MIN(n, sb->num_inodes - ino);
+    long size = bdev_read(inodes, n * sizeof(struct inode), inode_offset(ino));
+    n = size > 0 ? size / (long)sizeof(struct inode) : 0;
+    stats_count(STAT_INODES_READ, n);
+    return n;
+}
+
 /** 根据数据块号读取数据块
  * @param data_block_no 需要读取的数据块号
  * @param data_block    从磁盘中读取数据块后拷贝数据到该参数
  */
-int read_data_block(short int data_block_no, struct data_block* data_block) {
-    printf("[read_data_block] data_block_no=%d\n", data_block_no);
-    if (data_block_no < 0) {
+int read_data_block(int data_block_no, struct data_block* data_block) {
+    TRACE(DEBUG, "data_block_no=%ld", data_block_no);
+    if (data_block_no < 0 || data_block_no >= sb->datasize) {
         return -1;
     }
-    fseek(fs, (sb->first_blk + data_block_no) * BLOCK_SIZE, SEEK_SET);
-    fread(data_block, sizeof(struct data_block), 1, fs);
+    uint64_t start = stats_now();
+    bdev_read_blocks(sb->first_blk + data_block_no, 1, data_block->data);
+    stats_record(STAT_BLOCK_READ, start);
+    stats_count(STAT_BLOCKS_READ, 1);
     // 读取成功
     return 0;
 }
@@ -245,10 +784,11 @@ int read_data_block(short int data_block_no, struct data_block* data_block) {
  * @param ino   需要写入磁盘的inode号
  * @param inode 索引节点指针，存放了写入磁盘的inode属性
 */
-int write_inode(short int ino, struct inode* inode) {
-    printf("[write_inode] ino=%d\n", ino);
-    fseek(fs, (sb->first_inode + ino) * BLOCK_SIZE, SEEK_SET);
-    fwrite(inode, sizeof(struct inode), 1, fs);
+int write_inode(int ino, struct inode* inode) {
+    TRACE(DEBUG, "ino=%ld", ino);
+    bdev_write(inode, sizeof(struct inode), inode_offset(ino));
+    stats_count(STAT_INODES_WRITTEN, 1);
+    mark_block_dirty(inode_block_no(ino));
     return 0;
 }
 
@@ -257,221 +797,609 @@ int write_inode(short int ino, struct inode* inode) {
  * @param data_block_no 需要写入磁盘的数据块号
  * @param data_block    数据块指针，存放了写入磁盘的数据
 */
-int write_data_block(short int data_block_no, struct data_block* data_block) {
-    printf("[write_data_block] datablock_no=%d\n", data_block_no);
-    fseek(fs, (sb->first_blk + data_block_no) * BLOCK_SIZE, SEEK_SET);
-    fwrite(data_block, sizeof(struct data_block), 1, fs);
+int write_data_block(int data_block_no, struct data_block* data_block) {
+    TRACE(DEBUG, "datablock_no=%ld", data_block_no);
+    uint64_t start = stats_now();
+    bdev_write_blocks(sb->first_blk + data_block_no, 1, data_block->data);
+    stats_record(STAT_BLOCK_WRITE, start);
+    stats_count(STAT_BLOCKS_WRITTEN, 1);
+    mark_block_dirty(sb->first_blk + data_block_no);
     return 0;
 }
 
 /**
- * 判断一个数据块有无可用entry，有则返回1，没有则返回0
- * 用于判断一个目录中的数据块有无存放目录项，没有则进行释放
- * @param datablock_no 需要判断有无可用entry的数据库号
-*/
-int datablock_has_entry(short int datablock_no) {
-    struct data_block* datablock = (struct data_block*)malloc(sizeof(struct data_block));
-    read_data_block(datablock_no, datablock);
-    int read_size = BLOCK_SIZE;
-    struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
-    int k = 0; // 下一个待读取的entry下标
-    // 遍历整个数据块取出每个entry
-    while (read_size > 0) {
-        memcpy(entry, datablock->data + k*sizeof(struct entry), sizeof(struct entry));
-        if (entry->type != UNUSED) {
-            // 存在可用entry
-            return 1;
-        }
-        k++;
-        read_size -= sizeof(struct entry);
+ * 获取一个空闲数据块并标记为已使用
+ * @param datablock_no 返回分配的数据块号
+ */
+int new_datablock(int* datablock_no) {
+    if (get_free_datablock_no(datablock_no) != 0) {
+        return -1; // 没有空闲数据块
     }
-    // 不存在可用entry
+    set_datablock_bitmap_used(*datablock_no);
     return 0;
 }
 
 /**
- * 为inode分配一个新的数据块（会自动寻找空闲数据块）
- * @param inode        需要添加新数据块的inode指针
- * @param datablock_no 返回的空闲数据块号
-*/
-int alloc_datablock(struct inode* inode, short int* datablock_no) {
-    get_free_datablock_no(datablock_no); // 获取空闲数据块进行返回
-    // 将该数据块加入到inode
-    if (inode->st_size == 0) {
-        // inode大小为空，在第一个addr指向新的数据块号
-        inode->addr[0] = *datablock_no;
-        set_datablock_bitmap_used(*datablock_no); // 设置其已被使用
-        return 0;
+ * 分配一个间接索引块，块内全部块号初始化为-1（未使用）
+ * @param datablock_no 返回分配的数据块号
+ */
+int new_index_block(int* datablock_no) {
+    if (new_datablock(datablock_no) != 0) {
+        return -1;
     }
-    int index = 0; // 索引级别
-    while (index <= 6) {
-        if (index <= 3) {
-            // 直接索引
-            if (!data_block_is_used(inode->addr[index])) {
-                inode->addr[index] = *datablock_no;
-                set_datablock_bitmap_used(*datablock_no);
-                return 0;
-            }
-        } else if (index == 4) {
-            // 一级间接索引
-            if (inode->addr[index] < 0) {
-                // 一级间接未使用，分配存储数据块号的数据块
-                short int* no = (short int*)malloc(sizeof(short int));
-                get_free_datablock_no(no); // 获取空闲数据块
-                inode->addr[index] = *no;
-                set_datablock_bitmap_used(*no); // 更新bitmap
-                // 读取存放数据块号的数据块
-                struct data_block* db = (struct data_block*)malloc(sizeof(struct data_block));
-                read_data_block(*no, db);
-                memset(db, -1, sizeof(struct data_block)); // 设置数据块为全是负数
-                memcpy(db, datablock_no, sizeof(short int)); // 第一个块号为分配的新数据块号
-                // 数据块写回磁盘
-                write_data_block(*no, db);
-                set_datablock_bitmap_used(*datablock_no); // 更新bitmap
-                return 0;
-            } else {
-                // 读取存放数据块号的数据块
-                struct data_block* db = (struct data_block*)malloc(sizeof(struct data_block));
-                read_data_block(inode->addr[index], db);
-                int k = 0;
-                while (k*sizeof(short int) < BLOCK_SIZE) {
-                    short int read_no;
-                    memcpy(&read_no, db + k*sizeof(short int), sizeof(short int));
-                    if (read_no < 0) {
-                        // 这一个数据块未使用，进行替换
-                        memcpy(db + k*sizeof(short int), datablock_no, sizeof(short int));
-                        set_datablock_bitmap_used(*datablock_no); // 更新bitmap已使用数据块
-                        // 写回数据块
-                        write_data_block(inode->addr[index], db);
-                        return 0;
-                    }
-                    k++;
-                }
-            }
-            // struct data_block* datablock = (struct data_block*)malloc(sizeof(struct data_block));
-        } else if (index == 5) {
-            // 二级间接索引
-            if (inode->addr[index] < 0) {
-                // 二级间接未使用，分配存储数据块号的数据块
-                short int* no1 = (short int*)malloc(sizeof(short int));
-                get_free_datablock_no(no1); // 获取空闲数据块
-                inode->addr[index] = *no1;
-                set_datablock_bitmap_used(*no1); // 更新bitmap
-                // 读取存放数据块号的数据块
-                struct data_block* db1 = (struct data_block*)malloc(sizeof(struct data_block));
-                read_data_block(*no1, db1);
-                memset(db1, -1, sizeof(struct data_block)); // 设置数据块为全是负数
-                short int* no2 = (short int*)malloc(sizeof(short int));
-                get_free_datablock_no(no2); // 获取空闲数据块
-                struct data_block* db2 = (struct data_block*)malloc(sizeof(struct data_block));
-                read_data_block(*no2, db2);
-                memset(db2, -1, sizeof(struct data_block)); // 设置数据块为全是负数
-                memcpy(db2, datablock_no, sizeof(short int)); // 第一个块号为分配的新数据块号
-                set_datablock_bitmap_used(*no2); // 更新bitmap
-                // 数据块写回磁盘
-                write_data_block(*no1, db1);
-                write_data_block(*no2, db2);
-                set_datablock_bitmap_used(*datablock_no); // 更新bitmap
-                return 0;
-            } else {
-                // 已使用二级间接
-                struct data_block* db1 = (struct data_block*)malloc(sizeof(struct data_block));
-                read_data_block(inode->addr[index], db1);
-                int k1 = 0;
-                while (k1*sizeof(short int) < BLOCK_SIZE) {
-                    short int no2;
-                    memcpy(&no2, db1 + k1*sizeof(short int), sizeof(short int));
-                    struct data_block* db2 = (struct data_block*)malloc(sizeof(struct data_block));
-                    read_data_block(no2, db2);
-                    int k2 = 0;
-                    while (k2*sizeof(short int) < BLOCK_SIZE) {
-                        short int read_no;
-                        memcpy(&read_no, db2 + k2*sizeof(short int), sizeof(short int));
-                        if (read_no < 0) {
-                            // 这一个数据块未使用，进行替换
-                            memcpy(db2 + k2*sizeof(short int), datablock_no, sizeof(short int));
-                            set_datablock_bitmap_used(*datablock_no); // 更新bitmap已使用数据块
-                            // 写回数据块
-                            write_data_block(no2, db2);
-                            write_data_block(inode->addr[index], db1);
-                            return 0;
-                        }
-                        k2++;
-                    }
-                }
-            }
-        } else if (index == 6) {
-            // 三级间接索引
-            if (inode->addr[index] < 0) {
-                // 三级间接未使用，分配存储数据块号的数据块
-                short int* no1 = (short int*)malloc(sizeof(short int));
-                get_free_datablock_no(no1); // 获取空闲数据块
-                inode->addr[index] = *no1;
-                set_datablock_bitmap_used(*no1); // 更新bitmap
-                // 读取存放数据块号的数据块
-                struct data_block* db1 = (struct data_block*)malloc(sizeof(struct data_block));
-                read_data_block(*no1, db1);
-                memset(db1, -1, sizeof(struct data_block)); // 设置数据块为全是负数
-                short int* no2 = (short int*)malloc(sizeof(short int));
-                get_free_datablock_no(no2); // 获取空闲数据块
-                struct data_block* db2 = (struct data_block*)malloc(sizeof(struct data_block));
-                read_data_block(*no2, db2);
-                memset(db2, -1, sizeof(struct data_block)); // 设置数据块为全是负数
-                memcpy(db2, datablock_no, sizeof(short int)); // 第一个块号为分配的新数据块号
-                set_datablock_bitmap_used(*no2); // 更新bitmap
-                short int* no3 = (short int*)malloc(sizeof(short int));
-                get_free_datablock_no(no3); // 获取空闲数据块
-                struct data_block* db3 = (struct data_block*)malloc(sizeof(struct data_block));
-                read_data_block(*no3, db3);
-                memset(db3, -1, sizeof(struct data_block)); // 设置数据块为全是负数
-                memcpy(db3, datablock_no, sizeof(short int)); // 第一个块号为分配的新数据块号
-                set_datablock_bitmap_used(*no3); // 更新bitmap
-                // 数据块写回磁盘
-                write_data_block(*no1, db1);
-                write_data_block(*no2, db2);
-                write_data_block(*no3, db3);
-                set_datablock_bitmap_used(*datablock_no); // 更新bitmap
-                return 0;
-            } else {
-                // 已使用三级间接
-                struct data_block* db1 = (struct data_block*)malloc(sizeof(struct data_block));
-                read_data_block(inode->addr[index], db1);
-                int k1 = 0;
-                while (k1*sizeof(short int) < BLOCK_SIZE) {
-                    short int no2;
-                    memcpy(&no2, db1 + k1*sizeof(short int), sizeof(short int));
-                    struct data_block* db2 = (struct data_block*)malloc(sizeof(struct data_block));
-                    read_data_block(no2, db2);
-                    int k2 = 0;
-                    while (k2*sizeof(short int) < BLOCK_SIZE) {
-                        short int no3;
-                        memcpy(&no3, db2 + k2*sizeof(short int), sizeof(short int));
-                        struct data_block* db3 = (struct data_block*)malloc(sizeof(struct data_block));
-                        read_data_block(no3, db3);
-                        int k3 = 0;
-                        while (k3*sizeof(short int) < BLOCK_SIZE) {
-                            short int read_no;
-                            memcpy(&read_no, db2 + k3*sizeof(short int), sizeof(short int));
-                            if (read_no < 0) {
-                                // 这一个数据块未使用，进行替换
-                                memcpy(db3 + k3*sizeof(short int), datablock_no, sizeof(short int));
-                                set_datablock_bitmap_used(*datablock_no); // 更新bitmap已使用数据块
-                                // 写回数据块
-                                write_data_block(no3, db3);
-                                write_data_block(no2, db2);
-                                write_data_block(inode->addr[index], db1);
-                                return 0;
-                            }
-                            k2++;
-                        }
-                    }
+    struct data_block* db = new_data_block();
+    memset(db->data, -1, sb->block_size); // 每个字节为0xFF，即每个块号为-1
+    write_data_block(*datablock_no, db);
+    free_data_block(db);
+    return 0;
+}
+
+/**
+ * 将从datablock_no开始的len个数据块清零（用于预分配的块，保证读出为0）
+ * 优先在宿主机映像中打洞，不支持时写入全0块
+ */
+void zero_datablocks(int datablock_no, long len) {
+    if (punch_host_range(sb->first_blk + datablock_no, len) == 0) {
+        return;
+    }
+    struct data_block* db = new_data_block();
+    memset(db->data, 0, sb->block_size);
+    for (long i=0; i<len; i++) {
+        write_data_block(datablock_no + i, db);
+    }
+    free_data_block(db);
+}
+
+/************************/
+/* extent树相关函数 */
+
+// 一个extent树节点块可存放的项数
+#define EXTENTS_PER_BLOCK ((sb->block_size - sizeof(struct extent_header)) / sizeof(struct extent))
+
+// 节点块中的extent数组
+#define BLOCK_EXTENTS(db) ((struct extent*)((db)->data + sizeof(struct extent_header)))
+
+// 压缩簇的大小（字节），簇至少包含4个逻辑块
+#define COMPRESS_CLUSTER_SIZE 32768
+#define CLUSTER_BLOCKS MAX(4, COMPRESS_CLUSTER_SIZE / sb->block_size)
+
+// extent覆盖的逻辑块数（压缩extent覆盖一个完整的簇）
+long extent_llen(struct extent* ext) {
+    return (ext->len & EXTENT_COMPRESSED) ? CLUSTER_BLOCKS : ext->len;
+}
+
+// extent占用的数据块数
+long extent_plen(struct extent* ext) {
+    return ext->len & ~EXTENT_COMPRESSED;
+}
+
+/**
+ * 为逻辑块lblk选择期望的数据块号：紧接在其前一个extent占用的数据块之后
+ * @param ext lblk之前最近的extent（len为0表示没有）
+ * @return 期望的数据块号，没有前一个extent时返回-1
+ */
+int extent_goal(struct extent* ext, long lblk) {
+    if (ext->len == 0) {
+        return -1;
+    }
+    return ext->pblk + extent_plen(ext) + (lblk - ext->lblk - extent_llen(ext));
+}
+
+/**
+ * 在节点中二分查找最后一个起始逻辑块号不大于lblk的项
+ * @return 项的下标，所有项的起始逻辑块号都大于lblk时返回-1
+ */
+int extent_search(struct extent_header* header, struct extent* extents, long lblk) {
+    int lo = 0, hi = header->entries - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (extents[mid].lblk <= lblk) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+/**
+ * 在extent树中查找逻辑块lblk所在的extent
+ * @param inode 使用extent映射的inode
+ * @param lblk  逻辑块号
+ * @param ext   返回包含lblk的extent；lblk未映射时返回它之前最近的extent（没有则len为0）
+ * @param next  不为NULL时返回lblk之后下一个extent的起始逻辑块号（没有则为LONG_MAX），用于跳过空洞
+ * @return lblk已映射返回0，否则返回-1
+ */
+int extent_find(struct inode* inode, long lblk, struct extent* ext, long* next) {
+    struct extent_header* header = &inode->ext_root.header;
+    struct extent* extents = inode->ext_root.extents;
+    struct data_block* db = NULL;
+    long bound = LONG_MAX; // 当前子树之后第一个逻辑块号
+    memset(ext, 0, sizeof(struct extent));
+    int i = extent_search(header, extents, lblk);
+    while (header->depth > 0) {
+        if (i < 0) {
+            i = 0; // lblk在整棵树的第一个extent之前
+        }
+        if (i + 1 < header->entries) {
+            bound = extents[i + 1].lblk;
+        }
+        if (db == NULL) {
+            db = new_data_block();
+        }
+        read_data_block(extents[i].pblk, db);
+        header = (struct extent_header*)db->data;
+        extents = BLOCK_EXTENTS(db);
+        if (header->magic != EXTENT_MAGIC) {
+            TRACE(ERROR, "bad extent node in ino=%ld", inode->st_ino);
+            free_data_block(db);
+            return -1;
+        }
+        i = extent_search(header, extents, lblk);
+    }
+    int ret = -1;
+    if (i >= 0) {
+        *ext = extents[i];
+        if (lblk < ext->lblk + extent_llen(ext)) {
+            ret = 0;
+        }
+    }
+    if (next != NULL) {
+        *next = i + 1 < header->entries ? extents[i + 1].lblk : bound;
+    }
+    if (db != NULL) {
+        free_data_block(db);
+    }
+    return ret;
+}
+
+/**
+ * 将节点写回：树根在inode中（由调用者写回inode），其余节点写回其数据块
+ */
+void write_extent_node(int node_no, struct data_block* db) {
+    if (node_no >= 0) {
+        write_data_block(node_no, db);
+    }
+}
+
+/**
+ * 在节点的pos处插入一项，节点已满时分裂
+ * 非根节点分裂为两个块，后一半移入新块，new_node返回指向新块的索引项
+ * 根节点（在inode中）已满时将全部项下移到新块，树根变为只有一项的索引节点，树高加一
+ * @return 未分裂返回0，分裂返回1，没有空闲数据块返回-1
+ */
+int extent_node_insert(struct inode* inode, struct extent_header* header, struct extent* extents,
+                       int node_no, struct data_block* node_db, int pos, struct extent* item,
+                       struct extent* new_node) {
+    if (header->entries < header->max) {
+        memmove(&extents[pos + 1], &extents[pos], (header->entries - pos) * sizeof(struct extent));
+        extents[pos] = *item;
+        header->entries++;
+        write_extent_node(node_no, node_db);
+        return 0;
+    }
+    int no;
+    if (new_datablock(&no) != 0) {
+        return -1;
+    }
+    inode->st_blocks++;
+    struct data_block* db = new_data_block();
+    memset(db->data, 0, sb->block_size);
+    struct extent_header* new_header = (struct extent_header*)db->data;
+    struct extent* new_extents = BLOCK_EXTENTS(db);
+    new_header->magic = EXTENT_MAGIC;
+    new_header->max = EXTENTS_PER_BLOCK;
+    new_header->depth = header->depth;
+    if (node_no < 0) {
+        // 树根下移：新块接收树根的全部项和新插入的项（块节点的容量远大于树根）
+        memcpy(new_extents, extents, pos * sizeof(struct extent));
+        new_extents[pos] = *item;
+        memcpy(&new_extents[pos + 1], &extents[pos], (header->entries - pos) * sizeof(struct extent));
+        new_header->entries = header->entries + 1;
+        write_data_block(no, db);
+        header->depth++;
+        header->entries = 1;
+        extents[0].lblk = new_extents[0].lblk;
+        extents[0].pblk = no;
+        extents[0].len = 0;
+        free_data_block(db);
+        return 0;
+    }
+    // 普通节点分裂：先在临时数组中完成插入，再前后各留一半
+    // 在末尾插入（顺序追加写）时只把新项移入新块，避免节点长期半满
+    int total = header->entries + 1;
+    struct extent* all = (struct extent*)malloc(total * sizeof(struct extent));
+    memcpy(all, extents, pos * sizeof(struct extent));
+    all[pos] = *item;
+    memcpy(&all[pos + 1], &extents[pos], (header->entries - pos) * sizeof(struct extent));
+    int left = pos == header->entries ? header->entries : total / 2;
+    memcpy(extents, all, left * sizeof(struct extent));
+    header->entries = left;
+    memcpy(new_extents, &all[left], (total - left) * sizeof(struct extent));
+    new_header->entries = total - left;
+    write_extent_node(node_no, node_db);
+    write_data_block(no, db);
+    new_node->lblk = new_extents[0].lblk;
+    new_node->pblk = no;
+    new_node->len = 0;
+    free(all);
+    free_data_block(db);
+    return 1;
+}
+
+/**
+ * 在子树中插入映射：从lblk开始的len个逻辑块依次存放在从pblk开始的数据块中
+ * 能与前一个extent在逻辑和物理上都相接时直接延长该extent（压缩extent不合并）
+ * 映射不能跨越子树的边界（由extent_insert拆分）
+ * @return 未分裂返回0，节点分裂返回1（new_node为需要插入到上一级的索引项），出错返回-1
+ */
+int extent_insert_node(struct inode* inode, struct extent_header* header, struct extent* extents,
+                       int node_no, struct data_block* node_db, long lblk, int pblk, int len,
+                       struct extent* new_node) {
+    int i = extent_search(header, extents, lblk);
+    if (header->depth == 0) {
+        if (i >= 0 && !((extents[i].len | len) & EXTENT_COMPRESSED) &&
+            extents[i].lblk + extents[i].len == lblk && extents[i].pblk + extents[i].len == pblk) {
+            extents[i].len += len;
+            write_extent_node(node_no, node_db);
+            return 0;
+        }
+        struct extent item = { (int)lblk, pblk, len };
+        return extent_node_insert(inode, header, extents, node_no, node_db, i + 1, &item, new_node);
+    }
+    if (i < 0) {
+        // 比树中全部逻辑块号都小，插入第一个子树并更新其索引
+        i = 0;
+        extents[0].lblk = lblk;
+        write_extent_node(node_no, node_db);
+    }
+    int child_no = extents[i].pblk;
+    struct data_block* db = new_data_block();
+    read_data_block(child_no, db);
+    struct extent child_split;
+    int ret = extent_insert_node(inode, (struct extent_header*)db->data, BLOCK_EXTENTS(db),
+                                 child_no, db, lblk, pblk, len, &child_split);
+    free_data_block(db);
+    if (ret == 1) {
+        ret = extent_node_insert(inode, header, extents, node_no, node_db, i + 1, &child_split, new_node);
+    }
+    return ret;
+}
+
+/**
+ * 在inode的extent树中记录映射：从lblk开始的len个逻辑块依次存放在从pblk开始的数据块中（这些逻辑块此前未映射）
+ * 一次插入只能落在一个叶子节点覆盖的区间内，跨越子树边界的映射按边界拆分为多次插入
+ * 树根被修改，由调用者负责写回inode
+ */
+int extent_insert(struct inode* inode, long lblk, int pblk, int len) {
+    while (len > 0) {
+        int n = len;
+        if (len > 1 && !(len & EXTENT_COMPRESSED)) {
+            struct extent ext;
+            long next = LONG_MAX; // lblk之后下一个extent或子树的起始逻辑块号
+            extent_find(inode, lblk, &ext, &next);
+            n = MIN(len, next - lblk);
+        }
+        struct extent new_node;
+        if (extent_insert_node(inode, &inode->ext_root.header, inode->ext_root.extents,
+                               -1, NULL, lblk, pblk, n, &new_node) < 0) {
+            return -1;
+        }
+        if (len & EXTENT_COMPRESSED) {
+            break;
+        }
+        lblk += n;
+        pblk += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * extent映射下的bmap：二分查找extent树，分配时优先选择紧接在前一个extent之后的数据块
+ * 压缩簇内的逻辑块没有对应的数据块，需通过read_cluster/write_cluster整簇读写，此时返回-1
+ * 参数与返回值同map_block
+ */
+int extent_bmap(struct inode* inode, long lblk, int create, int install, int* datablock_no) {
+    struct extent ext;
+    if (lblk > INT32_MAX) {
+        return -1; // 逻辑块号为32位
+    }
+    if (extent_find(inode, lblk, &ext, NULL) == 0) {
+        if (ext.len & EXTENT_COMPRESSED) {
+            return -1;
+        }
+        *datablock_no = ext.pblk + (lblk - ext.lblk);
+        return 0;
+    }
+    if (!create) {
+        return 0;
+    }
+    int goal = extent_goal(&ext, lblk); // 与前一个extent物理连续的位置
+    int no = install;
+    if (no < 0) {
+        if (get_free_datablock_near(goal, &no) != 0) {
+            return -1;
+        }
+        set_datablock_bitmap_used(no);
+    }
+    if (extent_insert(inode, lblk, no, 1) != 0) {
+        if (install < 0) {
+            set_free_datablock_bitmap(no); // 没有空闲块存放extent树节点
+        }
+        return -1;
+    }
+    inode->st_blocks++;
+    *datablock_no = no;
+    return 0;
+}
+
+/**
+ * 递归遍历extent树节点：叶子节点访问extent中的每个数据块，索引节点先访问子节点块再递归
+ * @param header  节点头
+ * @param extents 节点中的项
+ */
+void walk_extent_node(struct extent_header* header, struct extent* extents,
+                      void (*visit)(int datablock_no, int level, void* arg), void* arg) {
+    for (int i=0; i<header->entries; i++) {
+        if (header->depth == 0) {
+            for (int k=0; k<extent_plen(&extents[i]); k++) {
+                visit(extents[i].pblk + k, 0, arg);
+            }
+            continue;
+        }
+        int child_no = extents[i].pblk;
+        if (child_no < 0 || child_no >= sb->datasize) {
+            continue;
+        }
+        visit(child_no, header->depth, arg);
+        struct data_block* db = new_data_block();
+        read_data_block(child_no, db);
+        if (((struct extent_header*)db->data)->magic == EXTENT_MAGIC) {
+            walk_extent_node((struct extent_header*)db->data, BLOCK_EXTENTS(db), visit, arg);
+        }
+        free_data_block(db);
+    }
+}
+
+/**
+ * 释放子树中落在逻辑块区间[start, end)内的数据块，以及因此变空的节点块
+ * 跨越整个区间的extent截为前一段，后一段通过tail返回，由调用者重新插入
+ * @param batch 批量释放使用的位图修改
+ * @param tail  返回需要重新插入的后一段extent（len为0表示没有）
+ */
+void extent_punch_node(struct extent_header* header, struct extent* extents, int node_no,
+                       struct data_block* node_db, long start, long end,
+                       struct bitmap_batch* batch, struct extent* tail) {
+    int changed = 0;
+    int i = 0;
+    while (i < header->entries) {
+        struct extent* e = &extents[i];
+        if (header->depth == 0) {
+            long es = e->lblk, ee = (long)e->lblk + extent_llen(e);
+            if (ee <= start || es >= end) {
+                i++;
+                continue;
+            }
+            if (e->len & EXTENT_COMPRESSED) {
+                // 压缩簇只能整簇释放，部分落在区间内的簇由调用者先转为普通块（见punch_blocks）
+                if (start <= es && ee <= end) {
+                    batch_set_datablocks(batch, e->pblk, extent_plen(e), 0);
+                    memmove(e, e + 1, (header->entries - i - 1) * sizeof(struct extent));
+                    header->entries--;
+                    changed = 1;
+                    continue;
                 }
+                i++;
+                continue;
+            }
+            long cs = MAX(es, start), ce = MIN(ee, end); // 需要释放的部分
+            batch_set_datablocks(batch, e->pblk + (cs - es), ce - cs, 0);
+            changed = 1;
+            if (cs == es && ce == ee) {
+                // 整个extent被释放
+                memmove(e, e + 1, (header->entries - i - 1) * sizeof(struct extent));
+                header->entries--;
+                continue;
             }
+            if (cs == es) {
+                e->pblk += ce - es;
+                e->lblk = ce;
+                e->len = ee - ce;
+            } else if (ce == ee) {
+                e->len = cs - es;
+            } else {
+                tail->lblk = ce;
+                tail->pblk = e->pblk + (ce - es);
+                tail->len = ee - ce;
+                e->len = cs - es;
+            }
+            i++;
+            continue;
+        }
+        // 索引节点：子节点覆盖[e->lblk, 下一项的起始逻辑块号)
+        long cs = e->lblk, ce = i + 1 < header->entries ? extents[i + 1].lblk : LONG_MAX;
+        if (ce <= start || cs >= end) {
+            i++;
+            continue;
+        }
+        struct data_block* db = new_data_block();
+        read_data_block(e->pblk, db);
+        struct extent_header* child = (struct extent_header*)db->data;
+        if (start <= cs && ce <= end) {
+            // 整个子树都在区间内
+            walk_extent_node(child, BLOCK_EXTENTS(db), free_block_visitor, batch);
+            child->entries = 0;
+        } else {
+            extent_punch_node(child, BLOCK_EXTENTS(db), e->pblk, db, start, end, batch, tail);
+        }
+        int empty = child->entries == 0;
+        if (!empty && BLOCK_EXTENTS(db)[0].lblk != e->lblk) {
+            // 子树的第一个extent被截短或释放，索引项的起始逻辑块号随之后移
+            e->lblk = BLOCK_EXTENTS(db)[0].lblk;
+            changed = 1;
+        }
+        free_data_block(db);
+        if (empty) {
+            batch_set_datablocks(batch, e->pblk, 1, 0);
+            memmove(e, e + 1, (header->entries - i - 1) * sizeof(struct extent));
+            header->entries--;
+            changed = 1;
+            continue;
         }
-        index++;
+        i++;
+    }
+    if (changed) {
+        write_extent_node(node_no, node_db);
     }
-    printf("[alloc_datablock] datablock_no=%d\n", *datablock_no);
+}
 
+/**
+ * 释放extent树中落在逻辑块区间[start, end)内的数据块，树变矮时将唯一的子节点上移到树根
+ * @return 成功返回0，需要拆分extent但没有空闲块存放树节点时返回-1（此时不做任何修改）
+ */
+int extent_punch(struct inode* inode, long start, long end, struct bitmap_batch* batch) {
+    struct extent_header* root = &inode->ext_root.header;
+    if (end != LONG_MAX && !has_free_datablocks(root->depth + 1)) {
+        return -1; // 拆分extent时每层最多分裂一个节点
+    }
+    struct extent tail = { 0, 0, 0 };
+    extent_punch_node(root, inode->ext_root.extents, -1, NULL, start, end, batch, &tail);
+    if (root->entries == 0) {
+        root->depth = 0; // 树已空
+    }
+    while (root->depth > 0 && root->entries == 1) {
+        struct data_block* db = new_data_block();
+        int child_no = inode->ext_root.extents[0].pblk;
+        read_data_block(child_no, db);
+        struct extent_header* child = (struct extent_header*)db->data;
+        int fits = child->entries <= INLINE_EXTENTS;
+        if (fits) {
+            memcpy(inode->ext_root.extents, BLOCK_EXTENTS(db), child->entries * sizeof(struct extent));
+            root->entries = child->entries;
+            root->depth = child->depth;
+            batch_set_datablocks(batch, child_no, 1, 0);
+        }
+        free_data_block(db);
+        if (!fits) {
+            break;
+        }
+    }
+    if (tail.len > 0) {
+        return extent_insert(inode, tail.lblk, tail.pblk, tail.len);
+    }
+    return 0;
+}
+
+/* 以上是extent树相关函数 */
+
+/**
+ * 将文件内的逻辑块号映射为数据块号
+ * 逻辑块0~3由addr[0]-addr[3]直接索引，之后依次由addr[4]、addr[5]、addr[6]的一、二、三级间接索引覆盖
+ * 使用extent映射的inode（INODE_EXTENTS）改为查找extent树
+ * @param inode        文件的inode（分配时会修改addr，由调用者负责写回inode）
+ * @param lblk         逻辑块号（文件内第lblk个数据块）
+ * @param create       非0时为未分配的逻辑块分配数据块（包括所需的间接索引块）
+ * @param install      不小于0时未分配的逻辑块直接映射到这个已有的数据块，而不是分配新块
+ * @param datablock_no 返回对应的数据块号，未分配且create为0时为-1
+ * @return 成功返回0，逻辑块号超出索引范围或没有空闲数据块返回-1
+ */
+int map_block(struct inode* inode, long lblk, int create, int install, int* datablock_no) {
+    *datablock_no = -1;
+    if (lblk < 0) {
+        return -1;
+    }
+    if (inode->flags & INODE_INLINE) {
+        return create ? -1 : 0; // 内联数据没有数据块，需先转为块存储
+    }
+    if (inode->flags & INODE_EXTENTS) {
+        return extent_bmap(inode, lblk, create, install, datablock_no);
+    }
+    int level = 0;   // 间接索引级别（0为直接索引）
+    long span = 1;   // 下一级每个块号覆盖的逻辑块数
+    int* slot;       // inode中对应的地址
+    if (lblk < 4) {
+        slot = &inode->addr[lblk];
+    } else {
+        lblk -= 4;
+        level = 1;
+        span = 1;
+        // 找到lblk所属的间接索引级别，span为该级别顶层索引块中每个块号覆盖的逻辑块数
+        while (lblk >= span * NUM_PER_INDEX_BLOCK) {
+            lblk -= span * NUM_PER_INDEX_BLOCK;
+            span *= NUM_PER_INDEX_BLOCK;
+            if (++level > 3) {
+                return -1; // 超出三级间接索引范围
+            }
+        }
+        slot = &inode->addr[3 + level];
+    }
+    if (*slot < 0) {
+        if (!create) {
+            return 0;
+        }
+        if (level == 0 && install >= 0) {
+            *slot = install;
+        } else if ((level == 0 ? new_datablock(slot) : new_index_block(slot)) != 0) {
+            return -1;
+        }
+        inode->st_blocks++;
+    }
+    int no = *slot;
+    struct data_block* db = new_data_block();
+    // 逐级读取间接索引块
+    for (int l=level; l>0; l--) {
+        read_data_block(no, db);
+        int* nos = (int*)db->data;
+        long k = lblk / span;
+        lblk %= span;
+        span /= NUM_PER_INDEX_BLOCK;
+        if (nos[k] < 0) {
+            if (!create) {
+                free_data_block(db);
+                return 0;
+            }
+            if (l == 1 && install >= 0) {
+                nos[k] = install;
+            } else if ((l == 1 ? new_datablock(&nos[k]) : new_index_block(&nos[k])) != 0) {
+                free_data_block(db);
+                return -1;
+            }
+            inode->st_blocks++;
+            write_data_block(no, db); // 写回更新后的间接索引块
+        }
+        no = nos[k];
+    }
+    free_data_block(db);
+    *datablock_no = no;
+    return 0;
+}
+
+/**
+ * 将文件内的逻辑块号映射为数据块号，create非0时为未分配的逻辑块分配数据块
+ * 参数与返回值同map_block
+ */
+int bmap(struct inode* inode, long lblk, int create, int* datablock_no) {
+    return map_block(inode, lblk, create, -1, datablock_no);
+}
+
+/**
+ * 为inode的第lblk个逻辑块分配一个新的数据块（会自动寻找空闲数据块）
+ * 若该逻辑块已分配则直接返回其数据块号
+ * @param inode        需要添加新数据块的inode指针
+ * @param lblk         逻辑块号
+ * @param datablock_no 返回的数据块号
+*/
+int alloc_datablock(struct inode* inode, long lblk, int* datablock_no) {
+    uint64_t start = stats_now();
+    int ret = bmap(inode, lblk, 1, datablock_no);
+    stats_record(STAT_ALLOC, start);
+    if (ret != 0) {
+        TRACE(ERROR, "no free data block for ino=%ld", inode->st_ino);
+        return -1;
+    }
+    TRACE(DEBUG, "datablock_no=%ld", *datablock_no);
     return 0;
 }
 
@@ -482,170 +1410,671 @@ int alloc_datablock(struct inode* inode, short int* datablock_no) {
 
 // 判断inode迭代过程有无下一个数据块
 int has_next(struct inode_iter* iter) {
-    if (iter->inode->st_size == 0 || iter->read_size >= iter->inode->st_size || iter->index > 6) {
-        // 超出间接索引级别，或者已读取完全部数据
+    if (iter->read_size >= iter->inode->st_size) {
+        // 已读取完全部数据
         return 0;
     }
     return 1; // 有下一个数据块
 }
 
 /**
- * 一次取出一个可用的数据块（512B），包括其对应的数据块号（可能需要用来将该数据块写回磁盘）
+ * 一次取出一个数据块（块大小由超级块决定），包括其对应的数据块号（可能需要用来将该数据块写回磁盘）
+ * 未分配的逻辑块读出为全0，此时iter->datablock_no为-1
  * @param iter       inode迭代器
  * @param data_block 获取的数据块指针
  */
 void next(struct inode_iter* iter, struct data_block* data_block) {
-    if (iter->index <= 3) {
-        // 直接索引
-        short int data_block_no = iter->inode->addr[iter->index];
-        iter->index += 1;
-        iter->datablock_no = data_block_no;
-        if (!data_block_is_used(data_block_no)) {
-            next(iter, data_block);
-            return;
-        }
+    int data_block_no;
+    bmap(iter->inode, iter->index, 0, &data_block_no);
+    iter->datablock_no = data_block_no;
+    if (data_block_no < 0) {
+        memset(data_block->data, 0, sb->block_size);
+    } else {
         read_data_block(data_block_no, data_block);
-        iter->read_size += sizeof(struct data_block);
+    }
+    iter->index += 1;
+    iter->read_size += sb->block_size;
+}
+
+/* 以上是inode迭代器相关函数 */
+
+/**
+ * 递归遍历一个（间接索引）块及其下级块
+ * @param datablock_no 块号
+ * @param level        0表示数据块，1~3表示该块为几级间接索引块
+ * @param visit        每个块调用一次的回调函数
+ * @param arg          传给回调函数的参数
+ */
+void walk_index_block(int datablock_no, int level,
+                      void (*visit)(int datablock_no, int level, void* arg), void* arg) {
+    if (datablock_no < 0 || datablock_no >= sb->datasize) {
+        return; // 未使用的块号
+    }
+    visit(datablock_no, level, arg);
+    if (level == 0) {
         return;
-    } else if (iter->index == 4) {
-        // 一级间接索引
-        short int no1 = iter->inode->addr[iter->index];
-        if (!data_block_is_used(no1)) {
-            next(iter, data_block);
-            return;
+    }
+    struct data_block* db = new_data_block();
+    read_data_block(datablock_no, db);
+    int* nos = (int*)db->data;
+    for (int k=0; k<NUM_PER_INDEX_BLOCK; k++) {
+        walk_index_block(nos[k], level - 1, visit, arg);
+    }
+    free_data_block(db);
+}
+
+/**
+ * 遍历inode块映射中的全部块（包括数据块和各级间接索引块或extent树节点块）
+ * 与inode迭代器不同，这里不读取数据块内容，只读取间接索引块
+ * @param inode 需要遍历的inode
+ * @param visit 每个块调用一次的回调函数
+ * @param arg   传给回调函数的参数
+ */
+void walk_inode_blocks(struct inode* inode,
+                       void (*visit)(int datablock_no, int level, void* arg), void* arg) {
+    if (inode->flags & INODE_INLINE) {
+        return; // 内联数据不占用数据块
+    }
+    if (inode->flags & INODE_EXTENTS) {
+        // extent树：level为节点块在树中的高度
+        walk_extent_node(&inode->ext_root.header, inode->ext_root.extents, visit, arg);
+        return;
+    }
+    for (int i=0; i<=3; i++) {
+        walk_index_block(inode->addr[i], 0, visit, arg); // 直接索引
+    }
+    for (int i=4; i<=6; i++) {
+        walk_index_block(inode->addr[i], i - 3, visit, arg); // 一、二、三级间接索引
+    }
+}
+
+/************************/
+/* 压缩簇相关函数 */
+
+/*
+ * 解压后的簇缓存：读取压缩簇时整簇解压，按(ino, 簇号)直接映射缓存最近解压的簇，
+ * 顺序读取同一簇内的多个块只需解压一次；写入簇时更新缓存，释放数据块时使该inode的缓存失效
+ */
+#define CLUSTER_CACHE_SLOTS 16
+
+struct cluster_cache_slot {
+    int valid;    // 槽中是否有缓存的簇
+    int ino;      // 簇所属的inode号
+    long cluster; // 簇号
+    long size;    // data的字节数
+    char* data;   // 解压后的簇
+};
+
+struct cluster_cache_slot cluster_cache[CLUSTER_CACHE_SLOTS];
+
+// 簇在缓存中对应的槽
+struct cluster_cache_slot* cluster_cache_slot(int ino, long cluster) {
+    return &cluster_cache[((unsigned long)ino * 31 + cluster) % CLUSTER_CACHE_SLOTS];
+}
+
+// 将解压后的簇放入缓存
+void cluster_cache_store(int ino, long cluster, const char* data) {
+    struct cluster_cache_slot* slot = cluster_cache_slot(ino, cluster);
+    long size = CLUSTER_BLOCKS * sb->block_size;
+    if (slot->size != size) {
+        free(slot->data);
+        slot->data = (char*)malloc(size);
+        slot->size = size;
+    }
+    memcpy(slot->data, data, size);
+    slot->ino = ino;
+    slot->cluster = cluster;
+    slot->valid = 1;
+}
+
+// 使inode的全部缓存簇失效（释放inode或其数据块时调用）
+void cluster_cache_invalidate(int ino) {
+    for (int i=0; i<CLUSTER_CACHE_SLOTS; i++) {
+        if (cluster_cache[i].ino == ino) {
+            cluster_cache[i].valid = 0;
         }
-        struct data_block* db1 = (struct data_block*)malloc(sizeof(struct data_block));
-        read_data_block(no1, db1);
-        short int datablock_no;
-        memcpy(&datablock_no, db1->data + iter->n*sizeof(short int), sizeof(short int));
-        if (!data_block_is_used(datablock_no)) {
-            iter->n++;
-            next(iter, data_block);
-            return;
+    }
+}
+
+/**
+ * 判断inode的数据是否按簇压缩存放（启用压缩且已转为块存储的普通文件）
+ */
+int inode_compressed(struct inode* inode) {
+    return S_ISREG(inode->st_mode) && (inode->flags & INODE_COMPRESS) && (inode->flags & INODE_EXTENTS);
+}
+
+/**
+ * 新建的文件或目录继承压缩设置：父目录启用压缩或文件系统启用FEATURE_COMPRESS时启用压缩
+ * 在new_inode之后、写回inode之前调用
+ * @param inode  新建的inode
+ * @param parent 父目录的inode
+ */
+void inherit_compress(struct inode* inode, struct inode* parent) {
+    if ((parent->flags & INODE_COMPRESS) || (sb->features & FEATURE_COMPRESS)) {
+        inode->flags |= INODE_COMPRESS;
+    }
+}
+
+/**
+ * 启用或关闭inode的压缩（chattr +c/-c）
+ * 目录的压缩标志只影响其下新建的文件和目录；已有数据块的文件可以启用压缩（之后写入的簇被压缩），
+ * 但不能再关闭（已压缩的簇只能按簇读取）；使用addr映射的文件有数据块时不能启用压缩
+ * inode被修改，由调用者写回
+ * @return 成功返回0，不支持时返回-EOPNOTSUPP
+ */
+int set_inode_compress(struct inode* inode, int enable) {
+    if (!!(inode->flags & INODE_COMPRESS) == !!enable) {
+        return 0;
+    }
+    int has_blocks = !S_ISDIR(inode->st_mode) && !(inode->flags & INODE_INLINE) && inode->st_blocks > 0;
+    if (!enable) {
+        if (has_blocks) {
+            return -EOPNOTSUPP;
         }
-        iter->datablock_no = datablock_no;
-        read_data_block(datablock_no, data_block);
-        iter->n++;
-        // 该级索引的块号已遍历完毕
-        if (iter->n >= BLOCK_SIZE / sizeof(short int)) {
-            iter->index += 1;
-            iter->n = 0;
+        inode->flags &= ~INODE_COMPRESS;
+        return 0;
+    }
+    if (has_blocks && !(inode->flags & INODE_EXTENTS)) {
+        return -EOPNOTSUPP;
+    }
+    inode->flags |= INODE_COMPRESS;
+    if (S_ISREG(inode->st_mode) && !(inode->flags & (INODE_INLINE | INODE_EXTENTS))) {
+        init_block_map(inode); // 没有数据块的文件改为extent映射
+    }
+    return 0;
+}
+
+/**
+ * 查找簇对应的压缩extent
+ * @param ext 返回簇的压缩extent
+ * @return 簇压缩存放返回1，否则（原样存放或未分配）返回0
+ */
+int find_compressed_cluster(struct inode* inode, long cluster, struct extent* ext) {
+    return extent_find(inode, cluster * CLUSTER_BLOCKS, ext, NULL) == 0 && (ext->len & EXTENT_COMPRESSED);
+}
+
+/**
+ * 读取整个簇的内容到buf中（CLUSTER_BLOCKS个块）
+ * 压缩簇优先从缓存读取，否则读出压缩数据并解压到缓存；原样存放的簇逐块读取，未分配的逻辑块读出为全0
+ * @return 成功返回0，压缩簇损坏返回-1
+ */
+int read_cluster(struct inode* inode, long cluster, char* buf) {
+    long n = CLUSTER_BLOCKS, bs = sb->block_size;
+    struct cluster_cache_slot* slot = cluster_cache_slot(inode->st_ino, cluster);
+    if (slot->valid && slot->ino == inode->st_ino && slot->cluster == cluster) {
+        memcpy(buf, slot->data, n * bs);
+        stats_count(STAT_CLUSTER_CACHE_HITS, 1);
+        return 0;
+    }
+    struct extent ext;
+    struct data_block view; // 指向buf中的一个块
+    if (!find_compressed_cluster(inode, cluster, &ext)) {
+        for (long i=0; i<n; i++) {
+            int datablock_no;
+            bmap(inode, cluster * n + i, 0, &datablock_no);
+            view.data = buf + i * bs;
+            if (datablock_no < 0) {
+                memset(view.data, 0, bs);
+            } else {
+                read_data_block(datablock_no, &view);
+            }
         }
-        return;
-    } else if (iter->index == 5) {
-        // 二级间接索引
-        short int no1 = iter->inode->addr[iter->index];
-        if (!data_block_is_used(no1)) {
-            next(iter, data_block);
-            return;
+        return 0;
+    }
+    stats_count(STAT_CLUSTER_CACHE_MISSES, 1);
+    long plen = extent_plen(&ext);
+    char* cdata = (char*)malloc(plen * bs);
+    for (long i=0; i<plen; i++) {
+        view.data = cdata + i * bs;
+        read_data_block(ext.pblk + i, &view);
+    }
+    struct cluster_header* header = (struct cluster_header*)cdata;
+    int ret = -1;
+    if (header->magic == CLUSTER_MAGIC && header->clen > 0 &&
+        header->clen <= plen * bs - (long)sizeof(struct cluster_header) &&
+        LZ4_decompress_safe(cdata + sizeof(struct cluster_header), buf, header->clen, n * bs) == n * bs) {
+        cluster_cache_store(inode->st_ino, cluster, buf);
+        ret = 0;
+    } else {
+        TRACE(ERROR, "bad compressed cluster %ld in ino=%ld", cluster, inode->st_ino);
+    }
+    free(cdata);
+    return ret;
+}
+
+/**
+ * 写入整个簇：LZ4压缩后至少能节省一个数据块时，压缩数据存放在连续的数据块中并记录为压缩extent；
+ * 否则（不可压缩的数据或没有足够长的连续空闲块）逐块原样存放，全0的簇不占用数据块
+ * 原样存放时，超出文件末尾的块和原本未分配的全0块保持为空洞
+ * inode被修改（块映射和占用块数），由调用者写回
+ * @param cluster 簇号
+ * @param buf     簇的完整内容（CLUSTER_BLOCKS个块）
+ * @param valid   簇内位于文件末尾之前的字节数
+ * @return 成功返回0，没有空闲数据块返回-1
+ */
+int write_cluster(struct inode* inode, long cluster, char* buf, long valid) {
+    long n = CLUSTER_BLOCKS, bs = sb->block_size, lblk = cluster * n;
+    long hdr = sizeof(struct cluster_header);
+    struct extent ext;
+    int was_compressed = find_compressed_cluster(inode, cluster, &ext);
+    int shared = 0; // 簇内有共享的数据块时整簇重新分配（copy-on-write）
+    for (long i=0; i<n && reftable != NULL && !was_compressed; i++) {
+        int datablock_no;
+        bmap(inode, lblk + i, 0, &datablock_no);
+        shared |= block_is_shared(datablock_no);
+    }
+    int zero = buf[0] == 0 && memcmp(buf, buf + 1, n * bs - 1) == 0;
+    char* cdata = (char*)calloc(n, bs);
+    int clen = zero ? 0 : LZ4_compress_default(buf, cdata + hdr, n * bs, (n - 1) * bs - hdr);
+    long k = (hdr + clen + bs - 1) / bs; // 压缩簇占用的数据块数
+    int no = -1;
+    if (clen > 0 && get_free_datablock_span(extent_goal(&ext, lblk), k, &no) != 0) {
+        clen = 0; // 没有足够长的连续空闲块，原样存放
+    }
+    TRACE(DEBUG, "ino=%ld cluster=%ld clen=%ld", inode->st_ino, cluster, clen);
+    struct bitmap_batch batch;
+    init_bitmap_batch(&batch);
+    int ret = 0;
+    if (clen > 0) {
+        batch_set_datablocks(&batch, no, k, 1); // 先占用新的数据块，再释放簇原有的块，二者不会重叠
+    }
+    if (zero || clen > 0 || was_compressed || shared) {
+        long before = batch.count;
+        ret = extent_punch(inode, lblk, lblk + n, &batch);
+        inode->st_blocks -= batch.count - before;
+    }
+    if (ret == 0 && clen > 0) {
+        struct cluster_header* header = (struct cluster_header*)cdata;
+        header->magic = CLUSTER_MAGIC;
+        header->clen = clen;
+        struct data_block view;
+        for (long i=0; i<k; i++) {
+            view.data = cdata + i * bs;
+            write_data_block(no + i, &view);
         }
-        struct data_block* db1 = (struct data_block*)malloc(sizeof(struct data_block));
-        read_data_block(no1, db1);
-        short int no2;
-        memcpy(&no2, db1->data + iter->n*sizeof(short int), sizeof(short int));
-        if (!data_block_is_used(no2)) {
-            iter->n++;
-            next(iter, data_block);
-            return;
+        ret = extent_insert(inode, lblk, no, k | EXTENT_COMPRESSED);
+        if (ret == 0) {
+            inode->st_blocks += k;
         }
-        struct data_block* db2 = (struct data_block*)malloc(sizeof(struct data_block));
-        read_data_block(no2, db2);
-        short int datablock_no;
-        memcpy(&datablock_no, db2->data + iter->n*sizeof(short int), sizeof(short int));
-        if (!data_block_is_used(datablock_no)) {
-            iter->n++;
-            next(iter, data_block);
-            return;
+    }
+    if (ret != 0 && clen > 0) {
+        batch_set_datablocks(&batch, no, k, 0);
+    }
+    if (ret == 0 && clen == 0 && !zero) {
+        for (long i=0; i<n && i * bs < valid; i++) {
+            struct data_block view = { buf + i * bs };
+            int datablock_no;
+            bmap(inode, lblk + i, 0, &datablock_no);
+            if (datablock_no < 0 && view.data[0] == 0 && memcmp(view.data, view.data + 1, bs - 1) == 0) {
+                continue;
+            }
+            if (alloc_datablock(inode, lblk + i, &datablock_no) != 0) {
+                ret = -1;
+                break;
+            }
+            write_data_block(datablock_no, &view);
         }
-        iter->datablock_no = datablock_no;
-        read_data_block(datablock_no, data_block);
-        iter->n++;
-        // 该级索引的块号已遍历完毕
-        if (iter->n >= pow((BLOCK_SIZE / sizeof(short int)), 2)) {
-            iter->index += 1;
-            iter->n = 0;
+    }
+    commit_bitmap_batch(&batch);
+    if (ret == 0 && clen > 0) {
+        cluster_cache_store(inode->st_ino, cluster, buf);
+    } else {
+        cluster_cache_slot(inode->st_ino, cluster)->valid = 0;
+    }
+    free(cdata);
+    return ret;
+}
+
+/**
+ * 将簇内[from, to)字节清零后重新写入簇（用于截断、打洞时部分落在区间内的压缩簇）
+ * @return 成功返回0，失败返回-1
+ */
+int zero_cluster_range(struct inode* inode, long cluster, long from, long to) {
+    long csize = CLUSTER_BLOCKS * sb->block_size;
+    char* buf = (char*)malloc(csize);
+    int ret = read_cluster(inode, cluster, buf);
+    if (ret == 0) {
+        memset(buf + from, 0, to - from);
+        ret = write_cluster(inode, cluster, buf, inode->st_size - cluster * csize);
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * 释放逻辑块区间[start, end)前处理首尾部分落在区间内的压缩簇：将落在区间内的部分清零后重新写入
+ * 完全落在区间内的压缩簇随后由extent_punch整簇释放
+ * @return 成功返回0，失败返回-1
+ */
+int punch_partial_clusters(struct inode* inode, long start, long end) {
+    long n = CLUSTER_BLOCKS, bs = sb->block_size;
+    long first = start / n, last = end == LONG_MAX ? -1 : (end - 1) / n; // 首尾所在的簇
+    struct extent ext;
+    int ret = 0;
+    if (start % n != 0 && find_compressed_cluster(inode, first, &ext)) {
+        long to = last == first ? end - first * n : n;
+        ret = zero_cluster_range(inode, first, (start % n) * bs, to * bs);
+    }
+    if (ret == 0 && end != LONG_MAX && end % n != 0 && !(last == first && start % n != 0) &&
+        find_compressed_cluster(inode, last, &ext)) {
+        ret = zero_cluster_range(inode, last, 0, (end % n) * bs);
+    }
+    return ret;
+}
+
+/**
+ * 按簇写入压缩文件：不完整覆盖的簇先读出（解压）原内容，修改后整簇重新压缩写入
+ * 参数与返回值同write_file
+ */
+int write_clusters(struct inode* inode, const char* data, size_t size, off_t offset) {
+    long csize = CLUSTER_BLOCKS * sb->block_size;
+    long end = MAX(inode->st_size, (long)(offset + size)); // 写入后的文件大小
+    char* buf = (char*)malloc(csize);
+    long done = 0;
+    int ret = 0;
+    while (done < size) {
+        long cluster = (offset + done) / csize;
+        long start = (offset + done) % csize;
+        long copy_size = MIN(csize - start, size - done);
+        if (copy_size < csize && read_cluster(inode, cluster, buf) != 0) {
+            ret = -1;
+            break;
         }
-        return;
+        memcpy(buf + start, data + done, copy_size);
+        if (write_cluster(inode, cluster, buf, end - cluster * csize) != 0) {
+            ret = -1;
+            break;
+        }
+        done += copy_size;
+    }
+    free(buf);
+    return ret;
+}
 
-    } else if (iter->index == 6) {
-        // 三级间接索引
-        short int no1 = iter->inode->addr[iter->index];
-        if (!data_block_is_used(no1)) {
-            next(iter, data_block);
-            return;
+/* 以上是压缩簇相关函数 */
+
+/**
+ * 释放（level级）间接索引块下落在逻辑块区间[start, end)内的块
+ * 完全落在区间内的子树整体释放，不再逐块查找
+ * @param datablock_no 间接索引块号
+ * @param level        间接索引级别（1~3）
+ * @param base         该块覆盖的第一个逻辑块号
+ * @param span         块内每个块号覆盖的逻辑块数
+ * @return 释放后该块不再引用任何块时返回1（由调用者释放该块），否则返回0
+ */
+int punch_index_block(int datablock_no, int level, long base, long span,
+                      long start, long end, struct bitmap_batch* batch) {
+    struct data_block* db = new_data_block();
+    read_data_block(datablock_no, db);
+    int* nos = (int*)db->data;
+    int changed = 0, empty = 1;
+    for (int k=0; k<NUM_PER_INDEX_BLOCK; k++) {
+        long cs = base + k * span, ce = cs + span; // 第k个块号覆盖的逻辑块
+        if (nos[k] < 0) {
+            continue;
         }
-        struct data_block* db1 = (struct data_block*)malloc(sizeof(struct data_block));
-        read_data_block(no1, db1);
-        short int no2;
-        memcpy(&no2, db1->data + iter->n*sizeof(short int), sizeof(short int));
-        if (!data_block_is_used(no2)) {
-            iter->n++;
-            next(iter, data_block);
-            return;
+        if (ce <= start || cs >= end) {
+            empty = 0;
+            continue;
+        }
+        if (start <= cs && ce <= end) {
+            walk_index_block(nos[k], level - 1, free_block_visitor, batch);
+            nos[k] = -1;
+            changed = 1;
+            continue;
+        }
+        // 部分落在区间内（只会出现在二、三级间接索引块中）
+        if (punch_index_block(nos[k], level - 1, cs, span / NUM_PER_INDEX_BLOCK, start, end, batch)) {
+            batch_set_datablocks(batch, nos[k], 1, 0);
+            nos[k] = -1;
+            changed = 1;
+            continue;
+        }
+        empty = 0;
+    }
+    if (changed && !empty) {
+        write_data_block(datablock_no, db);
+    }
+    free_data_block(db);
+    return empty;
+}
+
+/**
+ * 释放文件中逻辑块区间[start, end)内的全部数据块，以及因此不再需要的间接索引块或extent树节点块
+ * 压缩文件中部分落在区间内的簇先清零该部分后重新写入，其余整簇释放
+ * 位图修改批量提交，每个位图块只写回一次；inode被修改，由调用者写回
+ * @return 成功返回0，需要拆分extent但没有空闲数据块时返回-1
+ */
+int punch_blocks(struct inode* inode, long start, long end) {
+    if ((inode->flags & INODE_INLINE) || start >= end) {
+        return 0;
+    }
+    if (inode_compressed(inode) && punch_partial_clusters(inode, start, end) != 0) {
+        return -1;
+    }
+    struct bitmap_batch batch;
+    init_bitmap_batch(&batch);
+    int ret = 0;
+    if (inode->flags & INODE_EXTENTS) {
+        ret = extent_punch(inode, start, end, &batch);
+    } else {
+        for (int i=0; i<=3; i++) {
+            if (i >= start && i < end && inode->addr[i] >= 0) {
+                batch_set_datablocks(&batch, inode->addr[i], 1, 0);
+                inode->addr[i] = -1;
+            }
+        }
+        long base = 4, span = 1; // 当前级别覆盖的第一个逻辑块号，顶层索引块中每个块号覆盖的逻辑块数
+        for (int level=1; level<=3; level++) {
+            long cover = span * NUM_PER_INDEX_BLOCK; // 该级别覆盖的逻辑块数
+            int* slot = &inode->addr[3 + level];
+            if (*slot >= 0 && base < end && base + cover > start) {
+                if (start <= base && base + cover <= end) {
+                    walk_index_block(*slot, level, free_block_visitor, &batch);
+                    *slot = -1;
+                } else if (punch_index_block(*slot, level, base, span, start, end, &batch)) {
+                    batch_set_datablocks(&batch, *slot, 1, 0);
+                    *slot = -1;
+                }
+            }
+            base += cover;
+            span *= NUM_PER_INDEX_BLOCK;
+        }
+    }
+    inode->st_blocks -= batch.count;
+    commit_bitmap_batch(&batch);
+    cluster_cache_invalidate(inode->st_ino);
+    return ret;
+}
+
+/************************/
+/* 共享数据块（去重、写时复制）相关函数 */
+
+/**
+ * 获取可以原地写入的第lblk个逻辑块的数据块：未分配时分配新块；块被共享时（copy-on-write）
+ * 先释放该逻辑块对共享块的引用，再分配独占的新块。块的原内容由调用者在此之前读出
+ * inode被修改，由调用者写回
+ * @param datablock_no 返回数据块号
+ * @return 成功返回0，没有空闲数据块返回-1
+ */
+int cow_datablock(struct inode* inode, long lblk, int* datablock_no) {
+    bmap(inode, lblk, 0, datablock_no);
+    if (block_is_shared(*datablock_no)) {
+        TRACE(DEBUG, "ino=%ld lblk=%ld shared datablock_no=%ld", inode->st_ino, lblk, *datablock_no);
+        if (punch_blocks(inode, lblk, lblk + 1) != 0) {
+            return -1;
+        }
+    }
+    if (alloc_datablock(inode, lblk, datablock_no) != 0) {
+        return -1;
+    }
+    forget_fingerprint(*datablock_no); // 内容即将改变
+    return 0;
+}
+
+/**
+ * 在指纹索引中查找内容与data相同的数据块（比较块的实际内容，排除指纹冲突）
+ * @param fingerprint data的指纹
+ * @param data        块内容
+ * @return 找到返回数据块号，否则返回-1
+ */
+int find_duplicate_block(uint32_t fingerprint, const char* data) {
+    struct data_block* db = new_data_block();
+    int found = -1;
+    for (int no=*fp_bucket(fingerprint); no>=0 && found<0; no=fp_next[no]) {
+        if (reftable[no].fingerprint != fingerprint || reftable[no].shares == UINT32_MAX) {
+            continue;
+        }
+        read_data_block(no, db);
+        if (memcmp(db->data, data, sb->block_size) == 0) {
+            found = no;
+        }
+    }
+    free_data_block(db);
+    return found;
+}
+
+/**
+ * 写入文件的第lblk个逻辑块（整块）
+ * 启用FEATURE_DEDUP时先按指纹查找内容相同的数据块，找到则将逻辑块映射到该块并增加其引用数，不写入数据；
+ * 否则写入逻辑块独占的数据块（共享的块先复制）并记录指纹
+ * inode被修改，由调用者写回
+ * @param db 块的完整内容
+ * @return 成功返回0，没有空闲数据块返回-1
+ */
+int write_file_block(struct inode* inode, long lblk, struct data_block* db) {
+    int datablock_no;
+    uint32_t fingerprint = 0;
+    if ((sb->features & FEATURE_DEDUP) && reftable != NULL) {
+        fingerprint = block_fingerprint(db->data);
+        int dup = find_duplicate_block(fingerprint, db->data);
+        bmap(inode, lblk, 0, &datablock_no);
+        if (dup >= 0 && dup == datablock_no) {
+            return 0; // 内容没有改变
+        }
+        if (dup >= 0) {
+            TRACE(DEBUG, "ino=%ld lblk=%ld share datablock_no=%ld", inode->st_ino, lblk, dup);
+            stats_count(STAT_DEDUP_HITS, 1);
+            share_datablock(dup); // 先增加引用，释放原数据块时不会误释放dup
+            int ret = punch_blocks(inode, lblk, lblk + 1);
+            if (ret == 0) {
+                ret = map_block(inode, lblk, 1, dup, &datablock_no);
+            }
+            if (ret != 0) {
+                release_datablock_ref(dup);
+            }
+            write_reftable();
+            return ret;
+        }
+    }
+    if (cow_datablock(inode, lblk, &datablock_no) != 0) {
+        return -1;
+    }
+    write_data_block(datablock_no, db);
+    if (fingerprint != 0) {
+        set_fingerprint(datablock_no, fingerprint); // 指纹延后写回
+    }
+    return 0;
+}
+
+/* 以上是共享数据块相关函数 */
+
+/**
+ * 为逻辑块区间[start, end)中尚未分配的逻辑块分配数据块并清零
+ * extent映射时按连续的空闲块段分配，每段只插入一个extent，位图修改批量提交
+ * @return 成功返回0，没有空闲数据块返回-1（已分配的块保留）
+ */
+int prealloc_blocks(struct inode* inode, long start, long end) {
+    int ret = 0;
+    if (inode->flags & INODE_EXTENTS) {
+        struct bitmap_batch batch;
+        init_bitmap_batch(&batch);
+        long lblk = start;
+        while (lblk < end) {
+            struct extent ext;
+            long next;
+            if (extent_find(inode, lblk, &ext, &next) == 0) {
+                lblk = ext.lblk + extent_llen(&ext); // 跳过已分配的extent
+                continue;
+            }
+            int goal = extent_goal(&ext, lblk);
+            int no;
+            long len;
+            if (get_free_datablock_run(goal, MIN(next, end) - lblk, &no, &len) != 0) {
+                ret = -1;
+                break;
+            }
+            batch_set_datablocks(&batch, no, len, 1);
+            zero_datablocks(no, len);
+            if (extent_insert(inode, lblk, no, len) != 0) {
+                batch_set_datablocks(&batch, no, len, 0);
+                ret = -1;
+                break;
+            }
+            inode->st_blocks += len;
+            lblk += len;
         }
-        struct data_block* db2 = (struct data_block*)malloc(sizeof(struct data_block));
-        read_data_block(no2, db2);
-        short int no3;
-        memcpy(&no3, db2->data + iter->n*sizeof(short int), sizeof(short int));
-        if (!data_block_is_used(no3)) {
-            iter->n++;
-            next(iter, data_block);
-            return;
+        commit_bitmap_batch(&batch);
+        return ret;
+    }
+    // addr映射逐块分配，物理上连续的块合并清零
+    int run_no = -1;
+    long run_len = 0;
+    for (long lblk=start; lblk<end; lblk++) {
+        int no;
+        bmap(inode, lblk, 0, &no);
+        if (no >= 0) {
+            continue;
         }
-        struct data_block* db3 = (struct data_block*)malloc(sizeof(struct data_block));
-        read_data_block(no3, db3);
-        short int datablock_no; // 最终获取的数据块号
-        memcpy(&datablock_no, db3->data + iter->n*sizeof(short int), sizeof(short int));
-        if (!data_block_is_used(datablock_no)) {
-            iter->n++;
-            next(iter, data_block);
-            return;
+        if (alloc_datablock(inode, lblk, &no) != 0) {
+            ret = -1;
+            break;
         }
-        iter->datablock_no = datablock_no;
-        read_data_block(datablock_no, data_block);
-        iter->n++;
-
-        // 该级索引的块号已遍历完毕
-        if (iter->n >= pow((BLOCK_SIZE / sizeof(short int)), 3)) {
-            iter->index += 1;
-            iter->n = 0;
+        if (run_len > 0 && run_no + run_len == no) {
+            run_len++;
+            continue;
         }
-        return;
-
+        zero_datablocks(run_no, run_len);
+        run_no = no;
+        run_len = 1;
     }
-    printf("[next] out of index\n");
+    zero_datablocks(run_no, run_len);
+    return ret;
 }
 
-/* 以上是inode迭代器相关函数 */
+// 一个数据块可以存放的目录项数目
+#define NUM_ENTRIES_PER_BLOCK (sb->block_size / sizeof(struct entry))
 
-// 根据inode获取目录（包括子目录和文件）
+/**
+ * 根据inode获取目录（包括子目录和文件）
+ * 目录文件的大小为其数据块总大小，数据块中type为UNUSED的目录项为空位
+ * @param inode 目录的inode
+ * @param dir   读取到的目录，使用完毕后需要调用free_dir释放
+ */
 int read_dir(struct inode* inode, struct dir* dir) {
-    printf("[read_dir] ino=%d\n", inode->st_ino);
-    dir->num_entries = 0;
-    int inode_size = inode->st_size;
+    TRACE(DEBUG, "ino=%ld", inode->st_ino);
+    new_dir(dir);
     // 创建inode迭代器用于遍历数据块，寻找子目录加入到dir
     struct inode_iter* iter = (struct inode_iter*)malloc(sizeof(struct inode_iter));
     new_inode_iter(iter, inode);
-    struct data_block* data_block = (struct data_block*)malloc(sizeof(struct data_block));
-    while (has_next(iter) && inode_size > 0) {
+    struct data_block* data_block = new_data_block();
+    while (has_next(iter)) {
         next(iter, data_block);
-        int read_size = BLOCK_SIZE;
-        int k = 0; // 下一个待读取的entry下标（包括UNUSED类型的entry）
-        while (read_size > 0 && inode_size > 0) {
-            struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
-            memcpy(entry, data_block->data + k*sizeof(struct entry), sizeof(struct entry));
-            k++;
-            if (entry->type != UNUSED) {
-                // 读取到的entry是已使用的才会加入dir（被删除的entry会被设置成UNUSED类型）
-                dir->entries[dir->num_entries++] = entry;
-                inode_size -= sizeof(struct entry);
+        for (int k=0; k<NUM_ENTRIES_PER_BLOCK; k++) {
+            struct entry* e = (struct entry*)(data_block->data + k*sizeof(struct entry));
+            if (e->type == UNUSED) {
+                continue; // 被删除的entry会被设置成UNUSED类型
+            }
+            if (dir->num_entries == dir->capacity) {
+                dir->capacity = dir->capacity == 0 ? NUM_ENTRIES_PER_BLOCK : dir->capacity * 2;
+                dir->entries = (struct entry**)realloc(dir->entries, dir->capacity * sizeof(struct entry*));
             }
-            read_size -= sizeof(struct entry);
-            // free(entry);
-            // entry = NULL;
+            struct entry* entry = (struct entry*)malloc(sizeof(struct entry));
+            *entry = *e;
+            dir->entries[dir->num_entries++] = entry;
         }
     }
-    free(data_block);
+    free_data_block(data_block);
     free(iter);
     data_block = NULL;
     iter = NULL;
@@ -663,9 +2092,9 @@ int read_dir(struct inode* inode, struct dir* dir) {
  *     (4) find ef's entry
 */
 int find_entry(const char* path, struct entry* entry) {
-    printf("[find_entry] path=%s\n", path);
+    TRACE_STR(DEBUG, path, "path=%s");
     if (path == NULL || strcmp(path, "") == 0) {
-        printf("[find_entry] Error: the entry path should not be NULL or empty\n");
+        TRACE(ERROR, "the entry path should not be NULL or empty");
         return -1;
     }
     if (strcmp(path, "/") == 0) {
@@ -673,8 +2102,11 @@ int find_entry(const char* path, struct entry* entry) {
         *entry = *root_entry;
         return 0;
     }
-    char* path_copy = (char*)malloc(sizeof(path));
-    strcpy(path_copy, path);
+    if (strlen(path) >= MAX_PATH_LEN) {
+        return -1;
+    }
+    uint64_t start = stats_now();
+    char* path_copy = (char*)malloc(MAX_PATH_LEN);
     strcpy(path_copy, path + 1);
     // 当前需要解析的路径以及对应的inode和entry结构
     struct inode* cur_inode = (struct inode*)malloc(sizeof(struct inode));
@@ -682,15 +2114,18 @@ int find_entry(const char* path, struct entry* entry) {
     struct entry* cur_entry = (struct entry*)malloc(sizeof(struct entry));
     *cur_entry = *root_entry;
     // 路径解析
-    char* cur_path = (char*)malloc(sizeof(path)); // 开始为根目录"/"
-    char* head = (char*)malloc(sizeof(path)); // 分割路径的前部分（待匹配的子目录）
-    char* tail = (char*)malloc(sizeof(path)); // 分割路径的后部分
+    char* head = (char*)malloc(MAX_PATH_LEN); // 分割路径的前部分（待匹配的子目录）
+    char* tail = (char*)malloc(MAX_PATH_LEN); // 分割路径的后部分
     split_path(path_copy, head, tail);
-    strcpy(cur_path, "/");
     int flag = 0; // 匹配成功标志
     int ret;
-    char name[MAX_FILE_NAME + MAX_FILE_EXTENSION + 1];
+    char name[MAX_FILE_NAME + MAX_FILE_EXTENSION + 2];
     while (1) {
+        if (cur_entry->type != DIR_TYPE) {
+            // 普通文件下不存在子路径
+            ret = -1;
+            break;
+        }
         read_inode(cur_entry->inode, cur_inode);
         read_dir(cur_inode, cur_dir);
         for (int i=0; i<cur_dir->num_entries; i++) {
@@ -702,6 +2137,7 @@ int find_entry(const char* path, struct entry* entry) {
                 break;
             }
         }
+        free_dir(cur_dir);
         if (flag) {
             // 路径匹配成功
             flag = 0; // 重新设置为0，用于下一级的匹配
@@ -715,7 +2151,6 @@ int find_entry(const char* path, struct entry* entry) {
             continue;
         } else {
             // 路径匹配失败
-            entry = NULL;
             ret = -1;
             break;
         }
@@ -726,199 +2161,853 @@ int find_entry(const char* path, struct entry* entry) {
     free(cur_entry);
     free(cur_inode);
     free(cur_dir);
+    stats_record(STAT_RESOLVE, start);
     return ret;
 }
 
 /**
  * 在父目录下添加新的子entry（目录或文件）
+ * 优先复用已删除目录项留下的空位，没有空位时为目录分配新的数据块
  * @param parent_inode 父目录的inode指针
  * @param entry        待添加的entry指针
+ * @return 成功返回0，没有空闲数据块返回-1
 */
-void add_entry(struct inode* parent_inode, struct entry* entry) {
-    char name[MAX_FILE_NAME + 1 + MAX_FILE_EXTENSION];
+int add_entry(struct inode* parent_inode, struct entry* entry) {
+    char name[MAX_FILE_NAME + MAX_FILE_EXTENSION + 2];
     full_name(entry->name, entry->extension, name);
     if (name[0] == '.') {
-        return; // 隐藏文件
+        return 0; // 隐藏文件
     }
-    printf("[add_entry] entry name=%s\n", name);
-    // 遍历父目录数据块，将新entry加入到最后的可用位置
+    TRACE_STR(DEBUG, name, "entry name=%s");
+    // 遍历父目录数据块，寻找空位
     struct inode_iter* iter = (struct inode_iter*)malloc(sizeof(struct inode_iter));
     new_inode_iter(iter, parent_inode);
-    struct data_block* datablock = (struct data_block*)malloc(sizeof(struct data_block));
+    struct data_block* datablock = new_data_block();
+    int ret = 0;
     while (has_next(iter)) {
         next(iter, datablock);
+        for (int k=0; k<NUM_ENTRIES_PER_BLOCK; k++) {
+            struct entry* e = (struct entry*)(datablock->data + k*sizeof(struct entry));
+            if (e->type == UNUSED && iter->datablock_no >= 0) {
+                // 找到空位，写回磁盘
+                memcpy(e, entry, sizeof(struct entry));
+                write_data_block(iter->datablock_no, datablock);
+                goto out;
+            }
+        }
     }
 
-    // 此时datablock是parent_inode的最后一个数据块
-    off_t used_size = parent_inode->st_size % BLOCK_SIZE;
-    if (used_size == 0) {
-        // 最后一个数据块已满，需要分配新的数据块
-        printf("[add_entry] data block is full\n");
-        short int* datablock_no = (short int*)malloc(sizeof(short int));
-        alloc_datablock(parent_inode, datablock_no); // 分配一个未使用的数据块
-        read_data_block(*datablock_no, datablock);
-        memcpy(datablock, entry, sizeof(struct entry));
-        // 写回磁盘
-        write_data_block(*datablock_no, datablock);
-        set_datablock_bitmap_used(*datablock_no);
-        free(datablock_no);
-        datablock_no = NULL;
-    } else {
-        // 最后的数据块未满，可以存放新entry
-        memcpy(datablock->data + used_size, entry, sizeof(struct entry));
-        // 写回磁盘
-        write_data_block(iter->datablock_no, datablock);
+    // 已有数据块均已满，需要分配新的数据块
+    TRACE(DEBUG, "data block is full");
+    int datablock_no;
+    if (alloc_datablock(parent_inode, parent_inode->st_size / sb->block_size, &datablock_no) != 0) {
+        ret = -1;
+        goto out;
     }
-    parent_inode->st_size += sizeof(struct entry);   // 更新inode大小
+    memset(datablock->data, 0, sb->block_size); // 新数据块中的目录项均为UNUSED
+    memcpy(datablock->data, entry, sizeof(struct entry));
+    // 写回磁盘
+    write_data_block(datablock_no, datablock);
+    parent_inode->st_size += sb->block_size;             // 更新inode大小
     write_inode(parent_inode->st_ino, parent_inode); // 写回磁盘
+out:
     free(iter);
-    free(datablock);
+    free_data_block(datablock);
     iter = NULL;
     datablock = NULL;
+    return ret;
+}
+
+/**
+ * 释放inode及其占用的全部数据块、间接索引块（或extent树节点块）
+ * 目录会先递归释放其下的全部子目录和文件（目录块随后整体释放，无需逐项清除目录项）
+ * @param ino   需要释放的inode号
+ * @param batch 释放数据块使用的批量位图修改
+ */
+void release_inode(int ino, struct bitmap_batch* batch) {
+    struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
+    read_inode(ino, inode);
+    if (S_ISDIR(inode->st_mode)) {
+        struct dir* dir = (struct dir*)malloc(sizeof(struct dir));
+        read_dir(inode, dir);
+        for (int i=0; i<dir->num_entries; i++) {
+            release_inode(dir->entries[i]->inode, batch);
+        }
+        free_dir(dir);
+        free(dir);
+    }
+    walk_inode_blocks(inode, free_block_visitor, batch);
+    cluster_cache_invalidate(ino);
+    set_free_inode_bitmap(ino);
+    free(inode);
+}
+
+// 删除时数据块多于该数目的文件放入孤儿链表，由后台线程回收
+#define ORPHAN_MIN_BLOCKS 64
+
+pthread_cond_t orphan_cond = PTHREAD_COND_INITIALIZER; // 孤儿链表非空时唤醒后台回收线程
+
+/**
+ * 将已从目录中摘除的inode加入孤儿链表头部，其子项和数据块由后台线程回收
+ * 孤儿链表保存在虚拟磁盘上（超级块中的链表头和inode中的next_orphan），挂载时继续回收
+ * 调用者持有fs_lock
+ * @param inode 需要回收的inode（会被修改并写回）
+ */
+void orphan_add(struct inode* inode) {
+    TRACE(INFO, "ino=%ld", inode->st_ino);
+    inode->flags |= INODE_ORPHAN;
+    inode->next_orphan = sb->orphan_head;
+    write_inode(inode->st_ino, inode);
+    sb->orphan_head = inode->st_ino;
+    write_sb();
+    pthread_cond_signal(&orphan_cond);
 }
 
 /**
  * 在父目录下删除entry（目录或文件）
+ * 小文件立即释放数据块；目录树和大文件只从父目录摘除并加入孤儿链表，由后台线程按速率限制回收
  * @param parent_inode 父目录的inode指针
  * @param entry        待删除的entry指针
+ * @return 成功返回0，父目录下不存在该entry返回-1
 */
 int remove_entry(struct inode* parent_inode, struct entry* entry) {
-    // 这里暂时保证待删除的参数entry一定存在
     struct inode_iter* iter = (struct inode_iter*)malloc(sizeof(struct inode_iter));
     new_inode_iter(iter, parent_inode);
-    struct data_block* datablock = (struct data_block*)malloc(sizeof(struct data_block));
-    int inode_size = parent_inode->st_size;
-    struct entry* e = (struct entry*)malloc(sizeof(struct entry));
+    struct data_block* datablock = new_data_block();
+    int ret = -1;
     // 遍历parent_inode数据块
-    while (has_next(iter) && inode_size > 0) {
+    while (has_next(iter) && ret != 0) {
         next(iter, datablock);
         // 匹配待删除的entry
-        int read_size = BLOCK_SIZE; 
-        int k = 0; // 从数据块中下一个待读取第k个entry（包括UNUSED类型的entry）
-        while (read_size > 0 && inode_size > 0) {
-            memcpy(e, datablock->data + k*sizeof(struct entry), sizeof(struct entry));
-            read_size -= sizeof(struct entry);
+        for (int k=0; k<NUM_ENTRIES_PER_BLOCK; k++) {
+            struct entry* e = (struct entry*)(datablock->data + k*sizeof(struct entry));
             if (e->type == UNUSED) {
-                k++;
                 continue;
             }
-            inode_size -= sizeof(struct entry);
             if (strcmp(entry->name, e->name) == 0 && strcmp(entry->extension, e->extension) == 0) {
                 // 匹配成功，进行删除
-                if (e->type == DIR_TYPE) {
-                    struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
-                    read_inode(e->inode, inode);
-                    struct dir* dir = (struct dir*)malloc(sizeof(struct dir));
-                    read_dir(inode, dir);
-                    for (int i=0; i<dir->num_entries; i++) {
-                        remove_entry(inode, dir->entries[i]);
-                    }
-                }
                 e->type = UNUSED;
                 // 写回数据块
-                memcpy(datablock->data + k*sizeof(struct entry), e, sizeof(struct entry));
                 write_data_block(iter->datablock_no, datablock);
-                // 如果数据块内没有可用entry则需要释放
-                if (!datablock_has_entry(iter->datablock_no)) {
-                    // 数据块无可用entry，进行释放（设置bitmap）
-                    set_free_datablock_bitmap(iter->datablock_no);
+                struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
+                read_inode(e->inode, inode);
+                if (S_ISDIR(inode->st_mode) || inode->st_blocks > ORPHAN_MIN_BLOCKS) {
+                    orphan_add(inode);
+                } else {
+                    // 释放inode和数据块
+                    struct bitmap_batch batch;
+                    init_bitmap_batch(&batch);
+                    release_inode(e->inode, &batch);
+                    commit_bitmap_batch(&batch);
                 }
-                // 释放inode
-                set_free_inode_bitmap(e->inode);
-
-                // 更新inode大小
-                parent_inode->st_size -= sizeof(struct entry);
-                // 写回磁盘
-                write_inode(parent_inode->st_ino, parent_inode);
-                return 0;
+                free(inode);
+                ret = 0;
+                break;
             }
-            k++;
         }
         // 该数据块无待删除entry，继续读取下一个数据块
     }
     free(iter);
-    free(e);
-    free(datablock);
+    free_data_block(datablock);
     iter = NULL;
-    e = NULL;
     datablock = NULL;
+    return ret;
+}
+
+
+/************************/
+/* 内联数据相关函数 */
+
+/**
+ * 读写inode中的内联数据：前48字节在block_map中，其余在inline_tail中
+ * @param inode  内联存放数据的inode
+ * @param data   数据缓冲区
+ * @param size   字节数
+ * @param offset 起始偏移，offset+size不超过INLINE_DATA_SIZE
+ * @param write  非0表示将data写入inode，否则从inode读出到data
+ */
+void inline_copy(struct inode* inode, char* data, size_t size, off_t offset, int write) {
+    long head = sizeof(inode->block_map);
+    while (size > 0) {
+        char* area = offset < head ? inode->block_map + offset : inode->inline_tail + (offset - head);
+        long n = offset < head ? MIN(size, head - offset) : size;
+        if (write) {
+            memcpy(area, data, n);
+        } else {
+            memcpy(data, area, n);
+        }
+        data += n;
+        offset += n;
+        size -= n;
+    }
+}
+
+/**
+ * 内联数据超出INLINE_DATA_SIZE时转为块存储：初始化块映射，将已有数据写入第0个逻辑块
+ * 修改了inode，由调用者负责写回
+ * @return 成功返回0，没有空闲数据块返回-1（inode保持内联）
+ */
+int promote_inline(struct inode* inode) {
+    char saved[INLINE_DATA_SIZE];
+    long size = MIN(inode->st_size, INLINE_DATA_SIZE);
+    inline_copy(inode, saved, size, 0, 0);
+    inode->flags &= ~INODE_INLINE;
+    init_block_map(inode);
+    memset(inode->inline_tail, 0, sizeof(inode->inline_tail));
+    TRACE(DEBUG, "ino=%ld size=%ld", inode->st_ino, size);
+    if (size == 0) {
+        return 0;
+    }
+    int datablock_no;
+    if (alloc_datablock(inode, 0, &datablock_no) != 0) {
+        // 恢复为内联存放
+        inode->flags &= ~INODE_EXTENTS;
+        inode->flags |= INODE_INLINE;
+        inline_copy(inode, saved, size, 0, 1);
+        return -1;
+    }
+    struct data_block* db = new_data_block();
+    memset(db->data, 0, sb->block_size);
+    memcpy(db->data, saved, size);
+    write_data_block(datablock_no, db);
+    free_data_block(db);
     return 0;
 }
 
+/* 以上是内联数据相关函数 */
 
 /*********************************************/
 /* 以下是文件读写相关（read/write）函数 */
 
 /**
- * 将文件对应inode数据读取到data中
- * @param inode 需要读取文件对应索引节点
- * @param data  将读取数据拷贝到该data参数中
- * @param size  需要读取的数据大小
+ * 读取文件中从offset开始的size字节到data中
+ * 只读取与[offset, offset+size)相交的数据块，未分配的逻辑块读出为全0
+ * @param inode  需要读取文件对应索引节点
+ * @param data   将读取数据拷贝到该data参数中
+ * @param size   需要读取的数据大小
+ * @param offset 读取的起始偏移
+ * @return 实际读取的字节数（不超过文件末尾），压缩簇损坏时返回-EIO
  */
-int read_file(struct inode* inode, char* data, size_t size) {
-    printf("[read_file] ino=%d\n", inode->st_ino);
-    struct inode_iter* iter = (struct inode_iter*)malloc(sizeof(struct inode_iter));
-    new_inode_iter(iter, inode);
-    // 遍历inode中的数据块，拷贝到data中
-    struct data_block* datablock = (struct data_block*)malloc(sizeof(struct data_block));
-    int n = 0; // 已读取的数据块数
-    int read_size = size;
-    read_size = MIN(read_size, inode->st_size); // 由于参数size按块读取（read_size=4096?），设置为不能超过原inode大小
-    while (has_next(iter)) {
-        int copy_size = MIN(read_size, sizeof(struct data_block));
-        read_size -= copy_size;
-        next(iter, datablock);
-        memcpy(data + n*sizeof(struct data_block), datablock, copy_size);;
-        n += 1;
+long read_file(struct inode* inode, char* data, size_t size, off_t offset) {
+    TRACE(DEBUG, "ino=%ld", inode->st_ino);
+    if (offset >= inode->st_size) {
+        return 0;
     }
-    free(datablock);
-    datablock = NULL;
+    long read_size = MIN(size, inode->st_size - offset); // 不能超过文件末尾
+    if (inode->flags & INODE_INLINE) {
+        // 数据内联存放在inode中，无需读取数据块
+        inline_copy(inode, data, read_size, offset, 0);
+        return read_size;
+    }
+    struct data_block* datablock = new_data_block();
+    char* cluster_buf = NULL; // 解压后的簇
+    long done = 0; // 已读取的字节数
+    while (done < read_size) {
+        long lblk = (offset + done) / sb->block_size;  // 逻辑块号
+        long start = (offset + done) % sb->block_size; // 块内偏移
+        long copy_size = MIN(sb->block_size - start, read_size - done);
+        struct extent ext;
+        if (inode_compressed(inode) && find_compressed_cluster(inode, lblk / CLUSTER_BLOCKS, &ext)) {
+            // 压缩簇：整簇解压（或从簇缓存读取）后拷贝簇内的部分
+            long csize = CLUSTER_BLOCKS * sb->block_size;
+            if (cluster_buf == NULL) {
+                cluster_buf = (char*)malloc(csize);
+            }
+            if (read_cluster(inode, lblk / CLUSTER_BLOCKS, cluster_buf) != 0) {
+                read_size = -EIO;
+                break;
+            }
+            copy_size = MIN(csize - (offset + done) % csize, read_size - done);
+            memcpy(data + done, cluster_buf + (offset + done) % csize, copy_size);
+            done += copy_size;
+            continue;
+        }
+        int datablock_no;
+        bmap(inode, lblk, 0, &datablock_no);
+        if (datablock_no < 0) {
+            memset(data + done, 0, copy_size);
+        } else {
+            read_data_block(datablock_no, datablock);
+            memcpy(data + done, datablock->data + start, copy_size);
+        }
+        done += copy_size;
+    }
+    free(cluster_buf);
+    free_data_block(datablock);
+    return read_size;
+}
+
+/**
+ * 将data写到文件从offset开始的位置（不在这里更新inode大小，但分配数据块时会修改inode的addr）
+ * 只写入与[offset, offset+size)相交的数据块，整块覆盖时无需先读出原数据
+ * 内联文件写入后仍不超过INLINE_DATA_SIZE时直接写入inode（由调用者写回inode），否则先转为块存储
+ * 压缩文件按簇写入（见write_clusters）
+ * @param inode  需要写的文件对应索引节点
+ * @param data   需要写入的数据
+ * @param size   需要写入的数据大小
+ * @param offset 写入的起始偏移
+ * @return 成功返回0，没有空闲数据块返回-1
+ */
+int write_file(struct inode* inode, const char* data, size_t size, off_t offset) {
+    TRACE(DEBUG, "ino=%ld", inode->st_ino);
+    TRACE(DEBUG, "size=%ld offset=%ld", size, offset);
+    if (inode->flags & INODE_INLINE) {
+        if (offset + size <= INLINE_DATA_SIZE) {
+            if (offset > inode->st_size) {
+                // 文件末尾与offset之间补0
+                char zeros[INLINE_DATA_SIZE] = {0};
+                inline_copy(inode, zeros, offset - inode->st_size, inode->st_size, 1);
+            }
+            inline_copy(inode, (char*)data, size, offset, 1);
+            return 0;
+        }
+        if (promote_inline(inode) != 0) {
+            return -1;
+        }
+    }
+    if (inode_compressed(inode)) {
+        return write_clusters(inode, data, size, offset);
+    }
+    struct data_block* datablock = new_data_block();
+    long done = 0; // 已写入的字节数
+    int ret = 0;
+    while (done < size) {
+        long lblk = (offset + done) / sb->block_size;  // 逻辑块号
+        long start = (offset + done) % sb->block_size; // 块内偏移
+        long copy_size = MIN(sb->block_size - start, size - done);
+        int datablock_no;
+        if (copy_size < sb->block_size) {
+            // 只覆盖块的一部分，需要保留块内其余数据（新分配的块补0）
+            bmap(inode, lblk, 0, &datablock_no);
+            if (datablock_no < 0) {
+                memset(datablock->data, 0, sb->block_size);
+            } else {
+                read_data_block(datablock_no, datablock);
+            }
+        }
+        memcpy(datablock->data + start, data + done, copy_size);
+        // 写回磁盘（未分配则进行分配，共享的块先复制，启用去重时相同内容的块共享）
+        if (write_file_block(inode, lblk, datablock) != 0) {
+            ret = -1;
+            break;
+        }
+        done += copy_size;
+    }
+    free_data_block(datablock);
+    return ret;
+}
+
+/**
+ * 根据块映射查找从offset开始的下一段数据或空洞（lseek的SEEK_DATA和SEEK_HOLE）
+ * 未分配的逻辑块视为空洞，文件末尾视为一个隐含的空洞
+ * @param inode  文件的inode
+ * @param offset 查找的起始偏移
+ * @param whence SEEK_DATA或SEEK_HOLE
+ * @return 找到的偏移，offset不小于文件大小或其后没有数据时返回-ENXIO
+ */
+off_t seek_data_hole(struct inode* inode, off_t offset, int whence) {
+    if (offset < 0 || offset >= inode->st_size) {
+        return -ENXIO;
+    }
+    if (inode->flags & INODE_INLINE) {
+        return whence == SEEK_DATA ? offset : inode->st_size; // 内联数据没有空洞
+    }
+    long last = (inode->st_size - 1) / sb->block_size; // 最后一个逻辑块号
+    long lblk = offset / sb->block_size;
+    while (lblk <= last) {
+        int mapped;
+        long run = 1; // 与lblk映射状态相同的连续逻辑块数
+        if (inode->flags & INODE_EXTENTS) {
+            // extent树可以直接跳过整段数据或空洞
+            struct extent ext;
+            long next;
+            mapped = extent_find(inode, lblk, &ext, &next) == 0;
+            run = mapped ? ext.lblk + extent_llen(&ext) - lblk : next - lblk;
+        } else {
+            int datablock_no;
+            bmap(inode, lblk, 0, &datablock_no);
+            mapped = datablock_no >= 0;
+        }
+        if (mapped == (whence == SEEK_DATA)) {
+            return MIN(MAX(offset, lblk * sb->block_size), inode->st_size);
+        }
+        if (run > last - lblk) {
+            break;
+        }
+        lblk += run;
+    }
+    return whence == SEEK_DATA ? -ENXIO : inode->st_size;
+}
+
+/**
+ * 在（level级）间接索引块下从逻辑块lblk向前查找已映射的块，跳过整个未分配的子树
+ * @param base   该块覆盖的第一个逻辑块号
+ * @param span   块内每个块号覆盖的逻辑块数
+ * @param budget 还需要找到的块数，每找到一块减一，减到0时停止
+ * @return 找到的最前面一个已映射的逻辑块号，没有找到返回-1
+ */
+long index_seek_back(int datablock_no, int level, long base, long span, long lblk, long* budget) {
+    struct data_block* db = new_data_block();
+    read_data_block(datablock_no, db);
+    int* nos = (int*)db->data;
+    long start = -1;
+    for (long k=MIN((lblk - base) / span, NUM_PER_INDEX_BLOCK - 1); k>=0 && *budget>0; k--) {
+        if (nos[k] < 0) {
+            continue;
+        }
+        if (level == 1) {
+            start = base + k;
+            (*budget)--;
+            continue;
+        }
+        long found = index_seek_back(nos[k], level - 1, base + k * span, span / NUM_PER_INDEX_BLOCK, lblk, budget);
+        if (found >= 0) {
+            start = found;
+        }
+    }
+    free_data_block(db);
+    return start;
+}
+
+/**
+ * 从逻辑块end之前向前查找budget个已映射的块（跳过空洞，压缩簇按其占用的块数计且不拆分）
+ * 用于从文件末尾分步释放数据块：[返回值, end)内最多有budget个（压缩簇可能略多）已分配的数据块
+ * @param end    查找的上界（不含），LONG_MAX表示从块映射的末尾开始
+ * @param budget 最多查找的块数
+ * @return 找到的最前面一个已映射的逻辑块号，end之前没有已映射的块返回-1
+ */
+long seek_mapped_back(struct inode* inode, long end, long budget) {
+    if ((inode->flags & INODE_INLINE) || end <= 0 || budget <= 0) {
+        return -1;
+    }
+    long lblk = end - 1, start = -1;
+    if (inode->flags & INODE_EXTENTS) {
+        while (budget > 0 && lblk >= 0) {
+            struct extent ext;
+            extent_find(inode, MIN(lblk, INT32_MAX), &ext, NULL);
+            if (ext.len == 0) {
+                break; // lblk及其之前没有extent
+            }
+            if (ext.len & EXTENT_COMPRESSED) {
+                start = ext.lblk;
+                budget -= MAX(1, extent_plen(&ext));
+            } else {
+                long last = MIN(lblk, ext.lblk + ext.len - 1);
+                long n = MIN(budget, last - ext.lblk + 1);
+                start = last - n + 1;
+                budget -= n;
+            }
+            lblk = ext.lblk - 1;
+        }
+        return start;
+    }
+    long base = 4, span = 1, bases[4], spans[4]; // 各级间接索引覆盖的第一个逻辑块号和每个块号覆盖的逻辑块数
+    for (int level=1; level<=3; level++) {
+        bases[level] = base;
+        spans[level] = span;
+        base += span * NUM_PER_INDEX_BLOCK;
+        span *= NUM_PER_INDEX_BLOCK;
+    }
+    for (int level=3; level>=1 && budget>0; level--) {
+        if (inode->addr[3 + level] >= 0 && bases[level] <= lblk) {
+            long found = index_seek_back(inode->addr[3 + level], level, bases[level], spans[level], lblk, &budget);
+            if (found >= 0) {
+                start = found;
+            }
+        }
+    }
+    for (int i=MIN(lblk, 3); i>=0 && budget>0; i--) {
+        if (inode->addr[i] >= 0) {
+            start = i;
+            budget--;
+        }
+    }
+    return start;
+}
+
+/**
+ * 将逻辑块lblk中[from, to)范围内的字节清零（逻辑块未分配时无需处理）
+ * 压缩簇内的逻辑块需要解压后清零再重新写入整个簇
+ */
+void zero_block_range(struct inode* inode, long lblk, long from, long to) {
+    struct extent ext;
+    if (inode_compressed(inode) && from < to && find_compressed_cluster(inode, lblk / CLUSTER_BLOCKS, &ext)) {
+        long base = (lblk % CLUSTER_BLOCKS) * sb->block_size; // 逻辑块在簇内的偏移
+        zero_cluster_range(inode, lblk / CLUSTER_BLOCKS, base + from, base + to);
+        return;
+    }
+    int datablock_no;
+    bmap(inode, lblk, 0, &datablock_no);
+    if (datablock_no < 0 || from >= to) {
+        return;
+    }
+    struct data_block* db = new_data_block();
+    read_data_block(datablock_no, db);
+    memset(db->data + from, 0, to - from);
+    if (cow_datablock(inode, lblk, &datablock_no) == 0) {
+        write_data_block(datablock_no, db);
+    }
+    free_data_block(db);
+}
+
+/**
+ * 将文件大小调整为size：缩小时释放新文件末尾之后的全部数据块，扩大时增加的部分为空洞
+ * inode被修改，由调用者写回
+ * @return 成功返回0，没有空闲数据块返回-1
+ */
+int truncate_file(struct inode* inode, off_t size) {
+    TRACE(DEBUG, "ino=%ld size=%ld", inode->st_ino, size);
+    if (inode->flags & INODE_INLINE) {
+        if (size <= INLINE_DATA_SIZE) {
+            if (size < inode->st_size) {
+                // 文件末尾之后的内联数据保持为0，扩大文件时可以直接读出0
+                char zeros[INLINE_DATA_SIZE] = {0};
+                inline_copy(inode, zeros, inode->st_size - size, size, 1);
+            }
+            inode->st_size = size;
+            return 0;
+        }
+        if (promote_inline(inode) != 0) {
+            return -1;
+        }
+    }
+    if (size < inode->st_size) {
+        long bs = sb->block_size;
+        if (punch_blocks(inode, (size + bs - 1) / bs, LONG_MAX) != 0) {
+            return -1;
+        }
+        // 最后一个块中新文件末尾之后的部分清零
+        zero_block_range(inode, size / bs, size % bs == 0 ? bs : size % bs, bs);
+    }
+    inode->st_size = size;
     return 0;
 }
 
 /**
- * 将data写到inode数据中（不在这里更新inode大小）
- * @param inode 需要写的文件对应索引节点
- * @param data  将已写的data数据写入inode的数据块中
- * @param size  需要写入的数据大小
+ * 预分配或释放文件空间（fallocate）
+ * 默认模式为[offset, offset+len)分配数据块（读出为0），文件大小随之扩大，FALLOC_FL_KEEP_SIZE时不改变文件大小
+ * FALLOC_FL_PUNCH_HOLE（须同时指定KEEP_SIZE）释放区间内的整块，首尾不足一块的部分清零
+ * inode被修改，由调用者写回
+ * @return 成功返回0，失败返回负的错误码
  */
-int write_file(struct inode* inode, char* data, size_t size) {
-    printf("[write_file] ino=%d\n", inode->st_ino);
-    printf("[write_file] size=%ld\n", size);
-    struct inode_iter* iter = (struct inode_iter*)malloc(sizeof(struct inode_iter));
-    new_inode_iter(iter, inode);
-    // 遍历inode数据块写入（如果已满需要分配，如果没写完则需要释放）
-    struct data_block* datablock = (struct data_block*)malloc(sizeof(struct data_block));
-    int n = 0; // 读取的数据块数量
-    int write_size = size;
-    while (has_next(iter)) {
-        next(iter, datablock);
-        int copy_size = MIN(write_size, sizeof(struct data_block));
-        if (write_size > 0) {
-            memcpy(datablock->data, data + n*sizeof(struct data_block), copy_size);
-            // 写回磁盘
-            write_data_block(iter->datablock_no, datablock);
-            write_size -= copy_size;
-        } else if (write_size <= 0) {
-            // inode其它多余的没写的数据块需要释放
-            set_free_datablock_bitmap(iter->datablock_no);
+int fallocate_file(struct inode* inode, int mode, off_t offset, off_t len) {
+    TRACE(DEBUG, "ino=%ld mode=%#lx offset=%ld len=%ld", inode->st_ino, mode, offset, len);
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+        return -EOPNOTSUPP;
+    }
+    long bs = sb->block_size;
+    off_t end = offset + len;
+    if ((end + bs - 1) / bs > INT32_MAX) {
+        return -EFBIG; // 逻辑块号为32位
+    }
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+            return -EOPNOTSUPP;
         }
-        n++;
+        if (inode->flags & INODE_INLINE) {
+            if (offset < inode->st_size) {
+                char zeros[INLINE_DATA_SIZE] = {0};
+                inline_copy(inode, zeros, MIN(end, inode->st_size) - offset, offset, 1);
+            }
+            return 0;
+        }
+        long first = (offset + bs - 1) / bs, last = end / bs; // 完全落在区间内的逻辑块[first, last)
+        if (first > last) {
+            // 区间在一个块内
+            zero_block_range(inode, offset / bs, offset % bs, end % bs);
+            return 0;
+        }
+        if (offset % bs != 0) {
+            zero_block_range(inode, offset / bs, offset % bs, bs);
+        }
+        if (end % bs != 0) {
+            zero_block_range(inode, end / bs, 0, end % bs);
+        }
+        return punch_blocks(inode, first, last) == 0 ? 0 : -ENOSPC;
     }
-    // 遍历完所有数据块也还有需要写的数据，需要分配数据块
-    while (write_size > 0)  {
-        int short* datablock_no = (int short*)malloc(sizeof(int short));
-        alloc_datablock(inode, datablock_no);
-        read_data_block(*datablock_no, datablock); // 读取刚分配的数据块
-        int copy_size = MIN(write_size, sizeof(struct data_block));
-        // 写入数据块
-        memcpy(datablock->data, data + n*sizeof(struct data_block), copy_size);
-        n++;
-        // 写回磁盘
-        write_data_block(*datablock_no, datablock);
-        write_size -= copy_size;
+    if (inode->flags & INODE_INLINE) {
+        if (end <= INLINE_DATA_SIZE) {
+            // 内联数据区本身就是预留的空间
+            if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+                inode->st_size = MAX(inode->st_size, end);
+            }
+            return 0;
+        }
+        if (promote_inline(inode) != 0) {
+            return -ENOSPC;
+        }
+    }
+    int ret = prealloc_blocks(inode, offset / bs, (end + bs - 1) / bs) == 0 ? 0 : -ENOSPC;
+    if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE)) {
+        inode->st_size = MAX(inode->st_size, end);
+    }
+    return ret;
+}
+
+/************************/
+/* 文件区间复制（copy_file_range）相关函数 */
+
+#define COPY_CHUNK_SIZE (1 << 20) // 文件系统内复制时每次读写的字节数
+
+/**
+ * 在文件系统内将src从off_in开始的len字节复制到dst的off_out处（经内部缓冲区读写，不经过FUSE）
+ * 每次写入后更新dst的大小；inode被修改，由调用者写回
+ * @return 成功返回0，没有空闲数据块返回-ENOSPC，压缩簇损坏返回-EIO
+ */
+int copy_file_bytes(struct inode* src, off_t off_in, struct inode* dst, off_t off_out, long len) {
+    if (len <= 0) {
+        return 0;
+    }
+    char* buf = (char*)malloc(MIN(len, COPY_CHUNK_SIZE));
+    long done = 0;
+    int ret = 0;
+    while (done < len) {
+        long n = read_file(src, buf, MIN(len - done, COPY_CHUNK_SIZE), off_in + done);
+        if (n <= 0) {
+            ret = n; // 读到src末尾（0）或出错
+            break;
+        }
+        if (write_file(dst, buf, n, off_out + done) != 0) {
+            ret = -ENOSPC;
+            break;
+        }
+        done += n;
+        dst->st_size = MAX(dst->st_size, off_out + done);
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * 将inode从lblk开始的len个逻辑块映射到从pblk开始的已有数据块，并增加这些块的引用数（逻辑块此前未映射）
+ * extent映射时按下一个extent或子树的边界分段插入（同prealloc_blocks），失败时已插入的段保留
+ * @return 成功返回0，没有空闲数据块（间接索引块或extent节点）返回-ENOSPC（未映射的块不增加引用数）
+ */
+int share_blocks(struct inode* inode, long lblk, int pblk, long len) {
+    for (long i=0; i<len; i++) {
+        share_datablock(pblk + i);
+    }
+    if (inode->flags & INODE_EXTENTS) {
+        long done = 0;
+        while (done < len) {
+            struct extent ext;
+            long next;
+            extent_find(inode, lblk + done, &ext, &next);
+            long n = MIN(len - done, next - (lblk + done));
+            if (extent_insert(inode, lblk + done, pblk + done, n) != 0) {
+                for (long i=done; i<len; i++) {
+                    release_datablock_ref(pblk + i);
+                }
+                return -ENOSPC;
+            }
+            inode->st_blocks += n;
+            done += n;
+        }
+        return 0;
+    }
+    for (long i=0; i<len; i++) {
+        int datablock_no;
+        if (map_block(inode, lblk + i, 1, pblk + i, &datablock_no) != 0) {
+            for (long j=i; j<len; j++) {
+                release_datablock_ref(pblk + j);
+            }
+            return -ENOSPC;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 让dst的逻辑块[dlblk, dlblk+count)共享src的逻辑块[slblk, slblk+count)的数据块（reflink），不复制数据
+ * 之后任一方写入共享的块时按copy-on-write复制；src中的空洞在dst中也成为空洞
+ * extent映射的src按extent整段共享，耗时与extent数目（而不是文件大小）成正比
+ * 压缩簇只能整簇共享给按簇对齐的压缩文件，其余情况在文件系统内复制该簇的数据
+ * 调用者保证引用计数表存在、dst为压缩文件时区间按簇对齐且两侧的簇内偏移相同
+ * （否则src中部分落入dst某簇的压缩簇会被复制为整簇的压缩extent，与同一簇中共享的普通块重叠）；
+ * inode被修改，由调用者写回
+ * @return 成功返回0，失败返回-ENOSPC或-EIO
+ */
+int clone_blocks(struct inode* src, long slblk, struct inode* dst, long dlblk, long count) {
+    TRACE(DEBUG, "ino=%ld lblk=%ld -> ino=%ld lblk=%ld count=%ld", src->st_ino, slblk, dst->st_ino, dlblk, count);
+    long n = CLUSTER_BLOCKS, bs = sb->block_size;
+    if (punch_blocks(dst, dlblk, dlblk + count) != 0) {
+        return -ENOSPC;
+    }
+    int ret = 0;
+    long i = 0;
+    while (i < count && ret == 0) {
+        long lblk = slblk + i;
+        int pblk;
+        long run;
+        if (src->flags & INODE_EXTENTS) {
+            struct extent ext;
+            long next;
+            if (extent_find(src, lblk, &ext, &next) != 0) {
+                i = MIN(count, next - slblk); // 跳过空洞
+                continue;
+            }
+            if (ext.len & EXTENT_COMPRESSED) {
+                run = MIN(ext.lblk + n - lblk, count - i); // 簇内落在区间中的部分
+                if (inode_compressed(dst) && lblk == ext.lblk && (dlblk + i) % n == 0 && run == n) {
+                    long k = extent_plen(&ext);
+                    for (long j=0; j<k; j++) {
+                        share_datablock(ext.pblk + j);
+                    }
+                    if (extent_insert(dst, dlblk + i, ext.pblk, ext.len) == 0) {
+                        dst->st_blocks += k;
+                    } else {
+                        for (long j=0; j<k; j++) {
+                            release_datablock_ref(ext.pblk + j);
+                        }
+                        ret = -ENOSPC;
+                    }
+                } else {
+                    ret = copy_file_bytes(src, lblk * bs, dst, (dlblk + i) * bs, run * bs);
+                }
+                i += run;
+                continue;
+            }
+            pblk = ext.pblk + (lblk - ext.lblk);
+            run = MIN(ext.lblk + ext.len - lblk, count - i);
+        } else {
+            bmap(src, lblk, 0, &pblk);
+            run = 1;
+            if (pblk < 0) {
+                i++;
+                continue;
+            }
+        }
+        ret = share_blocks(dst, dlblk + i, pblk, run);
+        i += run;
+    }
+    write_reftable();
+    cluster_cache_invalidate(dst->st_ino);
+    return ret;
+}
+
+/**
+ * 将src从off_in开始的len字节复制到dst的off_out处（copy_file_range）
+ * 存在引用计数表（FEATURE_DEDUP或FEATURE_REFLINK）且两侧的块内偏移（dst为压缩文件时为簇内偏移）相同时，
+ * 块对齐的部分共享数据块（见clone_blocks），只修改块映射和引用计数；
+ * 首尾不足一块（dst为压缩文件时为一簇）的部分以及无法共享时在文件系统内复制
+ * src与dst可以是同一个inode（须为同一个结构体），此时两个区间不能重叠
+ * inode被修改，由调用者写回dst
+ * @return 复制的字节数（off_in不小于src的大小时为0），失败返回负的错误码
+ */
+long copy_file_range_inode(struct inode* src, off_t off_in, struct inode* dst, off_t off_out, size_t len) {
+    TRACE(DEBUG, "ino=%ld off=%ld -> ino=%ld off=%ld len=%ld", src->st_ino, off_in, dst->st_ino, off_out, len);
+    if (off_in < 0 || off_out < 0) {
+        return -EINVAL;
+    }
+    if (off_in >= src->st_size || len == 0) {
+        return 0;
+    }
+    len = MIN(len, src->st_size - off_in);
+    if (src == dst && off_in < off_out + (off_t)len && off_out < off_in + (off_t)len) {
+        return -EINVAL;
+    }
+    long bs = sb->block_size;
+    off_t end = off_out + len;
+    if ((end + bs - 1) / bs > INT32_MAX) {
+        return -EFBIG; // 逻辑块号为32位
+    }
+    if (reftable != NULL && !(src->flags & INODE_INLINE) && (dst->flags & INODE_INLINE) && end > INLINE_DATA_SIZE) {
+        // 内联的dst写入后也会转为块映射，先转换才能按其实际的映射方式（是否压缩）确定可共享的区间
+        if (promote_inline(dst) != 0) {
+            return -ENOSPC;
+        }
+    }
+    long unit = inode_compressed(dst) ? CLUSTER_BLOCKS * bs : bs; // dst中可共享的最小单位
+    off_t head = (off_out + unit - 1) / unit * unit, tail = end / unit * unit; // 可共享的区间[head, tail)
+    int ret;
+    if (reftable != NULL && !(src->flags & INODE_INLINE) && (off_in - off_out) % unit == 0 && head < tail) {
+        ret = copy_file_bytes(src, off_in, dst, off_out, head - off_out);
+        if (ret == 0) {
+            ret = clone_blocks(src, (off_in + head - off_out) / bs, dst, head / bs, (tail - head) / bs);
+        }
+        if (ret == 0) {
+            dst->st_size = MAX(dst->st_size, tail);
+            ret = copy_file_bytes(src, off_in + tail - off_out, dst, tail, end - tail);
+        }
+    } else {
+        ret = copy_file_bytes(src, off_in, dst, off_out, len);
     }
+    if (ret != 0) {
+        return ret;
+    }
+    dst->st_size = MAX(dst->st_size, end);
+    return len;
+}
+
+/* 以上是文件区间复制相关函数 */
+
+/**
+ * 格式化虚拟磁盘：写入超级块，清空位图，创建根目录
+ * @param fs_bytes   文件系统载体文件大小（字节）
+ * @param block_size 块大小（字节）
+ * @param num_inodes inode总数
+ * @param features   文件系统特性（FEATURE_*）
+ * @return 成功返回0，几何参数不合法返回-1
+ */
+int format_fs(long fs_bytes, long block_size, long num_inodes, long features) {
+    if (init_sb(sb, fs_bytes, block_size, num_inodes) != 0) {
+        TRACE(ERROR, "invalid geometry size=%ld block size=%ld inodes=%ld", fs_bytes, block_size, num_inodes);
+        return -1;
+    }
+    sb->features = features;
+    if (features & (FEATURE_DEDUP | FEATURE_REFLINK)) {
+        // 引用计数表占用数据区开头的块
+        sb->first_blk_of_reftable = sb->first_blk;
+        sb->reftable_size = (sb->datasize * sizeof(struct ref_entry) + block_size - 1) / block_size;
+        if (sb->reftable_size >= sb->datasize) {
+            TRACE(ERROR, "no room for the reference table");
+            return -1;
+        }
+    }
+    // 空闲空间摘要占用引用计数表之后的块，与数据块位图一样大
+    sb->first_blk_of_summary = sb->first_blk + sb->reftable_size;
+    sb->summary_size = sb->databitmap_size;
+    if (sb->reftable_size + sb->summary_size >= sb->datasize) {
+        TRACE(ERROR, "no room for the free space summary");
+        return -1;
+    }
+    // 超级块写入第0块（块内其余部分补0）
+    struct data_block* db = new_data_block();
+    memset(db->data, 0, sb->block_size);
+    memcpy(db->data, sb, sizeof(struct sb));
+    bdev_write_blocks(0, 1, db->data);
+    // 清空inode位图和数据块位图（两者连续存放）
+    memset(db->data, 0, sb->block_size);
+    for (long i=0; i<sb->inodebitmap_size + sb->databitmap_size; i++) {
+        bdev_write_blocks(sb->first_blk_of_inodebitmap + i, 1, db->data);
+    }
+    free_data_block(db);
+    init_dirty_map();
+    for (long i=0; i<sb->first_inode; i++) {
+        mark_block_dirty(i);
+    }
+    load_bitmaps();
+    // 在位图中标记引用计数表和空闲空间摘要占用的数据块，清空引用计数表
+    struct bitmap_batch batch;
+    init_bitmap_batch(&batch);
+    batch_set_datablocks(&batch, 0, sb->reftable_size + sb->summary_size, 1);
+    commit_bitmap_batch(&batch);
+    if (sb->reftable_size > 0) {
+        zero_datablocks(0, sb->reftable_size);
+    }
+    load_reftable();
+
+    // 将根目录的相关信息填写到inode区的第一个inode
+    struct inode* root_inode = (struct inode*)malloc(sizeof(struct inode));
+    new_inode(root_inode, 0, DIR_TYPE); // 根目录的inode号为0（第一个），索引地址均未使用
+    root_inode->st_nlink = 2;           // 链接引用数（根目录为2，其它目录为1）
+    write_inode(0, root_inode);         // 写回磁盘更新
+    set_inode_bitmap_used(0);           // 第一个inode已分配（ino=0）
+    free(root_inode);
     return 0;
 }
 
-#endif
\ No newline at end of file
+#endif
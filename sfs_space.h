@@ -0,0 +1,425 @@
+/*
+ * SFS文件系统的空闲空间索引
+ * 数据块位图仍是块是否已分配的依据，内存中另外按起始块号维护全部连续空闲段（空闲extent），
+ * 修改位图时同步更新：分配时从所在的段中切出，释放时与前后相接的段合并
+ * 空闲段组织为treap（按起始块号有序的二叉搜索树，按随机优先级保持平衡），每个节点记录其子树中最长的段，
+ * “goal之后第一个空闲块”“goal之后第一段至少n个连续空闲块”“最长的空闲段”都只需O(log n)，不再扫描位图
+ * 空闲块总数即超级块中的free_blocks，随索引一起更新
+ * 挂载时读入正常卸载时保存的摘要，或由多个线程分段扫描位图（见sfs_rw.h中的load_free_extents），两者都按序一次建树
+*/
+#ifndef __SFS_SPACE_H__
+#define __SFS_SPACE_H__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sfs_ds.h"
+#include "sfs_utils.h"
+#include "sfs_stats.h"
+
+// 一个连续空闲段（treap的节点）
+struct free_extent {
+    int start, len;  // 从start开始的len个空闲数据块
+    int max;         // 子树中最长的空闲段
+    int left, right; // 子节点在节点数组中的下标（-1表示没有）
+    uint32_t prio;   // 随机优先级，父节点不小于子节点
+};
+
+struct free_extent* fext_nodes = NULL; // 节点数组（按需扩大，下标不变）
+long fext_cap = 0;                     // 节点数组容量
+int fext_root = -1;                    // 树根
+int fext_unused = -1;                  // 回收的节点，通过left串成链表
+long free_extent_count = 0;            // 空闲段数
+uint32_t fext_seed = 2463534242u;      // 优先级的随机数状态
+
+#define SCAN_MIN_BLOCKS (1L << 20) // 并行扫描位图时每个线程至少负责的数据块数（位图中128KB），小映像只用一个线程
+#define MAX_SCAN_THREADS 8         // 并行扫描位图的最大线程数
+
+// 一个线程扫描的一段位图
+struct bitmap_scan {
+    const uint8_t* bitmap;
+    long from, to;                   // 扫描[from, to)，from是8的倍数
+    struct free_summary_entry* runs; // 找到的空闲段（按起始块号排列，与摘要中的格式相同）
+    long n, cap;
+};
+
+/************************/
+/* treap相关函数 */
+
+// 清空索引（重新建立之前调用）
+void reset_free_extents() {
+    free(fext_nodes);
+    fext_nodes = NULL;
+    fext_cap = 0;
+    fext_root = fext_unused = -1;
+    free_extent_count = 0;
+    sb->free_blocks = 0;
+}
+
+int fext_new(int start, int len) {
+    int i = fext_unused;
+    if (i >= 0) {
+        fext_unused = fext_nodes[i].left;
+    } else {
+        if (free_extent_count == fext_cap) {
+            fext_cap = fext_cap == 0 ? 64 : fext_cap * 2;
+            fext_nodes = (struct free_extent*)realloc(fext_nodes, fext_cap * sizeof(struct free_extent));
+        }
+        i = free_extent_count;
+    }
+    fext_seed ^= fext_seed << 13;
+    fext_seed ^= fext_seed >> 17;
+    fext_seed ^= fext_seed << 5;
+    fext_nodes[i] = (struct free_extent){ start, len, len, -1, -1, fext_seed };
+    free_extent_count++;
+    return i;
+}
+
+void fext_release(int i) {
+    fext_nodes[i].left = fext_unused;
+    fext_unused = i;
+    free_extent_count--;
+}
+
+// 子树中最长的空闲段
+int fext_max(int t) {
+    return t < 0 ? 0 : fext_nodes[t].max;
+}
+
+void fext_update(int t) {
+    struct free_extent* n = &fext_nodes[t];
+    n->max = MAX(n->len, MAX(fext_max(n->left), fext_max(n->right)));
+}
+
+// 将树t按起始块号分为小于key的l和不小于key的r
+void fext_split(int t, int key, int* l, int* r) {
+    if (t < 0) {
+        *l = *r = -1;
+        return;
+    }
+    if (fext_nodes[t].start < key) {
+        fext_split(fext_nodes[t].right, key, &fext_nodes[t].right, r);
+        *l = t;
+    } else {
+        fext_split(fext_nodes[t].left, key, l, &fext_nodes[t].left);
+        *r = t;
+    }
+    fext_update(t);
+}
+
+// 合并两棵树（l中的段都在r之前）
+int fext_merge(int l, int r) {
+    if (l < 0 || r < 0) {
+        return l < 0 ? r : l;
+    }
+    if (fext_nodes[l].prio >= fext_nodes[r].prio) {
+        fext_nodes[l].right = fext_merge(fext_nodes[l].right, r);
+        fext_update(l);
+        return l;
+    }
+    fext_nodes[r].left = fext_merge(l, fext_nodes[r].left);
+    fext_update(r);
+    return r;
+}
+
+void fext_insert(int start, int len) {
+    int l, r;
+    fext_split(fext_root, start, &l, &r);
+    fext_root = fext_merge(fext_merge(l, fext_new(start, len)), r);
+    sb->free_blocks += len;
+}
+
+// 删除从start开始的段（该段必须存在）
+void fext_remove(int start) {
+    int l, m, r;
+    fext_split(fext_root, start, &l, &r);
+    fext_split(r, start + 1, &m, &r);
+    sb->free_blocks -= fext_nodes[m].len;
+    fext_release(m);
+    fext_root = fext_merge(l, r);
+}
+
+// 起始块号不大于key的最后一段，没有时返回-1
+int fext_floor(int key) {
+    int t = fext_root, found = -1;
+    while (t >= 0) {
+        if (fext_nodes[t].start <= key) {
+            found = t;
+            t = fext_nodes[t].right;
+        } else {
+            t = fext_nodes[t].left;
+        }
+    }
+    return found;
+}
+
+// 起始块号不小于key的第一段，没有时返回-1
+int fext_ceil(int key) {
+    int t = fext_root, found = -1;
+    while (t >= 0) {
+        if (fext_nodes[t].start >= key) {
+            found = t;
+            t = fext_nodes[t].left;
+        } else {
+            t = fext_nodes[t].right;
+        }
+    }
+    return found;
+}
+
+// 子树t中起始块号不小于key且长度至少为want的第一段，没有时返回-1（按子树中最长的段剪枝）
+int fext_first_fit(int t, int key, int want) {
+    if (t < 0 || fext_nodes[t].max < want) {
+        return -1;
+    }
+    stats_count(STAT_ALLOC_SCANS, 1);
+    struct free_extent* n = &fext_nodes[t];
+    if (n->start < key) {
+        return fext_first_fit(n->right, key, want);
+    }
+    int found = fext_first_fit(n->left, key, want);
+    if (found >= 0) {
+        return found;
+    }
+    return n->len >= want ? t : fext_first_fit(n->right, key, want);
+}
+
+void fext_walk(int t, void (*visit)(int start, int len, void* arg), void* arg) {
+    if (t < 0) {
+        return;
+    }
+    fext_walk(fext_nodes[t].left, visit, arg);
+    visit(fext_nodes[t].start, fext_nodes[t].len, arg);
+    fext_walk(fext_nodes[t].right, visit, arg);
+}
+
+/**
+ * 由按起始块号排列、互不相接的空闲段直接建立treap（索引须为空）
+ * 段依次挂在树的最右链上，沿最右链按优先级找到位置，总共O(n)，不必逐段插入
+ */
+void fext_build(const struct free_summary_entry* runs, long n) {
+    int* spine = (int*)malloc(MAX(n, 1) * sizeof(int)); // 当前的最右链（自根向下）
+    long depth = 0;
+    for (long i=0; i<n; i++) {
+        int t = fext_new(runs[i].start, runs[i].len);
+        sb->free_blocks += runs[i].len;
+        int last = -1; // 优先级比t低的最右链下半部分，成为t的左子树
+        while (depth > 0 && fext_nodes[spine[depth - 1]].prio < fext_nodes[t].prio) {
+            last = spine[--depth];
+            fext_update(last);
+        }
+        fext_nodes[t].left = last;
+        if (depth > 0) {
+            fext_nodes[spine[depth - 1]].right = t;
+        }
+        spine[depth++] = t;
+    }
+    while (depth > 0) {
+        fext_update(spine[--depth]);
+    }
+    fext_root = n > 0 ? spine[0] : -1;
+    free(spine);
+}
+
+/* 以上是treap相关函数 */
+
+/************************/
+/* 空闲空间索引相关函数 */
+
+/**
+ * 从start开始的len个数据块被释放（位图中已由已使用变为空闲），与前后相接的空闲段合并
+ */
+void free_extent_add(int start, int len) {
+    int prev = fext_floor(start - 1);
+    if (prev >= 0 && fext_nodes[prev].start + fext_nodes[prev].len == start) {
+        start = fext_nodes[prev].start;
+        len += fext_nodes[prev].len;
+        fext_remove(start);
+    }
+    int next = fext_ceil(start + len);
+    if (next >= 0 && fext_nodes[next].start == start + len) {
+        len += fext_nodes[next].len;
+        fext_remove(fext_nodes[next].start);
+    }
+    fext_insert(start, len);
+}
+
+/**
+ * 从start开始的len个数据块被分配（位图中已由空闲变为已使用），从所在的空闲段中切出
+ */
+void free_extent_take(int start, int len) {
+    int end = start + len;
+    while (start < end) {
+        int t = fext_floor(start);
+        if (t < 0 || fext_nodes[t].start + fext_nodes[t].len <= start) {
+            // start不在任何空闲段中，跳到下一段
+            t = fext_ceil(start);
+            if (t < 0 || fext_nodes[t].start >= end) {
+                return;
+            }
+            start = fext_nodes[t].start;
+        }
+        int s = fext_nodes[t].start, e = s + fext_nodes[t].len;
+        fext_remove(s);
+        if (s < start) {
+            fext_insert(s, start - s);
+        }
+        if (end < e) {
+            fext_insert(end, e - end);
+        }
+        start = MIN(e, end);
+    }
+}
+
+/**
+ * 查找goal（含）之后的第一个空闲数据块
+ * @param datablock_no 返回找到的数据块号
+ * @return 找到返回0，goal之后没有空闲块返回-1
+ */
+int free_extent_near(int goal, int* datablock_no) {
+    stats_count(STAT_ALLOC_SCANS, 1);
+    int t = fext_floor(goal);
+    if (t >= 0 && fext_nodes[t].start + fext_nodes[t].len > goal) {
+        *datablock_no = goal;
+        return 0;
+    }
+    t = fext_ceil(goal);
+    if (t < 0) {
+        return -1;
+    }
+    *datablock_no = fext_nodes[t].start;
+    return 0;
+}
+
+/**
+ * 查找goal（含）之后的第一段至少want个连续空闲块
+ * @param datablock_no 返回这段空闲块的起始块号（不小于goal）
+ * @return 找到返回0，没有返回-1
+ */
+int free_extent_find(int goal, long want, int* datablock_no) {
+    stats_count(STAT_ALLOC_SCANS, 1);
+    int t = fext_floor(goal);
+    if (t >= 0 && fext_nodes[t].start + fext_nodes[t].len - goal >= want) {
+        *datablock_no = goal; // goal所在的空闲段从goal起就足够长
+        return 0;
+    }
+    t = fext_first_fit(fext_root, goal + 1, want);
+    if (t < 0) {
+        return -1;
+    }
+    *datablock_no = fext_nodes[t].start;
+    return 0;
+}
+
+/**
+ * 最长的空闲段
+ * @return 最长段的块数，没有空闲块时返回0
+ */
+long free_extent_largest(int* start) {
+    int t = fext_root;
+    while (t >= 0) {
+        struct free_extent* n = &fext_nodes[t];
+        if (n->len == n->max) {
+            *start = n->start;
+            return n->len;
+        }
+        t = fext_max(n->left) == n->max ? n->left : n->right;
+    }
+    return 0;
+}
+
+/**
+ * 按起始块号顺序访问全部空闲段
+ */
+void walk_free_extents(void (*visit)(int start, int len, void* arg), void* arg) {
+    fext_walk(fext_root, visit, arg);
+}
+
+// 将从start开始的len个空闲块追加到扫描结果
+void scan_add_run(struct bitmap_scan* scan, long start, long len) {
+    if (scan->n == scan->cap) {
+        scan->cap = scan->cap == 0 ? 64 : scan->cap * 2;
+        scan->runs = (struct free_summary_entry*)realloc(scan->runs, scan->cap * sizeof(struct free_summary_entry));
+    }
+    scan->runs[scan->n++] = (struct free_summary_entry){ (int)start, (int)len };
+}
+
+// 扫描线程：找出[from, to)中的空闲段（整字节空闲或已使用时按字节跳过）
+void* scan_free_runs(void* arg) {
+    struct bitmap_scan* scan = (struct bitmap_scan*)arg;
+    const uint8_t* bitmap = scan->bitmap;
+    long run = 0;
+    for (long no=scan->from; no<=scan->to; no++) {
+        if (no < scan->to && (no & 7) == 0 && no + 8 <= scan->to && (bitmap[no >> 3] == 0 || bitmap[no >> 3] == 0xFF)) {
+            if (bitmap[no >> 3] == 0) {
+                run += 8; // 整个字节空闲
+                no += 7;
+                continue;
+            }
+            if (run > 0) {
+                scan_add_run(scan, no - run, run);
+                run = 0;
+            }
+            no += 7; // 整个字节已使用
+            continue;
+        }
+        if (no < scan->to && ((bitmap[no >> 3] >> (7 - no % 8)) & 1) == 0) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            scan_add_run(scan, no - run, run);
+            run = 0;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 扫描数据块位图，重新建立空闲空间索引（没有可用的摘要时，如崩溃后挂载）
+ * 位图按字节边界分成若干段由多个线程同时扫描，再按序拼接（跨段相接的空闲段连成一段）后一次建树
+ * @return 扫描使用的线程数
+ */
+int build_free_extents(const uint8_t* bitmap, long datasize) {
+    reset_free_extents();
+    long nthreads = MIN(MIN(sysconf(_SC_NPROCESSORS_ONLN), MAX_SCAN_THREADS), datasize / SCAN_MIN_BLOCKS);
+    nthreads = MAX(nthreads, 1);
+    long chunk = (datasize / nthreads + 7) / 8 * 8;
+    struct bitmap_scan scans[MAX_SCAN_THREADS];
+    pthread_t threads[MAX_SCAN_THREADS];
+    int started[MAX_SCAN_THREADS] = {0};
+    for (long i=0; i<nthreads; i++) {
+        long to = i == nthreads - 1 ? datasize : MIN((i + 1) * chunk, datasize);
+        scans[i] = (struct bitmap_scan){ bitmap, MIN(i * chunk, datasize), to, NULL, 0, 0 };
+        started[i] = i > 0 && pthread_create(&threads[i], NULL, scan_free_runs, &scans[i]) == 0;
+    }
+    scan_free_runs(&scans[0]); // 第一段在当前线程中扫描
+    struct bitmap_scan all = { bitmap, 0, datasize, NULL, 0, 0 };
+    for (long i=0; i<nthreads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else if (i > 0) {
+            scan_free_runs(&scans[i]); // 线程创建失败，在当前线程中扫描
+        }
+        for (long j=0; j<scans[i].n; j++) {
+            struct free_summary_entry* last = all.n > 0 ? &all.runs[all.n - 1] : NULL;
+            if (last != NULL && last->start + last->len == scans[i].runs[j].start) {
+                last->len += scans[i].runs[j].len; // 与上一段末尾的空闲段相接
+            } else {
+                scan_add_run(&all, scans[i].runs[j].start, scans[i].runs[j].len);
+            }
+        }
+        free(scans[i].runs);
+    }
+    fext_build(all.runs, all.n);
+    free(all.runs);
+    return nthreads;
+}
+
+/* 以上是空闲空间索引相关函数 */
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * SFS文件系统的缓冲区读写（read_buf、write_buf）
+ * 写入时数据由fuse_buf_copy从libfuse的缓冲区（可能是管道）直接写入映像文件，内核可以splice，不经过用户态缓冲区；
+ * 读取时物理上连续的块合并为一段，每段用一次块设备读取填入内存缓冲区。不返回指向映像文件的fd段：
+ * libfuse在回调返回（释放fs_lock）之后才读取fd段，且不通知读取何时完成，其间被释放并重新分配的块会把其他文件的数据交给读者
+ * 空洞、压缩簇、内联数据、需要按内容去重的写入以及没有载体文件的块设备（ram）仍按文件逐块经过内存缓冲区
+*/
+#ifndef __SFS_SPLICE_H__
+#define __SFS_SPLICE_H__
+
+#include <fuse3/fuse.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sfs_ds.h"
+#include "sfs_dev.h"
+#include "sfs_rw.h"
+
+/**
+ * 正在构造的缓冲区段列表，最后转换为fuse_bufvec
+ * 构造时用pos记录段的位置：映像段（带FUSE_BUF_IS_FD标记）为虚拟磁盘中的偏移，其余为文件中的偏移，全部段确定后再读出数据
+ */
+struct buf_list {
+    struct fuse_buf* bufs; // 缓冲区段
+    size_t n, cap;         // 段数目与容量
+};
+
+/**
+ * 向列表末尾追加size字节：no不小于0时为虚拟磁盘中第no个数据块内从start开始的部分（映像段），否则为按文件读取的段
+ * 与前一段在虚拟磁盘（或文件）中连续时合并为一段
+ * @param offset 这部分数据在文件中的偏移
+ */
+void buf_list_add(struct buf_list* list, int no, long start, off_t offset, long size) {
+    int is_fd = no >= 0;
+    off_t pos = is_fd ? (sb->first_blk + no) * sb->block_size + start : offset;
+    if (list->n > 0) {
+        struct fuse_buf* last = &list->bufs[list->n - 1];
+        if (((last->flags & FUSE_BUF_IS_FD) != 0) == is_fd && last->pos + (off_t)last->size == pos) {
+            last->size += size;
+            return;
+        }
+    }
+    if (list->n == list->cap) {
+        list->cap = list->cap == 0 ? 8 : list->cap * 2;
+        list->bufs = (struct fuse_buf*)realloc(list->bufs, list->cap * sizeof(struct fuse_buf));
+    }
+    struct fuse_buf* buf = &list->bufs[list->n++];
+    memset(buf, 0, sizeof(struct fuse_buf));
+    buf->size = size;
+    buf->pos = pos;
+    buf->fd = -1;
+    if (is_fd) {
+        buf->flags = FUSE_BUF_IS_FD; // 仅作构造时的标记，读出数据后清除
+    }
+}
+
+/**
+ * 读取文件中从offset开始的size字节，结果以fuse_bufvec返回（read_buf）
+ * 所有数据在持有fs_lock时读出到内存段（各自malloc，由libfuse释放）：
+ * 物理上连续的已分配数据块用一次块设备读取，空洞、压缩簇和内联数据经read_file读取
+ * @param bufp 返回的bufvec（由libfuse释放）
+ * @return 成功返回0，压缩簇损坏返回-EIO
+ */
+int read_file_bufvec(struct inode* inode, size_t size, off_t offset, struct fuse_bufvec** bufp) {
+    TRACE(DEBUG, "ino=%ld size=%ld offset=%ld", inode->st_ino, size, offset);
+    long bs = sb->block_size;
+    long read_size = offset >= inode->st_size ? 0 : MIN(size, inode->st_size - offset); // 不能超过文件末尾
+    struct buf_list list = {0};
+    long done = 0;
+    while (done < read_size) {
+        long lblk = (offset + done) / bs;
+        long start = (offset + done) % bs;
+        long copy_size = MIN(bs - start, read_size - done);
+        int no = -1;
+        struct extent ext;
+        if (!(inode->flags & INODE_INLINE) &&
+            !(inode_compressed(inode) && find_compressed_cluster(inode, lblk / CLUSTER_BLOCKS, &ext))) {
+            bmap(inode, lblk, 0, &no);
+        }
+        buf_list_add(&list, no, start, offset + done, copy_size);
+        done += copy_size;
+    }
+    int ret = 0;
+    for (size_t i=0; i<list.n && ret==0; i++) {
+        struct fuse_buf* buf = &list.bufs[i];
+        buf->mem = malloc(buf->size);
+        if (buf->flags & FUSE_BUF_IS_FD) {
+            uint64_t start = stats_now();
+            if (bdev_read(buf->mem, buf->size, buf->pos) != (long)buf->size) {
+                ret = -EIO;
+            }
+            stats_record(STAT_BLOCK_READ, start);
+            stats_count(STAT_BLOCKS_READ, (buf->pos + buf->size - 1) / sb->block_size - buf->pos / sb->block_size + 1);
+            buf->flags = 0;
+        } else if (read_file(inode, (char*)buf->mem, buf->size, buf->pos) != (long)buf->size) {
+            ret = -EIO;
+        }
+        buf->pos = 0;
+    }
+    if (ret != 0) {
+        for (size_t i=0; i<list.n; i++) {
+            free(list.bufs[i].mem);
+        }
+        free(list.bufs);
+        return ret;
+    }
+    size_t count = MAX(list.n, 1);
+    struct fuse_bufvec* bufv = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf));
+    *bufv = FUSE_BUFVEC_INIT(0);
+    if (list.n > 0) {
+        bufv->count = list.n;
+        memcpy(bufv->buf, list.bufs, list.n * sizeof(struct fuse_buf));
+    }
+    free(list.bufs);
+    *bufp = bufv;
+    return 0;
+}
+
+/**
+ * 从src（libfuse传入的bufvec，可能是内存或管道）中取出接下来的size字节写入文件offset处（内存路径）
+ * @return 成功返回0，失败返回负的错误码
+ */
+int write_file_from_bufvec(struct inode* inode, struct fuse_bufvec* src, off_t offset, long size) {
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+    mem.buf[0].mem = malloc(size);
+    int ret = 0;
+    if (fuse_buf_copy(&mem, src, 0) != size) {
+        ret = -EIO;
+    } else if (write_file(inode, (char*)mem.buf[0].mem, size, offset) != 0) {
+        ret = -ENOSPC;
+    }
+    free(mem.buf[0].mem);
+    return ret;
+}
+
+/**
+ * 从src中取出接下来的size字节直接写入映像文件中从pos开始的连续区域
+ * @return 成功返回0，失败返回-EIO
+ */
+int write_image_from_bufvec(struct fuse_bufvec* src, off_t pos, long size) {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = bdev->fd;
+    dst.buf[0].pos = pos;
+    if (fuse_buf_copy(&dst, src, 0) != size) {
+        return -EIO;
+    }
+    stats_count(STAT_SPLICE_BYTES_WRITTEN, size);
+    return 0;
+}
+
+/**
+ * 将buf中的数据写到文件从offset开始的位置（write_buf，不更新inode大小）
+ * 写入独占的（未共享的）已分配数据块时，数据由fuse_buf_copy从buf直接写入映像文件中对应的位置，
+ * buf来自管道时内核直接splice，不经过用户态；整块覆盖的未分配块或共享块先分配（copy-on-write）独占的块
+ * 内联文件、压缩文件、启用去重、块设备没有载体文件时，以及部分覆盖未分配块或共享块时，经内存缓冲区交给write_file
+ * inode被修改，由调用者写回
+ * @return 写入的字节数，失败返回负的错误码
+ */
+long write_file_bufvec(struct inode* inode, struct fuse_bufvec* buf, off_t offset) {
+    long size = fuse_buf_size(buf);
+    TRACE(DEBUG, "ino=%ld size=%ld offset=%ld", inode->st_ino, size, offset);
+    if ((inode->flags & INODE_INLINE) || inode_compressed(inode) || (sb->features & FEATURE_DEDUP) || bdev->fd < 0) {
+        int ret = write_file_from_bufvec(inode, buf, offset, size);
+        return ret == 0 ? size : ret;
+    }
+    long bs = sb->block_size;
+    off_t run_pos = 0; // 尚未写入的连续直接写入区域（映像文件中的偏移与长度）
+    long run_len = 0;
+    long done = 0;
+    int ret = 0;
+    while (done < size && ret == 0) {
+        long lblk = (offset + done) / bs;
+        long start = (offset + done) % bs;
+        long copy_size = MIN(bs - start, size - done);
+        int no;
+        bmap(inode, lblk, 0, &no);
+        if (copy_size == bs && (no < 0 || block_is_shared(no)) && cow_datablock(inode, lblk, &no) != 0) {
+            ret = -ENOSPC;
+            break;
+        }
+        if (no >= 0 && !block_is_shared(no)) {
+            off_t pos = (sb->first_blk + no) * bs + start;
+            if (run_len > 0 && run_pos + run_len != pos) {
+                ret = write_image_from_bufvec(buf, run_pos, run_len);
+                run_len = 0;
+            }
+            if (run_len == 0) {
+                run_pos = pos;
+            }
+            run_len += copy_size;
+            mark_block_dirty(sb->first_blk + no);
+        } else {
+            // 部分覆盖未分配块或共享块，需要保留块内其余数据
+            if (run_len > 0) {
+                ret = write_image_from_bufvec(buf, run_pos, run_len);
+                run_len = 0;
+            }
+            if (ret == 0) {
+                ret = write_file_from_bufvec(inode, buf, offset + done, copy_size);
+            }
+        }
+        done += copy_size;
+    }
+    if (ret == 0 && run_len > 0) {
+        ret = write_image_from_bufvec(buf, run_pos, run_len);
+    }
+    return ret == 0 ? size : ret;
+}
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * SFS文件系统的运行统计
+ * 每个FUSE回调和内部阶段（路径解析、块读写、分配）记录一个延迟直方图，另有块读写、缓存命中、位图扫描等计数器；
+ * 统计数据按线程分片，每个线程只修改自己的分片（不加锁），读取时汇总各分片
+ * 通过只读的虚拟文件/.sfs_stats读取（打开时生成快照），收到SIGUSR1时输出到stderr
+ *
+ * 直方图采用HDR（High Dynamic Range）式的对数线性分桶：每个2的幂区间等分为STATS_SUB_BUCKETS个桶，
+ * 任意延迟的相对误差不超过1/STATS_SUB_BUCKETS，从1纳秒到约18分钟只需固定数目的桶
+*/
+#ifndef __SFS_STATS_H__
+#define __SFS_STATS_H__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+
+#define STATS_PATH "/.sfs_stats" // 统计信息虚拟文件的路径
+
+#define STATS_SUB_BITS 3                         // 每个2的幂区间分桶数的对数
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)  // 每个2的幂区间的桶数（相对误差12.5%）
+#define STATS_MAX_EXP 40                         // 记录的最大延迟为2^40纳秒（约18分钟），更大的计入最后一个桶
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 2) * STATS_SUB_BUCKETS)
+
+// 记录延迟直方图的回调和内部阶段
+enum stats_timer {
+    STAT_GETATTR, STAT_READDIR, STAT_MKDIR, STAT_RMDIR, STAT_MKNOD, STAT_UNLINK,
+    STAT_READ, STAT_WRITE, STAT_READ_BUF, STAT_WRITE_BUF, STAT_FLUSH, STAT_FSYNC,
+    STAT_LSEEK, STAT_TRUNCATE, STAT_FALLOCATE, STAT_COPY_FILE_RANGE, STAT_IOCTL, STAT_STATFS,
+    // 内部阶段
+    STAT_LOCK_WAIT,   // 等待fs_lock
+    STAT_RESOLVE,     // 路径解析（find_entry）
+    STAT_BLOCK_READ,  // 读一个数据块
+    STAT_BLOCK_WRITE, // 写一个数据块
+    STAT_ALLOC,       // 为文件分配数据块（alloc_datablock）
+    NUM_STATS_TIMERS
+};
+#define NUM_FUSE_TIMERS STAT_LOCK_WAIT // FUSE回调的计时器为[0, NUM_FUSE_TIMERS)，其后为内部阶段
+
+const char* stats_timer_names[NUM_STATS_TIMERS] = {
+    "getattr", "readdir", "mkdir", "rmdir", "mknod", "unlink",
+    "read", "write", "read_buf", "write_buf", "flush", "fsync",
+    "lseek", "truncate", "fallocate", "copy_file_range", "ioctl", "statfs",
+    "lock_wait", "resolve", "block_read", "block_write", "alloc",
+};
+
+// 计数器
+enum stats_counter {
+    STAT_BLOCKS_READ,         // 从块设备读取的数据块
+    STAT_BLOCKS_WRITTEN,      // 写入块设备的数据块
+    STAT_INODES_READ,         // 读取的inode
+    STAT_INODES_WRITTEN,      // 写入的inode
+    STAT_SPLICE_BYTES_WRITTEN,// write_buf直接写入映像文件的字节数
+    STAT_CLUSTER_CACHE_HITS,  // 解压缓存命中
+    STAT_CLUSTER_CACHE_MISSES,// 解压缓存未命中（需要读取并解压压缩簇）
+    STAT_DEDUP_HITS,          // 写入时找到内容相同的块而直接共享
+    STAT_ALLOC_SCANS,         // 分配inode时扫描的位图字节数与分配数据块时查找空闲空间索引的次数和访问的节点数
+    NUM_STATS_COUNTERS
+};
+
+const char* stats_counter_names[NUM_STATS_COUNTERS] = {
+    "blocks_read", "blocks_written", "inodes_read", "inodes_written",
+    "splice_bytes_written", "cluster_cache_hits", "cluster_cache_misses",
+    "dedup_hits", "alloc_scans",
+};
+
+// 一个线程的统计分片：只有所属线程修改，读取者以relaxed语义读取（各项之间不保证一致）
+struct stats_shard {
+    uint64_t buckets[NUM_STATS_TIMERS][STATS_BUCKETS];
+    uint64_t sum_ns[NUM_STATS_TIMERS];
+    uint64_t max_ns[NUM_STATS_TIMERS];
+    uint64_t counters[NUM_STATS_COUNTERS];
+    int in_use;               // 是否属于某个存活的线程（线程退出后由新线程继续累加）
+    struct stats_shard* next; // 全部分片链表
+};
+
+struct stats_shard* stats_shards = NULL;              // 全部分片
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // 保护分片链表
+pthread_key_t stats_key;                               // 线程退出时归还分片
+pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+__thread struct stats_shard* stats_self = NULL;        // 当前线程的分片
+
+/************************/
+/* 统计记录相关函数 */
+
+// 单调时钟（纳秒）
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 延迟（纳秒）所在的桶：小于2*STATS_SUB_BUCKETS的值每个值一个桶，之后每个2的幂区间STATS_SUB_BUCKETS个桶
+int stats_bucket(uint64_t ns) {
+    if (ns < 2 * STATS_SUB_BUCKETS) {
+        return ns;
+    }
+    int exp = 63 - __builtin_clzll(ns);
+    if (exp > STATS_MAX_EXP) {
+        return STATS_BUCKETS - 1;
+    }
+    return (exp - STATS_SUB_BITS) * STATS_SUB_BUCKETS + (ns >> (exp - STATS_SUB_BITS));
+}
+
+// 桶中最大的延迟（纳秒）
+uint64_t stats_bucket_upper(int bucket) {
+    if (bucket < 2 * STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exp = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    uint64_t mantissa = bucket % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS;
+    return ((mantissa + 1) << (exp - STATS_SUB_BITS)) - 1;
+}
+
+// 线程退出时将其分片标记为空闲（保留其中的统计）
+void stats_release_shard(void* shard) {
+    __atomic_store_n(&((struct stats_shard*)shard)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void stats_make_key() {
+    pthread_key_create(&stats_key, stats_release_shard);
+}
+
+/**
+ * 取得当前线程的统计分片：优先复用已退出线程的分片，否则新分配一个
+ * @return 统计分片，内存不足时返回NULL（不记录）
+ */
+struct stats_shard* stats_shard_self() {
+    if (stats_self != NULL) {
+        return stats_self;
+    }
+    pthread_once(&stats_key_once, stats_make_key);
+    pthread_mutex_lock(&stats_lock);
+    struct stats_shard* shard = stats_shards;
+    while (shard != NULL && __atomic_load_n(&shard->in_use, __ATOMIC_ACQUIRE)) {
+        shard = shard->next;
+    }
+    if (shard == NULL) {
+        shard = (struct stats_shard*)calloc(1, sizeof(struct stats_shard));
+        if (shard != NULL) {
+            shard->next = stats_shards;
+            stats_shards = shard;
+        }
+    }
+    if (shard != NULL) {
+        shard->in_use = 1;
+        pthread_setspecific(stats_key, shard);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    stats_self = shard;
+    return shard;
+}
+
+// 分片中的一项加上value（只有所属线程修改，不需要原子的读-改-写）
+void stats_add(uint64_t* item, uint64_t value) {
+    __atomic_store_n(item, *item + value, __ATOMIC_RELAXED);
+}
+
+// 计数器加上value
+void stats_count(int counter, uint64_t value) {
+    struct stats_shard* shard = stats_shard_self();
+    if (shard != NULL) {
+        stats_add(&shard->counters[counter], value);
+    }
+}
+
+/**
+ * 记录一次从start（stats_now的返回值）到现在的延迟
+ * @return 当前时间，可以作为下一阶段的start
+ */
+uint64_t stats_record(int timer, uint64_t start) {
+    uint64_t now = stats_now();
+    struct stats_shard* shard = stats_shard_self();
+    if (shard == NULL) {
+        return now;
+    }
+    uint64_t ns = now - start;
+    stats_add(&shard->buckets[timer][stats_bucket(ns)], 1);
+    stats_add(&shard->sum_ns[timer], ns);
+    if (ns > shard->max_ns[timer]) {
+        __atomic_store_n(&shard->max_ns[timer], ns, __ATOMIC_RELAXED);
+    }
+    return now;
+}
+
+/* 以上是统计记录相关函数 */
+
+/************************/
+/* 统计输出相关函数 */
+
+// 直方图中位于百分位p（0~100）的延迟（纳秒），取所在桶的上界且不超过最大值
+uint64_t stats_percentile(const uint64_t* buckets, uint64_t count, uint64_t max_ns, double p) {
+    uint64_t rank = (uint64_t)(count * p / 100.0 + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t seen = 0;
+    for (int i=0; i<STATS_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = stats_bucket_upper(i);
+            return upper < max_ns ? upper : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+/**
+ * 汇总全部分片，将统计信息格式化为文本（延迟以微秒为单位，没有记录的项不输出）
+ * @return 文本（malloc分配，由调用者释放），len返回其长度
+ */
+char* stats_format(size_t* len) {
+    size_t cap = 4096, n = 0;
+    char* text = (char*)malloc(cap);
+    uint64_t* buckets = (uint64_t*)malloc(STATS_BUCKETS * sizeof(uint64_t));
+#define STATS_APPEND(...) do {                                         \
+        int m_ = snprintf(text + n, cap - n, __VA_ARGS__);             \
+        if (n + m_ >= cap) {                                           \
+            cap = (n + m_) * 2;                                        \
+            text = (char*)realloc(text, cap);                          \
+            snprintf(text + n, cap - n, __VA_ARGS__);                  \
+        }                                                              \
+        n += m_;                                                       \
+    } while (0)
+    STATS_APPEND("%-16s %10s %10s %10s %10s %10s %10s %10s\n",
+                 "latency(us)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    pthread_mutex_lock(&stats_lock);
+    for (int t=0; t<NUM_STATS_TIMERS; t++) {
+        memset(buckets, 0, STATS_BUCKETS * sizeof(uint64_t));
+        uint64_t count = 0, sum = 0, max = 0;
+        for (struct stats_shard* shard=stats_shards; shard!=NULL; shard=shard->next) {
+            for (int i=0; i<STATS_BUCKETS; i++) {
+                uint64_t c = __atomic_load_n(&shard->buckets[t][i], __ATOMIC_RELAXED);
+                buckets[i] += c;
+                count += c;
+            }
+            sum += __atomic_load_n(&shard->sum_ns[t], __ATOMIC_RELAXED);
+            uint64_t m = __atomic_load_n(&shard->max_ns[t], __ATOMIC_RELAXED);
+            max = m > max ? m : max;
+        }
+        if (count == 0) {
+            continue;
+        }
+        STATS_APPEND("%-16s %10lu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n", stats_timer_names[t], count,
+                     sum / 1000.0 / count,
+                     stats_percentile(buckets, count, max, 50) / 1000.0,
+                     stats_percentile(buckets, count, max, 90) / 1000.0,
+                     stats_percentile(buckets, count, max, 99) / 1000.0,
+                     stats_percentile(buckets, count, max, 99.9) / 1000.0,
+                     max / 1000.0);
+    }
+    STATS_APPEND("\n");
+    for (int c=0; c<NUM_STATS_COUNTERS; c++) {
+        uint64_t value = 0;
+        for (struct stats_shard* shard=stats_shards; shard!=NULL; shard=shard->next) {
+            value += __atomic_load_n(&shard->counters[c], __ATOMIC_RELAXED);
+        }
+        STATS_APPEND("%-24s %lu\n", stats_counter_names[c], value);
+    }
+    pthread_mutex_unlock(&stats_lock);
+#undef STATS_APPEND
+    free(buckets);
+    *len = n;
+    return text;
+}
+
+/**
+ * 收到SIGUSR1时将统计信息输出到stderr
+ * 信号处理函数中只能调用异步信号安全的函数，因此只唤醒输出线程，由其格式化并输出
+ */
+sem_t stats_sem;
+pthread_t stats_thread;
+int stats_thread_running = 0; // 输出线程是否已启动
+volatile int stats_stop = 0;  // 输出线程退出标志
+
+void stats_signal_handler(int sig) {
+    (void) sig;
+    sem_post(&stats_sem);
+}
+
+void* stats_dump_worker(void* arg) {
+    (void) arg;
+    while (1) {
+        if (sem_wait(&stats_sem) != 0) {
+            continue; // 被信号中断
+        }
+        if (stats_stop) {
+            break;
+        }
+        size_t len;
+        char* text = stats_format(&len);
+        fwrite(text, 1, len, stderr);
+        fflush(stderr);
+        free(text);
+    }
+    return NULL;
+}
+
+/**
+ * 安装SIGUSR1的处理函数并启动输出线程（SFS_init调用）
+ * @return 成功返回0，失败返回-1
+ */
+int start_stats_dump_worker() {
+    if (stats_thread_running) {
+        return 0;
+    }
+    sem_init(&stats_sem, 0, 0);
+    stats_stop = 0;
+    if (pthread_create(&stats_thread, NULL, stats_dump_worker, NULL) != 0) {
+        return -1;
+    }
+    stats_thread_running = 1;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stats_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    return sigaction(SIGUSR1, &sa, NULL);
+}
+
+// 恢复SIGUSR1的默认处理并停止输出线程（卸载时调用）
+void stop_stats_dump_worker() {
+    if (!stats_thread_running) {
+        return;
+    }
+    signal(SIGUSR1, SIG_DFL);
+    stats_stop = 1;
+    sem_post(&stats_sem);
+    pthread_join(stats_thread, NULL);
+    sem_destroy(&stats_sem);
+    stats_thread_running = 0;
+}
+
+/* 以上是统计输出相关函数 */
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * SFS文件系统的持久化操作（flush、fsync、fdatasync）
+ * 写入虚拟磁盘的数据首先停留在块设备的缓存（宿主机的页缓存）中，
+ * fsync需要将目标inode相关的脏块写回并刷新设备缓存，inode在其指向的块落盘之后才写回
+*/
+#ifndef __SFS_SYNC_H__
+#define __SFS_SYNC_H__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "sfs_ds.h"
+#include "sfs_rw.h"
+
+/**
+ * 设备刷新（fdatasync）的组提交状态
+ * 同时到达的多个fsync只需要一次设备刷新：
+ * 正在刷新时到达的fsync等待本轮结束，再由其中一个线程发起下一轮刷新，其余线程共享结果
+ */
+pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+unsigned long flush_started = 0; // 已开始的设备刷新轮数
+unsigned long flush_done = 0;    // 已完成的设备刷新轮数
+int flush_result = 0;            // 最近一轮设备刷新的结果
+
+/**
+ * 刷新宿主机设备缓存，保证调用前已写回的块落盘
+ * 只有在本次调用之后开始的一轮刷新才能覆盖本次调用前的写入
+ */
+int flush_device() {
+    pthread_mutex_lock(&flush_lock);
+    unsigned long target = flush_started + 1; // 需要等待的刷新轮次
+    while (flush_done < target) {
+        if (flush_started == flush_done) {
+            // 当前没有正在进行的刷新，由本线程发起新一轮刷新
+            unsigned long round = ++flush_started;
+            pthread_mutex_unlock(&flush_lock);
+            int ret = bdev_flush();
+            pthread_mutex_lock(&flush_lock);
+            flush_done = round;
+            flush_result = ret;
+            pthread_cond_broadcast(&flush_cond);
+        } else {
+            // 已有刷新正在进行，等待其结束
+            pthread_cond_wait(&flush_cond, &flush_lock);
+        }
+    }
+    int ret = flush_result;
+    pthread_mutex_unlock(&flush_lock);
+    return ret;
+}
+
+/**
+ * 按块收集需要写回的磁盘区间，相邻块合并为一次块设备写回
+ * 收集时清除块的脏标记；写回或设备刷新失败时，收集过的块重新标记为脏，留待下一次fsync重试
+ */
+struct sync_range {
+    long start;     // 当前区间起始绝对块号
+    long count;     // 当前区间块数
+    long* ranges;   // 已收集的区间（起始块号，块数）
+    int n, cap;     // 已收集区间数目与容量
+    int written;    // 前written个区间已写回
+    int error;      // 写回过程中的错误
+};
+
+// 结束当前区间，加入已收集的区间
+void end_sync_range(struct sync_range* range) {
+    if (range->count == 0) {
+        return;
+    }
+    if (range->n == range->cap) {
+        range->cap = range->cap == 0 ? 16 : range->cap * 2;
+        range->ranges = (long*)realloc(range->ranges, range->cap * 2 * sizeof(long));
+    }
+    range->ranges[2 * range->n] = range->start;
+    range->ranges[2 * range->n + 1] = range->count;
+    range->n++;
+    range->count = 0;
+}
+
+/**
+ * 若块为脏则加入待写回区间（清除其脏标记）
+ * @param range 待写回区间
+ * @param blk   虚拟磁盘的绝对块号
+ */
+void sync_block(struct sync_range* range, long blk) {
+    if (!test_and_clear_block_dirty(blk)) {
+        return;
+    }
+    if (range->count > 0 && range->start + range->count == blk) {
+        range->count++;
+        return;
+    }
+    end_sync_range(range);
+    range->start = blk;
+    range->count = 1;
+}
+
+/**
+ * 写回上次调用以来收集的区间：先全部提交，再统一等待完成
+ * 只保证块已写入设备，需要落盘（或作为不同阶段之间的顺序屏障）时还要调用flush_device
+ * @return 本次收集以来第一个写回错误，没有错误返回0
+ */
+int wait_sync_ranges(struct sync_range* range) {
+    end_sync_range(range);
+    for (int i=range->written; i<range->n; i++) {
+        int ret = bdev_writeback_blocks(range->ranges[2 * i], range->ranges[2 * i + 1], 0);
+        if (ret != 0 && range->error == 0) {
+            range->error = ret;
+        }
+    }
+    for (int i=range->written; i<range->n; i++) {
+        int ret = bdev_writeback_blocks(range->ranges[2 * i], range->ranges[2 * i + 1], 1);
+        if (ret != 0 && range->error == 0) {
+            range->error = ret;
+        }
+    }
+    range->written = range->n;
+    return range->error;
+}
+
+/**
+ * 结束一次持久化：失败时将收集过的块重新标记为脏，并释放区间
+ * @param ret 写回或设备刷新的结果
+ * @return ret
+ */
+int finish_sync_ranges(struct sync_range* range, int ret) {
+    end_sync_range(range);
+    if (ret != 0) {
+        for (int i=0; i<range->n; i++) {
+            for (long k=0; k<range->ranges[2 * i + 1]; k++) {
+                mark_block_dirty(range->ranges[2 * i] + k);
+            }
+        }
+    }
+    free(range->ranges);
+    range->ranges = NULL;
+    range->n = range->cap = range->written = 0;
+    return ret;
+}
+
+// walk_inode_blocks的回调：写回数据块
+void sync_data_visitor(int datablock_no, int level, void* arg) {
+    if (level == 0) {
+        sync_block((struct sync_range*)arg, sb->first_blk + datablock_no);
+    }
+}
+
+// walk_inode_blocks的回调：写回间接索引块
+void sync_index_visitor(int datablock_no, int level, void* arg) {
+    if (level > 0) {
+        sync_block((struct sync_range*)arg, sb->first_blk + datablock_no);
+    }
+}
+
+/**
+ * 将inode相关的脏块分两个阶段持久化，每个阶段之后进行一次（可与其它fsync合并的）设备刷新：
+ *   1. 数据块、间接索引块（或extent节点块）、位图和引用计数表
+ *   2. inode（inode所在的块不脏时不需要第二次刷新）
+ * 第一阶段的设备刷新是两阶段之间的屏障，保证inode不会先于其指向的块落盘
+ * 读取inode、收集脏块和写回时持有fs_lock（写回期间块映射不会改变），设备刷新时不持有，多个fsync仍可合并刷新；
+ * 两个阶段之间并发写入的块不在本次fsync的保证范围内（与并发的write和fsync之间没有顺序保证相同）
+ * @param ino      需要持久化的inode号
+ * @param datasync 非0表示fdatasync，inode未被修改时不写回inode
+ * @return 成功返回0，失败返回写回或设备刷新的错误（收集过的块重新标记为脏）
+ */
+int sync_inode(int ino, int datasync) {
+    (void) datasync; // SFS的inode字段都是读取数据所必需的元数据，inode为脏时两者都需要写回
+    struct sync_range range = {0};
+    struct inode* inode = (struct inode*)malloc(sizeof(struct inode));
+    pthread_mutex_lock(&fs_lock);
+    write_reftable(); // 延后写回的指纹
+    if (inode_is_used(ino)) { // 查找之后文件可能已被删除
+        read_inode(ino, inode);
+        walk_inode_blocks(inode, sync_data_visitor, &range);
+        walk_inode_blocks(inode, sync_index_visitor, &range);
+    }
+    // 无法区分位图块属于哪个inode，全部脏位图块都写回
+    for (long i=0; i<sb->inodebitmap_size; i++) {
+        sync_block(&range, sb->first_blk_of_inodebitmap + i);
+    }
+    for (long i=0; i<sb->databitmap_size; i++) {
+        sync_block(&range, sb->first_blk_of_databitmap + i);
+    }
+    for (long i=0; i<sb->reftable_size; i++) {
+        sync_block(&range, sb->first_blk_of_reftable + i);
+    }
+    int ret = wait_sync_ranges(&range);
+    pthread_mutex_unlock(&fs_lock);
+    free(inode);
+    // 即使没有收集到脏块也要刷新：这些块（包括inode）可能刚被其它fsync写回而尚未落盘
+    ret = ret != 0 ? ret : flush_device();
+    if (ret != 0) {
+        return finish_sync_ranges(&range, ret);
+    }
+    pthread_mutex_lock(&fs_lock);
+    int n = range.n;
+    sync_block(&range, inode_block_no(ino));
+    ret = wait_sync_ranges(&range);
+    pthread_mutex_unlock(&fs_lock);
+    if (ret == 0 && range.n > n) {
+        ret = flush_device();
+    }
+    return finish_sync_ranges(&range, ret);
+}
+
+/**
+ * 将延后写回的引用计数表写入块设备（close时调用，不保证落盘）
+ */
+int flush_fs() {
+    write_reftable();
+    return 0;
+}
+
+#endif
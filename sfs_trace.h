@@ -0,0 +1,269 @@
+/*
+ * SFS文件系统的跟踪（trace）
+ * 跟踪点按级别（ERROR、INFO、DEBUG）在编译时选择，级别高于SFS_TRACE_LEVEL的跟踪点不生成任何代码，也不求值参数；
+ * 启用的跟踪点不做格式化，以二进制记录写入当前线程私有的环形缓冲区（无锁，只有线程第一次记录时加锁），
+ * 卸载时转储到跟踪文件，由离线工具sfstrace按时间合并各线程的记录并格式化输出
+ * ERROR级别的跟踪点同时立即输出到stderr
+ *
+ * 用法：TRACE(DEBUG, "ino=%ld size=%ld", ino, size)，TRACE_STR(INFO, path, "path=%s ino=%ld", ino)
+ * 参数最多TRACE_MAX_ARGS个，一律按long记录（格式串中使用%ld、%lx等）；
+ * TRACE_STR额外记录一个字符串（截断为TRACE_STR_SIZE-1字节），格式串中第一个转换必须是对应的%s
+*/
+#ifndef __SFS_TRACE_H__
+#define __SFS_TRACE_H__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// 跟踪级别
+#define TRACE_LEVEL_NONE  0
+#define TRACE_LEVEL_ERROR 1 // 错误（同时立即输出到stderr）
+#define TRACE_LEVEL_INFO  2 // 挂载、格式化、后台回收等低频事件
+#define TRACE_LEVEL_DEBUG 3 // 每个回调、每次块读写等高频事件
+
+// 编译时启用的最高级别（make TRACE=3启用DEBUG，make TRACE=0去掉全部跟踪点）
+#ifndef SFS_TRACE_LEVEL
+#define SFS_TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+#define TRACE_MAX_ARGS 5      // 每条记录最多的整数参数
+#define TRACE_STR_SIZE 32     // 每条记录中字符串参数的长度（含结尾的0）
+#define TRACE_RING_SIZE 4096  // 每个线程环形缓冲区中的记录数（2的幂），写满后覆盖最旧的记录
+#define TRACE_MAX_SITES 1024  // 跟踪点数目上限
+#define TRACE_MAGIC 0x43525453 // 跟踪文件魔数（"STRC"）
+
+// 跟踪点的静态描述，第一次记录时登记，得到写入记录和跟踪文件中的编号
+struct trace_site {
+    int level;        // 跟踪级别
+    const char* func; // 所在函数
+    const char* fmt;  // 格式串
+    int id;           // 登记后的编号，未登记为-1
+};
+
+// 一条跟踪记录（88字节）
+struct trace_record {
+    uint64_t time;                // 单调时钟（纳秒）
+    uint32_t site;                // 跟踪点编号
+    uint16_t nargs;               // 整数参数数目
+    uint16_t has_str;             // 是否记录了字符串参数
+    int64_t args[TRACE_MAX_ARGS]; // 整数参数
+    char str[TRACE_STR_SIZE];     // 字符串参数
+};
+
+// 线程私有的环形缓冲区：只有所属线程写入，head在记录写完后以release语义递增
+struct trace_ring {
+    uint64_t head;              // 已写入的记录总数
+    int tid;                    // 线程编号（按第一次记录的顺序分配）
+    int in_use;                 // 是否属于某个存活的线程（线程退出后由新线程复用）
+    struct trace_ring* next;    // 全部环形缓冲区链表
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+// 跟踪文件头，之后依次是各跟踪点（编号、级别、函数名和格式串，字符串以0结尾）和各线程的记录
+struct trace_file_header {
+    uint32_t magic;
+    uint32_t nsites; // 跟踪点数目
+    uint32_t nrings; // 环形缓冲区数目，每个缓冲区先写tid和记录数（各4字节），再写记录
+    uint32_t ring_size;
+};
+
+struct trace_site* trace_sites[TRACE_MAX_SITES]; // 已登记的跟踪点
+int trace_nsites = 0;
+struct trace_ring* trace_rings = NULL;            // 全部环形缓冲区
+int trace_nrings = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // 保护跟踪点登记和环形缓冲区链表
+pthread_key_t trace_key;                           // 线程退出时归还环形缓冲区
+pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+__thread struct trace_ring* trace_self = NULL;     // 当前线程的环形缓冲区
+
+/**
+ * 按跟踪点的格式串格式化一条记录
+ * 参数一律按long传入，多余的参数被printf忽略；有字符串参数时它对应格式串中的第一个转换
+ */
+int trace_format(char* buf, size_t size, const char* fmt, const struct trace_record* r) {
+    const int64_t* a = r->args;
+    if (r->has_str) {
+        return snprintf(buf, size, fmt, r->str, (long)a[0], (long)a[1], (long)a[2], (long)a[3], (long)a[4]);
+    }
+    return snprintf(buf, size, fmt, (long)a[0], (long)a[1], (long)a[2], (long)a[3], (long)a[4]);
+}
+
+/************************/
+/* 跟踪记录相关函数 */
+
+// 线程退出时将其环形缓冲区标记为空闲（保留其中的记录）
+void trace_release_ring(void* ring) {
+    __atomic_store_n(&((struct trace_ring*)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void trace_make_key() {
+    pthread_key_create(&trace_key, trace_release_ring);
+}
+
+/**
+ * 取得当前线程的环形缓冲区：优先复用已退出线程的缓冲区，否则新分配一个
+ * @return 环形缓冲区，内存不足时返回NULL（丢弃记录）
+ */
+struct trace_ring* trace_ring_self() {
+    if (trace_self != NULL) {
+        return trace_self;
+    }
+    pthread_once(&trace_key_once, trace_make_key);
+    pthread_mutex_lock(&trace_lock);
+    struct trace_ring* ring = trace_rings;
+    while (ring != NULL && __atomic_load_n(&ring->in_use, __ATOMIC_ACQUIRE)) {
+        ring = ring->next;
+    }
+    if (ring == NULL) {
+        ring = (struct trace_ring*)calloc(1, sizeof(struct trace_ring));
+        if (ring != NULL) {
+            ring->tid = trace_nrings++;
+            ring->next = trace_rings;
+            trace_rings = ring;
+        }
+    }
+    if (ring != NULL) {
+        ring->in_use = 1;
+        pthread_setspecific(trace_key, ring);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    trace_self = ring;
+    return ring;
+}
+
+// 登记跟踪点（每个跟踪点只在第一次记录时登记一次）
+int trace_register(struct trace_site* site) {
+    pthread_mutex_lock(&trace_lock);
+    if (site->id < 0 && trace_nsites < TRACE_MAX_SITES) {
+        trace_sites[trace_nsites] = site;
+        __atomic_store_n(&site->id, trace_nsites++, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return site->id;
+}
+
+/**
+ * 记录一次跟踪事件（由TRACE宏调用）：写入当前线程的环形缓冲区，ERROR级别同时输出到stderr
+ * @param str   字符串参数，没有时为NULL
+ * @param nargs 整数参数数目
+ * @param args  整数参数
+ */
+void trace_emit(struct trace_site* site, const char* str, int nargs, const long* args) {
+    int id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+    if (id < 0 && (id = trace_register(site)) < 0) {
+        return; // 跟踪点过多
+    }
+    struct trace_ring* ring = trace_ring_self();
+    if (ring == NULL) {
+        return;
+    }
+    struct trace_record* r = &ring->records[ring->head & (TRACE_RING_SIZE - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    r->site = id;
+    r->nargs = nargs;
+    r->has_str = str != NULL;
+    for (int i=0; i<TRACE_MAX_ARGS; i++) {
+        r->args[i] = i < nargs ? args[i] : 0;
+    }
+    if (str != NULL) {
+        strncpy(r->str, str, TRACE_STR_SIZE - 1);
+        r->str[TRACE_STR_SIZE - 1] = '\0';
+    }
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    if (site->level <= TRACE_LEVEL_ERROR) {
+        char buf[256];
+        trace_format(buf, sizeof(buf), site->fmt, r);
+        fprintf(stderr, "[%s] %s\n", site->func, buf);
+    }
+}
+
+/**
+ * 将全部跟踪点和各线程环形缓冲区中的记录转储到path（卸载时调用，其它线程可以同时继续记录）
+ * 复制记录后重新读取head，丢弃复制过程中可能已被覆盖的记录
+ * @return 成功返回0，无法写入文件返回-1
+ */
+int trace_dump(const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&trace_lock);
+    struct trace_file_header header = { TRACE_MAGIC, trace_nsites, trace_nrings, TRACE_RING_SIZE };
+    fwrite(&header, sizeof(header), 1, f);
+    for (int i=0; i<trace_nsites; i++) {
+        int32_t desc[2] = { trace_sites[i]->id, trace_sites[i]->level };
+        fwrite(desc, sizeof(desc), 1, f);
+        fwrite(trace_sites[i]->func, strlen(trace_sites[i]->func) + 1, 1, f);
+        fwrite(trace_sites[i]->fmt, strlen(trace_sites[i]->fmt) + 1, 1, f);
+    }
+    struct trace_record* copy = (struct trace_record*)malloc(TRACE_RING_SIZE * sizeof(struct trace_record));
+    for (struct trace_ring* ring=trace_rings; ring!=NULL; ring=ring->next) {
+        uint64_t end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+        for (uint64_t i=start; i<end; i++) {
+            copy[i - start] = ring->records[i & (TRACE_RING_SIZE - 1)];
+        }
+        uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        // 编号小于valid的记录可能已被覆盖（包括正在写入的第now条记录所覆盖的那一条）
+        uint64_t valid = now + 1 > TRACE_RING_SIZE ? now + 1 - TRACE_RING_SIZE : 0;
+        uint64_t skip = valid <= start ? 0 : valid >= end ? end - start : valid - start;
+        int32_t desc[2] = { ring->tid, (int32_t)(end - start - skip) };
+        fwrite(desc, sizeof(desc), 1, f);
+        fwrite(copy + skip, sizeof(struct trace_record), end - start - skip, f);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    free(copy);
+    fclose(f);
+    return 0;
+}
+
+/* 以上是跟踪记录相关函数 */
+
+/************************/
+/* 跟踪宏 */
+
+// 启用的跟踪点：每个跟踪点一个静态描述，参数转换为long数组
+#define TRACE_EMIT(level, str, fmt, ...) do {                                            \
+    static struct trace_site trace_site_ = { level, __func__, fmt, -1 };                \
+    long trace_args_[] = { 0, ##__VA_ARGS__ };                                           \
+    _Static_assert(sizeof(trace_args_) <= (TRACE_MAX_ARGS + 1) * sizeof(long),           \
+                   "too many trace arguments");                                         \
+    trace_emit(&trace_site_, str, sizeof(trace_args_) / sizeof(long) - 1, trace_args_ + 1); \
+} while (0)
+
+// 编译时去掉的跟踪点：只在sizeof中引用参数（不求值、不生成代码），避免变量未使用的警告
+#define TRACE_NOP(level, str, fmt, ...) do {         \
+    (void) sizeof((long[]){ 0, ##__VA_ARGS__ });    \
+    (void) sizeof(str);                              \
+} while (0)
+
+#if SFS_TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_SELECT_ERROR TRACE_EMIT
+#else
+#define TRACE_SELECT_ERROR TRACE_NOP
+#endif
+#if SFS_TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_SELECT_INFO TRACE_EMIT
+#else
+#define TRACE_SELECT_INFO TRACE_NOP
+#endif
+#if SFS_TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_SELECT_DEBUG TRACE_EMIT
+#else
+#define TRACE_SELECT_DEBUG TRACE_NOP
+#endif
+
+// 记录跟踪事件，level为ERROR、INFO或DEBUG
+#define TRACE(level, fmt, ...) TRACE_SELECT_##level(TRACE_LEVEL_##level, NULL, fmt, ##__VA_ARGS__)
+// 记录带一个字符串参数（格式串中的第一个%s）的跟踪事件
+#define TRACE_STR(level, str, fmt, ...) TRACE_SELECT_##level(TRACE_LEVEL_##level, str, fmt, ##__VA_ARGS__)
+
+/* 以上是跟踪宏 */
+
+#endif
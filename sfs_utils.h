@@ -33,7 +33,7 @@ void split_path(const char* path, char* head, char* tail) {
         strcpy(tail, "");
         return;
     }
-    char* path_copy = (char*)malloc(sizeof(path));
+    char* path_copy = (char*)malloc(MAX_PATH_LEN);
     strcpy(path_copy, path);
     strcpy(head, path);
     strtok(head, "/");
@@ -75,18 +75,19 @@ void get_parent_path(const char* path, char* parent) {
  *          path="/a" -> file_name="a"
 */
 void get_file_name(const char* path, char* file_name) {
-    char* path_copy = (char*)malloc(sizeof(path));
+    char* path_copy = (char*)malloc(MAX_PATH_LEN);
     strcpy(path_copy, path);
     if (path_copy[0] == '/') {
         strcpy(path_copy, path + 1);
     }
-    char* head = (char*)malloc(sizeof(path));
-    char* tail = (char*)malloc(sizeof(path));
+    char* head = (char*)malloc(MAX_PATH_LEN);
+    char* tail = (char*)malloc(MAX_PATH_LEN);
     do {
         split_path(path_copy, head, tail);
         strcpy(path_copy, tail);
     } while (strcmp(tail, "") != 0);
     strcpy(file_name, head);
+    free(path_copy);
     free(head);
     free(tail);
 }
@@ -141,4 +142,24 @@ void full_name(const char* fname, const char* ext, char* file) {
     strcat(file, "\0");
 }
 
+/**
+ * 解析带K、M、G后缀的大小（mkfs、sfsbench的参数和ram_size挂载选项）
+ * @return 字节数，解析失败返回-1
+ * @example "64M" -> 67108864
+*/
+long parse_size(const char* str) {
+    char* end;
+    long size = strtol(str, &end, 10);
+    switch (*end) {
+        case 'G': case 'g': size *= 1024;
+        case 'M': case 'm': size *= 1024;
+        case 'K': case 'k': size *= 1024; end++;
+        default: break;
+    }
+    if (*end != '\0' || size <= 0) {
+        return -1;
+    }
+    return size;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,757 @@
+/*
+ * SFS文件系统的离线检查与修复工具（sfsck）
+ * 用法: sfsck [-y] [-v] [-j 线程数] 映像文件
+ * 映像文件须未挂载。按大块顺序读入位图和inode表，由多个线程分别检查互不相交的inode区间和数据块区间：
+ *   inode：块映射中的块号是否越界、st_blocks是否与块映射一致、目录项是否指向已使用的inode
+ *   可达性：已使用的inode都应能从根目录或孤儿链表到达，每个inode最多被一个目录项引用
+ *   数据块：位图与块映射一致（没有泄漏或漏标的块），引用计数表中的共享数与实际引用数一致，
+ *          引用计数表和空闲空间摘要占用的块已标记为已使用且不被文件引用
+ *   超级块：正常卸载时记录的空闲计数和空闲空间摘要与位图一致
+ * -y：修复能够修复的错误（泄漏的inode加入孤儿链表，下次挂载时回收；泄漏的块直接释放），
+ *     之后写回空闲计数和空闲空间摘要并标记为正常卸载；不带-y时只检查，不修改映像
+ * -v：逐项输出发现的错误（否则只输出各类错误的数目）
+ * -j：检查使用的线程数（默认为在线CPU数）
+ * 退出码：0没有错误，1错误已全部修复，4有未修复的错误，8无法检查
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sfs_ds.h"     // SFS文件系统相关数据结构
+#include "sfs_dev.h"    // SFS文件系统块设备
+#include "sfs_rw.h"     // SFS文件系统相关读写操作
+#include "sfs_utils.h"  // SFS文件系统相关辅助函数
+#include "sfs_space.h"  // SFS文件系统空闲空间索引
+
+#define FSCK_INODE_CHUNK 2048 // 每次批量读取的inode数目（线程每次领取一段）
+#define FSCK_MAX_THREADS 64   // 最大线程数
+
+// 退出码（与e2fsck相同）
+#define FSCK_OK          0
+#define FSCK_FIXED       1
+#define FSCK_UNCORRECTED 4
+#define FSCK_FAILED      8
+
+// 错误类型
+enum fsck_problem {
+    P_BAD_POINTER,   // 块映射中的块号越界
+    P_ST_BLOCKS,     // st_blocks与块映射不一致
+    P_DANGLING,      // 目录项指向越界或未使用的inode
+    P_MULTI_LINK,    // inode被多个目录项引用（或根目录被引用）
+    P_ORPHAN_LIST,   // 孤儿链表中有越界、未使用、未标记或重复的inode
+    P_LEAKED_INODE,  // 已使用但从根目录和孤儿链表都不可达的inode
+    P_LEAKED_BLOCK,  // 位图中已使用但没有被引用的块
+    P_UNMARKED,      // 被引用或保留但位图中空闲的块
+    P_CROSS_LINKED,  // 未记录共享却被多处引用的块、被多处引用的索引块、被文件引用的保留块
+    P_SHARES,        // 引用计数表中的共享数与实际引用数不一致
+    P_STALE_REF,     // 空闲块在引用计数表中仍有共享数
+    P_COUNTERS,      // 超级块中的空闲计数与位图不一致
+    P_SUMMARY,       // 空闲空间摘要与位图不一致
+    NUM_PROBLEMS
+};
+
+const char* problem_names[NUM_PROBLEMS] = {
+    "bad block pointers", "wrong block counts", "dangling entries", "multiply linked inodes",
+    "broken orphan list", "leaked inodes", "leaked blocks", "unmarked blocks", "cross-linked blocks",
+    "wrong share counts", "stale share counts", "wrong free counters", "stale free summary",
+};
+
+// 能否修复（越界的块号和交叉引用需要人工处理）
+const int problem_fixable[NUM_PROBLEMS] = { 0, 1, 1, 0, 1, 1, 1, 1, 0, 1, 1, 1, 1 };
+
+// 扫描得到的inode状态
+#define FSCK_USED    0x1 // inode位图中已使用
+#define FSCK_DIR     0x2 // 目录
+#define FSCK_ORPHAN  0x4 // 带INODE_ORPHAN标志
+#define FSCK_REACHED 0x8 // 从根目录或孤儿链表可达
+#define FSCK_LISTED  0x10 // 已在孤儿链表中遇到（检查链表是否成环）
+
+struct fsck_inode {
+    int next_orphan; // 孤儿链表中的下一个inode（带INODE_ORPHAN时有效）
+    uint8_t state;
+    int links;       // 引用该inode的目录项数
+};
+
+// 一个目录项（父目录、子inode以及所在的数据块和槽位，用于修复）
+struct fsck_edge {
+    int parent, child;
+    int datablock_no, slot;
+};
+
+// 整数数组（按需扩大），成对存放时每项占两个元素
+struct int_list {
+    int* v;
+    long n, cap;
+};
+
+// 一个检查线程的状态和结果
+struct fsck_worker {
+    pthread_t thread;
+    int started;
+    long from, to;               // 第二阶段检查的数据块区间[from, to)
+    struct fsck_edge* edges;     // 扫描到的目录项
+    long num_edges, cap_edges;
+    struct int_list st_blocks;   // (inode号, 实际块数)
+    struct int_list bad;         // (inode号, 越界块号数)
+    struct int_list leaked;      // 泄漏的块
+    struct int_list unmarked;    // 漏标的块
+    struct int_list crossed;     // 交叉引用的块
+    struct int_list shares;      // (块号, 实际引用数)
+    struct int_list stale;       // 引用计数表中残留共享数的空闲块
+};
+
+// 遍历一个inode的块映射时的状态
+struct fsck_inode_scan {
+    long blocks;                 // 块映射中的块数（含索引块）
+    long bad;                    // 越界的块号数
+    struct int_list* dir_blocks; // 目录的数据块（按逻辑顺序），普通文件为NULL
+};
+
+struct fsck_inode* fsck_inodes = NULL; // 每个inode的扫描结果
+uint32_t* block_refs = NULL;           // 每个数据块被块映射引用的次数
+uint8_t* block_meta = NULL;            // 数据块是否被用作间接索引块或extent树节点块
+long reserved_blocks = 0;              // 数据区开头保留的块数（引用计数表和空闲空间摘要）
+long next_chunk = 0;                   // 下一段待扫描的inode（各线程原子地领取）
+long found[NUM_PROBLEMS];              // 各类错误的数目
+int repair = 0, verbose = 0;
+
+void usage(const char* prog) {
+    printf("usage: %s [-y] [-v] [-j threads] image\n", prog);
+}
+
+void int_list_add(struct int_list* list, int value) {
+    if (list->n == list->cap) {
+        list->cap = list->cap == 0 ? 64 : list->cap * 2;
+        list->v = (int*)realloc(list->v, list->cap * sizeof(int));
+    }
+    list->v[list->n++] = value;
+}
+
+// 记录一个错误，-v时输出
+void problem(enum fsck_problem kind, const char* fmt, ...) {
+    found[kind]++;
+    if (!verbose) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+/************************/
+/* inode扫描相关函数 */
+
+// 遍历块映射的回调：累计块的引用次数，记录目录的数据块
+void fsck_block_visitor(int datablock_no, int level, void* arg) {
+    struct fsck_inode_scan* scan = (struct fsck_inode_scan*)arg;
+    scan->blocks++;
+    if (datablock_no < 0 || datablock_no >= sb->datasize) {
+        scan->bad++; // 越界的块号
+        return;
+    }
+    __atomic_fetch_add(&block_refs[datablock_no], 1, __ATOMIC_RELAXED);
+    if (level > 0) {
+        __atomic_store_n(&block_meta[datablock_no], 1, __ATOMIC_RELAXED);
+    } else if (scan->dir_blocks != NULL) {
+        int_list_add(scan->dir_blocks, datablock_no);
+    }
+}
+
+/**
+ * 遍历以datablock_no为根的level级索引（同walk_index_block）
+ * walk_index_block跳过越界的块号，这里把非负的越界块号也交给fsck_block_visitor计为越界，不再向下遍历
+ */
+void fsck_walk_index_block(int datablock_no, int level, struct fsck_inode_scan* scan) {
+    if (datablock_no < 0) {
+        return; // 未使用的块号
+    }
+    fsck_block_visitor(datablock_no, level, scan);
+    if (level == 0 || datablock_no >= sb->datasize) {
+        return;
+    }
+    struct data_block* db = new_data_block();
+    read_data_block(datablock_no, db);
+    int* nos = (int*)db->data;
+    for (int k=0; k<NUM_PER_INDEX_BLOCK; k++) {
+        fsck_walk_index_block(nos[k], level - 1, scan);
+    }
+    free_data_block(db);
+}
+
+/**
+ * 遍历extent树的一个节点（同walk_extent_node），越界的子节点块号计为越界，不再向下遍历
+ */
+void fsck_walk_extent_node(struct extent_header* header, struct extent* extents, struct fsck_inode_scan* scan) {
+    for (int i=0; i<header->entries; i++) {
+        if (header->depth == 0) {
+            for (int k=0; k<extent_plen(&extents[i]); k++) {
+                fsck_block_visitor(extents[i].pblk + k, 0, scan);
+            }
+            continue;
+        }
+        int child_no = extents[i].pblk;
+        fsck_block_visitor(child_no, header->depth, scan);
+        if (child_no < 0 || child_no >= sb->datasize) {
+            continue;
+        }
+        struct data_block* db = new_data_block();
+        read_data_block(child_no, db);
+        if (((struct extent_header*)db->data)->magic == EXTENT_MAGIC) {
+            fsck_walk_extent_node((struct extent_header*)db->data, BLOCK_EXTENTS(db), scan);
+        }
+        free_data_block(db);
+    }
+}
+
+// 遍历inode的块映射（同walk_inode_blocks，但报告越界的块号）
+void fsck_walk_inode_blocks(struct inode* inode, struct fsck_inode_scan* scan) {
+    if (inode->flags & INODE_INLINE) {
+        return; // 内联数据不占用数据块
+    }
+    if (inode->flags & INODE_EXTENTS) {
+        fsck_walk_extent_node(&inode->ext_root.header, inode->ext_root.extents, scan);
+        return;
+    }
+    for (int i=0; i<=3; i++) {
+        fsck_walk_index_block(inode->addr[i], 0, scan); // 直接索引
+    }
+    for (int i=4; i<=6; i++) {
+        fsck_walk_index_block(inode->addr[i], i - 3, scan); // 一、二、三级间接索引
+    }
+}
+
+// 记录目录数据块中的目录项
+void scan_dir_entries(struct fsck_worker* w, int ino, struct int_list* dir_blocks) {
+    struct data_block* db = new_data_block();
+    for (long i=0; i<dir_blocks->n; i++) {
+        read_data_block(dir_blocks->v[i], db);
+        for (int k=0; k<NUM_ENTRIES_PER_BLOCK; k++) {
+            struct entry* e = (struct entry*)(db->data + k*sizeof(struct entry));
+            if (e->type == UNUSED) {
+                continue;
+            }
+            if (w->num_edges == w->cap_edges) {
+                w->cap_edges = w->cap_edges == 0 ? 256 : w->cap_edges * 2;
+                w->edges = (struct fsck_edge*)realloc(w->edges, w->cap_edges * sizeof(struct fsck_edge));
+            }
+            w->edges[w->num_edges++] = (struct fsck_edge){ ino, e->inode, dir_blocks->v[i], k };
+        }
+    }
+    free_data_block(db);
+}
+
+// 检查一个已使用的inode（只写该inode自己的fsck_inodes项，块引用次数原子地累加）
+void scan_inode(struct fsck_worker* w, int ino, struct inode* inode) {
+    struct fsck_inode* info = &fsck_inodes[ino];
+    info->state = FSCK_USED;
+    if (S_ISDIR(inode->st_mode)) {
+        info->state |= FSCK_DIR;
+    }
+    if (inode->flags & INODE_ORPHAN) {
+        info->state |= FSCK_ORPHAN;
+        info->next_orphan = inode->next_orphan;
+    }
+    struct int_list dir_blocks = {0};
+    struct fsck_inode_scan scan = { 0, 0, S_ISDIR(inode->st_mode) ? &dir_blocks : NULL };
+    fsck_walk_inode_blocks(inode, &scan);
+    if (scan.bad > 0) {
+        // 块映射本身已损坏，不按它修正st_blocks
+        int_list_add(&w->bad, ino);
+        int_list_add(&w->bad, scan.bad);
+    } else if (scan.blocks != inode->st_blocks) {
+        int_list_add(&w->st_blocks, ino);
+        int_list_add(&w->st_blocks, scan.blocks);
+    }
+    if (dir_blocks.n > 0) {
+        scan_dir_entries(w, ino, &dir_blocks);
+    }
+    free(dir_blocks.v);
+}
+
+// 第一阶段的检查线程：每次领取FSCK_INODE_CHUNK个inode，一次读入后逐个检查已使用的inode
+void* inode_worker(void* arg) {
+    struct fsck_worker* w = (struct fsck_worker*)arg;
+    struct inode* inodes = (struct inode*)malloc(FSCK_INODE_CHUNK * sizeof(struct inode));
+    while (1) {
+        long first = __atomic_fetch_add(&next_chunk, FSCK_INODE_CHUNK, __ATOMIC_RELAXED);
+        if (first >= sb->num_inodes) {
+            break;
+        }
+        long n = read_inodes(first, FSCK_INODE_CHUNK, inodes);
+        for (long i=0; i<n; i++) {
+            if (inode_is_used(first + i)) {
+                scan_inode(w, first + i, &inodes[i]);
+            }
+        }
+    }
+    free(inodes);
+    return NULL;
+}
+
+/* 以上是inode扫描相关函数 */
+
+/************************/
+/* 数据块检查相关函数 */
+
+// 第二阶段的检查线程：比较[from, to)中每个块的位图状态、引用次数和引用计数表
+void* block_worker(void* arg) {
+    struct fsck_worker* w = (struct fsck_worker*)arg;
+    for (long no=w->from; no<w->to; no++) {
+        int used = data_block_is_used(no);
+        uint32_t refs = block_refs[no];
+        if (no < reserved_blocks) {
+            if (refs > 0) {
+                int_list_add(&w->crossed, no); // 文件引用了引用计数表或摘要的块
+            }
+            if (!used) {
+                int_list_add(&w->unmarked, no);
+            }
+            continue;
+        }
+        if (refs == 0) {
+            if (used) {
+                int_list_add(&w->leaked, no);
+            } else if (reftable != NULL && reftable[no].shares != 0) {
+                int_list_add(&w->stale, no);
+            }
+            continue;
+        }
+        if (!used) {
+            int_list_add(&w->unmarked, no);
+        }
+        if (refs > 1 && (reftable == NULL || block_meta[no])) {
+            int_list_add(&w->crossed, no);
+        } else if (reftable != NULL && reftable[no].shares != refs - 1) {
+            int_list_add(&w->shares, no);
+            int_list_add(&w->shares, refs);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 启动nthreads个线程执行fn，线程创建失败时在当前线程中执行
+ */
+void run_workers(struct fsck_worker* workers, int nthreads, void* (*fn)(void*)) {
+    for (int i=0; i<nthreads; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, fn, &workers[i]) == 0;
+    }
+    for (int i=0; i<nthreads; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        } else {
+            fn(&workers[i]);
+        }
+    }
+}
+
+/* 以上是数据块检查相关函数 */
+
+/************************/
+/* 可达性检查相关函数 */
+
+int cmp_edge_parent(const void* a, const void* b) {
+    const struct fsck_edge* ea = (const struct fsck_edge*)a;
+    const struct fsck_edge* eb = (const struct fsck_edge*)b;
+    if (ea->parent != eb->parent) {
+        return ea->parent < eb->parent ? -1 : 1;
+    }
+    return ea->child < eb->child ? -1 : ea->child > eb->child;
+}
+
+// 按父目录排序的目录项及每个目录的第一项
+struct fsck_edge* edges = NULL;
+long num_edges = 0;
+long* first_edge = NULL;
+
+/**
+ * 标记从ino可达的全部inode（只经过指向已使用inode的目录项）
+ * @param stack 工作栈，至少num_inodes个元素
+ */
+void mark_reachable(int ino, int* stack) {
+    if (fsck_inodes[ino].state & FSCK_REACHED) {
+        return;
+    }
+    long top = 0;
+    fsck_inodes[ino].state |= FSCK_REACHED;
+    stack[top++] = ino;
+    while (top > 0) {
+        int parent = stack[--top];
+        for (long i=first_edge[parent]; i<first_edge[parent + 1]; i++) {
+            int child = edges[i].child;
+            if (child < 0 || child >= sb->num_inodes || !(fsck_inodes[child].state & FSCK_USED) ||
+                (fsck_inodes[child].state & FSCK_REACHED)) {
+                continue;
+            }
+            fsck_inodes[child].state |= FSCK_REACHED;
+            stack[top++] = child;
+        }
+    }
+}
+
+/**
+ * 检查孤儿链表：遇到越界、未使用、未带INODE_ORPHAN或重复的inode时截断（之后的inode作为泄漏的inode重新加入）
+ */
+void check_orphan_list(int* stack) {
+    int prev = -1, ino = sb->orphan_head;
+    while (ino != 0) {
+        if (ino < 0 || ino >= sb->num_inodes || !(fsck_inodes[ino].state & FSCK_USED) ||
+            !(fsck_inodes[ino].state & FSCK_ORPHAN) || (fsck_inodes[ino].state & FSCK_LISTED)) {
+            problem(P_ORPHAN_LIST, "orphan list: invalid inode %d after %d", ino, prev);
+            if (repair) {
+                if (prev < 0) {
+                    sb->orphan_head = 0;
+                    write_sb();
+                } else {
+                    struct inode inode;
+                    read_inode(prev, &inode);
+                    inode.next_orphan = 0;
+                    write_inode(prev, &inode);
+                }
+            }
+            return;
+        }
+        fsck_inodes[ino].state |= FSCK_LISTED;
+        mark_reachable(ino, stack);
+        prev = ino;
+        ino = fsck_inodes[ino].next_orphan;
+    }
+}
+
+/**
+ * 检查目录项和可达性
+ */
+void check_reachability(struct fsck_worker* workers, int nthreads) {
+    for (int i=0; i<nthreads; i++) {
+        num_edges += workers[i].num_edges;
+    }
+    edges = (struct fsck_edge*)malloc(MAX(num_edges, 1) * sizeof(struct fsck_edge));
+    long n = 0;
+    for (int i=0; i<nthreads; i++) {
+        if (workers[i].num_edges > 0) {
+            memcpy(edges + n, workers[i].edges, workers[i].num_edges * sizeof(struct fsck_edge));
+            n += workers[i].num_edges;
+        }
+    }
+    qsort(edges, num_edges, sizeof(struct fsck_edge), cmp_edge_parent);
+    first_edge = (long*)calloc(sb->num_inodes + 1, sizeof(long));
+    for (long i=0; i<num_edges; i++) {
+        first_edge[edges[i].parent + 1]++;
+    }
+    for (long i=0; i<sb->num_inodes; i++) {
+        first_edge[i + 1] += first_edge[i];
+    }
+
+    // 指向越界或未使用inode的目录项
+    struct data_block* db = new_data_block();
+    for (long i=0; i<num_edges; i++) {
+        struct fsck_edge* e = &edges[i];
+        if (e->child >= 0 && e->child < sb->num_inodes && (fsck_inodes[e->child].state & FSCK_USED)) {
+            fsck_inodes[e->child].links++;
+            continue;
+        }
+        problem(P_DANGLING, "directory %d: entry points to unused inode %d", e->parent, e->child);
+        if (repair) {
+            read_data_block(e->datablock_no, db);
+            ((struct entry*)(db->data + e->slot * sizeof(struct entry)))->type = UNUSED;
+            write_data_block(e->datablock_no, db);
+        }
+    }
+    free_data_block(db);
+    for (long ino=0; ino<sb->num_inodes; ino++) {
+        if (fsck_inodes[ino].links > (ino == 0 ? 0 : 1)) {
+            problem(P_MULTI_LINK, "inode %ld: %d directory entries", ino, fsck_inodes[ino].links);
+        }
+    }
+
+    // 从根目录和孤儿链表出发标记可达的inode
+    int* stack = (int*)malloc(sb->num_inodes * sizeof(int));
+    mark_reachable(0, stack);
+    check_orphan_list(stack);
+
+    // 泄漏的inode：先加入不被其它泄漏目录引用的（子树的根），其余（目录项成环）逐个加入
+    for (int pass=0; pass<2; pass++) {
+        for (long ino=0; ino<sb->num_inodes; ino++) {
+            struct fsck_inode* info = &fsck_inodes[ino];
+            if (!(info->state & FSCK_USED) || (info->state & FSCK_REACHED) || (pass == 0 && info->links > 0)) {
+                continue;
+            }
+            problem(P_LEAKED_INODE, "inode %ld: not reachable from the root or the orphan list", ino);
+            mark_reachable(ino, stack);
+            if (repair) {
+                struct inode inode;
+                read_inode(ino, &inode);
+                orphan_add(&inode); // 下次挂载时由后台线程回收
+            }
+        }
+    }
+    free(stack);
+}
+
+/* 以上是可达性检查相关函数 */
+
+/************************/
+/* 超级块检查相关函数 */
+
+// 位图前n位中已使用的数目
+long count_used_bits(const uint8_t* bitmap, long n) {
+    long used = 0;
+    for (long i=0; i<n / 8; i++) {
+        used += __builtin_popcount(bitmap[i]);
+    }
+    for (long no=n / 8 * 8; no<n; no++) {
+        used += (bitmap[no >> 3] >> (7 - no % 8)) & 1;
+    }
+    return used;
+}
+
+/**
+ * 检查正常卸载时保存的空闲计数和空闲空间摘要（在修改位图之前调用）
+ * @param disk_sb 映像中的超级块
+ */
+void check_clean_state(struct sb* disk_sb) {
+    if (!disk_sb->clean) {
+        return; // 上次没有正常卸载，挂载时会重新统计
+    }
+    long free_blocks = sb->datasize - count_used_bits(data_bitmap, sb->datasize);
+    long free_inodes = sb->num_inodes - count_used_bits(inode_bitmap, sb->num_inodes);
+    if (disk_sb->free_blocks != free_blocks || disk_sb->free_inodes != free_inodes) {
+        problem(P_COUNTERS, "superblock: %ld free blocks, %ld free inodes (bitmaps: %ld, %ld)",
+                disk_sb->free_blocks, disk_sb->free_inodes, free_blocks, free_inodes);
+    }
+    if (!disk_sb->summary_valid || sb->summary_size == 0) {
+        return;
+    }
+    // 摘要应与位图中的空闲段完全相同
+    struct free_summary_header* header = (struct free_summary_header*)malloc(sb->summary_size * sb->block_size);
+    struct free_summary_entry* entries = (struct free_summary_entry*)(header + 1);
+    long cap = (sb->summary_size * sb->block_size - sizeof(struct free_summary_header)) / sizeof(struct free_summary_entry);
+    struct bitmap_scan scan = { data_bitmap, 0, sb->datasize, NULL, 0, 0 };
+    scan_free_runs(&scan);
+    int ok = bdev_read_blocks(sb->first_blk_of_summary, sb->summary_size, header) == 0 &&
+             header->magic == SUMMARY_MAGIC && header->count == scan.n && header->count <= cap &&
+             header->blocks == free_blocks;
+    for (long i=0; ok && i<scan.n; i++) {
+        ok = entries[i].start == scan.runs[i].start && entries[i].len == scan.runs[i].len;
+    }
+    if (!ok) {
+        problem(P_SUMMARY, "free space summary does not match the data bitmap");
+    }
+    free(scan.runs);
+    free(header);
+}
+
+/* 以上是超级块检查相关函数 */
+
+/**
+ * 汇总第一阶段各线程发现的inode错误，修复st_blocks（块映射中有越界块号的inode只报告，不修复）
+ */
+void report_inodes(struct fsck_worker* workers, int nthreads) {
+    for (int i=0; i<nthreads; i++) {
+        struct int_list* bad = &workers[i].bad;
+        for (long k=0; k<bad->n; k+=2) {
+            problem(P_BAD_POINTER, "inode %d: %d block numbers out of range", bad->v[k], bad->v[k + 1]);
+        }
+        struct int_list* st = &workers[i].st_blocks;
+        for (long k=0; k<st->n; k+=2) {
+            struct inode inode;
+            read_inode(st->v[k], &inode);
+            problem(P_ST_BLOCKS, "inode %d: st_blocks %d, block map has %d", st->v[k], inode.st_blocks, st->v[k + 1]);
+            if (repair) {
+                inode.st_blocks = st->v[k + 1];
+                write_inode(st->v[k], &inode);
+            }
+        }
+    }
+}
+
+/**
+ * 汇总第二阶段各线程发现的数据块错误并修复
+ */
+void report_blocks(struct fsck_worker* workers, int nthreads) {
+    struct bitmap_batch batch;
+    if (repair) {
+        init_bitmap_batch(&batch);
+    }
+    for (int i=0; i<nthreads; i++) {
+        struct fsck_worker* w = &workers[i];
+        for (long k=0; k<w->crossed.n; k++) {
+            problem(P_CROSS_LINKED, "block %d: referenced %u times%s", w->crossed.v[k], block_refs[w->crossed.v[k]],
+                    w->crossed.v[k] < reserved_blocks ? " (reserved)" : "");
+        }
+        for (long k=0; k<w->shares.n; k+=2) {
+            int no = w->shares.v[k];
+            problem(P_SHARES, "block %d: %u shares, referenced %d times", no, reftable[no].shares, w->shares.v[k + 1]);
+            if (repair) {
+                reftable[no].shares = w->shares.v[k + 1] - 1;
+                mark_reftable_dirty(no);
+            }
+        }
+        for (long k=0; k<w->stale.n; k++) {
+            int no = w->stale.v[k];
+            problem(P_STALE_REF, "block %d: free but has %u shares", no, reftable[no].shares);
+            if (repair) {
+                reftable[no].shares = 0;
+                mark_reftable_dirty(no);
+            }
+        }
+        for (long k=0; k<w->leaked.n; k++) {
+            int no = w->leaked.v[k];
+            problem(P_LEAKED_BLOCK, "block %d: used but not referenced", no);
+            if (repair) {
+                if (reftable != NULL && reftable[no].shares != 0) {
+                    reftable[no].shares = 0; // 按未共享释放，同时清除指纹
+                    mark_reftable_dirty(no);
+                }
+                batch_set_datablocks(&batch, no, 1, 0);
+            }
+        }
+        for (long k=0; k<w->unmarked.n; k++) {
+            int no = w->unmarked.v[k];
+            problem(P_UNMARKED, "block %d: referenced but free in the bitmap", no);
+            if (repair) {
+                batch_set_datablocks(&batch, no, 1, 1);
+            }
+        }
+    }
+    if (repair) {
+        commit_bitmap_batch(&batch); // 同时写回引用计数表
+    }
+}
+
+/**
+ * 打开映像：检查时一次读入两个位图（不建立空闲空间索引，不修改映像）；
+ * 修复时按挂载的顺序加载，并先在映像中清除clean标记，修复中途退出时下次挂载会重新统计
+ * @param disk_sb 返回映像中原来的超级块
+ * @return 成功返回0
+ */
+int open_image(const char* img, struct sb* disk_sb) {
+    if ((bdev = open_file_dev(img)) == NULL) {
+        perror("[sfsck] Error: failed to open the file system image");
+        return -1;
+    }
+    sb = (struct sb*)calloc(1, sizeof(struct sb));
+    bdev_read(sb, sizeof(struct sb), 0);
+    if (sb->magic != SFS_MAGIC || sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE) {
+        printf("[sfsck] Error: %s is not an SFS image\n", img);
+        return -1;
+    }
+    *disk_sb = *sb;
+    if (repair) {
+        sb->clean = 0;
+        sb->summary_valid = 0; // 不使用摘要，由位图重新建立空闲空间索引
+        write_sb();
+        bdev_flush();
+        if (load_bitmaps() != 0 || init_dirty_map() != 0) {
+            printf("[sfsck] Error: out of memory\n");
+            return -1;
+        }
+    } else {
+        // inode位图和数据块位图连续存放
+        long blocks = sb->inodebitmap_size + sb->databitmap_size;
+        inode_bitmap = (uint8_t*)malloc(blocks * sb->block_size);
+        if (inode_bitmap == NULL || bdev_read_blocks(sb->first_blk_of_inodebitmap, blocks, inode_bitmap) != 0) {
+            printf("[sfsck] Error: failed to read the bitmaps\n");
+            return -1;
+        }
+        data_bitmap = inode_bitmap + sb->inodebitmap_size * sb->block_size;
+    }
+    if (load_reftable() != 0) {
+        printf("[sfsck] Error: out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    long nthreads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    int opt;
+    while ((opt = getopt(argc, argv, "yvj:h")) != -1) {
+        switch (opt) {
+            case 'y': repair = 1; break;
+            case 'v': verbose = 1; break;
+            case 'j': nthreads = parse_size(optarg); break;
+            default: usage(argv[0]); return FSCK_FAILED;
+        }
+        if (nthreads <= 0) {
+            printf("[sfsck] Error: invalid argument %s\n", optarg);
+            return FSCK_FAILED;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return FSCK_FAILED;
+    }
+    nthreads = MIN(nthreads, FSCK_MAX_THREADS);
+    fs_img = argv[optind];
+    struct sb disk_sb;
+    if (open_image(fs_img, &disk_sb) != 0) {
+        close_block_dev(bdev);
+        return FSCK_FAILED;
+    }
+    reserved_blocks = sb->reftable_size + sb->summary_size;
+    fsck_inodes = (struct fsck_inode*)calloc(sb->num_inodes, sizeof(struct fsck_inode));
+    block_refs = (uint32_t*)calloc(sb->datasize, sizeof(uint32_t));
+    block_meta = (uint8_t*)calloc(sb->datasize, 1);
+    struct fsck_worker* workers = (struct fsck_worker*)calloc(nthreads, sizeof(struct fsck_worker));
+    if (fsck_inodes == NULL || block_refs == NULL || block_meta == NULL || workers == NULL) {
+        printf("[sfsck] Error: out of memory\n");
+        close_block_dev(bdev);
+        return FSCK_FAILED;
+    }
+    printf("checking %s: %ld inodes, %ld data blocks, %ld threads\n", fs_img, sb->num_inodes, sb->datasize, nthreads);
+
+    // 第一阶段：并行扫描inode表
+    run_workers(workers, nthreads, inode_worker);
+    if ((fsck_inodes[0].state & (FSCK_USED | FSCK_DIR)) != (FSCK_USED | FSCK_DIR)) {
+        printf("[sfsck] Error: the root inode is not a directory\n");
+        close_block_dev(bdev);
+        return FSCK_UNCORRECTED;
+    }
+    // 第二阶段：并行比较数据块的位图、引用次数和引用计数表
+    long chunk = (sb->datasize + nthreads - 1) / nthreads;
+    for (long i=0; i<nthreads; i++) {
+        workers[i].from = MIN(i * chunk, sb->datasize);
+        workers[i].to = MIN((i + 1) * chunk, sb->datasize);
+    }
+    run_workers(workers, nthreads, block_worker);
+
+    // 汇总并修复（修改位图之前先检查正常卸载时保存的计数和摘要）
+    check_clean_state(&disk_sb);
+    report_inodes(workers, nthreads);
+    check_reachability(workers, nthreads);
+    report_blocks(workers, nthreads);
+
+    long used_inodes = 0, orphans = 0;
+    for (long ino=0; ino<sb->num_inodes; ino++) {
+        used_inodes += (fsck_inodes[ino].state & FSCK_USED) != 0;
+        orphans += (fsck_inodes[ino].state & FSCK_ORPHAN) != 0;
+    }
+    long used_blocks = count_used_bits(data_bitmap, sb->datasize);
+    printf("inodes:     %ld used, %ld orphans\n", used_inodes, orphans);
+    printf("blocks:     %ld used (%ld reserved)\n", used_blocks, reserved_blocks);
+    int ret = FSCK_OK;
+    for (int i=0; i<NUM_PROBLEMS; i++) {
+        if (found[i] == 0) {
+            continue;
+        }
+        int fixed = repair && problem_fixable[i];
+        printf("%-24s %ld%s\n", problem_names[i], found[i], fixed ? " (repaired)" : "");
+        ret |= fixed ? FSCK_FIXED : FSCK_UNCORRECTED;
+    }
+    if (ret == FSCK_OK) {
+        printf("no problems found\n");
+    }
+    if (repair) {
+        write_reftable();
+        mark_fs_clean(); // 写回重新统计的空闲计数和空闲空间摘要
+    }
+    close_block_dev(bdev);
+    return ret & FSCK_UNCORRECTED ? FSCK_UNCORRECTED : ret;
+}
@@ -0,0 +1,247 @@
+/*
+ * SFS文件系统的碎片分析与整理工具（sfsfrag）
+ * 用法: sfsfrag [-v] [-n 数目] [-d] 映像文件
+ *       sfsfrag -f 文件...
+ * 离线（映像文件未挂载）：扫描inode表和数据块位图，输出碎片最多的文件、文件碎片汇总和空闲空间碎片的分布
+ * -v：输出每个有数据块的文件
+ * -n：输出碎片最多的前若干个文件（默认10）
+ * -d：分析后整理全部文件的碎片，再输出整理后的汇总
+ * -f：在线整理已挂载的SFS中的文件（通过SFS_IOC_DEFRAG，文件系统保持挂载）
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include "sfs_ds.h"     // SFS文件系统相关数据结构
+#include "sfs_dev.h"    // SFS文件系统块设备
+#include "sfs_rw.h"     // SFS文件系统相关读写操作
+#include "sfs_utils.h"  // SFS文件系统相关辅助函数
+#include "sfs_defrag.h" // SFS文件系统碎片分析与整理
+
+#define SCAN_INODES 256 // 每次批量读取的inode数目
+
+// 一个文件的分析结果
+struct file_frag {
+    int ino;
+    long size;
+    struct frag_info info;
+};
+
+// 全部文件的分析结果
+struct frag_report {
+    struct file_frag* files;
+    long n;
+    long data_blocks, meta_blocks, fragments;
+    long fragmented; // 碎片数大于1的文件数
+};
+
+void usage(const char* prog) {
+    printf("usage: %s [-v] [-n top] [-d] image\n", prog);
+    printf("       %s -f file...\n", prog);
+}
+
+// 按碎片数从多到少排列，碎片数相同时按inode号
+int cmp_fragments(const void* a, const void* b) {
+    const struct file_frag* fa = (const struct file_frag*)a;
+    const struct file_frag* fb = (const struct file_frag*)b;
+    if (fa->info.fragments != fb->info.fragments) {
+        return fa->info.fragments < fb->info.fragments ? 1 : -1;
+    }
+    return fa->ino - fb->ino;
+}
+
+/**
+ * 扫描inode表，统计每个有数据块的文件的碎片信息（孤儿不计入）
+ */
+void scan_files(struct frag_report* report) {
+    memset(report, 0, sizeof(struct frag_report));
+    struct inode* inodes = (struct inode*)malloc(SCAN_INODES * sizeof(struct inode));
+    long cap = 0;
+    for (int ino=0; ino<sb->num_inodes; ino+=SCAN_INODES) {
+        long n = read_inodes(ino, SCAN_INODES, inodes);
+        for (long i=0; i<n; i++) {
+            if (!inode_is_used(ino + i) || (inodes[i].flags & INODE_ORPHAN)) {
+                continue;
+            }
+            struct frag_info info;
+            inode_frag_info(&inodes[i], &info);
+            if (info.data_blocks == 0) {
+                continue;
+            }
+            if (report->n == cap) {
+                cap = cap == 0 ? 64 : cap * 2;
+                report->files = (struct file_frag*)realloc(report->files, cap * sizeof(struct file_frag));
+            }
+            report->files[report->n++] = (struct file_frag){ ino + i, inodes[i].st_size, info };
+            report->data_blocks += info.data_blocks;
+            report->meta_blocks += info.meta_blocks;
+            report->fragments += info.fragments;
+            report->fragmented += info.fragments > 1;
+        }
+    }
+    free(inodes);
+}
+
+void print_file(struct file_frag* file) {
+    printf("%8d %12ld %10ld %6ld %10ld\n", file->ino, file->size, file->info.data_blocks,
+           file->info.meta_blocks, file->info.fragments);
+}
+
+void print_report(struct frag_report* report, int verbose, long top) {
+    qsort(report->files, report->n, sizeof(struct file_frag), cmp_fragments);
+    long shown = verbose ? report->n : MIN(top, report->n);
+    if (shown > 0) {
+        printf("%8s %12s %10s %6s %10s\n", "inode", "size", "blocks", "meta", "fragments");
+        for (long i=0; i<shown; i++) {
+            print_file(&report->files[i]);
+        }
+        printf("\n");
+    }
+    printf("files:      %ld (%ld fragmented)\n", report->n, report->fragmented);
+    printf("blocks:     %ld data, %ld meta\n", report->data_blocks, report->meta_blocks);
+    printf("fragments:  %ld (%.2f per file)\n", report->fragments,
+           report->n > 0 ? (double)report->fragments / report->n : 0.0);
+
+    struct free_space_info free_info;
+    free_space_info(&free_info);
+    printf("free space: %ld blocks in %ld runs, largest %ld blocks\n",
+           free_info.free_blocks, free_info.free_runs, free_info.largest_run);
+    for (int i=0; i<FREE_HIST_SIZE; i++) {
+        if (free_info.hist[i] > 0) {
+            printf("\t[%ld, %ld): %ld runs\n", 1L << i, 1L << (i + 1), free_info.hist[i]);
+        }
+    }
+}
+
+/**
+ * 离线整理全部文件的碎片
+ * @return 整理失败的文件数（含共享数据块、压缩文件和空闲块不足）
+ */
+long defrag_files(struct frag_report* report) {
+    long failed = 0;
+    for (long i=0; i<report->n; i++) {
+        if (report->files[i].info.fragments <= 1) {
+            continue;
+        }
+        struct inode inode;
+        read_inode(report->files[i].ino, &inode);
+        struct frag_info info;
+        int ret = defrag_inode(&inode, &info);
+        if (ret != 0) {
+            printf("inode %d: %s\n", report->files[i].ino, strerror(-ret));
+            failed++;
+        }
+    }
+    write_reftable();
+    return failed;
+}
+
+/**
+ * 通过SFS_IOC_DEFRAG在线整理已挂载的SFS中的文件
+ * @return 全部成功返回0，否则返回1
+ */
+int defrag_online(int argc, char* argv[]) {
+    int ret = 0;
+    for (int i=0; i<argc; i++) {
+        int fd = open(argv[i], O_RDONLY);
+        struct frag_info info;
+        if (fd < 0 || ioctl(fd, SFS_IOC_DEFRAG, &info) != 0) {
+            printf("%s: %s\n", argv[i], strerror(errno));
+            ret = 1;
+        } else {
+            printf("%s: %ld blocks, %ld -> %ld fragments\n", argv[i], info.data_blocks, info.fragments, info.defragged);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return ret;
+}
+
+int main(int argc, char* argv[]) {
+    int verbose = 0, defrag = 0, online = 0;
+    long top = 10; // 输出碎片最多的文件数
+    int opt;
+    while ((opt = getopt(argc, argv, "vn:dfh")) != -1) {
+        switch (opt) {
+            case 'v': verbose = 1; break;
+            case 'n': top = parse_size(optarg); break;
+            case 'd': defrag = 1; break;
+            case 'f': online = 1; break;
+            default: usage(argv[0]); return 1;
+        }
+        if (top < 0) {
+            printf("[sfsfrag] Error: invalid argument %s\n", optarg);
+            return 1;
+        }
+    }
+    if (online) {
+        if (optind == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        return defrag_online(argc - optind, argv + optind);
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    fs_img = argv[optind];
+
+    // 打开映像文件：超级块、位图（整理时按挂载的顺序加载，并加载脏块表）和引用计数表
+    if ((bdev = open_file_dev(fs_img)) == NULL) {
+        perror("[sfsfrag] Error: failed to open the file system image");
+        return 1;
+    }
+    sb = (struct sb*)calloc(1, sizeof(struct sb));
+    bdev_read(sb, sizeof(struct sb), 0);
+    if (sb->magic != SFS_MAGIC || sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE) {
+        printf("[sfsfrag] Error: %s is not an SFS image\n", fs_img);
+        close_block_dev(bdev);
+        return 1;
+    }
+    if (defrag) {
+        if (load_bitmaps() != 0 || init_dirty_map() != 0) {
+            printf("[sfsfrag] Error: out of memory\n");
+            close_block_dev(bdev);
+            return 1;
+        }
+    } else {
+        // 只分析时不修改映像：直接读入位图（inode位图和数据块位图连续存放），由位图建立空闲空间索引
+        long blocks = sb->inodebitmap_size + sb->databitmap_size;
+        inode_bitmap = (uint8_t*)malloc(blocks * sb->block_size);
+        if (inode_bitmap == NULL || bdev_read_blocks(sb->first_blk_of_inodebitmap, blocks, inode_bitmap) != 0) {
+            printf("[sfsfrag] Error: failed to read the bitmaps\n");
+            close_block_dev(bdev);
+            return 1;
+        }
+        data_bitmap = inode_bitmap + sb->inodebitmap_size * sb->block_size;
+        build_free_extents(data_bitmap, sb->datasize);
+    }
+    if (load_reftable() != 0) {
+        printf("[sfsfrag] Error: out of memory\n");
+        close_block_dev(bdev);
+        return 1;
+    }
+
+    struct frag_report report;
+    scan_files(&report);
+    print_report(&report, verbose, top);
+    long failed = 0;
+    if (defrag) {
+        failed = defrag_files(&report);
+        free(report.files);
+        scan_files(&report);
+        printf("\nafter defragmentation:\n");
+        print_report(&report, 0, 0);
+        mark_fs_clean();
+    }
+    free(report.files);
+    close_block_dev(bdev);
+    return failed > 0 ? 1 : 0;
+}
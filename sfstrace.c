@@ -0,0 +1,173 @@
+/*
+ * SFS文件系统的跟踪文件解析工具（sfstrace）
+ * 读取卸载时转储的跟踪文件（挂载选项-o trace_file=路径），按时间合并各线程的记录并格式化输出
+ * 用法: sfstrace [-l 级别] 跟踪文件
+ * -l：只输出不高于该级别的记录（error、info或debug，默认全部输出）
+ * 每行输出：相对第一条记录的时间（微秒）、线程编号、级别、函数名和格式化后的内容
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "sfs_trace.h" // SFS文件系统跟踪
+
+// 解析出的一个跟踪点
+struct site_desc {
+    int level;
+    char* func;
+    char* fmt;
+};
+
+// 一个线程的全部记录
+struct ring_desc {
+    int tid;
+    uint32_t count;
+    uint32_t next; // 合并输出时下一条待输出的记录
+    struct trace_record* records;
+};
+
+const char* level_names[] = { "NONE", "ERROR", "INFO", "DEBUG" };
+
+// 读取以0结尾的字符串，失败返回NULL
+char* read_string(FILE* f) {
+    size_t len = 0, cap = 32;
+    char* str = (char*)malloc(cap);
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        if (len + 1 == cap) {
+            cap *= 2;
+            str = (char*)realloc(str, cap);
+        }
+        str[len++] = c;
+        if (c == '\0') {
+            return str;
+        }
+    }
+    free(str);
+    return NULL;
+}
+
+// 解析级别名称（或数字），失败返回-1
+int parse_level(const char* str) {
+    for (int i=TRACE_LEVEL_ERROR; i<=TRACE_LEVEL_DEBUG; i++) {
+        if (strcasecmp(str, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    char* end;
+    long level = strtol(str, &end, 10);
+    return *end == '\0' && level >= TRACE_LEVEL_NONE && level <= TRACE_LEVEL_DEBUG ? level : -1;
+}
+
+void usage(const char* prog) {
+    printf("usage: %s [-l error|info|debug] trace_file\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    int max_level = TRACE_LEVEL_DEBUG; // 输出的最高级别
+    int opt;
+    while ((opt = getopt(argc, argv, "l:h")) != -1) {
+        switch (opt) {
+            case 'l':
+                if ((max_level = parse_level(optarg)) < 0) {
+                    printf("[sfstrace] Error: invalid level %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    FILE* f = fopen(argv[optind], "rb");
+    if (f == NULL) {
+        perror("[sfstrace] Error: failed to open the trace file");
+        return 1;
+    }
+    struct trace_file_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != TRACE_MAGIC) {
+        printf("[sfstrace] Error: %s is not an SFS trace file\n", argv[optind]);
+        return 1;
+    }
+
+    // 读取跟踪点
+    struct site_desc* sites = (struct site_desc*)calloc(header.nsites, sizeof(struct site_desc));
+    for (uint32_t i=0; i<header.nsites; i++) {
+        int32_t desc[2];
+        char* func;
+        char* fmt;
+        if (fread(desc, sizeof(desc), 1, f) != 1 || (func = read_string(f)) == NULL || (fmt = read_string(f)) == NULL ||
+            desc[0] < 0 || (uint32_t)desc[0] >= header.nsites) {
+            printf("[sfstrace] Error: corrupted trace point table\n");
+            return 1;
+        }
+        sites[desc[0]].level = desc[1];
+        sites[desc[0]].func = func;
+        sites[desc[0]].fmt = fmt;
+    }
+
+    // 读取各线程的记录（每个线程的记录已按时间排列）
+    struct ring_desc* rings = (struct ring_desc*)calloc(header.nrings, sizeof(struct ring_desc));
+    uint64_t first_time = UINT64_MAX;
+    for (uint32_t i=0; i<header.nrings; i++) {
+        int32_t desc[2];
+        if (fread(desc, sizeof(desc), 1, f) != 1 || desc[1] < 0 || (uint32_t)desc[1] > header.ring_size) {
+            printf("[sfstrace] Error: corrupted ring header\n");
+            return 1;
+        }
+        rings[i].tid = desc[0];
+        rings[i].count = desc[1];
+        rings[i].records = (struct trace_record*)malloc((rings[i].count + 1) * sizeof(struct trace_record));
+        if (fread(rings[i].records, sizeof(struct trace_record), rings[i].count, f) != rings[i].count) {
+            printf("[sfstrace] Error: truncated trace file\n");
+            return 1;
+        }
+        if (rings[i].count > 0 && rings[i].records[0].time < first_time) {
+            first_time = rings[i].records[0].time;
+        }
+    }
+    fclose(f);
+
+    // 按时间合并各线程的记录（线程数很少，每次线性选出时间最早的一条）
+    char buf[512];
+    while (1) {
+        struct ring_desc* min = NULL;
+        for (uint32_t i=0; i<header.nrings; i++) {
+            struct ring_desc* ring = &rings[i];
+            if (ring->next < ring->count &&
+                (min == NULL || ring->records[ring->next].time < min->records[min->next].time)) {
+                min = ring;
+            }
+        }
+        if (min == NULL) {
+            break;
+        }
+        struct trace_record* r = &min->records[min->next++];
+        if (r->site >= header.nsites || sites[r->site].fmt == NULL) {
+            continue;
+        }
+        struct site_desc* site = &sites[r->site];
+        if (site->level > max_level) {
+            continue;
+        }
+        trace_format(buf, sizeof(buf), site->fmt, r);
+        printf("%12.3f %3d %-5s [%s] %s\n", (r->time - first_time) / 1000.0, min->tid,
+               level_names[site->level >= 0 && site->level <= TRACE_LEVEL_DEBUG ? site->level : 0], site->func, buf);
+    }
+
+    for (uint32_t i=0; i<header.nsites; i++) {
+        free(sites[i].func);
+        free(sites[i].fmt);
+    }
+    for (uint32_t i=0; i<header.nrings; i++) {
+        free(rings[i].records);
+    }
+    free(sites);
+    free(rings);
+    return 0;
+}